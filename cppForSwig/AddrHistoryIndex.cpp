@@ -0,0 +1,416 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "AddrHistoryIndex.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Coinbase TxIns point at the all-zero hash, output 0xffffffff
+static bool isCoinbaseTxIn(uint8_t const * txinPtr)
+{
+   static uint8_t const zeros[32] = {0};
+   return (*(uint32_t*)(txinPtr+32) == UINT32_MAX &&
+           memcmp(txinPtr, zeros, 32) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint32_t getAddrKey(uint8_t const * addr160)
+{
+   uint32_t key;
+   memcpy(&key, addr160, 4);
+   return key;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static uint64_t readHistVarInt(vector<uint8_t> const & bytes, uint32_t & pos)
+{
+   uint64_t val   = 0;
+   uint32_t shift = 0;
+   while(pos < bytes.size())
+   {
+      uint8_t b = bytes[pos++];
+      val |= (uint64_t)(b & 0x7f) << shift;
+      if((b & 0x80) == 0)
+         break;
+      shift += 7;
+   }
+   return val;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::clear(void)
+{
+   // Swap trick, to actually give the memory back
+   vector<AddrRecord>().swap(addrs_);
+   vector<uint8_t>().swap(chunks_);
+   vector<uint32_t>(1, 0).swap(firstOut_);
+   vector<uint32_t>().swap(outAddrIds_);
+   vector<PendingTxIn>().swap(pending_);
+   numEntries_ = 0;
+
+   Bucket empty = {0, 0};
+   vector<Bucket>(ADDRHIST_INIT_BUCKETS, empty).swap(addrTable_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t AddrHistoryIndex::findAddrId(uint8_t const * addr160) const
+{
+   uint32_t key  = getAddrKey(addr160);
+   uint32_t mask = addrTable_.size()-1;
+   uint32_t b    = getBucketStart(key);
+   while(addrTable_[b].idPlus1_ != 0)
+   {
+      if(addrTable_[b].key_ == key &&
+         memcmp(addrs_[addrTable_[b].idPlus1_-1].addr160_, addr160, 20) == 0)
+         return addrTable_[b].idPlus1_-1;
+      b = (b+1) & mask;
+   }
+   return UINT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The keys are right in the buckets, so nothing else is needed to rehash
+void AddrHistoryIndex::growTableIfNeeded(void)
+{
+   if( (uint64_t)addrs_.size() * 100 <=
+       (uint64_t)addrTable_.size() * ADDRHIST_MAX_LOAD_PCT)
+      return;
+
+   vector<Bucket> oldTable;
+   oldTable.swap(addrTable_);
+   Bucket empty = {0, 0};
+   addrTable_.resize(oldTable.size()*2, empty);
+   uint32_t mask = addrTable_.size()-1;
+   for(uint32_t i=0; i<oldTable.size(); i++)
+   {
+      if(oldTable[i].idPlus1_ == 0)
+         continue;
+      uint32_t b = getBucketStart(oldTable[i].key_);
+      while(addrTable_[b].idPlus1_ != 0)
+         b = (b+1) & mask;
+      addrTable_[b] = oldTable[i];
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t AddrHistoryIndex::getOrAddAddrId(uint8_t const * addr160)
+{
+   uint32_t addrId = findAddrId(addr160);
+   if(addrId != UINT32_MAX)
+      return addrId;
+
+   addrId = addrs_.size();
+   AddrRecord rec;
+   memcpy(rec.addr160_, addr160, 20);
+   rec.firstChunk_ = UINT32_MAX;
+   rec.lastChunk_  = UINT32_MAX;
+   rec.lastTxIdx_  = 0;
+   rec.numBytes_   = 0;
+   addrs_.push_back(rec);
+
+   growTableIfNeeded();
+   uint32_t key  = getAddrKey(addr160);
+   uint32_t mask = addrTable_.size()-1;
+   uint32_t b    = getBucketStart(key);
+   while(addrTable_[b].idPlus1_ != 0)
+      b = (b+1) & mask;
+   addrTable_[b].key_    = key;
+   addrTable_[b].idPlus1_ = addrId + 1;
+   return addrId;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::appendByte(AddrRecord & rec, uint8_t b)
+{
+   uint32_t used = rec.numBytes_ % ADDRHIST_CHUNK_DATA;
+   if(rec.firstChunk_ == UINT32_MAX || (used == 0 && rec.numBytes_ > 0))
+   {
+      uint32_t newChunk = chunks_.size() / ADDRHIST_CHUNK_SIZE;
+      chunks_.resize(chunks_.size() + ADDRHIST_CHUNK_SIZE, 0);
+      *(uint32_t*)(&chunks_[newChunk*ADDRHIST_CHUNK_SIZE]) = UINT32_MAX;
+
+      if(rec.firstChunk_ == UINT32_MAX)
+         rec.firstChunk_ = newChunk;
+      else
+         *(uint32_t*)(&chunks_[rec.lastChunk_*ADDRHIST_CHUNK_SIZE]) = newChunk;
+      rec.lastChunk_ = newChunk;
+   }
+
+   chunks_[rec.lastChunk_*ADDRHIST_CHUNK_SIZE + 4 + used] = b;
+   rec.numBytes_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Seven bits at a time, high bit set on all but the last byte
+void AddrHistoryIndex::appendVarInt(AddrRecord & rec, uint64_t val)
+{
+   while(val >= 0x80)
+   {
+      appendByte(rec, (uint8_t)(val & 0x7f) | 0x80);
+      val >>= 7;
+   }
+   appendByte(rec, (uint8_t)val);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::addEntry(uint32_t addrId,
+                                uint32_t txIdx,
+                                uint32_t index,
+                                bool     isTxIn)
+{
+   AddrRecord & rec = addrs_[addrId];
+   int64_t delta = (int64_t)txIdx - (int64_t)rec.lastTxIdx_;
+   uint64_t zigzag = (delta >= 0 ? (uint64_t)delta << 1
+                                 : (((uint64_t)(-delta)) << 1) - 1);
+   appendVarInt(rec, zigzag);
+   appendVarInt(rec, ((uint64_t)index << 1) | (isTxIn ? 1 : 0));
+   rec.lastTxIdx_ = txIdx;
+   numEntries_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::readBytes(AddrRecord const & rec,
+                                 vector<uint8_t> & bytes) const
+{
+   bytes.resize(rec.numBytes_);
+   uint32_t chunk = rec.firstChunk_;
+   for(uint32_t pos=0; pos<rec.numBytes_; pos+=ADDRHIST_CHUNK_DATA)
+   {
+      uint8_t const * chunkPtr = &chunks_[chunk*ADDRHIST_CHUNK_SIZE];
+      uint32_t n = min((uint32_t)ADDRHIST_CHUNK_DATA, rec.numBytes_-pos);
+      memcpy(&bytes[pos], chunkPtr+4, n);
+      chunk = *(uint32_t const *)chunkPtr;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool AddrHistoryIndex::addTx(uint32_t txIdx, uint32_t numTxOut)
+{
+   if(txIdx != getNumTx())
+      return false;
+
+   outAddrIds_.resize(outAddrIds_.size() + numTxOut, 0);
+   firstOut_.push_back(outAddrIds_.size());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Address number of a TxOut, UINT32_MAX if it's non-standard or not here
+uint32_t AddrHistoryIndex::getOutAddrId(uint32_t txIdx, uint32_t txOutIdx) const
+{
+   if(txIdx >= getNumTx())
+      return UINT32_MAX;
+
+   if(txOutIdx >= firstOut_[txIdx+1] - firstOut_[txIdx])
+      return UINT32_MAX;
+
+   return outAddrIds_[firstOut_[txIdx] + txOutIdx] - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::addTxIns(TxHashIndex const & txIndex,
+                                uint32_t            txIdx,
+                                uint8_t const *     txPtr,
+                                vector<uint32_t> const & offsetsIn)
+{
+   for(uint32_t i=0; i+1<offsetsIn.size(); i++)
+   {
+      uint8_t const * txinPtr = txPtr + offsetsIn[i];
+      if(isCoinbaseTxIn(txinPtr))
+         continue;
+
+      uint32_t prevOutIdx = *(uint32_t*)(txinPtr+32);
+      uint32_t prevIdx    = txIndex.findTxIndex(txinPtr);
+      if(prevIdx == UINT32_MAX || prevIdx >= getNumTx())
+      {
+         PendingTxIn pt;
+         memcpy(pt.prevTxHash_, txinPtr, 32);
+         pt.prevOutIdx_ = prevOutIdx;
+         pt.txIdx_      = txIdx;
+         pt.txInIdx_    = i;
+         pending_.push_back(pt);
+         continue;
+      }
+
+      uint32_t addrId = getOutAddrId(prevIdx, prevOutIdx);
+      if(addrId != UINT32_MAX)
+         addEntry(addrId, txIdx, i, true);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::addTxOut(uint32_t txIdx,
+                                uint32_t txOutIdx,
+                                uint8_t const * addr160)
+{
+   if(addr160 == NULL || txIdx >= getNumTx() ||
+      txOutIdx >= firstOut_[txIdx+1] - firstOut_[txIdx])
+      return;
+
+   uint32_t addrId = getOrAddAddrId(addr160);
+   outAddrIds_[firstOut_[txIdx] + txOutIdx] = addrId + 1;
+   addEntry(addrId, txIdx, txOutIdx, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::resolvePending(TxHashIndex const & txIndex)
+{
+   for(uint32_t i=0; i<pending_.size(); i++)
+   {
+      PendingTxIn const & pt = pending_[i];
+      uint32_t prevIdx = txIndex.findTxIndex(pt.prevTxHash_);
+      uint32_t addrId  = getOutAddrId(prevIdx, pt.prevOutIdx_);
+      if(addrId != UINT32_MAX)
+         addEntry(addrId, pt.txIdx_, pt.txInIdx_, true);
+   }
+   vector<PendingTxIn>().swap(pending_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool AddrHistoryIndex::getHistory(uint8_t const * addr160,
+                                  vector<AddrHistoryEntry> & entries) const
+{
+   entries.clear();
+   uint32_t addrId = findAddrId(addr160);
+   if(addrId == UINT32_MAX)
+      return false;
+
+   static vector<uint8_t> bytes;
+   readBytes(addrs_[addrId], bytes);
+
+   uint32_t pos = 0;
+   uint32_t txIdx = 0;
+   while(pos < bytes.size())
+   {
+      uint64_t zigzag = readHistVarInt(bytes, pos);
+      int64_t  delta  = (zigzag & 1) ? -(int64_t)((zigzag+1) >> 1)
+                                     :  (int64_t)(zigzag >> 1);
+      uint64_t idxAndFlag = readHistVarInt(bytes, pos);
+      txIdx = (uint32_t)((int64_t)txIdx + delta);
+      entries.push_back(AddrHistoryEntry(txIdx,
+                                         (uint32_t)(idxAndFlag >> 1),
+                                         (idxAndFlag & 1) != 0));
+   }
+
+   // Only pending TxIns come in out of order
+   stable_sort(entries.begin(), entries.end());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void AddrHistoryIndex::prefixSearch(uint8_t const * prefix,
+                                    uint32_t prefixLen,
+                                    vector<BinaryData> & addrList) const
+{
+   addrList.clear();
+   prefixLen = min(prefixLen, (uint32_t)20);
+   for(uint32_t i=0; i<addrs_.size(); i++)
+      if(memcmp(addrs_[i].addr160_, prefix, prefixLen) == 0)
+         addrList.push_back(BinaryData(addrs_[i].addr160_, 20));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t AddrHistoryIndex::getMemoryUsage(void) const
+{
+   return (uint64_t)addrs_.capacity()      * sizeof(AddrRecord)  +
+          (uint64_t)addrTable_.capacity()  * sizeof(Bucket)      +
+          (uint64_t)chunks_.capacity()                           +
+          (uint64_t)firstOut_.capacity()   * sizeof(uint32_t)    +
+          (uint64_t)outAddrIds_.capacity() * sizeof(uint32_t)    +
+          (uint64_t)pending_.capacity()    * sizeof(PendingTxIn);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The history bytes go out in one piece per address, the chunks are just
+// how they're kept in RAM.  Pending TxIns are not saved, the snapshot is
+// only written after they're resolved.
+void AddrHistoryIndex::serialize(BinaryWriter & bw) const
+{
+   bw.put_uint32_t(getNumTx());
+   for(uint32_t i=0; i<getNumTx(); i++)
+      bw.put_uint32_t(firstOut_[i+1] - firstOut_[i]);
+
+   bw.put_uint32_t(outAddrIds_.size());
+   for(uint32_t i=0; i<outAddrIds_.size(); i++)
+      bw.put_uint32_t(outAddrIds_[i]);
+
+   static vector<uint8_t> bytes;
+   bw.put_uint32_t(addrs_.size());
+   for(uint32_t a=0; a<addrs_.size(); a++)
+   {
+      AddrRecord const & rec = addrs_[a];
+      readBytes(rec, bytes);
+      bw.put_BinaryData((uint8_t*)rec.addr160_, 20);
+      bw.put_uint32_t(rec.lastTxIdx_);
+      bw.put_uint32_t(rec.numBytes_);
+      if(rec.numBytes_ > 0)
+         bw.put_BinaryData(&bytes[0], rec.numBytes_);
+   }
+   bw.put_uint64_t(numEntries_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool AddrHistoryIndex::unserialize(BinaryRefReader & brr)
+{
+   clear();
+   if(brr.getSizeRemaining() < 4)
+      return false;
+
+   uint32_t numTx = brr.get_uint32_t();
+   if(brr.getSizeRemaining() < 4*(uint64_t)numTx + 4)
+      return false;
+   for(uint32_t i=0; i<numTx; i++)
+      firstOut_.push_back(firstOut_.back() + brr.get_uint32_t());
+
+   uint32_t numTxOut = brr.get_uint32_t();
+   if(numTxOut != firstOut_.back() ||
+      brr.getSizeRemaining() < 4*(uint64_t)numTxOut + 4)
+   {
+      clear();
+      return false;
+   }
+   outAddrIds_.resize(numTxOut);
+   for(uint32_t i=0; i<numTxOut; i++)
+      outAddrIds_[i] = brr.get_uint32_t();
+
+   uint32_t numAddr = brr.get_uint32_t();
+   for(uint32_t a=0; a<numAddr; a++)
+   {
+      if(brr.getSizeRemaining() < 28)
+      {
+         clear();
+         return false;
+      }
+      uint32_t addrId = getOrAddAddrId(brr.getCurrPtr());
+      brr.advance(20);
+      uint32_t lastTxIdx = brr.get_uint32_t();
+      uint32_t numBytes  = brr.get_uint32_t();
+      if(addrId != a || brr.getSizeRemaining() < numBytes)
+      {
+         clear();
+         return false;
+      }
+
+      AddrRecord & rec = addrs_[addrId];
+      uint8_t const * ptr = brr.getCurrPtr();
+      for(uint32_t i=0; i<numBytes; i++)
+         appendByte(rec, ptr[i]);
+      rec.lastTxIdx_ = lastTxIdx;
+      brr.advance(numBytes);
+   }
+
+   if(brr.getSizeRemaining() < 8)
+   {
+      clear();
+      return false;
+   }
+   numEntries_ = brr.get_uint64_t();
+   return true;
+}
@@ -0,0 +1,162 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// Every address that shows up in the blockchain, and every tx that touches
+// it:  the TxOuts that pay it, and the TxIns that spend those.  With this,
+// the history of an address that was never registered is a lookup instead
+// of a scan over the whole blockchain.
+//
+// Everything is by the tx numbers the TxHashIndex gives out.  Each address
+// gets a number too, in the order they're first seen:
+//
+//    addrs_[addrId]      -- the addr160, and where its history is
+//    outAddrIds_[i]      -- the address number plus one (0 is non-standard)
+//                           of each TxOut of every tx, in the same layout
+//                           as the TxOutSpendIndex.  So a TxIn can find the
+//                           address it spends from without reading the
+//                           prev tx again.
+//
+// The history of an address is a list of (txIdx, TxIn or TxOut, index)
+// entries.  They're stored as var_ints:  the difference from the previous
+// entry's txIdx (almost always small and positive, so zig-zag encoded),
+// then the index with the in/out flag in the low bit.  Most entries come to
+// 2-4 bytes.  The bytes go in a chain of small fixed-size chunks from one
+// big pool, so an address with one entry doesn't cost a whole vector.
+//
+// Tx that end up off the main chain stay in here, the BDM just skips them
+// when it's asked for the history.  A tx is only added once, even if it's
+// in blocks on both sides of a fork.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _ADDRHISTORYINDEX_H_
+#define _ADDRHISTORYINDEX_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "TxHashIndex.h"
+
+
+// Address table starts this big (power of 2), and doubles whenever it gets
+// more than ADDRHIST_MAX_LOAD_PCT percent full
+#define ADDRHIST_INIT_BUCKETS   65536
+#define ADDRHIST_MAX_LOAD_PCT   70
+
+// Each chunk is a 4-byte index of the next chunk, then the entry bytes
+#define ADDRHIST_CHUNK_SIZE     32
+#define ADDRHIST_CHUNK_DATA     (ADDRHIST_CHUNK_SIZE-4)
+
+
+class AddrHistoryEntry
+{
+public:
+   AddrHistoryEntry(uint32_t txIdx=0, uint32_t index=0, bool isTxIn=false) :
+      txIdx_(txIdx), index_(index), isTxIn_(isTxIn) {}
+
+   uint32_t getTxIndex(void) const { return txIdx_; }
+   uint32_t getIndex(void)   const { return index_; }
+   bool     isTxIn(void)     const { return isTxIn_; }
+
+   bool operator<(AddrHistoryEntry const & e2) const
+                                   { return txIdx_ < e2.txIdx_; }
+
+private:
+   uint32_t txIdx_;
+   uint32_t index_;    // of the TxIn or TxOut, in that tx
+   bool     isTxIn_;
+};
+
+
+class AddrHistoryIndex
+{
+public:
+   AddrHistoryIndex(void) { clear(); }
+
+   void     clear(void);
+   uint32_t getNumTx(void)        const { return firstOut_.size() - 1; }
+   uint32_t getNumAddresses(void) const { return addrs_.size(); }
+   uint64_t getNumEntries(void)   const { return numEntries_; }
+
+   // Tx have to be added in the order the TxHashIndex numbers them, so this
+   // returns false (and does nothing) if txIdx isn't the next one.  Then
+   // add its TxIns, and its TxOuts (addr160 is NULL if it's non-standard)
+   bool     addTx(uint32_t txIdx, uint32_t numTxOut);
+   void     addTxIns(TxHashIndex const & txIndex,
+                     uint32_t            txIdx,
+                     uint8_t const *     txPtr,
+                     vector<uint32_t> const & offsetsIn);
+   void     addTxOut(uint32_t txIdx, uint32_t txOutIdx, uint8_t const * addr160);
+
+   // TxIns whose prev tx wasn't added yet (blocks out of order in the blk
+   // files) wait until this is called
+   void     resolvePending(TxHashIndex const & txIndex);
+   uint32_t getNumPending(void) const { return pending_.size(); }
+
+   // Sorted by txIdx.  Returns false if the address was never seen
+   bool     getHistory(uint8_t const * addr160,
+                       vector<AddrHistoryEntry> & entries) const;
+
+   // Every address starting with these bytes
+   void     prefixSearch(uint8_t const * prefix, uint32_t prefixLen,
+                         vector<BinaryData> & addrList) const;
+
+   // Approximate bytes used
+   uint64_t getMemoryUsage(void) const;
+
+   // For the BDM snapshot file
+   void     serialize(BinaryWriter & bw) const;
+   bool     unserialize(BinaryRefReader & brr);
+
+private:
+   struct AddrRecord
+   {
+      uint8_t  addr160_[20];
+      uint32_t firstChunk_;     // UINT32_MAX if it has no entries yet
+      uint32_t lastChunk_;
+      uint32_t lastTxIdx_;      // for the delta of the next entry
+      uint32_t numBytes_;
+   };
+
+   struct Bucket
+   {
+      uint32_t key_;            // 4 bytes of addr160
+      uint32_t idPlus1_;        // 0 means the bucket is empty
+   };
+
+   struct PendingTxIn
+   {
+      uint8_t  prevTxHash_[32];
+      uint32_t prevOutIdx_;
+      uint32_t txIdx_;
+      uint32_t txInIdx_;
+   };
+
+   // Anyone can grind the addr160 bytes (vanity addresses), so the bucket
+   // can't come straight from the key
+   uint32_t getBucketStart(uint32_t key) const
+                  { return BtcUtils::hashToBucket(key, addrTable_.size()); }
+
+   uint32_t findAddrId(uint8_t const * addr160) const;
+   uint32_t getOrAddAddrId(uint8_t const * addr160);
+   void     growTableIfNeeded(void);
+   void     addEntry(uint32_t addrId, uint32_t txIdx, uint32_t index, bool isTxIn);
+   void     appendByte(AddrRecord & rec, uint8_t b);
+   void     appendVarInt(AddrRecord & rec, uint64_t val);
+   void     readBytes(AddrRecord const & rec, vector<uint8_t> & bytes) const;
+   uint32_t getOutAddrId(uint32_t txIdx, uint32_t txOutIdx) const;
+
+   vector<AddrRecord>  addrs_;
+   vector<Bucket>      addrTable_;
+   vector<uint8_t>     chunks_;
+   vector<uint32_t>    firstOut_;     // one more than the number of tx
+   vector<uint32_t>    outAddrIds_;   // addrId+1 of each TxOut, 0 if none
+   vector<PendingTxIn> pending_;
+   uint64_t            numEntries_;
+};
+
+
+#endif
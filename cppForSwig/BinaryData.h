@@ -378,7 +378,7 @@ public:
       uint32_t filesize = (size_t)is.tellg();
       is.seekg(0, ios::beg);
       
-      data_.resize(getSize());
+      data_.resize(filesize);
       is.read((char*)getPtr(), getSize());
       return getSize();
    }
@@ -386,6 +386,9 @@ public:
    // For deallocating all the memory that is currently used by this BD
    void clear(void) { data_.clear(); }
 
+   // Trade buffers with another BD, without copying anything
+   void swap(BinaryData & bd2) { data_.swap(bd2.data_); }
+
 private:
    vector<uint8_t> data_;
 
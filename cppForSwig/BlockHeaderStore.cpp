@@ -0,0 +1,223 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "BtcUtils.h"
+#include "BlockHeaderStore.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeaderStore::BlockHeaderStore(void) :
+   bucketMask_(0),
+   numHeaders_(0)
+{
+   clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeaderStore::~BlockHeaderStore(void)
+{
+   clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Frees all the slabs, so any BlockHeader* still floating around is garbage
+// after this.  Same as it was when clearing the map.
+void BlockHeaderStore::clear(void)
+{
+   for(uint32_t i=0; i<viewSlabs_.size(); i++)
+   {
+      delete[] rawSlabs_[i];
+      delete[] metaSlabs_[i];
+      delete[] txListSlabs_[i];
+      delete[] viewSlabs_[i];
+   }
+   rawSlabs_.clear();
+   metaSlabs_.clear();
+   txListSlabs_.clear();
+   viewSlabs_.clear();
+   numHeaders_ = 0;
+
+   Bucket empty = {0, 0};
+   vector<Bucket>(HEADERSTORE_INIT_BUCKETS, empty).swap(buckets_);
+   bucketMask_ = HEADERSTORE_INIT_BUCKETS - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The views are pointed at their data once, here, and never change
+void BlockHeaderStore::addSlab(void)
+{
+   BlockHeaderRaw*  rawSlab    = new BlockHeaderRaw[HEADERSTORE_SLAB_SIZE];
+   BlockHeaderMeta* metaSlab   = new BlockHeaderMeta[HEADERSTORE_SLAB_SIZE];
+   vector<TxRef*>*  txListSlab = new vector<TxRef*>[HEADERSTORE_SLAB_SIZE];
+   BlockHeader*     viewSlab   = new BlockHeader[HEADERSTORE_SLAB_SIZE];
+
+   // A default BlockHeader comes with its own data, which a view doesn't want
+   for(uint32_t i=0; i<HEADERSTORE_SLAB_SIZE; i++)
+   {
+      viewSlab[i].freeOwnData();
+      viewSlab[i].raw_       = &(rawSlab[i]);
+      viewSlab[i].meta_      = &(metaSlab[i]);
+      viewSlab[i].txPtrList_ = &(txListSlab[i]);
+      viewSlab[i].ownsData_  = false;
+   }
+
+   rawSlabs_.push_back(rawSlab);
+   metaSlabs_.push_back(metaSlab);
+   txListSlabs_.push_back(txListSlab);
+   viewSlabs_.push_back(viewSlab);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* BlockHeaderStore::findHeader(uint8_t const * blkHash) const
+{
+   uint32_t key = getKey(blkHash);
+   uint32_t b   = getBucketStart(key);
+   while(buckets_[b].hdrIdxPlus1_ != 0)
+   {
+      if(buckets_[b].key_ == key)
+      {
+         BlockHeader* bhptr = getHeaderByIndex(buckets_[b].hdrIdxPlus1_ - 1);
+         if(memcmp(bhptr->raw_->hash_, blkHash, 32) == 0)
+            return bhptr;
+      }
+      b = (b+1) & bucketMask_;
+   }
+   return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* BlockHeaderStore::findPrevHeader(BlockHeader* bhptr) const
+{
+   if(bhptr->meta_->prevHeaderPtr_ == NULL)
+      bhptr->meta_->prevHeaderPtr_ = findHeader(bhptr->raw_->header_ + 4);
+   return bhptr->meta_->prevHeaderPtr_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader* BlockHeaderStore::insertHeader(uint8_t const * rawHeader,
+                                            bool * wasAdded)
+{
+   static BinaryData hash(32);
+   BtcUtils::getHash256_NoSafetyCheck(rawHeader, HEADER_SIZE, hash);
+
+   uint32_t key = getKey(hash.getPtr());
+   uint32_t b   = getBucketStart(key);
+   while(buckets_[b].hdrIdxPlus1_ != 0)
+   {
+      if(buckets_[b].key_ == key)
+      {
+         BlockHeader* bhptr = getHeaderByIndex(buckets_[b].hdrIdxPlus1_ - 1);
+         if(memcmp(bhptr->raw_->hash_, hash.getPtr(), 32) == 0)
+         {
+            if(wasAdded != NULL)
+               *wasAdded = false;
+            return bhptr;
+         }
+      }
+      b = (b+1) & bucketMask_;
+   }
+
+   // Not here yet -- b is the empty bucket at the end of the probe sequence
+   uint32_t newIdx = numHeaders_;
+   if(newIdx % HEADERSTORE_SLAB_SIZE == 0)
+      addSlab();
+
+   BlockHeader* bhptr = getHeaderByIndex(newIdx);
+   memcpy(bhptr->raw_->header_, rawHeader, HEADER_SIZE);
+   memcpy(bhptr->raw_->hash_, hash.getPtr(), 32);
+   BlockHeader::initMeta(*(bhptr->meta_), rawHeader);
+   bhptr->txPtrList_->clear();
+   numHeaders_++;
+
+   buckets_[b].key_         = key;
+   buckets_[b].hdrIdxPlus1_ = newIdx + 1;
+
+   if( (uint64_t)numHeaders_ * 100 >
+       (uint64_t)buckets_.size() * HEADERSTORE_MAX_LOAD_PCT)
+      growTable();
+
+   if(wasAdded != NULL)
+      *wasAdded = true;
+   return bhptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockHeaderStore::growTable(void)
+{
+   vector<Bucket> oldBuckets;
+   oldBuckets.swap(buckets_);
+
+   Bucket empty = {0, 0};
+   buckets_.resize(oldBuckets.size()*2, empty);
+   bucketMask_ = buckets_.size() - 1;
+
+   for(uint32_t i=0; i<oldBuckets.size(); i++)
+   {
+      if(oldBuckets[i].hdrIdxPlus1_ == 0)
+         continue;
+
+      uint32_t b = getBucketStart(oldBuckets[i].key_);
+      while(buckets_[b].hdrIdxPlus1_ != 0)
+         b = (b+1) & bucketMask_;
+      buckets_[b] = oldBuckets[i];
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool compareHeaderHash(BlockHeader const * a, BlockHeader const * b)
+{
+   return memcmp(a->getThisHashRef().getPtr(),
+                 b->getThisHashRef().getPtr(), 32) < 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<BlockHeader*> BlockHeaderStore::findHeadersByPrefix(uint8_t const * prefix,
+                                                           uint32_t len) const
+{
+   vector<BlockHeader*> result;
+   len = min(len, (uint32_t)32);
+
+   if(len >= 4)
+   {
+      uint32_t key = getKey(prefix);
+      uint32_t b   = getBucketStart(key);
+      while(buckets_[b].hdrIdxPlus1_ != 0)
+      {
+         if(buckets_[b].key_ == key)
+         {
+            BlockHeader* bhptr = getHeaderByIndex(buckets_[b].hdrIdxPlus1_ - 1);
+            if(memcmp(bhptr->raw_->hash_, prefix, len) == 0)
+               result.push_back(bhptr);
+         }
+         b = (b+1) & bucketMask_;
+      }
+   }
+   else
+   {
+      for(uint32_t i=0; i<numHeaders_; i++)
+      {
+         BlockHeader* bhptr = getHeaderByIndex(i);
+         if(memcmp(bhptr->raw_->hash_, prefix, len) == 0)
+            result.push_back(bhptr);
+      }
+   }
+
+   sort(result.begin(), result.end(), compareHeaderHash);
+   return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BlockHeaderStore::getMemoryUsage(void) const
+{
+   uint64_t perHeader = sizeof(BlockHeaderRaw) + sizeof(BlockHeaderMeta) +
+                        sizeof(vector<TxRef*>) + sizeof(BlockHeader);
+   return (uint64_t)buckets_.capacity() * sizeof(Bucket) +
+          (uint64_t)viewSlabs_.size() * HEADERSTORE_SLAB_SIZE * perHeader;
+}
+
@@ -0,0 +1,112 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// All the block headers the BDM knows about.  This used to be a
+// map<HashString, BlockHeader>, where every header was a tree node with its
+// own key, plus three BinaryData members (raw header, hash, next hash) that
+// each had their own little heap buffer.
+//
+// Now the raw headers+hashes, the metadata (height, difficulty sums, flags,
+// prev/next pointers), and the tx lists each go into their own big arrays,
+// which are allocated in fixed-size slabs so nothing ever moves.  The
+// BlockHeader objects handed out are just views into those arrays, and they
+// live in slabs too, so BlockHeader* pointers are good until clear().
+//
+// Lookup by hash is the same kind of flat open-addressing table as the
+// TxHashIndex:  each bucket is the first 4 bytes of the hash and the index of
+// the header, and the full hash is checked when the 4 bytes match.
+//
+// Headers are numbered in the order they were added.  There's no way to
+// remove one, the BDM never needs to.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BLOCKHEADERSTORE_H_
+#define _BLOCKHEADERSTORE_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "BtcUtils.h"
+#include "BlockObj.h"
+
+
+// Number of headers per slab
+#define HEADERSTORE_SLAB_SIZE      4096
+
+// Starting number of buckets, must be a power of 2.  The table doubles
+// whenever it gets more than HEADERSTORE_MAX_LOAD_PCT percent full
+#define HEADERSTORE_INIT_BUCKETS   4096
+#define HEADERSTORE_MAX_LOAD_PCT   70
+
+
+class BlockHeaderStore
+{
+public:
+   BlockHeaderStore(void);
+   ~BlockHeaderStore(void);
+
+   void         clear(void);
+   uint32_t     size(void) const { return numHeaders_; }
+
+   BlockHeader* findHeader(uint8_t const * blkHash) const;
+
+   // The parent is looked up by hash the first time, then remembered in the
+   // header's metadata, so walking down the chain is just following pointers
+   BlockHeader* findPrevHeader(BlockHeader* bhptr) const;
+
+   // Hashes the header and adds it, unless it's already here, in which case
+   // the existing one is returned untouched.  wasAdded tells you which.
+   BlockHeader* insertHeader(uint8_t const * rawHeader, bool * wasAdded=NULL);
+
+   // All headers whose hash starts with these bytes, sorted by hash
+   vector<BlockHeader*> findHeadersByPrefix(uint8_t const * prefix,
+                                            uint32_t len) const;
+
+   BlockHeader* getHeaderByIndex(uint32_t i) const
+         { return &(viewSlabs_[i/HEADERSTORE_SLAB_SIZE][i%HEADERSTORE_SLAB_SIZE]); }
+
+   // Approximate bytes used by the buckets and slabs (not the tx lists)
+   uint64_t     getMemoryUsage(void) const;
+
+private:
+   // Not copyable, it owns the slabs
+   BlockHeaderStore(BlockHeaderStore const &);
+   BlockHeaderStore & operator=(BlockHeaderStore const &);
+
+   struct Bucket
+   {
+      uint32_t key_;         // first 4 bytes of the block hash
+      uint32_t hdrIdxPlus1_; // 0 means the bucket is empty
+   };
+
+   static uint32_t getKey(uint8_t const * blkHash)
+   {
+      uint32_t key;
+      memcpy(&key, blkHash, 4);
+      return key;
+   }
+
+   // Proof of work makes ground block hashes expensive, but there's no
+   // reason to hash them differently than the tx
+   uint32_t getBucketStart(uint32_t key) const
+                  { return BtcUtils::hashToBucket(key, bucketMask_+1); }
+
+   void     addSlab(void);
+   void     growTable(void);
+
+   vector<Bucket>            buckets_;
+   uint32_t                  bucketMask_;
+   uint32_t                  numHeaders_;
+
+   vector<BlockHeaderRaw*>   rawSlabs_;
+   vector<BlockHeaderMeta*>  metaSlabs_;
+   vector<vector<TxRef*>*>   txListSlabs_;
+   vector<BlockHeader*>      viewSlabs_;
+};
+
+
+#endif
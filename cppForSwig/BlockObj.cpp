@@ -19,22 +19,145 @@
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Not initialized, but it has its own (zeroed) data like any standalone 
+// header, so the getters work on it
+BlockHeader::BlockHeader(void) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{ 
+   allocateOwnData();
+}
+BlockHeader::BlockHeader(uint8_t const * ptr) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{ 
+   unserialize(ptr); 
+}
+BlockHeader::BlockHeader(BinaryRefReader & brr) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{ 
+   unserialize(brr); 
+}
+BlockHeader::BlockHeader(BinaryDataRef const & str) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{ 
+   unserialize(str); 
+}
+BlockHeader::BlockHeader(BinaryData const & str) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{ 
+   unserialize(str); 
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader::BlockHeader(BlockHeader const & bh) : 
+   meta_(NULL), raw_(NULL), txPtrList_(NULL), ownsData_(false)
+{
+   *this = bh;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BlockHeader::~BlockHeader(void)
+{
+   freeOwnData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A view stays a view, a standalone header gets its own copy of the data
+BlockHeader & BlockHeader::operator=(BlockHeader const & bh)
+{
+   if(&bh == this)
+      return *this;
+
+   freeOwnData();
+   if(!bh.ownsData_)
+   {
+      meta_      = bh.meta_;
+      raw_       = bh.raw_;
+      txPtrList_ = bh.txPtrList_;
+   }
+   else
+   {
+      allocateOwnData();
+      *meta_      = *bh.meta_;
+      *raw_       = *bh.raw_;
+      *txPtrList_ = *bh.txPtrList_;
+   }
+   return *this;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockHeader::allocateOwnData(void)
+{
+   meta_      = new BlockHeaderMeta;
+   raw_       = new BlockHeaderRaw;
+   txPtrList_ = new vector<TxRef*>;
+   ownsData_  = true;
+
+   memset(raw_, 0, sizeof(BlockHeaderRaw));
+   meta_->thisBlockFilePtr_ = FileDataPtr();
+   meta_->blockHeight_      = 0;
+   meta_->difficultyDbl_    = 0;
+   meta_->difficultySum_    = 0;
+   meta_->prevHeaderPtr_    = NULL;
+   meta_->nextHeaderPtr_    = NULL;
+   meta_->isInitialized_    = false;
+   meta_->isMainBranch_     = false;
+   meta_->isOrphan_         = false;
+   meta_->isFinishedCalc_   = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockHeader::freeOwnData(void)
+{
+   if(ownsData_)
+   {
+      delete meta_;
+      delete raw_;
+      delete txPtrList_;
+   }
+   meta_      = NULL;
+   raw_       = NULL;
+   txPtrList_ = NULL;
+   ownsData_  = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Everything we know about a header before it's been put into a chain
+void BlockHeader::initMeta(BlockHeaderMeta & meta, uint8_t const * rawHeader)
+{
+   meta.thisBlockFilePtr_ = FileDataPtr();
+   meta.blockHeight_      = UINT32_MAX;
+   meta.difficultyDbl_    = BtcUtils::convertDiffBitsToDouble( 
+                                       BinaryDataRef(rawHeader+72, 4));
+   meta.difficultySum_    = -1;
+   meta.prevHeaderPtr_    = NULL;
+   meta.nextHeaderPtr_    = NULL;
+   meta.isInitialized_    = true;
+   meta.isMainBranch_     = false;
+   meta.isOrphan_         = true;
+   meta.isFinishedCalc_   = false;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 void BlockHeader::unserialize(uint8_t const * ptr)
 {
-   dataCopy_.copyFrom(ptr, HEADER_SIZE);
-   BtcUtils::getHash256(dataCopy_.getPtr(), HEADER_SIZE, thisHash_);
-   difficultyDbl_ = BtcUtils::convertDiffBitsToDouble( 
-                              BinaryDataRef(dataCopy_.getPtr()+72, 4));
-   isInitialized_ = true;
-   nextHash_ = BinaryData(0);
-   blockHeight_ = UINT32_MAX;
-   difficultySum_ = -1;
-   isMainBranch_ = false;
-   isOrphan_ = true;
-   isFinishedCalc_ = false;
-   isOnDiskYet_ = false;
-   txPtrList_ = vector<TxRef*>(0);
+   if(meta_ == NULL)
+      allocateOwnData();
+
+   memcpy(raw_->header_, ptr, HEADER_SIZE);
+   BinaryData hash = BtcUtils::getHash256(raw_->header_, HEADER_SIZE);
+   memcpy(raw_->hash_, hash.getPtr(), 32);
+   initMeta(*meta_, raw_->header_);
+   txPtrList_->clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// All zeros if there's no next block (or we haven't organized the chain yet)
+BinaryDataRef BlockHeader::getNextHashRef(void) const
+{
+   if(meta_->nextHeaderPtr_ == NULL)
+      return BtcUtils::EmptyHash_.getRef();
+   return meta_->nextHeaderPtr_->getThisHashRef();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -64,10 +187,10 @@ BinaryData BlockHeader::serializeWholeBlock(BinaryData const & magic,
    else
       serializedBlock.reserve(blksize);
 
-   serializedBlock.put_BinaryData(dataCopy_);
+   serializedBlock.put_BinaryData(BinaryData(getPtr(), HEADER_SIZE));
    serializedBlock.put_var_int(getNumTx());
    for(uint32_t i=0; i<getNumTx(); i++)
-      serializedBlock.put_BinaryData(txPtrList_[i]->serialize());
+      serializedBlock.put_BinaryData((*txPtrList_)[i]->serialize());
 
    return serializedBlock.getData();
    
@@ -80,20 +203,69 @@ vector<BinaryData> BlockHeader::getTxHashList(void)
 {
    vector<BinaryData> vectOut(getNumTx());
    for(uint32_t i=0; i<getNumTx(); i++)
-      vectOut[i] = txPtrList_[i]->getThisHash();
+      vectOut[i] = (*txPtrList_)[i]->getThisHash();
 
    return vectOut;
 }
 ////////////////////////////////////////////////////////////////////////////////
+// If we know where the block is, read the whole thing once and hash all the
+// tx in it in one batch, instead of going back to the file for each TxRef.
+// Otherwise (or if the block data doesn't look right), the TxRefs it is.
 BinaryData BlockHeader::calcMerkleRoot(vector<BinaryData>* treeOut) 
 {
-   if(treeOut == NULL)
-      return BtcUtils::calculateMerkleRoot( getTxHashList() );
-   else
+   uint32_t nTx = getNumTx();
+   BinaryData txHashes(32*nTx);
+   bool gotHashes = false;
+
+   FileDataPtr fdpBlock = getBlockFilePtr();
+   if(nTx > 0 && fdpBlock.getNumBytes() > 8+HEADER_SIZE)
+   {
+      BinaryData buffer;
+      uint8_t const * blkPtr = fdpBlock.getThreadSafeDataPtr(buffer);
+      uint8_t const * blkEnd = blkPtr + fdpBlock.getNumBytes();
+      uint32_t viLen;
+      uint8_t const * txPtr = blkPtr + 8 + HEADER_SIZE;
+      if(blkPtr != NULL && BtcUtils::readVarInt(txPtr, &viLen) == nTx)
+      {
+         vector<uint8_t const *> txPtrs(nTx);
+         vector<uint32_t>        txSizes(nTx);
+         txPtr += viLen;
+         gotHashes = true;
+         for(uint32_t i=0; i<nTx; i++)
+         {
+            txPtrs[i]  = txPtr;
+            txSizes[i] = BtcUtils::TxCalcLength(txPtr);
+            txPtr += txSizes[i];
+            if(txPtr > blkEnd)
+            {
+               gotHashes = false;
+               break;
+            }
+         }
+
+         if(gotHashes)
+            Sha256::doubleHashBatch(&txPtrs[0], &txSizes[0], nTx, txHashes.getPtr());
+      }
+   }
+
+   if(!gotHashes)
    {
-      *treeOut = BtcUtils::calculateMerkleTree( getTxHashList() );
-      return (*treeOut)[treeOut->size()-1];
+      for(uint32_t i=0; i<nTx; i++)
+         (*txPtrList_)[i]->getThisHash().copyTo(txHashes.getPtr() + 32*i, 32);
    }
+
+   BinaryData tree;
+   uint32_t nNodes = BtcUtils::calculateMerkleTree(txHashes.getPtr(), nTx, tree);
+   if(treeOut != NULL)
+   {
+      treeOut->resize(nNodes);
+      for(uint32_t i=0; i<nNodes; i++)
+         (*treeOut)[i].copyFrom(tree.getPtr() + 32*i, 32);
+   }
+
+   if(nNodes == 0)
+      return BinaryData(0);
+   return BinaryData(tree.getPtr() + 32*(nNodes-1), 32);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -111,7 +283,7 @@ bool BlockHeader::verifyIntegrity(void)
 
    // Check that the last four bytes of the hash are zeros
    BinaryData fourzerobytes = BtcUtils::EmptyHash_.getSliceCopy(0,4);
-   bool headerIsGood = (thisHash_.getSliceCopy(28,4) == fourzerobytes);
+   bool headerIsGood = (getThisHashRef().getSliceCopy(28,4) == fourzerobytes);
    return (merkleIsGood && headerIsGood);
 }
 
@@ -124,7 +296,7 @@ void BlockHeader::pprint(ostream & os, int nIndent, bool pBigendian) const
       indent = indent + "   ";
 
    string endstr = (pBigendian ? " (BE)" : " (LE)");
-   os << indent << "Block Information: " << blockHeight_ << endl;
+   os << indent << "Block Information: " << meta_->blockHeight_ << endl;
    os << indent << "   Hash:       " 
                 << getThisHash().toHexStr(pBigendian).c_str() << endstr << endl;
    os << indent << "   Timestamp:  " << getTimestamp() << endl;
@@ -132,9 +304,9 @@ void BlockHeader::pprint(ostream & os, int nIndent, bool pBigendian) const
                 << getPrevHash().toHexStr(pBigendian).c_str() << endstr << endl;
    os << indent << "   MerkleRoot: " 
                 << getMerkleRoot().toHexStr(pBigendian).c_str() << endstr << endl;
-   os << indent << "   Difficulty: " << (difficultyDbl_)
+   os << indent << "   Difficulty: " << (meta_->difficultyDbl_)
                          << "    (" << getDiffBits().toHexStr().c_str() << ")" << endl;
-   os << indent << "   CumulDiff:  " << (difficultySum_) << endl;
+   os << indent << "   CumulDiff:  " << (meta_->difficultySum_) << endl;
    os << indent << "   Nonce:      " << getNonce() << endl;
 }
 
@@ -194,13 +366,13 @@ uint32_t BlockHeader::findNonce(void)
 uint32_t BlockHeader::getBlockSize(void) const
 {
    uint32_t nBytes = HEADER_SIZE; 
-   uint32_t nTx = txPtrList_.size();
+   uint32_t nTx = txPtrList_->size();
    for(uint32_t i=0; i<nTx; i++)
    {
-      if(txPtrList_[i] == NULL)
+      if((*txPtrList_)[i] == NULL)
          return 0;
       else
-         nBytes += txPtrList_[i]->getSize();
+         nBytes += (*txPtrList_)[i]->getSize();
    }
 
    // Add in a couple bytes for the var_int
@@ -517,7 +689,8 @@ Tx::Tx(TxRef* txref)
 {
    if(txref != NULL)
    {
-      unserialize(txref->getBlkFilePtr().getUnsafeDataPtr());
+      BinaryData buffer;
+      unserialize(txref->getBlkFilePtr().getThreadSafeDataPtr(buffer));
       headerPtr_ = txref->getHeaderPtr();
    }
    txRefPtr_ = txref;
@@ -637,7 +810,7 @@ uint32_t Tx::getBlockTxIndex(void)
 
    vector<TxRef*> txlist = headerPtr_->getTxRefPtrList();
    for(uint32_t i=0; i<txlist.size(); i++)
-      if( txlist[i]->getThisHash() == getThisHash() )
+      if( txlist[i]->matchesHash(getThisHash()) )
          return i;
    return UINT32_MAX;
 }
@@ -715,7 +888,8 @@ Tx TxRef::getTxCopy(void) const
    // It seems unnecessary to have to make this method non-const, but also
    // unnecessary to require (TxRef const *) for the tx copy...
    // I've never used const_cast before, but it seems appropriate here...
-   Tx out(blkFilePtr_.getUnsafeDataPtr());
+   BinaryData buffer;
+   Tx out(blkFilePtr_.getThreadSafeDataPtr(buffer));
    out.setTxRefPtr(const_cast<TxRef*>(this));
    out.setHeaderPtr(headerPtr_);
    return out;
@@ -733,7 +907,8 @@ bool TxRef::isMainBranch(void) const
 /////////////////////////////////////////////////////////////////////////////
 BinaryData TxRef::getThisHash(void) const
 {
-   uint8_t* tempPtr = blkFilePtr_.getUnsafeDataPtr();
+   BinaryData buffer;
+   uint8_t const * tempPtr = blkFilePtr_.getThreadSafeDataPtr(buffer);
    return BtcUtils::getHash256(tempPtr, blkFilePtr_.getNumBytes());
 }
 
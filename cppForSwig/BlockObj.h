@@ -15,63 +15,107 @@
 #include <cassert>
 
 #include "BinaryData.h"
+#include "BtcUtils.h"
 #include "FileDataPtr.h"
 
+// How much of the tx hash each TxRef keeps, so that lookups can tell tx 
+// apart without reading and re-hashing them from the blk files
+#define TXREF_HASH_PREFIX_BYTES 12
+
 
 
 class TxRef;
 class Tx;
+class BlockHeader;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The BDM keeps hundreds of thousands of headers, so it stores their data in
+// a BlockHeaderStore, as big contiguous arrays of these two structs, and the
+// BlockHeader objects it hands out are just views into those arrays.  The 
+// metadata is what organizeChain walks over, so it's kept apart from the 
+// raw 80 bytes and hash, which it almost never needs.
+struct BlockHeaderMeta
+{
+   FileDataPtr    thisBlockFilePtr_;  // points to beginning of blk, magic bytes
+   uint32_t       blockHeight_;
+   double         difficultyDbl_;
+   double         difficultySum_;
+
+   // NULL until organizeChain finds them.  Next is only set on the main chain
+   BlockHeader*   prevHeaderPtr_;
+   BlockHeader*   nextHeaderPtr_;
+
+   bool           isInitialized_;
+   bool           isMainBranch_;
+   bool           isOrphan_;
+   bool           isFinishedCalc_;
+};
+
+struct BlockHeaderRaw
+{
+   uint8_t        header_[HEADER_SIZE];
+   uint8_t        hash_[32];
+};
 
 
+////////////////////////////////////////////////////////////////////////////////
+// A BlockHeader is either a view into a BlockHeaderStore (that's all the ones
+// you get from the BDM), or holds its own copy of the data, like before, if
+// you create one yourself.  Copying a view gives you another view of the same
+// header, copying a standalone header copies the data.
 class BlockHeader
 {
    friend class BlockDataManager_FileRefs;
+   friend class BlockHeaderStore;
 
 public:
 
    /////////////////////////////////////////////////////////////////////////////
-   BlockHeader(void) : 
-           isInitialized_(false),  isFinishedCalc_(false) {}
-   BlockHeader(uint8_t const * ptr)       { unserialize(ptr); }
-   BlockHeader(BinaryRefReader & brr)     { unserialize(brr); }
-   BlockHeader(BinaryDataRef const & str) { unserialize(str); }
-   BlockHeader(BinaryData    const & str) { unserialize(str); }
+   BlockHeader(void);
+   BlockHeader(uint8_t const * ptr);
+   BlockHeader(BinaryRefReader & brr);
+   BlockHeader(BinaryDataRef const & str);
+   BlockHeader(BinaryData    const & str);
+   BlockHeader(BlockHeader const & bh);
+   ~BlockHeader(void);
+   BlockHeader & operator=(BlockHeader const & bh);
    // SWIG needs a non-overloaded method
    BlockHeader & unserialize_1_(BinaryData const & str) { unserialize(str); return *this; }
 
    uint32_t           getVersion(void) const      { return  *(uint32_t*)(getPtr()  );  }
-   BinaryData const & getThisHash(void) const     { return thisHash_;                  }
+   BinaryData         getThisHash(void) const     { return BinaryData(raw_->hash_, 32);}
    BinaryData         getPrevHash(void) const     { return BinaryData(getPtr()+4 ,32); }
-   BinaryData const & getNextHash(void) const     { return nextHash_;                  }
+   BinaryData         getNextHash(void) const     { return getNextHashRef().copy();    }
    BinaryData         getMerkleRoot(void) const   { return BinaryData(getPtr()+36,32); }
    BinaryData         getDiffBits(void) const     { return BinaryData(getPtr()+72,4 ); }
    uint32_t           getTimestamp(void) const    { return  *(uint32_t*)(getPtr()+68); }
    uint32_t           getNonce(void) const        { return  *(uint32_t*)(getPtr()+76); }
-   uint32_t           getBlockHeight(void) const  { return blockHeight_;               }
-   bool               isMainBranch(void) const    { return isMainBranch_;              }
-   bool               isOrphan(void) const        { return isOrphan_;                  }
-   double             getDifficulty(void) const   { return difficultyDbl_;             }
-   double             getDifficultySum(void) const{ return difficultySum_;             }
+   uint32_t           getBlockHeight(void) const  { return meta_->blockHeight_;        }
+   bool               isMainBranch(void) const    { return meta_->isMainBranch_;       }
+   bool               isOrphan(void) const        { return meta_->isOrphan_;           }
+   double             getDifficulty(void) const   { return meta_->difficultyDbl_;      }
+   double             getDifficultySum(void) const{ return meta_->difficultySum_;      }
 
    /////////////////////////////////////////////////////////////////////////////
-   BinaryDataRef  getThisHashRef(void) const   { return thisHash_.getRef();            }
+   BinaryDataRef  getThisHashRef(void) const   { return BinaryDataRef(raw_->hash_, 32);}
    BinaryDataRef  getPrevHashRef(void) const   { return BinaryDataRef(getPtr()+4, 32); }
-   BinaryDataRef  getNextHashRef(void) const   { return nextHash_.getRef();            }
+   BinaryDataRef  getNextHashRef(void) const;
    BinaryDataRef  getMerkleRootRef(void) const { return BinaryDataRef(getPtr()+36,32); }
    BinaryDataRef  getDiffBitsRef(void) const   { return BinaryDataRef(getPtr()+72,4 ); }
-   uint32_t       getNumTx(void) const         { return txPtrList_.size();             }
+   uint32_t       getNumTx(void) const         { return txPtrList_->size();            }
 
    /////////////////////////////////////////////////////////////////////////////
-   uint8_t const * getPtr(void) const  { assert(isInitialized_); return dataCopy_.getPtr(); }
-   uint32_t        getSize(void) const { assert(isInitialized_); return dataCopy_.getSize(); }
-   uint32_t        isInitialized(void) const { return isInitialized_; }
+   uint8_t const * getPtr(void) const  { assert(isInitialized()); return raw_->header_; }
+   uint32_t        getSize(void) const { assert(isInitialized()); return HEADER_SIZE; }
+   uint32_t        isInitialized(void) const { return meta_!=NULL && meta_->isInitialized_; }
    uint32_t        getBlockSize(void) const;
-   FileDataPtr     getBlockFilePtr(void) { return thisBlockFilePtr_; }
-   void            setBlockFilePtr(FileDataPtr b) { thisBlockFilePtr_ = b; }
+   FileDataPtr     getBlockFilePtr(void) { return meta_->thisBlockFilePtr_; }
+   void            setBlockFilePtr(FileDataPtr b) { meta_->thisBlockFilePtr_ = b; }
 
 
    /////////////////////////////////////////////////////////////////////////////
-   vector<TxRef*> &   getTxRefPtrList(void) {return txPtrList_;}
+   vector<TxRef*> &   getTxRefPtrList(void) {return *txPtrList_;}
    vector<BinaryData> getTxHashList(void);
    BinaryData         calcMerkleRoot(vector<BinaryData>* treeOut=NULL);
    bool               verifyMerkleRoot(void);
@@ -82,7 +126,7 @@ public:
    void          pprintAlot(ostream & os=cout);
 
    /////////////////////////////////////////////////////////////////////////////
-   BinaryData    serialize(void)    { return dataCopy_; }
+   BinaryData    serialize(void)    { return BinaryData(getPtr(), HEADER_SIZE); }
 
    /////////////////////////////////////////////////////////////////////////////
    BinaryData    serializeWholeBlock(BinaryData const & magic, 
@@ -92,31 +136,22 @@ public:
    uint32_t      findNonce(void);
 
    /////////////////////////////////////////////////////////////////////////////
+   // Don't call these on a header you got from the BDM, the store wouldn't
+   // know its hash changed
    void unserialize(uint8_t const * ptr);
    void unserialize(BinaryData const & str) { unserialize(str.getRef()); }
    void unserialize(BinaryDataRef const & str);
    void unserialize(BinaryRefReader & brr);
 
-   void clearDataCopy() {dataCopy_.resize(0);}
-
 private:
-   BinaryData     dataCopy_;
-   bool           isInitialized_;
-
-   // Derived properties - we expect these to be set after construct/copy
-   BinaryData     thisHash_;
-   double         difficultyDbl_;
-   FileDataPtr    thisBlockFilePtr_;  // points to beginning of blk, magic bytes
-
-   // Need to compute these later
-   BinaryData     nextHash_;
-   uint32_t       blockHeight_;
-   double         difficultySum_;
-   bool           isMainBranch_;
-   bool           isOrphan_;
-   bool           isFinishedCalc_;
-   bool           isOnDiskYet_;
-   vector<TxRef*> txPtrList_;
+   void allocateOwnData(void);
+   void freeOwnData(void);
+   static void initMeta(BlockHeaderMeta & meta, uint8_t const * rawHeader);
+
+   BlockHeaderMeta* meta_;
+   BlockHeaderRaw*  raw_;
+   vector<TxRef*>*  txPtrList_;
+   bool             ownsData_;
 };
 
 
@@ -440,8 +475,10 @@ class TxRef
 
 public:
    /////////////////////////////////////////////////////////////////////////////
-   TxRef(void) : headerPtr_(NULL) {}
-   TxRef(FileDataPtr fdr) : blkFilePtr_(fdr), headerPtr_(NULL) {}
+   TxRef(void) : headerPtr_(NULL) 
+      { memset(hashPrefix_, 0, TXREF_HASH_PREFIX_BYTES); }
+   TxRef(FileDataPtr fdr) : blkFilePtr_(fdr), headerPtr_(NULL) 
+      { memset(hashPrefix_, 0, TXREF_HASH_PREFIX_BYTES); }
      
    /////////////////////////////////////////////////////////////////////////////
    BinaryData         getThisHash(void) const;
@@ -456,6 +493,21 @@ public:
    FileDataPtr        getBlkFilePtr(void) { return blkFilePtr_; }
    void               setBlkFilePtr(FileDataPtr const & b) { blkFilePtr_ = b; }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // The BDM sets this when the TxRef goes into its tx index.  The first 12
+   // bytes are plenty to identify a tx (a false match is a 2^-96 chance), so
+   // the hash lookups never have to go to disk.  getThisHash() still does,
+   // since the full hash would almost triple the size of a TxRef
+   void               setHashPrefix(uint8_t const * txHash)
+                        { memcpy(hashPrefix_, txHash, TXREF_HASH_PREFIX_BYTES); }
+   BinaryDataRef      getHashPrefixRef(void) const
+                        { return BinaryDataRef(hashPrefix_, TXREF_HASH_PREFIX_BYTES); }
+   bool               matchesHash(BinaryData const & txHash) const
+   {
+      return (txHash.getSize() >= TXREF_HASH_PREFIX_BYTES &&
+              memcmp(hashPrefix_, txHash.getPtr(), TXREF_HASH_PREFIX_BYTES)==0);
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    BinaryData         serialize(void) const { return blkFilePtr_.getDataCopy(); }
 
@@ -469,6 +521,7 @@ public:
 
 private:
    FileDataPtr        blkFilePtr_;
+   uint8_t            hashPrefix_[TXREF_HASH_PREFIX_BYTES];
    BlockHeader*       headerPtr_;
 };
 
@@ -10,6 +10,7 @@
 #include <time.h>
 #include <stdio.h>
 #include "BlockUtils.h"
+#include "ThreadUtils.h"
 
 
 
@@ -338,6 +339,66 @@ bool TxIOPair::matchesColor(IdxColorID color)
     return (getColor() == color);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+// amount(8) flags(1), then hashPrefix(12) index(4) for the TxOut and TxIn
+// if the flags say we have them.  The amount is saved so we don't have to 
+// go to disk for every TxOut (which is what setTxOut does).
+#define TXIO_HAS_TXOUT     0x01
+#define TXIO_HAS_TXIN      0x02
+#define TXIO_FROM_SELF     0x04
+#define TXIO_FROM_COINBASE 0x08
+
+void TxIOPair::serialize(BinaryWriter & bw) const
+{
+   uint8_t flags = 0;
+   if(hasTxOut())       flags |= TXIO_HAS_TXOUT;
+   if(hasTxIn())        flags |= TXIO_HAS_TXIN;
+   if(isTxOutFromSelf_) flags |= TXIO_FROM_SELF;
+   if(isFromCoinbase_)  flags |= TXIO_FROM_COINBASE;
+
+   bw.put_uint64_t(amount_);
+   bw.put_uint8_t(flags);
+   if(hasTxOut())
+   {
+      bw.put_BinaryData(txPtrOfOutput_->getHashPrefixRef().copy());
+      bw.put_uint32_t(indexOfOutput_);
+   }
+   if(hasTxIn())
+   {
+      bw.put_BinaryData(txPtrOfInput_->getHashPrefixRef().copy());
+      bw.put_uint32_t(indexOfInput_);
+   }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+bool TxIOPair::unserialize(BinaryRefReader & brr)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance();
+   *this = TxIOPair();
+
+   amount_ = brr.get_uint64_t();
+   uint8_t flags = brr.get_uint8_t();
+   isTxOutFromSelf_ = (flags & TXIO_FROM_SELF) > 0;
+   isFromCoinbase_  = (flags & TXIO_FROM_COINBASE) > 0;
+   if(flags & TXIO_HAS_TXOUT)
+   {
+      txPtrOfOutput_ = bdm.getTxRefPtrByHash(
+                               brr.get_BinaryDataRef(TXREF_HASH_PREFIX_BYTES));
+      indexOfOutput_ = brr.get_uint32_t();
+      if(txPtrOfOutput_ == NULL)
+         return false;
+   }
+   if(flags & TXIO_HAS_TXIN)
+   {
+      txPtrOfInput_ = bdm.getTxRefPtrByHash(
+                               brr.get_BinaryDataRef(TXREF_HASH_PREFIX_BYTES));
+      indexOfInput_ = brr.get_uint32_t();
+      if(txPtrOfInput_ == NULL)
+         return false;
+   }
+   return true;
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -386,6 +447,50 @@ bool LedgerEntry::matchesColor(IdxColorID color)
     return (getColor() == color);
 }
 
+//////////////////////////////////////////////////////////////////////////////
+#define LEDGER_IS_VALID     0x01
+#define LEDGER_IS_COINBASE  0x02
+#define LEDGER_SENT_TO_SELF 0x04
+#define LEDGER_CHANGE_BACK  0x08
+
+void LedgerEntry::serialize(BinaryWriter & bw) const
+{
+   uint8_t flags = 0;
+   if(isValid_)      flags |= LEDGER_IS_VALID;
+   if(isCoinbase_)   flags |= LEDGER_IS_COINBASE;
+   if(isSentToSelf_) flags |= LEDGER_SENT_TO_SELF;
+   if(isChangeBack_) flags |= LEDGER_CHANGE_BACK;
+
+   bw.put_var_int(addr20_.getSize());
+   bw.put_BinaryData(addr20_);
+   bw.put_uint64_t((uint64_t)value_);
+   bw.put_uint32_t(blockNum_);
+   bw.put_BinaryData(txHash_);
+   bw.put_uint32_t(index_);
+   bw.put_uint64_t(txTime_);
+   bw.put_uint8_t(flags);
+   bw.put_uint32_t((uint32_t)color_);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+void LedgerEntry::unserialize(BinaryRefReader & brr)
+{
+   uint32_t addrSize = (uint32_t)brr.get_var_int();
+   brr.get_BinaryData(addr20_, addrSize);
+   value_    = (int64_t)brr.get_uint64_t();
+   blockNum_ = brr.get_uint32_t();
+   brr.get_BinaryData(txHash_, 32);
+   index_    = brr.get_uint32_t();
+   txTime_   = brr.get_uint64_t();
+
+   uint8_t flags = brr.get_uint8_t();
+   isValid_      = (flags & LEDGER_IS_VALID) > 0;
+   isCoinbase_   = (flags & LEDGER_IS_COINBASE) > 0;
+   isSentToSelf_ = (flags & LEDGER_SENT_TO_SELF) > 0;
+   isChangeBack_ = (flags & LEDGER_CHANGE_BACK) > 0;
+   color_ = (IdxColorID)brr.get_uint32_t();
+}
+
 
 //////////////////////////////////////////////////////////////////////////////
 void LedgerEntry::pprintOneLine(void)
@@ -398,6 +503,244 @@ void LedgerEntry::pprintOneLine(void)
                            getBlockNum());
 }
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// BalanceCache Methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+bool BalanceCache::startQuery(uint32_t currBlk, bool needBlk, IdxColorID color)
+{
+   uint32_t gen = BlockDataManager_FileRefs::GetInstance().getTxioGeneration();
+   if(gen != generation_)
+   {
+      invalidate();
+      generation_ = gen;
+   }
+
+   bool needColors = (color != COLOR_UNKNOWN);
+   if( isValid_ && 
+      (!needBlk    || currBlk==blk_) && 
+      (!needColors || colorsValid_))
+      return false;
+
+   // Once someone asks for colors, keep collecting them on every recompute
+   withColors_     = needColors || colorsValid_;
+   colorsResolved_ = true;
+   if(needBlk)
+      blk_ = currBlk;
+   total_ = Sums();
+   byColor_.clear();
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::addTxIO(TxIOPair & txio)
+{
+   bool isUnspent   = txio.isUnspent();
+   bool isSpendable = txio.isSpendable(blk_);
+   bool isUnconf    = txio.isMineButUnconfirmed(blk_);
+   if(!isUnspent && !isSpendable && !isUnconf)
+      return;
+
+   uint64_t val = txio.getValue();
+   if(isUnspent)   total_.full_        += val;
+   if(isSpendable) total_.spendable_   += val;
+   if(isUnconf)    total_.unconfirmed_ += val;
+
+   if(!withColors_)
+      return;
+
+   // Only ask for the color of txios that count for something, the same
+   // ones the old per-call loops would've asked about.  If ColorMan can't
+   // tell yet, the color sums are recomputed again next time.
+   IdxColorID color = txio.getColor();
+   if(color == COLOR_UNKNOWN)
+   {
+      colorsResolved_ = false;
+      return;
+   }
+
+   Sums & sums = byColor_[color];
+   if(isUnspent)   sums.full_        += val;
+   if(isSpendable) sums.spendable_   += val;
+   if(isUnconf)    sums.unconfirmed_ += val;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BalanceCache::finishRecompute(void)
+{
+   isValid_     = true;
+   colorsValid_ = withColors_ && colorsResolved_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+BalanceCache::Sums const * BalanceCache::getSums(IdxColorID color) const
+{
+   if(color == COLOR_UNKNOWN)
+      return &total_;
+
+   map<IdxColorID, Sums>::const_iterator iter = byColor_.find(color);
+   if(iter == byColor_.end())
+      return NULL;
+   return &(iter->second);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BalanceCache::getFull(IdxColorID color) const
+{
+   Sums const * sums = getSums(color);
+   return (sums==NULL ? 0 : sums->full_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BalanceCache::getSpendable(IdxColorID color) const
+{
+   Sums const * sums = getSums(color);
+   return (sums==NULL ? 0 : sums->spendable_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BalanceCache::getUnconfirmed(IdxColorID color) const
+{
+   Sums const * sums = getSums(color);
+   return (sums==NULL ? 0 : sums->unconfirmed_);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// LedgerIndex Methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+struct LedgerBlockLess
+{
+   bool operator()(LedgerEntry const & le, uint32_t blk) const
+                                            { return le.getBlockNum() < blk; }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Positions in the ledger, by time, and by position for the same time
+struct LedgerTimeLess
+{
+   LedgerTimeLess(vector<LedgerEntry> const & ledger) : ledger_(ledger) {}
+
+   bool operator()(uint32_t a, uint32_t b) const
+   {
+      uint32_t ta = ledger_[a].getTxTime();
+      uint32_t tb = ledger_[b].getTxTime();
+      return (ta != tb ? ta < tb : a < b);
+   }
+   bool operator()(uint32_t a, uint64_t t) const
+                                  { return ledger_[a].getTxTime() < t; }
+
+   vector<LedgerEntry> const & ledger_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+void LedgerIndex::update(vector<LedgerEntry> & ledger)
+{
+   // Somebody removed entries without telling us
+   if(numChecked_ > ledger.size())
+      invalidate();
+   if(numChecked_ == ledger.size())
+      return;
+
+   // Only the entries added since last time need to be looked at.  Address
+   // ledgers get each block's entries in scan order, not index order, so
+   // sort those by themselves, and only merge them in if they go before some
+   // of the old ones.  The sorts are stable, so entries for the same tx stay
+   // in the order they were added.
+   vector<LedgerEntry>::iterator newStart = ledger.begin() + numChecked_;
+   for(uint32_t i=numChecked_+1; i<ledger.size(); i++)
+   {
+      if(ledger[i] < ledger[i-1])
+      {
+         stable_sort(newStart, ledger.end());
+         break;
+      }
+   }
+
+   if(numChecked_ > 0 && *newStart < *(newStart-1))
+   {
+      inplace_merge(ledger.begin(), newStart, ledger.end());
+      timeOrder_.clear();
+   }
+   numChecked_ = ledger.size();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LedgerIndex::updateTimeOrder(vector<LedgerEntry> & ledger)
+{
+   uint32_t numOld = timeOrder_.size();
+   if(numOld == ledger.size())
+      return;
+
+   // Sort the new positions, then merge them with the old ones
+   for(uint32_t i=numOld; i<ledger.size(); i++)
+      timeOrder_.push_back(i);
+
+   LedgerTimeLess timeLess(ledger);
+   sort(timeOrder_.begin() + numOld, timeOrder_.end(), timeLess);
+   inplace_merge(timeOrder_.begin(), 
+                 timeOrder_.begin() + numOld, 
+                 timeOrder_.end(), 
+                 timeLess);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LedgerIndex::getPage(vector<LedgerEntry> & ledger,
+                          uint32_t startIdx, uint32_t numEntries,
+                          vector<LedgerEntry> & entries)
+{
+   update(ledger);
+   if(startIdx >= ledger.size())
+      return;
+
+   uint32_t endIdx = startIdx + min(numEntries, (uint32_t)ledger.size()-startIdx);
+   entries.insert(entries.end(), ledger.begin()+startIdx, ledger.begin()+endIdx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LedgerIndex::getBlockRange(vector<LedgerEntry> & ledger,
+                                uint32_t blkStart, uint32_t blkEnd,
+                                vector<LedgerEntry> & entries)
+{
+   update(ledger);
+   vector<LedgerEntry>::iterator iter = lower_bound(ledger.begin(), 
+                                                    ledger.end(), 
+                                                    blkStart, 
+                                                    LedgerBlockLess());
+   while(iter != ledger.end() && iter->getBlockNum() < blkEnd)
+   {
+      entries.push_back(*iter);
+      iter++;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void LedgerIndex::getTimeRange(vector<LedgerEntry> & ledger,
+                               uint32_t timeStart, uint32_t timeEnd,
+                               vector<LedgerEntry> & entries)
+{
+   update(ledger);
+   updateTimeOrder(ledger);
+
+   vector<uint32_t>::iterator iter = lower_bound(timeOrder_.begin(), 
+                                                 timeOrder_.end(), 
+                                                 (uint64_t)timeStart, 
+                                                 LedgerTimeLess(ledger));
+   while(iter != timeOrder_.end() && ledger[*iter].getTxTime() < timeEnd)
+   {
+      entries.push_back(ledger[*iter]);
+      iter++;
+   }
+}
+
+
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 //
@@ -423,109 +766,60 @@ BtcAddress::BtcAddress(HashString    addr,
 
 
 ////////////////////////////////////////////////////////////////////////////////
-uint64_t BtcAddress::getSpendableBalance(uint32_t currBlk)
+// A txio that's in both lists (a ZC TxOut that later showed up in a block) is
+// counted twice, same as it always was
+void BtcAddress::updateBalances(uint32_t currBlk, bool needBlk, IdxColorID color)
 {
-   uint64_t balance = 0;
+   if(!balances_.startQuery(currBlk, needBlk, color))
+      return;
+
    for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-      if(relevantTxIOPtrs_[i]->isSpendable(currBlk))
-         balance += relevantTxIOPtrs_[i]->getValue();
-   }
+      balances_.addTxIO(*relevantTxIOPtrs_[i]);
    for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-      if(relevantTxIOPtrsZC_[i]->isSpendable(currBlk))
-         balance += relevantTxIOPtrsZC_[i]->getValue();
-   }
-   return balance;
+      balances_.addTxIO(*relevantTxIOPtrsZC_[i]);
+   balances_.finishRecompute();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BtcAddress::getSpendableBalance(uint32_t currBlk)
+{
+   updateBalances(currBlk, true, COLOR_UNKNOWN);
+   return balances_.getSpendable(COLOR_UNKNOWN);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcAddress::getSpendableBalanceX(IdxColorID color,uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-     if(relevantTxIOPtrs_[i]->isSpendable(currBlk) && relevantTxIOPtrs_[i]->matchesColor(color))
-         balance += relevantTxIOPtrs_[i]->getValue();
-   }
-   for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-      if(relevantTxIOPtrsZC_[i]->isSpendable(currBlk) && relevantTxIOPtrsZC_[i]->matchesColor(color))
-         balance += relevantTxIOPtrsZC_[i]->getValue();
-   }
-   return balance;
+   updateBalances(currBlk, true, color);
+   return balances_.getSpendable(color);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcAddress::getUnconfirmedBalance(uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-      if(relevantTxIOPtrs_[i]->isMineButUnconfirmed(currBlk))
-         balance += relevantTxIOPtrs_[i]->getValue();
-   }
-   for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-      if(relevantTxIOPtrsZC_[i]->isMineButUnconfirmed(currBlk))
-         balance += relevantTxIOPtrsZC_[i]->getValue();
-   }
-   return balance;
+   updateBalances(currBlk, true, COLOR_UNKNOWN);
+   return balances_.getUnconfirmed(COLOR_UNKNOWN);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcAddress::getUnconfirmedBalanceX(IdxColorID color,uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-     if(relevantTxIOPtrs_[i]->isMineButUnconfirmed(currBlk) && relevantTxIOPtrs_[i]->matchesColor(color))
-         balance += relevantTxIOPtrs_[i]->getValue();
-   }
-   for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-     if(relevantTxIOPtrsZC_[i]->isMineButUnconfirmed(currBlk) && relevantTxIOPtrsZC_[i]->matchesColor(color))
-         balance += relevantTxIOPtrsZC_[i]->getValue();
-   }
-   return balance;
+   updateBalances(currBlk, true, color);
+   return balances_.getUnconfirmed(color);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcAddress::getFullBalance(void)
 {
-   uint64_t balance = 0;
-   for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-      TxIOPair & txio = *relevantTxIOPtrs_[i];
-      if(txio.isUnspent())
-         balance += txio.getValue();
-   }
-   for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-      TxIOPair & txio = *relevantTxIOPtrsZC_[i];
-      if(txio.isUnspent())
-         balance += txio.getValue();
-   }
-   return balance;
+   updateBalances(0, false, COLOR_UNKNOWN);
+   return balances_.getFull(COLOR_UNKNOWN);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcAddress::getFullBalanceX(IdxColorID color)
 {
-   uint64_t balance = 0;
-   for(uint32_t i=0; i<relevantTxIOPtrs_.size(); i++)
-   {
-      TxIOPair & txio = *relevantTxIOPtrs_[i];
-      if(txio.isUnspent() && txio.matchesColor(color))
-         balance += txio.getValue();
-   }
-   for(uint32_t i=0; i<relevantTxIOPtrsZC_.size(); i++)
-   {
-      TxIOPair & txio = *relevantTxIOPtrsZC_[i];
-      if(txio.isUnspent() && txio.matchesColor(color))
-         balance += txio.getValue();
-   }
-   return balance;
+   updateBalances(0, false, color);
+   return balances_.getFull(color);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -642,6 +936,7 @@ uint32_t BtcAddress::removeInvalidEntries(void)
    }
    ledger_.clear();
    ledger_ = newLedger;
+   ledgerIndex_.invalidate();
    return leRemoved;
 }
    
@@ -649,6 +944,7 @@ uint32_t BtcAddress::removeInvalidEntries(void)
 void BtcAddress::sortLedger(void)
 {
    sort(ledger_.begin(), ledger_.end());
+   ledgerIndex_.invalidate();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -667,6 +963,7 @@ void BtcAddress::addTxIO(TxIOPair * txio, bool isZeroConf)
       relevantTxIOPtrsZC_.push_back(txio);
    else
       relevantTxIOPtrs_.push_back(txio);
+   balances_.invalidate();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -676,6 +973,7 @@ void BtcAddress::addTxIO(TxIOPair & txio, bool isZeroConf)
       relevantTxIOPtrsZC_.push_back(&txio);
    else
       relevantTxIOPtrs_.push_back(&txio);
+   balances_.invalidate();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -713,6 +1011,7 @@ void BtcWallet::addAddress(HashString    addr,
    *addrPtr = BtcAddress(addr, firstTimestamp, firstBlockNum,
                                 lastTimestamp,  lastBlockNum);
    addrPtrVect_.push_back(addrPtr);
+   addToAddrBloom(addr);
 
    // Default behavior is "don't know, must rescan" if no firstBlk is spec'd
    if(bdmPtr_!=NULL)
@@ -726,6 +1025,7 @@ void BtcWallet::addNewAddress(HashString addr)
    BtcAddress* addrPtr = &(addrMap_[addr]);
    *addrPtr = BtcAddress(addr, 0,0, 0,0); 
    addrPtrVect_.push_back(addrPtr);
+   addToAddrBloom(addr);
 
    if(bdmPtr_!=NULL)
       bdmPtr_->registerNewAddress(addr);
@@ -739,6 +1039,7 @@ void BtcWallet::addAddress(BtcAddress const & newAddr)
       BtcAddress * addrPtr = &(addrMap_[newAddr.getAddrStr20()]);
       *addrPtr = newAddr;
       addrPtrVect_.push_back(addrPtr);
+      addToAddrBloom(newAddr.getAddrStr20());
    }
 
    if(bdmPtr_!=NULL)
@@ -781,12 +1082,145 @@ void BtcWallet::addAddress_5_(HashString    addr,
    addAddress(addr, firstBlockNum, firstTimestamp, lastBlockNum, lastTimestamp); 
 }
 
+/////////////////////////////////////////////////////////////////////////////
+static bool sameImportAddr(pair<HashString, uint32_t> const & a,
+                           pair<HashString, uint32_t> const & b)
+{
+   return a.first == b.first;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The packed import list, sorted by address.  If an address is in there 
+// more than once, the lowest creation block wins.
+static bool parseImportedAddresses(BinaryData const & packedAddrs,
+                        vector<pair<HashString, uint32_t> > & sortedAddrs)
+{
+   sortedAddrs.clear();
+   if(packedAddrs.getSize() % ADDR_IMPORT_BYTES != 0)
+   {
+      cout << "***ERROR:  Address import list is " << packedAddrs.getSize()
+           << " bytes, not a multiple of " << ADDR_IMPORT_BYTES << endl;
+      cerr << "***ERROR:  Address import list is " << packedAddrs.getSize()
+           << " bytes, not a multiple of " << ADDR_IMPORT_BYTES << endl;
+      return false;
+   }
+
+   uint32_t numAddr = packedAddrs.getSize() / ADDR_IMPORT_BYTES;
+   sortedAddrs.resize(numAddr);
+   BinaryRefReader brr(packedAddrs);
+   for(uint32_t i=0; i<numAddr; i++)
+   {
+      brr.get_BinaryData(sortedAddrs[i].first, 20);
+      sortedAddrs[i].second = brr.get_uint32_t();
+   }
+
+   sort(sortedAddrs.begin(), sortedAddrs.end());
+   sortedAddrs.erase(unique(sortedAddrs.begin(), sortedAddrs.end(), 
+                            sameImportAddr), 
+                     sortedAddrs.end());
+   return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+uint32_t BtcWallet::addImportedAddresses(BinaryData const & packedAddrs)
+{
+   vector<pair<HashString, uint32_t> > sortedAddrs;
+   if(!parseImportedAddresses(packedAddrs, sortedAddrs))
+      return 0;
+
+   // They're in order, so each one goes in right after the one before it,
+   // instead of searching the whole map for where it goes
+   vector<pair<HashString, uint32_t> > newAddrs;
+   newAddrs.reserve(sortedAddrs.size());
+   map<HashString, BtcAddress>::iterator hint = addrMap_.begin();
+   for(uint32_t i=0; i<sortedAddrs.size(); i++)
+   {
+      HashString const & addr160 = sortedAddrs[i].first;
+      uint32_t sizeBefore = addrMap_.size();
+      hint = addrMap_.insert(hint, make_pair(addr160, 
+                        BtcAddress(addr160, 0, sortedAddrs[i].second, 0, 0)));
+      if(addrMap_.size() == sizeBefore)
+         continue;  // already have it
+
+      addrPtrVect_.push_back(&(hint->second));
+      newAddrs.push_back(sortedAddrs[i]);
+   }
+
+   // Grow the bloom filter once, not every time it fills up
+   if(addrBloom_.getNumItems() + newAddrs.size() > addrBloom_.getCapacity())
+   {
+      addrBloom_.reset(2*addrMap_.size());
+      for(hint = addrMap_.begin(); hint != addrMap_.end(); hint++)
+         if(hint->first.getSize() == 20)
+            addrBloom_.insert(hint->first.getPtr());
+   }
+   else
+   {
+      for(uint32_t i=0; i<newAddrs.size(); i++)
+         addrBloom_.insert(newAddrs[i].first.getPtr());
+   }
+
+   if(bdmPtr_!=NULL)
+      bdmPtr_->registerImportedAddressList(newAddrs);
+
+   return newAddrs.size();
+}
+
 /////////////////////////////////////////////////////////////////////////////
 bool BtcWallet::hasAddr(HashString const & addr20)
 {
+   if(addr20.getSize()==20 && !addrBloom_.mayContain(addr20.getPtr()))
+      return false;
    return addrMap_.find(addr20) != addrMap_.end();
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// The address in the wallet with this hash160, or NULL.  getAddrByHash160
+// can leave empty BtcAddress objects in addrMap_ for addresses that aren't
+// ours, so those don't count.
+BtcAddress* BtcWallet::findAddrPtr(HashString const & addr20)
+{
+   if(addr20.getSize()==20 && !addrBloom_.mayContain(addr20.getPtr()))
+      return NULL;
+
+   map<HashString, BtcAddress>::iterator iter = addrMap_.find(addr20);
+   if(iter == addrMap_.end() || !(iter->second.getAddrStr20() == addr20))
+      return NULL;
+   return &(iter->second);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void BtcWallet::addToAddrBloom(HashString const & addr160)
+{
+   if(addr160.getSize() != 20)
+      return;
+
+   addrBloom_.insert(addr160.getPtr());
+   if(addrBloom_.isFull())
+   {
+      // Twice as big, and put everything back in
+      addrBloom_.reset(2*addrMap_.size());
+      map<HashString, BtcAddress>::iterator iter;
+      for(iter = addrMap_.begin(); iter != addrMap_.end(); iter++)
+         if(iter->first.getSize() == 20)
+            addrBloom_.insert(iter->first.getPtr());
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void BtcWallet::addToTxioBloom(OutPoint const & op)
+{
+   txioBloom_.insert(op.getTxHashRef().getPtr(), op.getTxOutIndex());
+   if(txioBloom_.isFull())
+   {
+      txioBloom_.reset(2*txioMap_.size());
+      map<OutPoint, TxIOPair>::iterator iter;
+      for(iter = txioMap_.begin(); iter != txioMap_.end(); iter++)
+         txioBloom_.insert(iter->first.getTxHashRef().getPtr(), 
+                           iter->first.getTxOutIndex());
+   }
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 // Determine, as fast as possible, whether this tx is relevant to us
@@ -803,8 +1237,14 @@ pair<bool,bool> BtcWallet::isMineBulkFilter( Tx & tx )
    for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
       // We have the txin, now check if it contains one of our TxOuts
+      // The bloom filter goes right off the raw outpoint bytes, and only
+      // the rare maybe-ours gets unserialized and looked up for real
+      uint8_t const * opPtr = txStartPtr + tx.getTxInOffset(iin);
+      if(!txioBloom_.mayContain(opPtr, *(uint32_t*)(opPtr+32)))
+         continue;
+
       static OutPoint op;
-      op.unserialize(txStartPtr + tx.getTxInOffset(iin));
+      op.unserialize(opPtr);
       if(txioMap_.find(op) != txioMap_.end())
          return pair<bool,bool>(true,true);
    }
@@ -822,6 +1262,8 @@ pair<bool,bool> BtcWallet::isMineBulkFilter( Tx & tx )
       if(scriptLenFirstByte == 25)
       {
          // Std TxOut with 25-byte script
+         if(!addrBloom_.mayContain(ptr+4))
+            continue;
          addr20.copyFrom(ptr+4, 20);
          if( hasAddr(addr20) )
             return pair<bool,bool>(true,false);
@@ -927,7 +1369,7 @@ void BlockDataManager_FileRefs::insertRegisteredTxIfNew(HashString txHash)
    {
       TxRef* tx_ptr = getTxRefPtrByHash(txHash);
       RegisteredTx regTx(tx_ptr,
-                         tx_ptr->getThisHash(),
+                         txHash,
                          tx_ptr->getBlockHeight(),
                          tx_ptr->getBlockTxIndex());
       registeredTxList_.push_back(regTx);
@@ -937,18 +1379,170 @@ void BlockDataManager_FileRefs::insertRegisteredTxIfNew(HashString txHash)
 
 
 /////////////////////////////////////////////////////////////////////////////
-//  This basically does the same thing as the bulk filter, but it's for the
-//  BDM to collect data on registered wallets/addresses during bulk
-//  blockchain scaning.  It needs to track relevant OutPoints and produce 
-//  a list of transactions that are relevant to the registered wallets.
-//
-//  Also, this takes a raw pointer to memory, because it is assumed that 
-//  the data is being buffered and not converted/parsd for Tx objects, yet.
-//
-//  If the txSize and offsets have been pre-calculated, you can pass them 
-//  in, or pass {0, NULL, NULL} to have it calculated for you.
-//  
-void BlockDataManager_FileRefs::registeredAddrScan( uint8_t const * txptr,
+// 1 flag byte + 65-byte pubkey + 20-byte hash
+#define PUBKEY_MEMO_SLOT_SIZE 86
+
+void PubKeyHashMemo::setNumSlots(uint32_t n)
+{
+   numSlots_ = 0;
+   if(n > 0)
+   {
+      numSlots_ = 1;
+      while(numSlots_*2 <= n && numSlots_ < (1<<30))
+         numSlots_ *= 2;
+   }
+
+   // Swap with an empty one to actually give the memory back
+   vector<uint8_t>().swap(slots_);
+   slots_.resize(numSlots_ * PUBKEY_MEMO_SLOT_SIZE, 0);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+uint8_t* PubKeyHashMemo::getSlot(uint8_t const * pubkey65)
+{
+   // Bytes 1-4 are the start of the x-coordinate (byte 0 is the 0x04 prefix)
+   uint32_t xbits;
+   memcpy(&xbits, pubkey65+1, 4);
+   return &slots_[(xbits & (numSlots_-1)) * PUBKEY_MEMO_SLOT_SIZE];
+}
+
+/////////////////////////////////////////////////////////////////////////////
+bool PubKeyHashMemo::lookup(uint8_t const * pubkey65, uint8_t * hash160Out)
+{
+   if(numSlots_ == 0)
+      return false;
+
+   uint8_t* slot = getSlot(pubkey65);
+   if(slot[0] == 0 || memcmp(slot+1, pubkey65, 65) != 0)
+   {
+      numMisses_++;
+      return false;
+   }
+
+   memcpy(hash160Out, slot+66, 20);
+   numHits_++;
+   return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void PubKeyHashMemo::store(uint8_t const * pubkey65, uint8_t const * hash160)
+{
+   if(numSlots_ == 0)
+      return;
+
+   uint8_t* slot = getSlot(pubkey65);
+   slot[0] = 1;
+   memcpy(slot+1,  pubkey65, 65);
+   memcpy(slot+66, hash160,  20);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Add the pubkeys of any pay-to-pubkey TxOuts in this tx to the queue.  The
+// tx has to stay where it is in memory until it's been scanned, because
+// registeredAddrScan matches them up by pointer.
+void BlockDataManager_FileRefs::queuePubKeyTxOuts(
+                                       uint8_t const * txptr,
+                                       vector<uint32_t> const & txOutOffsets)
+{
+   if(txOutOffsets.size() == 0)
+      return;
+
+   uint32_t nTxOut = txOutOffsets.size()-1;
+   for(uint32_t iout=0; iout<nTxOut; iout++)
+   {
+      uint8_t const * ptr = txptr + txOutOffsets[iout] + 8;
+      if(*ptr == 67)
+         pubKeyQueuePtrs_.push_back(ptr+2);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// HASH160 everything in the queue, in one batch except for any the memo
+// already has
+void BlockDataManager_FileRefs::hashPubKeyQueue(void)
+{
+   static vector<uint8_t const *> missPtrs;
+   static vector<uint32_t>        missSizes;
+   static vector<uint32_t>        missIdx;
+   static BinaryData              missHashes;
+
+   uint32_t nQueued = pubKeyQueuePtrs_.size();
+   pubKeyQueueHashes_.resize(20*nQueued);
+   pubKeyQueueNext_ = 0;
+
+   missPtrs.clear();
+   missIdx.clear();
+   for(uint32_t i=0; i<nQueued; i++)
+   {
+      if(pubKeyMemo_.lookup(pubKeyQueuePtrs_[i], pubKeyQueueHashes_.getPtr()+20*i))
+         continue;
+      missPtrs.push_back(pubKeyQueuePtrs_[i]);
+      missIdx.push_back(i);
+   }
+
+   uint32_t nMiss = missPtrs.size();
+   if(nMiss == 0)
+      return;
+
+   missSizes.assign(nMiss, 65);
+   missHashes.resize(20*nMiss);
+   BtcUtils::getHash160Batch(&missPtrs[0], &missSizes[0], nMiss, 
+                             missHashes.getPtr());
+
+   for(uint32_t i=0; i<nMiss; i++)
+   {
+      uint8_t const * hash160 = missHashes.getPtr() + 20*i;
+      memcpy(pubKeyQueueHashes_.getPtr() + 20*missIdx[i], hash160, 20);
+      pubKeyMemo_.store(missPtrs[i], hash160);
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The pointers are only good while the block they came from is, so this
+// has to be called when the caller is done scanning it
+void BlockDataManager_FileRefs::clearPubKeyQueue(void)
+{
+   pubKeyQueuePtrs_.clear();
+   pubKeyQueueNext_ = 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Uses the next hash from the queue if it's for this pubkey, otherwise the
+// memo, otherwise hashes it right here
+void BlockDataManager_FileRefs::getPubKeyHash160(uint8_t const * pubkey65,
+                                                 BinaryData & hash160)
+{
+   hash160.resize(20);
+   if(pubKeyQueueNext_ < pubKeyQueuePtrs_.size() &&
+      pubKeyQueuePtrs_[pubKeyQueueNext_] == pubkey65)
+   {
+      hash160.copyFrom(pubKeyQueueHashes_.getPtr() + 20*pubKeyQueueNext_, 20);
+      pubKeyQueueNext_++;
+      return;
+   }
+
+   if(pubKeyMemo_.lookup(pubkey65, hash160.getPtr()))
+      return;
+
+   BtcUtils::getHash160_NoSafetyCheck(pubkey65, 65, hash160);
+   pubKeyMemo_.store(pubkey65, hash160.getPtr());
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+//  This basically does the same thing as the bulk filter, but it's for the
+//  BDM to collect data on registered wallets/addresses during bulk
+//  blockchain scaning.  It needs to track relevant OutPoints and produce 
+//  a list of transactions that are relevant to the registered wallets.
+//
+//  Also, this takes a raw pointer to memory, because it is assumed that 
+//  the data is being buffered and not converted/parsd for Tx objects, yet.
+//
+//  If the txSize and offsets have been pre-calculated, you can pass them 
+//  in, or pass {0, NULL, NULL} to have it calculated for you.
+//  
+void BlockDataManager_FileRefs::registeredAddrScan( uint8_t const * txptr,
                                                     uint32_t txSize,
                                                     vector<uint32_t> * txInOffsets,
                                                     vector<uint32_t> * txOutOffsets)
@@ -975,8 +1569,12 @@ void BlockDataManager_FileRefs::registeredAddrScan( uint8_t const * txptr,
    for(uint32_t iin=0; iin<nTxIn; iin++)
    {
       // We have the txin, now check if it contains one of our TxOuts
+      uint8_t const * opPtr = txStartPtr + (*txInOffsets)[iin];
+      if(!regOutPointBloom_.mayContain(opPtr, *(uint32_t*)(opPtr+32)))
+         continue;
+
       static OutPoint op;
-      op.unserialize(txStartPtr + (*txInOffsets)[iin]);
+      op.unserialize(opPtr);
       if(registeredOutPoints_.count(op) > 0)
       {
          
@@ -998,24 +1596,26 @@ void BlockDataManager_FileRefs::registeredAddrScan( uint8_t const * txptr,
       if(scriptLenFirstByte == 25)
       {
          // Std TxOut with 25-byte script
+         if(!regAddrBloom_.mayContain(ptr+4))
+            continue;
          addr20.copyFrom(ptr+4, 20);
          if( addressIsRegistered(addr20) )
          {
             HashString txHash = BtcUtils::getHash256(txptr, txSize);
             insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
+            insertRegisteredOutPoint(OutPoint(txHash, iout));
          }
       }
       else if(scriptLenFirstByte==67)
       {
          // Std spend-coinbase TxOut script
          static HashString addr20(20);
-         BtcUtils::getHash160_NoSafetyCheck(ptr+2, 65, addr20);
+         getPubKeyHash160(ptr+2, addr20);
          if( addressIsRegistered(addr20) )
          {
             HashString txHash = BtcUtils::getHash256(txptr, txSize);
             insertRegisteredTxIfNew(txHash);
-            registeredOutPoints_.insert(OutPoint(txHash, iout));
+            insertRegisteredOutPoint(OutPoint(txHash, iout));
          }
       }
       else
@@ -1073,6 +1673,9 @@ void BtcWallet::scanTx(Tx & tx,
    if( !txIsRelevant )
       return;
 
+   // Anything below might change one of our txios
+   balances_.invalidate();
+
    // We distinguish "any" from "anyNew" because we want to avoid re-adding
    // transactions/TxIOPairs that are already part of the our tx list/ledger
    // but we do need to determine if this was sent-to-self, regardless of 
@@ -1080,220 +1683,227 @@ void BtcWallet::scanTx(Tx & tx,
    bool anyNewTxInIsOurs   = false;
    bool anyNewTxOutIsOurs  = false;
    bool isCoinbaseTx       = false;
-   for(uint32_t i=0; i<addrPtrVect_.size(); i++)
+
+   // Each TxIn and TxOut is matched to its address with one lookup by its
+   // hash160, instead of checking it against every address in the wallet.
+   // So this costs the same whether the wallet has 10 addresses or 100k.
+   uint8_t const * txStartPtr = tx.getPtr();
+   ///// LOOP OVER ALL TXIN IN BLOCK /////
+   for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
    {
-      BtcAddress & thisAddr = *(addrPtrVect_[i]);
-      HashString const & addr20 = thisAddr.getAddrStr20();
+      static OutPoint outpt;
+      outpt.unserialize(txStartPtr + tx.getTxInOffset(iin));
+      // Empty hash in Outpoint means it's a COINBASE tx --> no addr inputs
+      if(outpt.getTxHashRef() == BtcUtils::EmptyHash_)
+      {
+         isCoinbaseTx = true;
+         continue;
+      }
 
-      ///// LOOP OVER ALL TXIN IN BLOCK /////
-      for(uint32_t iin=0; iin<tx.getNumTxIn(); iin++)
+      // We have the txin, now check if it contains one of our TxOuts
+      map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
+      bool txioWasInMapAlready = (txioIter != txioMap_.end());
+      if(txioWasInMapAlready)
       {
-         TxIn txin = tx.getTxIn(iin);
-         OutPoint outpt = txin.getOutPoint();
-         // Empty hash in Outpoint means it's a COINBASE tx --> no addr inputs
-         if(outpt.getTxHashRef() == BtcUtils::EmptyHash_)
-         {
-            isCoinbaseTx = true;
+         // If we are here, we know that this input is spending an 
+         // output owned by this wallet.  Find out which address.
+         TxIOPair & txio  = txioIter->second;
+         TxOut txout = txio.getTxOut();
+
+         BtcAddress* addrPtr = findAddrPtr(txout.getRecipientAddr());
+         if(addrPtr == NULL)
             continue;
-         }
+         BtcAddress & thisAddr = *addrPtr;
+         HashString const & addr20 = thisAddr.getAddrStr20();
+
+         // We need to make sure the ledger entry makes sense, and make
+         // sure we update TxIO objects appropriately
+         int64_t thisVal = (int64_t)txout.getValue();
+         IdxColorID color = txio.getColor();
+         if(totalLedgerAmt.count(color))
+            totalLedgerAmt[color] -= thisVal;
+         else
+            totalLedgerAmt.insert(pair<IdxColorID, int64_t>(color, -thisVal));
 
-         // We have the txin, now check if it contains one of our TxOuts
-         map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
-         bool txioWasInMapAlready = (txioIter != txioMap_.end());
-         if(txioWasInMapAlready)
-         {
-            // If we are here, we know that this input is spending an 
-            // output owned by this wallet.
-            // We will get here for every address in the search, even 
-            // though it is only relevant to one of the addresses.
-            TxIOPair & txio  = txioIter->second;
-            TxOut txout = txio.getTxOut();
-
-            // Skip if this TxIO is not for this address
-            if(!(txout.getRecipientAddr()==thisAddr.getAddrStr20()))
-               continue;
+         // Skip, if this is a zero-conf-spend, but it's already got a zero-conf
+         if( isZeroConf && txio.hasTxInZC() )
+            return; // this tx can't be valid, might as well bail now
 
-            // We need to make sure the ledger entry makes sense, and make
-            // sure we update TxIO objects appropriately
-            int64_t thisVal = (int64_t)txout.getValue();
-            IdxColorID color = txio.getColor();
-	    if(totalLedgerAmt.count(color))
-                totalLedgerAmt[color] -= thisVal;
-	    else
-                totalLedgerAmt.insert(pair<IdxColorID, int64_t>(color, -thisVal));
+         if( !txio.hasTxInInMain() && !(isZeroConf && txio.hasTxInZC())  )
+         {
+            // isValidNew only identifies whether this set-call succeeded
+            // If it didn't, it's because this is from a zero-conf tx but this 
+            // TxIn already exists in the blockchain spending the same output.
+            // (i.e. we have a ref to the prev output, but it's been spent!)
+            bool isValidNew;
+            if(isZeroConf)
+               isValidNew = txio.setTxInZC(&tx, iin);
+            else
+               isValidNew = txio.setTxIn(tx.getTxRefPtr(), iin);
 
-            // Skip, if this is a zero-conf-spend, but it's already got a zero-conf
-            if( isZeroConf && txio.hasTxInZC() )
-               return; // this tx can't be valid, might as well bail now
+            if(!isValidNew)
+               continue;
 
-            if( !txio.hasTxInInMain() && !(isZeroConf && txio.hasTxInZC())  )
-            {
-               // isValidNew only identifies whether this set-call succeeded
-               // If it didn't, it's because this is from a zero-conf tx but this 
-               // TxIn already exists in the blockchain spending the same output.
-               // (i.e. we have a ref to the prev output, but it's been spent!)
-               bool isValidNew;
-               if(isZeroConf)
-                  isValidNew = txio.setTxInZC(&tx, iin);
-               else
-                  isValidNew = txio.setTxIn(tx.getTxRefPtr(), iin);
-
-               if(!isValidNew)
-                  continue;
+            anyNewTxInIsOurs = true;
+            thisAddr.balances_.invalidate();
+
+            LedgerEntry newEntry(addr20, 
+                                 -(int64_t)thisVal,
+                                 blknum, 
+                                 tx.getThisHash(), 
+                                 iin,
+                                 color,
+                                 txtime,
+                                 isCoinbaseTx,
+                                 false,  // SentToSelf is meaningless for addr ledger
+                                 false); // "isChangeBack" is meaningless for TxIn
+            thisAddr.addLedgerEntry(newEntry, isZeroConf);
 
-               anyNewTxInIsOurs = true;
-
-               LedgerEntry newEntry(addr20, 
-                                    -(int64_t)thisVal,
-                                    blknum, 
-                                    tx.getThisHash(), 
-                                    iin,
-                                    color,
-                                    txtime,
-                                    isCoinbaseTx,
-                                    false,  // SentToSelf is meaningless for addr ledger
-                                    false); // "isChangeBack" is meaningless for TxIn
-               thisAddr.addLedgerEntry(newEntry, isZeroConf);
-
-               // Update last seen on the network
-               thisAddr.setLastTimestamp(txtime);
-               thisAddr.setLastBlockNum(blknum);
-            }
+            // Update last seen on the network
+            thisAddr.setLastTimestamp(txtime);
+            thisAddr.setLastBlockNum(blknum);
          }
-         else
+      }
+      else
+      {
+         // Lots of txins that we won't have, this is a normal conditional
+         // But we should check the non-std txio list since it may actually
+         // be there
+         if(nonStdTxioMap_.find(outpt) != nonStdTxioMap_.end())
          {
-            // Lots of txins that we won't have, this is a normal conditional
-            // But we should check the non-std txio list since it may actually
-            // be there
-            if(nonStdTxioMap_.find(outpt) != nonStdTxioMap_.end())
-            {
-               if(isZeroConf)
-                  nonStdTxioMap_[outpt].setTxInZC(&tx, iin);
-               else
-                  nonStdTxioMap_[outpt].setTxIn(tx.getTxRefPtr(), iin);
-               nonStdUnspentOutPoints_.erase(outpt);
-            }
+            if(isZeroConf)
+               nonStdTxioMap_[outpt].setTxInZC(&tx, iin);
+            else
+               nonStdTxioMap_[outpt].setTxIn(tx.getTxRefPtr(), iin);
+            nonStdUnspentOutPoints_.erase(outpt);
          }
-      } // loop over TxIns
-   }
+      }
+   } // loop over TxIns
 
 
-   for(uint32_t i=0; i<addrPtrVect_.size(); i++)
+   ///// LOOP OVER ALL TXOUT IN TX /////
+   for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
    {
-      BtcAddress & thisAddr = *(addrPtrVect_[i]);
-      HashString const & addr20 = thisAddr.getAddrStr20();
-
-      ///// LOOP OVER ALL TXOUT IN TX /////
-      for(uint32_t iout=0; iout<tx.getNumTxOut(); iout++)
+      TxOut txout = tx.getTxOut(iout);
+      if( txout.getScriptType() == TXOUT_SCRIPT_UNKNOWN )
       {
-         TxOut txout = tx.getTxOut(iout);
-         if( txout.getScriptType() == TXOUT_SCRIPT_UNKNOWN )
+         // Any of our addresses anywhere in the script
+         BinaryDataRef scr = txout.getScriptRef();
+         set<BtcAddress*> nonStdAddrs;
+         for(int32_t i=0; i<(int32_t)scr.getSize()-19; i++)
          {
-            if(txout.getScriptRef().find(thisAddr.getAddrStr20()) > -1)
-               scanNonStdTx(blknum, txIndex, tx, iout, thisAddr);
-            continue;
+            if(!addrBloom_.mayContain(scr.getPtr()+i))
+               continue;
+            BtcAddress* addrPtr = findAddrPtr(scr.getSliceCopy(i,20));
+            if(addrPtr != NULL && nonStdAddrs.insert(addrPtr).second)
+               scanNonStdTx(blknum, txIndex, tx, iout, *addrPtr);
          }
+         continue;
+      }
+
+      BtcAddress* addrPtr = findAddrPtr(txout.getRecipientAddr());
+      if( addrPtr != NULL )
+      {
+         BtcAddress & thisAddr = *addrPtr;
+         HashString const & addr20 = thisAddr.getAddrStr20();
+
+         // If we got here, at least this TxOut is for this address.
+         // But we still need to find out if it's new and update
+         // ledgers/TXIOs appropriately
+         OutPoint outpt(tx.getThisHash(), iout);      
+         map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
+         bool txioWasInMapAlready = (txioIter != txioMap_.end());
+         bool doAddLedgerEntry = false;
 
-         if( txout.getRecipientAddr() == thisAddr.getAddrStr20() )
+         if(txioWasInMapAlready)
          {
-            // If we got here, at least this TxOut is for this address.
-            // But we still need to find out if it's new and update
-            // ledgers/TXIOs appropriately
-            OutPoint outpt(tx.getThisHash(), iout);      
-            map<OutPoint, TxIOPair>::iterator txioIter = txioMap_.find(outpt);
-            bool txioWasInMapAlready = (txioIter != txioMap_.end());
-            bool doAddLedgerEntry = false;
-
-            if(txioWasInMapAlready)
+            if(isZeroConf) 
             {
-               if(isZeroConf) 
-               {
-                  // This is a real txOut, in the blockchain
-                  if(txioIter->second.hasTxOutZC() || txioIter->second.hasTxOutInMain())
-                     continue; 
-
-                  // If we got here, somehow the Txio existed already, but 
-                  // there was no existing TxOut referenced by it.  Probably,
-                  // there was, but that TxOut was invalidated due to reorg
-                  // and now being re-added
-                  txioIter->second.setTxOutZC(&tx, iout);
-                  thisAddr.addTxIO( txioIter->second, isZeroConf);
-                  doAddLedgerEntry = true;
-               }
-               else
-               {
-                  if(txioIter->second.hasTxOutInMain()) // ...but we already have one
-                     continue;
-
-                  // If we got here, we have a in-blockchain TxOut that is 
-                  // replacing a zero-conf txOut.  Reset the txio to have 
-                  // only this real TxOut, blank ZC TxOut.  And the addr 
-                  // relevantTxIOPtrs_ does not have this yet so it needs 
-                  // to be added (it's already part of the relevantTxIOPtrsZC_
-                  // but that will be removed)
-                  txioIter->second.setTxOut(tx.getTxRefPtr(), iout);
-                  thisAddr.addTxIO( txioIter->second, isZeroConf);
-                  doAddLedgerEntry = true;
-               }
+               // This is a real txOut, in the blockchain
+               if(txioIter->second.hasTxOutZC() || txioIter->second.hasTxOutInMain())
+                  continue; 
+
+               // If we got here, somehow the Txio existed already, but 
+               // there was no existing TxOut referenced by it.  Probably,
+               // there was, but that TxOut was invalidated due to reorg
+               // and now being re-added
+               txioIter->second.setTxOutZC(&tx, iout);
+               thisAddr.addTxIO( txioIter->second, isZeroConf);
+               doAddLedgerEntry = true;
             }
             else
             {
-               // TxIO is not in the map yet -- create and add it
-               TxIOPair newTxio;
-               if(isZeroConf)
-                  newTxio.setTxOutZC(&tx, iout);
-               else
-                  newTxio.setTxOut(tx.getTxRefPtr(), iout);
-   
-               pair<OutPoint, TxIOPair> toBeInserted(outpt, newTxio);
-               txioIter = txioMap_.insert(toBeInserted).first;
+               if(txioIter->second.hasTxOutInMain()) // ...but we already have one
+                  continue;
+
+               // If we got here, we have a in-blockchain TxOut that is 
+               // replacing a zero-conf txOut.  Reset the txio to have 
+               // only this real TxOut, blank ZC TxOut.  And the addr 
+               // relevantTxIOPtrs_ does not have this yet so it needs 
+               // to be added (it's already part of the relevantTxIOPtrsZC_
+               // but that will be removed)
+               txioIter->second.setTxOut(tx.getTxRefPtr(), iout);
                thisAddr.addTxIO( txioIter->second, isZeroConf);
                doAddLedgerEntry = true;
             }
+         }
+         else
+         {
+            // TxIO is not in the map yet -- create and add it
+            TxIOPair newTxio;
+            if(isZeroConf)
+               newTxio.setTxOutZC(&tx, iout);
+            else
+               newTxio.setTxOut(tx.getTxRefPtr(), iout);
 
-            if(anyTxInIsOurs)
-               txioIter->second.setTxOutFromSelf(true);
-           
-            if(isCoinbaseTx)
-               txioIter->second.setFromCoinbase(true);
+            pair<OutPoint, TxIOPair> toBeInserted(outpt, newTxio);
+            txioIter = txioMap_.insert(toBeInserted).first;
+            addToTxioBloom(outpt);
+            thisAddr.addTxIO( txioIter->second, isZeroConf);
+            doAddLedgerEntry = true;
+         }
 
-            anyNewTxOutIsOurs = true;
-            thisTxOutIsOurs[iout] = true;
+         if(anyTxInIsOurs)
+            txioIter->second.setTxOutFromSelf(true);
+        
+         if(isCoinbaseTx)
+            txioIter->second.setFromCoinbase(true);
 
-	    int64_t thisVal = (int64_t)(txout.getValue());
-            IdxColorID color = txioIter->second.getColor();
-	    if (totalLedgerAmt.count(color))
-                totalLedgerAmt[color] += thisVal;
-	    else
-                totalLedgerAmt.insert(pair<IdxColorID, int64_t>(color, thisVal));
+         anyNewTxOutIsOurs = true;
+         thisTxOutIsOurs[iout] = true;
 
-            if(doAddLedgerEntry)
-            {
-               LedgerEntry newLedger(addr20, 
-                                     thisVal, 
-                                     blknum, 
-                                     tx.getThisHash(), 
-                                     iout,
-                                     color,
-                                     txtime,
-                                     isCoinbaseTx, // input was coinbase/generation
-                                     false,   // sentToSelf meaningless for addr ledger
-                                     false);  // we don't actually know
-               thisAddr.addLedgerEntry(newLedger, isZeroConf);
-            }
-            // Check if this is the first time we've seen this
-            if(thisAddr.getFirstTimestamp() == 0)
-            {
-               thisAddr.setFirstBlockNum( blknum );
-               thisAddr.setFirstTimestamp( txtime );
-            }
-            // Update last seen on the network
-            thisAddr.setLastTimestamp(txtime);
-            thisAddr.setLastBlockNum(blknum);
-         }
-      } // loop over TxOuts
+         int64_t thisVal = (int64_t)(txout.getValue());
+         IdxColorID color = txioIter->second.getColor();
+         if (totalLedgerAmt.count(color))
+            totalLedgerAmt[color] += thisVal;
+         else
+            totalLedgerAmt.insert(pair<IdxColorID, int64_t>(color, thisVal));
 
-   } // loop over all wallet addresses
+         if(doAddLedgerEntry)
+         {
+            LedgerEntry newLedger(addr20, 
+                                  thisVal, 
+                                  blknum, 
+                                  tx.getThisHash(), 
+                                  iout,
+                                  color,
+                                  txtime,
+                                  isCoinbaseTx, // input was coinbase/generation
+                                  false,   // sentToSelf meaningless for addr ledger
+                                  false);  // we don't actually know
+            thisAddr.addLedgerEntry(newLedger, isZeroConf);
+         }
+         // Check if this is the first time we've seen this
+         if(thisAddr.getFirstTimestamp() == 0)
+         {
+            thisAddr.setFirstBlockNum( blknum );
+            thisAddr.setFirstTimestamp( txtime );
+         }
+         // Update last seen on the network
+         thisAddr.setLastTimestamp(txtime);
+         thisAddr.setLastBlockNum(blknum);
+      }
+   } // loop over TxOuts
 
    bool allTxOutIsOurs = true;
    bool anyTxOutIsOurs = false;
@@ -1438,21 +2048,241 @@ void BtcAddress::clearBlkData(void)
    relevantTxIOPtrsZC_.clear();
    ledger_.clear();
    ledgerZC_.clear();
+   ledgerIndex_.invalidate();
+   balances_.invalidate();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void fixLedgerAfterReorg(vector<LedgerEntry> & ledger,
+                                set<HashString> const & txInvalid,
+                                map<HashString, uint32_t> const & newHeights)
+{
+   for(uint32_t i=0; i<ledger.size(); i++)
+   {
+      HashString const & txHash = ledger[i].getTxHash();
+      if(txInvalid.count(txHash) > 0)
+         ledger[i].setValid(false);
+
+      map<HashString, uint32_t>::const_iterator iter = newHeights.find(txHash);
+      if(iter != newHeights.end())
+         ledger[i].changeBlkNum(iter->second);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The BDM figures out what the reorg did to which tx (once for all the 
+// wallets), this just applies it to the ledgers
+void BtcWallet::updateLedgersAfterReorg(set<HashString> const & txInvalid,
+                                        map<HashString, uint32_t> const & newHeights)
+{
+   // Fix the wallet's ledger
+   fixLedgerAfterReorg(ledgerAllAddr_, txInvalid, newHeights);
+   ledgerIndex_.invalidate();
+
+   // Now fix the individual address ledgers
+   for(uint32_t a=0; a<addrPtrVect_.size(); a++)
+   {
+      fixLedgerAfterReorg(addrPtrVect_[a]->getTxLedger(), txInvalid, newHeights);
+      addrPtrVect_[a]->ledgerIndex_.invalidate();
+   }
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 void BtcWallet::clearBlkData(void)
 {
    txioMap_.clear();
+   txioBloom_.reset(0);
+   balances_.invalidate();
    ledgerAllAddr_.clear();
    ledgerAllAddrZC_.clear();
+   ledgerIndex_.invalidate();
    nonStdTxioMap_.clear();
    nonStdUnspentOutPoints_.clear();
+   scannedUpToBlk_ = 0;
 
    for(uint32_t a=0; a<addrPtrVect_.size(); a++)
       addrPtrVect_[a]->clearBlkData();
 }
 
+////////////////////////////////////////////////////////////////////////////////
+static void putTxioMap(BinaryWriter & bw, map<OutPoint, TxIOPair> const & txioMap,
+                       map<TxIOPair const *, uint32_t> * txioIndex=NULL)
+{
+   // Zero-conf txios (no TxOut in the blockchain) aren't saved
+   uint32_t numTxio = 0;
+   map<OutPoint, TxIOPair>::const_iterator iter;
+   for(iter = txioMap.begin(); iter != txioMap.end(); iter++)
+      if(iter->second.hasTxOut())
+         numTxio++;
+
+   bw.put_uint32_t(numTxio);
+   for(iter = txioMap.begin(); iter != txioMap.end(); iter++)
+   {
+      if(!iter->second.hasTxOut())
+         continue;
+
+      if(txioIndex != NULL)
+      {
+         uint32_t idx = txioIndex->size();
+         (*txioIndex)[&iter->second] = idx;
+      }
+      OutPoint op = iter->first;
+      op.serialize(bw);
+      iter->second.serialize(bw);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool getTxioMap(BinaryRefReader & brr, map<OutPoint, TxIOPair> & txioMap,
+                       vector<TxIOPair*> * txioList=NULL)
+{
+   uint32_t numTxio = brr.get_uint32_t();
+   for(uint32_t i=0; i<numTxio; i++)
+   {
+      OutPoint op;
+      op.unserialize(brr);
+      TxIOPair & txio = txioMap[op];
+      if(!txio.unserialize(brr))
+         return false;
+      if(txioList != NULL)
+         txioList->push_back(&txio);
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void putLedger(BinaryWriter & bw, vector<LedgerEntry> const & ledger)
+{
+   bw.put_uint32_t(ledger.size());
+   for(uint32_t i=0; i<ledger.size(); i++)
+      ledger[i].serialize(bw);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void getLedger(BinaryRefReader & brr, vector<LedgerEntry> & ledger)
+{
+   ledger.resize(brr.get_uint32_t());
+   for(uint32_t i=0; i<ledger.size(); i++)
+      ledger[i].unserialize(brr);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The txios are written once, from txioMap_, and the addresses refer to 
+// them by their position in that list.  See the wallet state file format
+// above BlockDataManager_FileRefs::writeWalletState for the whole layout.
+void BtcWallet::serializeState(BinaryWriter & bw)
+{
+   map<TxIOPair const *, uint32_t> txioIndex;
+   putTxioMap(bw, txioMap_, &txioIndex);
+
+   putTxioMap(bw, nonStdTxioMap_);
+   bw.put_uint32_t(nonStdUnspentOutPoints_.size());
+   set<OutPoint>::const_iterator opIter;
+   for(opIter  = nonStdUnspentOutPoints_.begin(); 
+       opIter != nonStdUnspentOutPoints_.end(); 
+       opIter++)
+   {
+      OutPoint op = *opIter;
+      op.serialize(bw);
+   }
+
+   bw.put_uint32_t(addrPtrVect_.size());
+   for(uint32_t a=0; a<addrPtrVect_.size(); a++)
+   {
+      BtcAddress & addr = *addrPtrVect_[a];
+      bw.put_var_int(addr.address20_.getSize());
+      bw.put_BinaryData(addr.address20_);
+      bw.put_uint32_t(addr.firstBlockNum_);
+      bw.put_uint32_t(addr.firstTimestamp_);
+      bw.put_uint32_t(addr.lastBlockNum_);
+      bw.put_uint32_t(addr.lastTimestamp_);
+
+      vector<uint32_t> addrTxio;
+      for(uint32_t i=0; i<addr.relevantTxIOPtrs_.size(); i++)
+      {
+         map<TxIOPair const *, uint32_t>::iterator iter;
+         iter = txioIndex.find(addr.relevantTxIOPtrs_[i]);
+         if(iter != txioIndex.end())
+            addrTxio.push_back(iter->second);
+      }
+      bw.put_uint32_t(addrTxio.size());
+      for(uint32_t i=0; i<addrTxio.size(); i++)
+         bw.put_uint32_t(addrTxio[i]);
+
+      putLedger(bw, addr.ledger_);
+   }
+
+   putLedger(bw, ledgerAllAddr_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BtcWallet::unserializeState(BinaryRefReader & brr)
+{
+   clearBlkData();
+
+   vector<TxIOPair*> txioList;
+   if(!getTxioMap(brr, txioMap_, &txioList) || 
+      !getTxioMap(brr, nonStdTxioMap_))
+   {
+      clearBlkData();
+      return false;
+   }
+
+   map<OutPoint, TxIOPair>::iterator iter;
+   for(iter = txioMap_.begin(); iter != txioMap_.end(); iter++)
+      addToTxioBloom(iter->first);
+
+   uint32_t numUnspent = brr.get_uint32_t();
+   for(uint32_t i=0; i<numUnspent; i++)
+   {
+      OutPoint op;
+      op.unserialize(brr);
+      nonStdUnspentOutPoints_.insert(op);
+   }
+
+   // It has to be the same addresses, in the same order
+   uint32_t numAddr = brr.get_uint32_t();
+   if(numAddr != addrPtrVect_.size())
+   {
+      clearBlkData();
+      return false;
+   }
+
+   for(uint32_t a=0; a<numAddr; a++)
+   {
+      BtcAddress & addr = *addrPtrVect_[a];
+      BinaryData addr20;
+      brr.get_BinaryData(addr20, (uint32_t)brr.get_var_int());
+      if(!(addr20 == addr.address20_))
+      {
+         clearBlkData();
+         return false;
+      }
+
+      addr.firstBlockNum_  = brr.get_uint32_t();
+      addr.firstTimestamp_ = brr.get_uint32_t();
+      addr.lastBlockNum_   = brr.get_uint32_t();
+      addr.lastTimestamp_  = brr.get_uint32_t();
+
+      uint32_t numAddrTxio = brr.get_uint32_t();
+      for(uint32_t i=0; i<numAddrTxio; i++)
+      {
+         uint32_t idx = brr.get_uint32_t();
+         if(idx >= txioList.size())
+         {
+            clearBlkData();
+            return false;
+         }
+         addr.addTxIO(txioList[idx]);
+      }
+
+      getLedger(brr, addr.ledger_);
+   }
+
+   getLedger(brr, ledgerAllAddr_);
+   return true;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Make a separate method here so we can get creative with how to handle these
@@ -1511,78 +2341,59 @@ void BtcWallet::scanNonStdTx(uint32_t blknum,
 //uint64_t BtcWallet::getBalance(bool blockchainOnly)
 
 ////////////////////////////////////////////////////////////////////////////////
-uint64_t BtcWallet::getSpendableBalance(uint32_t currBlk)
+void BtcWallet::updateBalances(uint32_t currBlk, bool needBlk, IdxColorID color)
 {
-   uint64_t balance = 0;
+   if(!balances_.startQuery(currBlk, needBlk, color))
+      return;
+
    map<OutPoint, TxIOPair>::iterator iter;
    for(iter  = txioMap_.begin();
        iter != txioMap_.end();
        iter++)
-   {
-      if(iter->second.isSpendable(currBlk))
-         balance += iter->second.getValue();      
-   }
-   return balance;
+      balances_.addTxIO(iter->second);
+   balances_.finishRecompute();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BtcWallet::getSpendableBalance(uint32_t currBlk)
+{
+   updateBalances(currBlk, true, COLOR_UNKNOWN);
+   return balances_.getSpendable(COLOR_UNKNOWN);
 }
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcWallet::getSpendableBalanceX(IdxColorID color ,uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
-   for(iter  = txioMap_.begin();
-       iter != txioMap_.end();
-       iter++)
-   {
-     if(iter->second.isSpendable(currBlk) && iter->second.matchesColor(color))
-         balance += iter->second.getValue();      
-   }
-   return balance;
+   updateBalances(currBlk, true, color);
+   return balances_.getSpendable(color);
 }
 
 
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcWallet::getUnconfirmedBalance(uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
-   for(iter  = txioMap_.begin();
-       iter != txioMap_.end();
-       iter++)
-   {
-      if(iter->second.isMineButUnconfirmed(currBlk))
-         balance += iter->second.getValue();      
-   }
-   return balance;
+   updateBalances(currBlk, true, COLOR_UNKNOWN);
+   return balances_.getUnconfirmed(COLOR_UNKNOWN);
 }
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcWallet::getUnconfirmedBalanceX(IdxColorID color,uint32_t currBlk)
 {
-   uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
-   for(iter  = txioMap_.begin();
-       iter != txioMap_.end();
-       iter++)
-   {
-     if(iter->second.isMineButUnconfirmed(currBlk) && iter->second.matchesColor(color))
-         balance += iter->second.getValue();      
-   }
-   return balance;
+   updateBalances(currBlk, true, color);
+   return balances_.getUnconfirmed(color);
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BtcWallet::getFullBalance(void)
+{
+   updateBalances(0, false, COLOR_UNKNOWN);
+   return balances_.getFull(COLOR_UNKNOWN);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 uint64_t BtcWallet::getFullBalanceX(IdxColorID color)
 {
-   uint64_t balance = 0;
-   map<OutPoint, TxIOPair>::iterator iter;
-   for(iter  = txioMap_.begin();
-       iter != txioMap_.end();
-       iter++)
-   {
-       if (iter->second.isUnspent() && iter->second.matchesColor(color))
-           balance += iter->second.getValue();      
-   }
-   return balance;
+   updateBalances(0, false, color);
+   return balances_.getFull(color);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -1659,6 +2470,7 @@ uint32_t BtcWallet::removeInvalidEntries(void)
    }
    ledgerAllAddr_.clear();
    ledgerAllAddr_ = newLedger;
+   ledgerIndex_.invalidate();
    return leRemoved;
 
 }
@@ -1667,6 +2479,7 @@ uint32_t BtcWallet::removeInvalidEntries(void)
 void BtcWallet::sortLedger(void)
 {
    sort(ledgerAllAddr_.begin(), ledgerAllAddr_.end());
+   ledgerIndex_.invalidate();
 }
 
 
@@ -1769,20 +2582,31 @@ vector<AddressBookEntry> BtcWallet::createAddressBook(void)
 ////////////////////////////////////////////////////////////////////////////////
 ////////////////////////////////////////////////////////////////////////////////
 BlockDataManager_FileRefs::BlockDataManager_FileRefs(void) : 
+      useSpendIndex_(false),
+      useUtxoSet_(false),
+      utxoTopPtr_(NULL),
+      useAddrHistory_(false),
       totalBlockchainBytes_(0),
       lastBlkFileBytes_(0),
       topBlockPtr_(NULL),
       genBlockPtr_(NULL),
       lastBlockWasReorg_(false),
+      txioGeneration_(0),
       isInitialized_(false),
+      numLoadThreads_(1),
+      integrityBytesTotal_(0),
+      integrityBytesDone_(0),
+      integrityBlocksDone_(0),
+      integrityCancel_(false),
       GenesisHash_(0),
       GenesisTxHash_(0),
       MagicBytes_(0),
       allRegAddrScannedUpToBlk_(0),
+      pubKeyQueueNext_(0),
       colorMan_(this)
 {
-   headerMap_.clear();
-   txHintMap_.clear();
+   headerStore_.clear();
+   txIndex_.clear();
 
    zeroConfRawTxList_.clear();
    zeroConfMap_.clear();
@@ -1793,6 +2617,7 @@ BlockDataManager_FileRefs::BlockDataManager_FileRefs(void) :
    blkFileList_.clear();
    previouslyValidBlockHeaderPtrs_.clear();
    orphanChainStartBlocks_.clear();
+   orphanHeaderPtrs_.clear();
 }
 
 
@@ -1862,12 +2687,20 @@ void BlockDataManager_FileRefs::Reset(void)
 {
    // Clear out all the "real" data in the blkfile
    blkFileDir_ = "";
-   headerMap_.clear();
-   txHintMap_.clear();
+   headerStore_.clear();
+   txIndex_.clear();
+   spendIndex_.clear();
+   utxoSet_.clear();
+   utxoTopPtr_ = NULL;
+   addrHistory_.clear();
 
    // These are not used at the moment, but we should clear them anyway
    blkFileList_.clear();
 
+   // Close the old blk files, or a directory with fewer of them would pick
+   // up the sizes of the old ones that are still open
+   FileDataPtr::getGlobalCacheRef().clear();
+
 
    // These should be set after the blockchain is organized
    headersByHeight_.clear();
@@ -1879,10 +2712,12 @@ void BlockDataManager_FileRefs::Reset(void)
    reorgBranchPoint_ = NULL;
    txJustInvalidated_.clear();
    txJustAffected_.clear();
+   txioGeneration_++;
 
    // Reset orphan chains
    previouslyValidBlockHeaderPtrs_.clear();
    orphanChainStartBlocks_.clear();
+   orphanHeaderPtrs_.clear();
    
    totalBlockchainBytes_ = 0;
    lastBlkFileBytes_ = 0;
@@ -1897,7 +2732,10 @@ void BlockDataManager_FileRefs::Reset(void)
    // Clear out any of the registered tx data we have collected so far.
    // Doesn't take any time to recollect if it we have to rescan, anyway.
    registeredTxList_.clear(); 
+   registeredTxSet_.clear(); 
    registeredOutPoints_.clear(); 
+   regOutPointBloom_.reset(0);
+   clearPubKeyQueue();
 }
 
 
@@ -1938,7 +2776,17 @@ BlockHeader & BlockDataManager_FileRefs::getTopBlockHeader(void)
 BlockHeader & BlockDataManager_FileRefs::getGenesisBlock(void) 
 {
    if(genBlockPtr_ == NULL)
-      genBlockPtr_ = &(headerMap_[GenesisHash_]);
+      genBlockPtr_ = headerStore_.findHeader(GenesisHash_.getPtr());
+
+   // Haven't loaded the genesis block yet, so all we can give back is an
+   // empty header (it used to quietly add one to the header map).  Reset it
+   // every time, in case someone wrote to the last one we gave out.
+   if(genBlockPtr_ == NULL)
+   {
+      static BlockHeader emptyHeader;
+      emptyHeader = BlockHeader();
+      return emptyHeader;
+   }
    return *genBlockPtr_;
 }
 
@@ -1957,11 +2805,10 @@ BlockHeader * BlockDataManager_FileRefs::getHeaderByHeight(int index)
 // The most common access method is to get a block by its hash
 BlockHeader * BlockDataManager_FileRefs::getHeaderByHash(HashString const & blkHash)
 {
-   map<HashString, BlockHeader>::iterator it = headerMap_.find(blkHash);
-   if(it==headerMap_.end())
+   if(blkHash.getSize() != 32)
       return NULL;
-   else
-      return &(it->second);
+
+   return headerStore_.findHeader(blkHash.getPtr());
 }
 
 
@@ -1969,66 +2816,24 @@ BlockHeader * BlockDataManager_FileRefs::getHeaderByHash(HashString const & blkH
 /////////////////////////////////////////////////////////////////////////////
 TxRef* BlockDataManager_FileRefs::getTxRefPtrByHash(HashString const & txhash) 
 {
-   typedef multimap<HashString,TxRef>::iterator hintMapIter;
-
-   static HashString hash4(4);
-   hash4.copyFrom(txhash.getPtr(), 4);
-   pair<hintMapIter, hintMapIter> eqRange = txHintMap_.equal_range(hash4);
-
-   if(eqRange.first==eqRange.second)
+   if(txhash.getSize() < TXREF_HASH_PREFIX_BYTES)
       return NULL;
-   else
-   {
-      hintMapIter iter;
-      for( iter = eqRange.first; iter != eqRange.second; iter++ )
-         if(iter->second.getThisHash() == txhash)
-            return &(iter->second);
 
-      // If we got here, we have some matching prefixes, but no tx that
-      // match the full requested tx-hash
-      return NULL;
-   }
+   return txIndex_.findTxRef(txhash.getPtr());
 }
 
 /////////////////////////////////////////////////////////////////////////////
-// Returns a pointer to the TxRef as it resides in the multimap node
+// Returns a pointer to the TxRef as it resides in the tx index
 // There should only ever be exactly one copy
-// NOTE:  This method was created because multimaps allow duplicate 
-//        elements (which are nodes with the same 4-byte prefix). 
-//        However, we don't want to allow two identical transactions
-//        at different locations in the blkfile lead to duplicate
-//        multimap nodes.  
-//
-//        i.e. transactions with same 4-byte prefix -- OK
-//             transactions with same 32-byte hash  -- NOT OK
+// NOTE:  Transactions with the same 4-byte prefix are fine, but we don't 
+//        want two identical transactions at different locations in the
+//        blkfile to lead to duplicate entries.  If the tx is already
+//        there, we just return the existing one and leave it alone.
 TxRef * BlockDataManager_FileRefs::insertTxRef(HashString const & txHash, 
                                                FileDataPtr & fdp,
                                                BlockHeader * bhptr)
 {
-   static multimap<HashString, TxRef>::iterator lowerBound;
-   static multimap<HashString, TxRef>::iterator upperBound;
-   static pair<HashString, TxRef>               txInputPair;
-   static multimap<HashString, TxRef>::iterator txInsResult;
-
-   txInputPair.first.copyFrom(txHash.getPtr(), 4);
-   lowerBound = txHintMap_.lower_bound(txInputPair.first);
-   upperBound = txHintMap_.upper_bound(txInputPair.first);
-
-   bool needInsert = false;
-   if(lowerBound!=upperBound)
-   {
-      multimap<HashString, TxRef>::iterator iter;
-      for(iter = lowerBound; iter != upperBound; iter++)
-         if(iter->second.getThisHash() == txHash)
-            return &(iter->second);
-   }
-
-   // If we got here, the tx doesn't exist in the multimap yet,
-   // and lowerBound is an appropriate hint for inserting the TxRef
-   txInputPair.second.setBlkFilePtr(fdp);
-   txInputPair.second.setHeaderPtr(bhptr);
-   txInsResult = txHintMap_.insert(lowerBound, txInputPair);
-   return &(txInsResult->second);
+   return txIndex_.insertTxRef(txHash.getPtr(), fdp, bhptr);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2069,7 +2874,7 @@ bool BlockDataManager_FileRefs::hasTxWithHash(HashString const & txhash,
 /////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_FileRefs::hasHeaderWithHash(HashString const & txhash) const
 {
-   return (headerMap_.find(txhash) != headerMap_.end());
+   return (txhash.getSize()==32 && headerStore_.findHeader(txhash.getPtr()) != NULL);
 }
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2080,26 +2885,7 @@ vector<BlockHeader*> BlockDataManager_FileRefs::prefixSearchHeaders(BinaryData c
    if(lenSearch < 2)
       return outList;  // don't search unless we have at least two bytes
 
-   BinaryData searchLow(32);
-   BinaryData searchHigh(32);
-   for(uint32_t i=0; i<lenSearch; i++)
-   {
-      searchLow[i]  = searchStr[i];
-      searchHigh[i] = searchStr[i];
-   }
-   for(uint32_t i=lenSearch; i<32; i++)
-   {
-      searchLow[i]  = 0;
-      searchHigh[i] = 255;
-   }
-
-   map<HashString, BlockHeader>::iterator iter;
-   for(iter  = headerMap_.lower_bound(searchLow);
-       iter != headerMap_.upper_bound(searchHigh);
-       iter++)
-   {
-      outList.push_back(&(iter->second));
-   }
+   outList = headerStore_.findHeadersByPrefix(searchStr.getPtr(), lenSearch);
    return outList;
 }
 
@@ -2111,28 +2897,16 @@ vector<TxRef*> BlockDataManager_FileRefs::prefixSearchTx(BinaryData const & sear
    if(lenSearch < 2)
       return outList;  // don't search unless we have at least two bytes
 
-   BinaryData searchLow(32);
-   BinaryData searchHigh(32);
-   for(uint32_t i=0; i<lenSearch; i++)
-   {
-      searchLow[i]  = searchStr[i];
-      searchHigh[i] = searchStr[i];
-   }
-   for(uint32_t i=lenSearch; i<32; i++)
-   {
-      searchLow[i]  = 0;
-      searchHigh[i] = 255;
-   }
-
-   BinaryData searchLow4  = searchLow.getSliceCopy(0,4);
-   BinaryData searchHigh4 = searchHigh.getSliceCopy(0,4);
-   multimap<HashString, TxRef>::iterator iter;
-   for(iter  = txHintMap_.lower_bound(searchLow4);
-       iter != txHintMap_.upper_bound(searchHigh4);
-       iter++)
+   // Check against the stored hash prefix first (that's all the index can
+   // do), and only go to disk for the full hash if the search string is 
+   // longer than that
+   vector<TxRef*> candidates = txIndex_.findTxRefsByPrefix(searchStr.getPtr(),
+                                                           lenSearch);
+   for(uint32_t i=0; i<candidates.size(); i++)
    {
-      if(iter->second.getThisHash().startsWith(searchStr))
-         outList.push_back(&(iter->second));
+      if(lenSearch <= TXREF_HASH_PREFIX_BYTES ||
+         candidates[i]->getThisHash().startsWith(searchStr))
+         outList.push_back(candidates[i]);
    }
    return outList;
 }
@@ -2142,12 +2916,15 @@ vector<TxRef*> BlockDataManager_FileRefs::prefixSearchTx(BinaryData const & sear
 // that's all we can search for.  
 vector<BinaryData> BlockDataManager_FileRefs::prefixSearchAddress(BinaryData const & searchStr)
 {
-   // Actually, we can't even search for this, because we don't have a list
-   // of addresses in the blockchain.  We could construct one, but it would
-   // take up a lot of RAM (and time)... I will need to create a separate 
-   // call to allow the caller to create a set<BinaryData> of addresses 
-   // before calling this method
-   return vector<BinaryData>(0);
+   // We only have a list of the addresses in the blockchain if the address
+   // history is turned on (setUseAddrHistory).  Otherwise there's nothing
+   // to search.
+   vector<BinaryData> outList(0);
+   if(!useAddrHistory_ || searchStr.getSize() == 0)
+      return outList;
+
+   addrHistory_.prefixSearch(searchStr.getPtr(), searchStr.getSize(), outList);
+   return outList;
 }
 
 
@@ -2197,6 +2974,7 @@ bool BlockDataManager_FileRefs::registerAddress(HashString addr160,
       firstBlk = getTopBlockHeight() + 1;
 
    registeredAddrMap_[addr160] = RegisteredAddress(addr160, firstBlk);
+   addRegisteredAddrToBloom(addr160);
    allRegAddrScannedUpToBlk_  = min(firstBlk, allRegAddrScannedUpToBlk_);
    return true;
 }
@@ -2210,6 +2988,7 @@ bool BlockDataManager_FileRefs::registerNewAddress(HashString addr160)
 
    uint32_t currBlk = getTopBlockHeight();
    registeredAddrMap_[addr160] = RegisteredAddress(addr160, currBlk);
+   addRegisteredAddrToBloom(addr160);
 
    // New address cannot affect allRegAddrScannedUpToBlk_, so don't bother
    //allRegAddrScannedUpToBlk_  = min(currBlk, allRegAddrScannedUpToBlk_);
@@ -2227,11 +3006,106 @@ bool BlockDataManager_FileRefs::registerImportedAddress(HashString addr160,
    if(createBlk==UINT32_MAX)
       createBlk = 0;
 
+   // With the address history, we don't have to scan for it at all, we 
+   // can just look it up and call it scanned.  The UTXO set alone isn't
+   // enough for that:  it doesn't have the tx whose outputs to this address
+   // were already spent, and if we called it scanned, the wallet ledger 
+   // would never get them.  So with just the UTXO set, the address gets 
+   // scanned for like any other (getAddrBalance and getUnspentTxOutsForAddr
+   // have its balance and UTXOs right away, without waiting for that).
+   if(useAddrHistory_ && isInitialized_ && addr160.getSize() == 20)
+   {
+      uint32_t nextBlk = getTopBlockHeight() + 1;
+      registeredAddrMap_[addr160] = RegisteredAddress(addr160, createBlk);
+      registeredAddrMap_[addr160].alreadyScannedUpToBlk_ = nextBlk;
+      addRegisteredAddrToBloom(addr160);
+      registerTxFromAddrHistory(addr160);
+      return true;
+   }
+
    registeredAddrMap_[addr160] = RegisteredAddress(addr160, createBlk);
+   addRegisteredAddrToBloom(addr160);
    allRegAddrScannedUpToBlk_ = min(createBlk, allRegAddrScannedUpToBlk_);
    return true;
 }
 
+/////////////////////////////////////////////////////////////////////////////
+// We already know every tx the address is in, so put them in the 
+// registered tx/outpoints
+void BlockDataManager_FileRefs::registerTxFromAddrHistory(HashString const & addr160)
+{
+   vector<AddrHistoryEntry> history;
+   addrHistory_.getHistory(addr160.getPtr(), history);
+   for(uint32_t i=0; i<history.size(); i++)
+   {
+      TxRef* txref = txIndex_.getTxRefByIndex(history[i].getTxIndex());
+      HashString txHash = txref->getThisHash();
+      insertRegisteredTxIfNew(txHash);
+      if(!history[i].isTxIn())
+         insertRegisteredOutPoint(OutPoint(txHash, history[i].getIndex()));
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+uint32_t BlockDataManager_FileRefs::registerImportedAddresses(
+                                             BinaryData const & packedAddrs)
+{
+   vector<pair<HashString, uint32_t> > sortedAddrs;
+   if(!parseImportedAddresses(packedAddrs, sortedAddrs))
+      return 0;
+   return registerImportedAddressList(sortedAddrs);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// registerImportedAddress for each of them, except the map inserts all go 
+// in after the previous one, the bloom filter grows once at the end, and 
+// allRegAddrScannedUpToBlk_ goes straight to the lowest creation block
+uint32_t BlockDataManager_FileRefs::registerImportedAddressList(
+                      vector<pair<HashString, uint32_t> > const & sortedAddrs)
+{
+   bool fromHistory = useAddrHistory_ && isInitialized_;
+   uint32_t nextBlk = (fromHistory ? getTopBlockHeight() + 1 : 0);
+   uint32_t lowestBlk = UINT32_MAX;
+
+   vector<HashString const *> newAddrs;
+   newAddrs.reserve(sortedAddrs.size());
+   map<HashString, RegisteredAddress>::iterator hint = registeredAddrMap_.begin();
+   for(uint32_t i=0; i<sortedAddrs.size(); i++)
+   {
+      HashString const & addr160 = sortedAddrs[i].first;
+      uint32_t createBlk = sortedAddrs[i].second;
+      if(createBlk==UINT32_MAX)
+         createBlk = 0;
+
+      uint32_t sizeBefore = registeredAddrMap_.size();
+      hint = registeredAddrMap_.insert(hint, 
+                     make_pair(addr160, RegisteredAddress(addr160, createBlk)));
+      if(registeredAddrMap_.size() == sizeBefore)
+         continue;  // already registered
+
+      newAddrs.push_back(&(hint->first));
+      if(fromHistory && addr160.getSize() == 20)
+      {
+         hint->second.alreadyScannedUpToBlk_ = nextBlk;
+         registerTxFromAddrHistory(addr160);
+      }
+      else
+         lowestBlk = min(lowestBlk, createBlk);
+   }
+
+   if(regAddrBloom_.getNumItems() + newAddrs.size() > regAddrBloom_.getCapacity())
+      rebuildRegisteredBlooms();
+   else
+   {
+      for(uint32_t i=0; i<newAddrs.size(); i++)
+         if(newAddrs[i]->getSize() == 20)
+            regAddrBloom_.insert(newAddrs[i]->getPtr());
+   }
+
+   allRegAddrScannedUpToBlk_ = min(lowestBlk, allRegAddrScannedUpToBlk_);
+   return newAddrs.size();
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_FileRefs::unregisterAddress(HashString addr160)
@@ -2241,6 +3115,9 @@ bool BlockDataManager_FileRefs::unregisterAddress(HashString addr160)
    
    registeredAddrMap_.erase(addr160);
    allRegAddrScannedUpToBlk_ = evalLowestBlockNextScan();
+
+   // Can't take it out of the bloom filter, but a new one won't have it
+   rebuildRegisteredBlooms();
    return true;
 }
 
@@ -2371,11 +3248,61 @@ bool BlockDataManager_FileRefs::walletIsRegistered(BtcWallet & wlt)
 }
 
 /////////////////////////////////////////////////////////////////////////////
-bool BlockDataManager_FileRefs::addressIsRegistered(HashString addr160)
+bool BlockDataManager_FileRefs::addressIsRegistered(HashString const & addr160)
 {
+   if(addr160.getSize()==20 && !regAddrBloom_.mayContain(addr160.getPtr()))
+      return false;
    return (registeredAddrMap_.find(addr160)!=registeredAddrMap_.end());
 }
 
+/////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::addRegisteredAddrToBloom(HashString const & addr160)
+{
+   if(addr160.getSize() != 20)
+      return;
+
+   regAddrBloom_.insert(addr160.getPtr());
+   if(regAddrBloom_.isFull())
+      rebuildRegisteredBlooms();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::insertRegisteredOutPoint(OutPoint const & op)
+{
+   if(!registeredOutPoints_.insert(op).second)
+      return;
+
+   regOutPointBloom_.insert(op.getTxHashRef().getPtr(), op.getTxOutIndex());
+   if(regOutPointBloom_.isFull())
+      rebuildRegisteredBlooms();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// Both filters from scratch, with room for twice what's in them now so that
+// they don't have to do this again for a while
+void BlockDataManager_FileRefs::rebuildRegisteredBlooms(void)
+{
+   regAddrBloom_.reset(2*registeredAddrMap_.size());
+   map<HashString, RegisteredAddress>::iterator addrIter;
+   for(addrIter  = registeredAddrMap_.begin();
+       addrIter != registeredAddrMap_.end();
+       addrIter++)
+   {
+      if(addrIter->first.getSize() == 20)
+         regAddrBloom_.insert(addrIter->first.getPtr());
+   }
+
+   regOutPointBloom_.reset(2*registeredOutPoints_.size());
+   set<OutPoint>::iterator opIter;
+   for(opIter  = registeredOutPoints_.begin();
+       opIter != registeredOutPoints_.end();
+       opIter++)
+   {
+      regOutPointBloom_.insert(opIter->getTxHashRef().getPtr(), 
+                               opIter->getTxOutIndex());
+   }
+}
+
 
 
 /////////////////////////////////////////////////////////////////////////////
@@ -2412,17 +3339,30 @@ void BlockDataManager_FileRefs::scanBlockchainForTx(BtcWallet & myWallet,
                                                     uint32_t startBlknum,
                                                     uint32_t endBlknum)
 {
+   vector<BtcWallet*> wltList(1, &myWallet);
+   scanBlockchainForWallets(wltList, startBlknum, endBlknum);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// The same thing for a bunch of wallets at once.  The registered tx list is
+// brought up to date and sorted once, and each registered tx is read from
+// disk once and handed to every wallet, instead of once per wallet.
+void BlockDataManager_FileRefs::scanBlockchainForWallets(
+                                                vector<BtcWallet*> wltList,
+                                                uint32_t startBlknum,
+                                                uint32_t endBlknum)
+{
 
    // The BDM knows the highest block to which ALL CURRENT REGISTERED ADDRESSES
    // are up-to-date in the registeredTxList_ list.  
-   // If this wallet is not registered, it needs to be, before we start
-   if(!walletIsRegistered(myWallet))
-      registerWallet( &myWallet );
+   // If a wallet is not registered, it needs to be, before we start
+   for(uint32_t w=0; w<wltList.size(); w++)
+      if(!walletIsRegistered(*wltList[w]))
+         registerWallet( wltList[w] );
 
    
    // Check whether we can get everything we need from the registered tx list
    endBlknum = min(endBlknum, getTopBlockHeight()+1);
-   uint32_t numRescan = numBlocksToRescan(myWallet, endBlknum);
 
 
    // *********************************************************************** //
@@ -2442,12 +3382,22 @@ void BlockDataManager_FileRefs::scanBlockchainForTx(BtcWallet & myWallet,
       // all the subsequent TxRef dereferences will be super fast.
       bhr.getBlockFilePtr().preCacheThisChunk();
 
-      ///// LOOP OVER ALL TX FOR THIS HEADER/////
+      // Copy out all the tx first, so the pay-to-pubkey TxOuts can all be
+      // hashed in one batch before scanning
+      static vector<Tx> blockTxs;
+      blockTxs.resize(txlist.size());
       for(uint32_t itx=0; itx<txlist.size(); itx++)
       {
-         Tx thisTx = txlist[itx]->getTxCopy();
-         registeredAddrScan(thisTx);
+         blockTxs[itx] = txlist[itx]->getTxCopy();
+         queuePubKeyTxOuts(blockTxs[itx].getPtr(), blockTxs[itx].offsetsTxOut_);
       }
+      hashPubKeyQueue();
+
+      ///// LOOP OVER ALL TX FOR THIS HEADER/////
+      for(uint32_t itx=0; itx<txlist.size(); itx++)
+         registeredAddrScan(blockTxs[itx]);
+
+      clearPubKeyQueue();
    }
    TIMER_STOP("RescanTiming");
 
@@ -2457,11 +3407,12 @@ void BlockDataManager_FileRefs::scanBlockchainForTx(BtcWallet & myWallet,
 
    // *********************************************************************** //
    // Finally, walk through all the registered tx
-   scanRegisteredTxForWallet(myWallet, startBlknum, endBlknum);
+   scanRegisteredTxForWallets(wltList, startBlknum, endBlknum);
 
-   // We should clean up any dangling TxIOs in the wallet then rescan
+   // We should clean up any dangling TxIOs in the wallets then rescan
    if(zcEnabled_)
-      rescanWalletZeroConf(myWallet);
+      for(uint32_t w=0; w<wltList.size(); w++)
+         rescanWalletZeroConf(*wltList[w]);
 
    PDEBUG("Done scanning blockchain for tx");
 }
@@ -2494,7 +3445,21 @@ void BlockDataManager_FileRefs::scanRegisteredTxForWallet( BtcWallet & wlt,
                                                            uint32_t blkStart,
                                                            uint32_t blkEnd)
 {
-   PDEBUG("Scanning relevant tx list for wallet");
+   vector<BtcWallet*> wltList(1, &wlt);
+   scanRegisteredTxForWallets(wltList, blkStart, blkEnd);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// One pass over the registered tx for all the wallets:  each tx is pulled
+// from disk and checked once, then every wallet gets to scan it.  The
+// wallets don't share anything, so it comes out the same as doing them one
+// at a time.
+void BlockDataManager_FileRefs::scanRegisteredTxForWallets( 
+                                                vector<BtcWallet*> & wltList,
+                                                uint32_t blkStart,
+                                                uint32_t blkEnd)
+{
+   PDEBUG("Scanning relevant tx list for wallets");
 
    // Make sure RegisteredTx objects have correct data, then sort.
    // TODO:  Why did I not need this with the MMAP blockchain?  Somehow
@@ -2518,7 +3483,7 @@ void BlockDataManager_FileRefs::scanRegisteredTxForWallet( BtcWallet & wlt,
        txIter != registeredTxList_.end();
        txIter++)
    {
-      // Pull the tx from disk and check it for the supplied wallet
+      // Pull the tx from disk and check it for the supplied wallets
       Tx theTx = txIter->getTxCopy();
       if( !theTx.isInitialized() )
       {
@@ -2542,15 +3507,23 @@ void BlockDataManager_FileRefs::scanRegisteredTxForWallet( BtcWallet & wlt,
          continue;
 
       // If we made it here, we want to scan this tx!
-      wlt.scanTx(theTx, txIter->txIndex_, bhptr->getTimestamp(), thisBlk);
+      for(uint32_t w=0; w<wltList.size(); w++)
+         wltList[w]->scanTx(theTx, txIter->txIndex_, bhptr->getTimestamp(), thisBlk);
    }
  
-   wlt.sortLedger();
+   for(uint32_t w=0; w<wltList.size(); w++)
+   {
+      wltList[w]->sortLedger();
 
+      // Only counts if it picks up where the last scan left off
+      if(blkStart <= wltList[w]->getScannedUpToBlk())
+         wltList[w]->setScannedUpToBlk(
+                          max(wltList[w]->getScannedUpToBlk(), blkEnd));
 
-   // We should clean up any dangling TxIOs in the wallet then rescan
-   if(zcEnabled_)
-      rescanWalletZeroConf(wlt);
+      // We should clean up any dangling TxIOs in the wallet then rescan
+      if(zcEnabled_)
+         rescanWalletZeroConf(*wltList[w]);
+   }
 
    PDEBUG("Done scanning blockchain for tx");
 }
@@ -2625,6 +3598,440 @@ vector<TxRef*> BlockDataManager_FileRefs::findAllNonStdTx(void)
 */
 
 
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// Parallel blockchain loading
+//
+// Loading is split into a three-stage pipeline:
+//
+//    READ:   One thread reads the blkXXXX.dat files sequentially into a ring
+//            of large buffers, and frames each buffer on block boundaries 
+//            (partial blocks at the end get carried into the next buffer).
+//    HASH:   Some number of threads take framed buffers and compute every
+//            tx hash in them, which is where nearly all the load time goes.
+//    INDEX:  The main thread takes the hashed buffers back in file order and
+//            hands each block to parseNewBlockData with its precomputed tx
+//            hashes, then returns the buffer to the ring.
+//
+// The stages are connected by BoundedQueues, and the ring has a fixed number
+// of buffers, so the reader keeps the disk busy while the hashers work, but
+// can never get more than a ring's worth of data ahead.
+//
+// Since everything that touches the maps is still done on the main thread,
+// in file order, through parseNewBlockData, the result is exactly what the 
+// serial load would've produced -- including the registeredAddrScan results
+// which depend on the order tx are seen.
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+class BlockFileChunk
+{
+public:
+   uint32_t           fileIndex0Idx_;
+   uint32_t           startByte_;
+   uint32_t           numBytes_;
+   uint32_t           seq_;           // chunks must be indexed in this order
+
+   // Offset of each block's magic bytes, relative to startByte_
+   vector<uint32_t>   blkOffsets_;
+   vector<uint32_t>   blkSizes_;
+
+   // blkFirstTx_ is the index of the block's first hash in txHashes_, or
+   // UINT32_MAX if the block didn't look right and should be hashed the
+   // old way by parseNewBlockData
+   BinaryData         rawData_;
+   BinaryData         txHashes_;
+   vector<uint32_t>   blkFirstTx_;
+
+   // Only used by verifyBlkFileIntegrity:  each block's header hash, and 
+   // what was wrong with it (BLK_INTEGRITY_* flags, 0 if nothing)
+   BinaryData         blkHashes_;
+   vector<uint8_t>    blkStatus_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Everything the stages share.  The stats are written by each stage, and only
+// read by the main thread after all the workers have exited
+class BlockLoadPipeline
+{
+public:
+   BlockLoadPipeline(uint32_t ringSize, uint32_t maxHashThreads) :
+      freeQueue_(ringSize),
+      readQueue_(ringSize + maxHashThreads),
+      hashedQueue_(ringSize + maxHashThreads),
+      numHashThreads_(0),
+      cancelFlag_(NULL),
+      readFailed_(false),
+      bytesRead_(0),
+      readSec_(0),
+      bytesHashed_(0),
+      hashSec_(0) {}
+
+   vector<string>                 blkFileList_;
+   BinaryData                     magicBytes_;
+
+   BoundedQueue<BlockFileChunk*>  freeQueue_;    // the ring of empty buffers
+   BoundedQueue<BlockFileChunk*>  readQueue_;    // framed, waiting for hash
+   BoundedQueue<BlockFileChunk*>  hashedQueue_;  // hashed, waiting for index
+   uint32_t                       numHashThreads_;
+
+   // If this is set, the reader stops (as if it hit the end of the files)
+   // as soon as it goes true
+   bool volatile *                cancelFlag_;
+   bool isCancelled(void) const { return cancelFlag_ != NULL && *cancelFlag_; }
+
+   bool                           readFailed_;
+   uint64_t                       bytesRead_;
+   double                         readSec_;
+
+   Mutex                          hashStatsMutex_;
+   uint64_t                       bytesHashed_;
+   double                         hashSec_;
+};
+
+
+/////////////////////////////////////////////////////////////////////////////
+// READ stage.  The framing rules here must match the BinaryStreamBuffer loop
+// in parseEntireBlockchain, so that we end up with exactly the same blocks
+static void* blockLoadReadStage(void* pipePtr)
+{
+   BlockLoadPipeline & pipe = *(BlockLoadPipeline*)pipePtr;
+   uint32_t seq = 0;
+   BinaryData leftover(0);
+   BinaryData fileMagic(4);
+
+   for(uint32_t f=0; f<pipe.blkFileList_.size() && !pipe.readFailed_; f++)
+   {
+      if(pipe.isCancelled())
+         break;
+
+      string blkfile = pipe.blkFileList_[f];
+      cout << "Attempting to read blockchain from file: " << blkfile.c_str() << endl;
+      uint64_t filesize = BtcUtils::GetFileSize(blkfile);
+      ifstream is(blkfile.c_str(), ios::in | ios::binary);
+      if( filesize == FILE_DOES_NOT_EXIST || !is.is_open() )
+      {
+         cout << "***ERROR:  Cannot open " << blkfile.c_str() << endl;
+         cerr << "***ERROR:  Cannot open " << blkfile.c_str() << endl;
+         pipe.readFailed_ = true;
+         break;
+      }
+
+      is.read((char*)(fileMagic.getPtr()), 4);
+      is.seekg(0, ios::beg);
+      cout << blkfile.c_str() << " is " << filesize/(float)(1024*1024) << " MB" << endl;
+      if( !(fileMagic == pipe.magicBytes_) )
+      {
+         cerr << "***ERROR:  Block file is for the wrong network!" << endl;
+         cerr << "           MagicBytes of this file: " << fileMagic.toHexStr().c_str() << endl;
+         pipe.readFailed_ = true;
+         break;
+      }
+
+      uint64_t fileBytesLeft = filesize;
+      uint32_t bufStartByte = 0;
+      leftover.resize(0);
+      while(fileBytesLeft > 0 && !pipe.isCancelled())
+      {
+         BlockFileChunk* chunk = pipe.freeQueue_.pop();
+         uint32_t nLeftover = leftover.getSize();
+         uint32_t nToRead   = (uint32_t)min((uint64_t)PARALLEL_LOAD_CHUNK_SIZE, 
+                                            fileBytesLeft);
+         chunk->rawData_.resize(nLeftover + nToRead);
+         if(nLeftover > 0)
+            leftover.copyTo(chunk->rawData_.getPtr(), nLeftover);
+
+         double t0 = ThreadUtils::getWallClockSec();
+         is.read((char*)(chunk->rawData_.getPtr() + nLeftover), nToRead);
+         pipe.readSec_ += ThreadUtils::getWallClockSec() - t0;
+         if((uint32_t)is.gcount() != nToRead)
+         {
+            cout << "***ERROR:  Could not read " << blkfile.c_str() << endl;
+            cerr << "***ERROR:  Could not read " << blkfile.c_str() << endl;
+            pipe.freeQueue_.push(chunk);
+            pipe.readFailed_ = true;
+            break;
+         }
+         fileBytesLeft   -= nToRead;
+         pipe.bytesRead_ += nToRead;
+
+         // Walk the 8-byte block prefixes to find all the complete blocks
+         chunk->fileIndex0Idx_ = f;
+         chunk->startByte_     = bufStartByte;
+         chunk->blkOffsets_.clear();
+         chunk->blkSizes_.clear();
+         uint8_t const * rawPtr = chunk->rawData_.getPtr();
+         uint32_t total = nLeftover + nToRead;
+         uint32_t pos = 0;
+         while(total - pos > 8)
+         {
+            uint32_t blkSize = *(uint32_t*)(rawPtr + pos + 4);
+            if(blkSize > DEFAULT_BUFFER_SIZE - 8)
+            {
+               // The serial loader can never fit this in its stream buffer,
+               // so it stops reading this file here.  So do we.
+               fileBytesLeft = 0;
+               break;
+            }
+
+            if(total - pos - 8 < blkSize)
+               break;
+
+            chunk->blkOffsets_.push_back(pos);
+            chunk->blkSizes_.push_back(blkSize);
+            pos += 8 + blkSize;
+         }
+         chunk->numBytes_ = pos;
+         leftover.copyFrom(rawPtr + pos, total - pos);
+         bufStartByte += pos;
+
+         if(chunk->blkOffsets_.size() == 0)
+            pipe.freeQueue_.push(chunk);
+         else
+         {
+            chunk->seq_ = seq++;
+            pipe.readQueue_.push(chunk);
+         }
+      }
+   }
+
+   // One stop signal for each hashing thread
+   for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+      pipe.readQueue_.push(NULL);
+   return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+static void hashBlockFileChunk(BlockFileChunk & chunk)
+{
+   // Count the tx first so we can allocate the hash list once
+   uint32_t nBlk = chunk.blkOffsets_.size();
+   uint32_t nTxTotal = 0;
+   chunk.blkFirstTx_.resize(nBlk);
+   for(uint32_t b=0; b<nBlk; b++)
+   {
+      chunk.blkFirstTx_[b] = UINT32_MAX;
+      if(chunk.blkSizes_[b] <= HEADER_SIZE)
+         continue;
+
+      // Every tx is at least one byte, so a bigger count is garbage
+      uint8_t const * blkPtr = chunk.rawData_.getPtr() + chunk.blkOffsets_[b] + 8;
+      uint64_t nTx = BtcUtils::readVarInt(blkPtr + HEADER_SIZE);
+      if(nTx > chunk.blkSizes_[b])
+         continue;
+      chunk.blkFirstTx_[b] = nTxTotal;
+      nTxTotal += (uint32_t)nTx;
+   }
+
+   // Then collect every tx in the chunk, and hash them all in one batch, so
+   // even the early blocks with one tx each fill up the SIMD lanes.  A block
+   // with garbage in it is left out, so we keep track of where each hash goes.
+   vector<uint8_t const *> txPtrs;
+   vector<uint32_t>        txSizes;
+   vector<uint32_t>        txDest;
+   txPtrs.reserve(nTxTotal);
+   txSizes.reserve(nTxTotal);
+   txDest.reserve(nTxTotal);
+   chunk.txHashes_.resize(32*nTxTotal);
+   for(uint32_t b=0; b<nBlk; b++)
+   {
+      if(chunk.blkFirstTx_[b] == UINT32_MAX)
+         continue;
+
+      uint8_t const * blkPtr = chunk.rawData_.getPtr() + chunk.blkOffsets_[b] + 8;
+      uint8_t const * blkEnd = blkPtr + chunk.blkSizes_[b];
+      uint32_t viLen;
+      uint32_t nTx = (uint32_t)BtcUtils::readVarInt(blkPtr+HEADER_SIZE, &viLen);
+      uint8_t const * txPtr = blkPtr + HEADER_SIZE + viLen;
+      uint32_t nBefore = txPtrs.size();
+      for(uint32_t i=0; i<nTx; i++)
+      {
+         uint32_t txSize = BtcUtils::TxCalcLength(txPtr);
+         if(txPtr + txSize > blkEnd)
+         {
+            // Garbage in the block, let the main thread deal with it
+            chunk.blkFirstTx_[b] = UINT32_MAX;
+            txPtrs.resize(nBefore);
+            txSizes.resize(nBefore);
+            txDest.resize(nBefore);
+            break;
+         }
+         txPtrs.push_back(txPtr);
+         txSizes.push_back(txSize);
+         txDest.push_back(chunk.blkFirstTx_[b]+i);
+         txPtr += txSize;
+      }
+   }
+
+   uint32_t nHash = txPtrs.size();
+   if(nHash == 0)
+      return;
+
+   BinaryData hashes(32*nHash);
+   Sha256::doubleHashBatch(&txPtrs[0], &txSizes[0], nHash, hashes.getPtr());
+   for(uint32_t i=0; i<nHash; i++)
+      memcpy(chunk.txHashes_.getPtr() + 32*txDest[i], hashes.getPtr() + 32*i, 32);
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// HASH stage
+static void* blockLoadHashStage(void* pipePtr)
+{
+   BlockLoadPipeline & pipe = *(BlockLoadPipeline*)pipePtr;
+   uint64_t nBytes = 0;
+   double   nSec   = 0;
+
+   while(true)
+   {
+      BlockFileChunk* chunk = pipe.readQueue_.pop();
+      if(chunk == NULL)
+         break;
+
+      double t0 = ThreadUtils::getWallClockSec();
+      hashBlockFileChunk(*chunk);
+      nSec   += ThreadUtils::getWallClockSec() - t0;
+      nBytes += chunk->numBytes_;
+      pipe.hashedQueue_.push(chunk);
+   }
+
+   pipe.hashStatsMutex_.lock();
+   pipe.bytesHashed_ += nBytes;
+   pipe.hashSec_     += nSec;
+   pipe.hashStatsMutex_.unlock();
+
+   // Tell the main thread this hasher is done
+   pipe.hashedQueue_.push(NULL);
+   return NULL;
+}
+
+
+/////////////////////////////////////////////////////////////////////////////
+// Runs the READ and HASH stages in worker threads, and the INDEX stage here.
+// One thread reads, this thread indexes, and the rest of numLoadThreads_
+// are used for hashing.
+bool BlockDataManager_FileRefs::parseBlockFilesParallel(uint32_t numFiles,
+                                                        uint32_t & nBlkRead)
+{
+   uint32_t nThreads = numLoadThreads_;
+   if(nThreads == 0)
+      nThreads = ThreadUtils::getNumCores();
+   uint32_t nHashThreads = (nThreads>1 ? nThreads-1 : 1);
+
+   // Two buffers per hasher keeps them busy while the reader refills
+   uint32_t ringSize = 2*nHashThreads + 2;
+   BlockLoadPipeline pipe(ringSize, nHashThreads);
+   pipe.blkFileList_.assign(blkFileList_.begin(), blkFileList_.begin()+numFiles);
+   pipe.magicBytes_ = MagicBytes_;
+   vector<BlockFileChunk> ring(ringSize);
+   for(uint32_t i=0; i<ringSize; i++)
+      pipe.freeQueue_.push(&ring[i]);
+
+   cout << "Loading blockchain using " << nHashThreads << " hashing threads" << endl;
+   double tStart = ThreadUtils::getWallClockSec();
+   TIMER_START("ScanBlockchain");
+
+   // Start the hashers before the reader, which needs to know how many
+   vector<ThreadHandle> hashThreads(nHashThreads);
+   for(uint32_t i=0; i<nHashThreads; i++)
+   {
+      if(!ThreadUtils::startThread(hashThreads[pipe.numHashThreads_], 
+                                   blockLoadHashStage, &pipe))
+         break;
+      pipe.numHashThreads_++;
+   }
+
+   ThreadHandle readThread;
+   bool readStarted = (pipe.numHashThreads_ > 0 &&
+                       ThreadUtils::startThread(readThread, blockLoadReadStage, &pipe));
+   if(!readStarted)
+   {
+      cout << "***ERROR:  Could not start blockchain loading threads" << endl;
+      cerr << "***ERROR:  Could not start blockchain loading threads" << endl;
+      for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+         pipe.readQueue_.push(NULL);
+      for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+         ThreadUtils::joinThread(hashThreads[i]);
+      TIMER_STOP("ScanBlockchain");
+      return false;
+   }
+
+   // INDEX stage:  hashers finish out of order, so hold onto chunks until
+   // it's their turn
+   map<uint32_t, BlockFileChunk*> waitingChunks;
+   map<uint32_t, BlockFileChunk*>::iterator iter;
+   uint32_t nextSeq = 0;
+   uint32_t nHashersDone = 0;
+   uint64_t bytesIndexed = 0;
+   double   indexSec = 0;
+   while(nHashersDone < pipe.numHashThreads_)
+   {
+      BlockFileChunk* chunkPtr = pipe.hashedQueue_.pop();
+      if(chunkPtr == NULL)
+      {
+         nHashersDone++;
+         continue;
+      }
+      waitingChunks[chunkPtr->seq_] = chunkPtr;
+
+      while((iter = waitingChunks.find(nextSeq)) != waitingChunks.end())
+      {
+         BlockFileChunk & chunk = *(iter->second);
+         double t0 = ThreadUtils::getWallClockSec();
+         for(uint32_t b=0; b<chunk.blkOffsets_.size(); b++)
+         {
+            uint32_t blkOffset = chunk.blkOffsets_[b];
+            uint32_t blkSize   = chunk.blkSizes_[b];
+            uint8_t const * hashes = NULL;
+            if(chunk.blkFirstTx_[b] != UINT32_MAX)
+               hashes = chunk.txHashes_.getPtr() + 32*chunk.blkFirstTx_[b];
+
+            BinaryRefReader brr(chunk.rawData_.getPtr() + blkOffset + 8, blkSize);
+            parseNewBlockData(brr, 
+                              chunk.fileIndex0Idx_, 
+                              chunk.startByte_ + blkOffset + 8, 
+                              blkSize, 
+                              hashes);
+            nBlkRead++;
+         }
+         indexSec     += ThreadUtils::getWallClockSec() - t0;
+         bytesIndexed += chunk.numBytes_;
+
+         waitingChunks.erase(iter);
+         pipe.freeQueue_.push(&chunk);
+         nextSeq++;
+      }
+   }
+
+   ThreadUtils::joinThread(readThread);
+   for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+      ThreadUtils::joinThread(hashThreads[i]);
+   TIMER_STOP("ScanBlockchain");
+   double totalSec = ThreadUtils::getWallClockSec() - tStart;
+
+   // Report how each stage did.  Hash time is summed over all the hashers
+   UniversalTimer::instance().add("ReadStage",  pipe.readSec_, "LoadPipeline");
+   UniversalTimer::instance().add("HashStage",  pipe.hashSec_, "LoadPipeline");
+   UniversalTimer::instance().add("IndexStage", indexSec,      "LoadPipeline");
+   double MB = 1024.0*1024.0;
+   double hashSecPerThread = pipe.hashSec_ / pipe.numHashThreads_;
+   printf("Load pipeline:  %0.1f MB in %0.2f s  (%0.1f MB/s)\n",
+          bytesIndexed/MB, totalSec, bytesIndexed/MB/max(totalSec,1e-6));
+   printf("   Read stage:  %0.2f s busy  (%0.1f MB/s)\n",
+          pipe.readSec_, pipe.bytesRead_/MB/max(pipe.readSec_,1e-6));
+   printf("   Hash stage:  %0.2f s busy per thread  (%0.1f MB/s over %d threads)\n",
+          hashSecPerThread, pipe.bytesHashed_/MB/max(hashSecPerThread,1e-6), 
+          pipe.numHashThreads_);
+   printf("   Index stage: %0.2f s busy  (%0.1f MB/s)\n",
+          indexSec, bytesIndexed/MB/max(indexSec,1e-6));
+
+   return !pipe.readFailed_;
+}
+
+
 /////////////////////////////////////////////////////////////////////////////
 uint32_t BlockDataManager_FileRefs::parseEntireBlockchain( string   blkdir, 
                                                            uint32_t cacheSize)
@@ -2679,9 +4086,47 @@ uint32_t BlockDataManager_FileRefs::parseEntireBlockchain( string   blkdir,
    // Now we start the meat of this process...
    uint32_t nBlkRead = 0;
    uint32_t nBytesRead = 0;
-   for(uint32_t fnum=1; fnum<=highestBlkFileNum; fnum++)
+   uint32_t numSerialFiles = highestBlkFileNum;
+   bool loadedSnapshot = false;
+   if(snapshotFile_.size() > 0)
    {
-      string blkfile = blkFileList_[fnum-1];
+      TIMER_START("ReadSnapshot");
+      loadedSnapshot = readSnapshotFile(snapshotFile_);
+      TIMER_STOP("ReadSnapshot");
+   }
+
+   if(loadedSnapshot)
+   {
+      // Everything up to the snapshot is already in the maps, and the 
+      // readBlkFileUpdate calls below will get everything after it
+      nBlkRead = headerStore_.size();
+      numSerialFiles = 0;
+
+      // The snapshot doesn't have the spend index, it has to be rebuilt
+      // from the blk files before any new blocks are added to it
+      if(useSpendIndex_)
+         rebuildSpendIndex();
+
+      // Same for the UTXO set
+      if(useUtxoSet_)
+         syncUtxoSet();
+
+      // The address history is in the snapshot, unless it was written 
+      // without it
+      if(useAddrHistory_ && addrHistory_.getNumTx() != txIndex_.size())
+         rebuildAddrHistory();
+   }
+   else if(numLoadThreads_ != 1)
+   {
+      // Produces the same maps as the loop below, just spread across threads
+      if(!parseBlockFilesParallel(highestBlkFileNum, nBlkRead))
+         return 0;
+      numSerialFiles = 0;
+   }
+
+   for(uint32_t fnum=1; fnum<=numSerialFiles; fnum++)
+   {
+      string blkfile = blkFileList_[fnum-1];
       cout << "Attempting to read blockchain from file: " << blkfile.c_str() << endl;
       uint64_t filesize = BtcUtils::GetFileSize(blkfile);
       if( filesize == FILE_DOES_NOT_EXIST )
@@ -2745,22 +4190,56 @@ uint32_t BlockDataManager_FileRefs::parseEntireBlockchain( string   blkdir,
    }
 
    
-   // We need to maintain the physical size of all blkXXXX.dat files together
-   numBlkFiles_          = highestBlkFileNum;
-   totalBlockchainBytes_ = globalCache.getCumulFileSize();
-   lastBlkFileBytes_     = globalCache.getLastFileSize();
-
-   // We now have a map of all blocks, let's organize them into a chain.
-   organizeChain();
-
-   // Update registered address list so we know what's already been scanned
-   uint32_t topBlk = getTopBlockHeight() + 1;
-   allRegAddrScannedUpToBlk_ = topBlk;
-   updateRegisteredAddresses(topBlk);
+   // The snapshot already restored all of this, as of when it was written
+   if(!loadedSnapshot)
+   {
+      // We need to maintain the physical size of all blkXXXX.dat files together
+      numBlkFiles_          = highestBlkFileNum;
+      totalBlockchainBytes_ = globalCache.getCumulFileSize();
+      lastBlkFileBytes_     = globalCache.getLastFileSize();
+
+      // We now have a map of all blocks, let's organize them into a chain.
+      organizeChain();
+
+      // Take out the spends of tx that didn't make it into the main chain,
+      // and put in the ones that had to wait until we knew
+      if(useSpendIndex_)
+      {
+         vector<BlockHeader*> offMainChain = getHeadersNotOnMainChain();
+         for(uint32_t h=0; h<offMainChain.size(); h++)
+            indexBlockSpends(offMainChain[h], false);
+         spendIndex_.resolvePending(txIndex_);
+      }
+
+      // Most of the UTXO set was filled in while parsing, this backs out
+      // anything that didn't end up on the main chain and fills in the rest
+      if(useUtxoSet_)
+         syncUtxoSet();
+
+      if(useAddrHistory_)
+         addrHistory_.resolvePending(txIndex_);
+
+      // Update registered address list so we know what's already been scanned
+      uint32_t topBlk = getTopBlockHeight() + 1;
+      allRegAddrScannedUpToBlk_ = topBlk;
+      updateRegisteredAddresses(topBlk);
+   }
    
    // Since loading takes so long, there's a good chance that new block data
-   // came in... let's get it.
-   readBlkFileUpdate();
+   // came in... let's get it.  readBlkFileUpdate only moves one blk file 
+   // ahead at a time, so keep going while it's switching to a new file (an
+   // old snapshot may be a few files behind)
+   uint32_t nNewBlks = 0;
+   uint64_t prevNumBlkFiles;
+   do
+   {
+      prevNumBlkFiles = numBlkFiles_;
+      nNewBlks += readBlkFileUpdate();
+   } while(numBlkFiles_ != prevNumBlkFiles);
+
+   // Don't bother rewriting the snapshot if nothing changed since
+   if(snapshotFile_.size() > 0 && (!loadedSnapshot || nNewBlks > 0))
+      writeSnapshotFile(snapshotFile_);
 
    // Return the number of blocks read from blkfile (this includes invalids)
    isInitialized_ = true;
@@ -2916,81 +4395,1066 @@ uint32_t BlockDataManager_FileRefs::readBlkFileUpdate(void)
 
 
 ////////////////////////////////////////////////////////////////////////////////
-// BDM detects the reorg, but is wallet-agnostic so it can't update any wallets
-// You have to call this yourself after you check whether the last organizeChain
-// call indicated that a reorg happened
-void BlockDataManager_FileRefs::updateWalletAfterReorg(BtcWallet & wlt)
+////////////////////////////////////////////////////////////////////////////////
+//
+// Blockchain index snapshot
+//
+// Every parseEntireBlockchain re-reads and re-hashes every block, just to
+// rebuild the same headerStore_, txIndex_ and chain that we had last time.
+// Instead, we can dump those structures to a file and read them back on the 
+// next load.  None of it needs the blk files except for the validation, so
+// loading the snapshot is mostly just allocating map nodes.
+//
+// File layout (all integers little-endian):
+//
+//    MAGIC(8)  VERSION(4)  CHECKSUM(32)  PAYLOAD
+//
+// CHECKSUM is hash256(PAYLOAD), and the PAYLOAD is:
+//
+//    Network:     MagicBytes_(4)  GenesisHash_(32)
+//    BlkFiles:    N(4), then N x { parsedSize(4), tailDigest(32) }
+//    ChainTip:    rawHeader(80) fileIdx(2) start(4) nBytes(4)
+//    Headers:     N(4), then N x { rawHeader(80) fileIdx(2) start(4) 
+//                                  nBytes(4) height(4) diffSum(8) flags(1)
+//                                  prevIndex(4) nextIndex(4) }
+//    TxIndex:     N(4), then N x { hashPrefix(12) fileIdx(2) start(4) 
+//                                  nBytes(4) headerIndex(4) }
+//    HeaderTx:    for each header, nTx(var_int) then nTx x txIndex(4)
+//    Registered:  allRegAddrScannedUpToBlk_(4) 
+//                 N(4), then N x addr160(20)
+//                 N(4), then N x { txHash(32) txIndex(4) blkNum(4) txPos(4) }
+//                 N(4), then N x { txHash(32) txOutIndex(4) }
+//
+// Headers are written in blk-file order, and tx in txIndex_ order, so the
+// maps come back exactly as they were -- including multiple headers that 
+// point to the same TxRef (which happens on forks).  TxRefs and headers
+// reference each other by their index in those lists, and indices are 
+// UINT32_MAX for NULL.
+//
+// The parsedSize of each file is how far we had parsed it:  all of it for
+// the earlier files, lastBlkFileBytes_ for the last one.  A snapshot is only 
+// used if every earlier file still has exactly that size, the last one is
+// at least that big, the last few kB before parsedSize hash to the same 
+// tailDigest, and the chain tip header is still where we said it was.  
+// Anything else and we do a full load.  After loading the snapshot, the 
+// normal readBlkFileUpdate() picks up any blocks added after parsedSize.
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Hash of the last BDM_SNAPSHOT_DIGEST_BYTES bytes before fileSize.  Returns
+// all zeros if the file can't be read that far, which will never match.
+static BinaryData getSnapshotFileDigest(string filename, uint32_t fileSize)
 {
-   // Fix the wallet's ledger
-   for(uint32_t i=0; i<wlt.getTxLedger().size(); i++)
+   uint32_t nBytes = min(fileSize, (uint32_t)BDM_SNAPSHOT_DIGEST_BYTES);
+   BinaryData tail(nBytes);
+
+   ifstream is(filename.c_str(), ios::in | ios::binary);
+   if(!is.is_open())
+      return BinaryData(32);
+
+   is.seekg(fileSize - nBytes, ios::beg);
+   is.read((char*)tail.getPtr(), nBytes);
+   if((uint32_t)is.gcount() != nBytes)
+      return BinaryData(32);
+
+   return BtcUtils::getHash256(tail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void putSnapshotFilePtr(BinaryWriter & bw, FileDataPtr const & fdp)
+{
+   bw.put_uint16_t(fdp.getFileIndex());
+   bw.put_uint32_t(fdp.getStartByte());
+   bw.put_uint32_t(fdp.getNumBytes());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static FileDataPtr getSnapshotFilePtr(BinaryRefReader & brr)
+{
+   uint16_t fidx  = brr.get_uint16_t();
+   uint32_t start = brr.get_uint32_t();
+   uint32_t nbyte = brr.get_uint32_t();
+   return FileDataPtr(fidx, start, nbyte);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool compareHeadersByFilePos(BlockHeader* a, BlockHeader* b)
+{
+   return (a->getBlockFilePtr() < b->getBlockFilePtr());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// magic(8) version(4) hash256(payload)(32) payload, written to a temp file
+// and then moved over filename.  The old file isn't touched unless the new
+// one was written completely, and on POSIX rename() replaces it atomically.
+static bool writeChecksummedFile(string filename, 
+                                 char const * magic8, 
+                                 uint32_t version,
+                                 BinaryData const & payload)
+{
+   BinaryData checksum = BtcUtils::getHash256(payload);
+   string tempFilename = filename + ".tmp";
+   ofstream os(tempFilename.c_str(), ios::out | ios::binary);
+   if(!os.is_open())
+      return false;
+   os.write(magic8,                          8);
+   os.write((char const *)&version,          4);
+   os.write((char const *)checksum.getPtr(), 32);
+   os.write((char const *)payload.getPtr(),  payload.getSize());
+
+   // A small file can sit in the stream buffer until close(), so that's
+   // where a write error (like a full disk) shows up
+   os.close();
+   if(os.fail())
    {
-      HashString const & txHash = wlt.getTxLedger()[i].getTxHash();
-      if(txJustInvalidated_.count(txHash) > 0)
-         wlt.getTxLedger()[i].setValid(false);
+      remove(tempFilename.c_str());
+      return false;
+   }
 
-      if(txJustAffected_.count(txHash) > 0)
-         wlt.getTxLedger()[i].changeBlkNum(getTxRefPtrByHash(txHash)->getBlockHeight());
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   // Windows won't rename over an existing file
+   remove(filename.c_str());
+#endif
+   if(rename(tempFilename.c_str(), filename.c_str()) != 0)
+   {
+      remove(tempFilename.c_str());
+      return false;
    }
+   return true;
+}
 
-   // Now fix the individual address ledgers
-   for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_FileRefs::writeSnapshotFile(string filename)
+{
+   if(headerStore_.size() == 0 || numBlkFiles_ == 0 || topBlockPtr_ == NULL)
+   {
+      cout << "***ERROR:  No blockchain loaded, cannot write snapshot!" << endl;
+      cerr << "***ERROR:  No blockchain loaded, cannot write snapshot!" << endl;
+      return false;
+   }
+
+   TIMER_START("WriteSnapshot");
+   FileDataCache & globalCache = FileDataPtr::getGlobalCacheRef();
+
+   // Put the headers in blk-file order, and remember where each one went
+   vector<BlockHeader*> headerList;
+   headerList.reserve(headerStore_.size());
+   for(uint32_t i=0; i<headerStore_.size(); i++)
+      headerList.push_back(headerStore_.getHeaderByIndex(i));
+   sort(headerList.begin(), headerList.end(), compareHeadersByFilePos);
+
+   map<BlockHeader const *, uint32_t> headerIndex;
+   for(uint32_t i=0; i<headerList.size(); i++)
+      headerIndex[headerList[i]] = i;
+
+   // Roughly:  headers, plus 26 bytes for each tx and 4 for each ref to it
+   BinaryWriter bw(100*headerList.size() + 30*txIndex_.size() + 1024);
+
+   // Network
+   bw.put_BinaryData(MagicBytes_);
+   bw.put_BinaryData(GenesisHash_);
+
+   // Blk files, and how far we've parsed them
+   bw.put_uint32_t((uint32_t)numBlkFiles_);
+   for(uint32_t i=0; i<numBlkFiles_; i++)
    {
-      BtcAddress & addr = wlt.getAddrByIndex(a);
-      for(uint32_t i=0; i<addr.getTxLedger().size(); i++)
+      uint32_t parsedSize = (i+1==numBlkFiles_ ? (uint32_t)lastBlkFileBytes_ 
+                                               : globalCache.getFileSize(i));
+      bw.put_uint32_t(parsedSize);
+      bw.put_BinaryData(getSnapshotFileDigest(blkFileList_[i], parsedSize));
+   }
+
+   // Chain tip, so we can check it against the blk file before using this
+   bw.put_BinaryData(topBlockPtr_->serialize());
+   putSnapshotFilePtr(bw, topBlockPtr_->getBlockFilePtr());
+
+   // Headers
+   bw.put_uint32_t(headerList.size());
+   for(uint32_t i=0; i<headerList.size(); i++)
+   {
+      BlockHeader & bh = *headerList[i];
+      BlockHeaderMeta const & meta = *(bh.meta_);
+      bw.put_BinaryData(bh.serialize());
+      putSnapshotFilePtr(bw, meta.thisBlockFilePtr_);
+      bw.put_uint32_t(meta.blockHeight_);
+
+      uint64_t diffSumBits;
+      memcpy(&diffSumBits, &meta.difficultySum_, 8);
+      bw.put_uint64_t(diffSumBits);
+
+      bw.put_uint8_t( (meta.isMainBranch_   ? 0x01 : 0x00) |
+                      (meta.isOrphan_       ? 0x02 : 0x00) |
+                      (meta.isFinishedCalc_ ? 0x04 : 0x00) );
+      bw.put_uint32_t(meta.prevHeaderPtr_==NULL ? UINT32_MAX 
+                                                : headerIndex[meta.prevHeaderPtr_]);
+      bw.put_uint32_t(meta.nextHeaderPtr_==NULL ? UINT32_MAX 
+                                                : headerIndex[meta.nextHeaderPtr_]);
+   }
+
+   // Tx index, in the order they were added
+   bw.put_uint32_t(txIndex_.size());
+   for(uint32_t i=0; i<txIndex_.size(); i++)
+   {
+      TxRef* txptr = txIndex_.getTxRefByIndex(i);
+      bw.put_BinaryData(txptr->getHashPrefixRef().copy());
+      putSnapshotFilePtr(bw, txptr->getBlkFilePtr());
+
+      BlockHeader* bhptr = txptr->getHeaderPtr();
+      bw.put_uint32_t(bhptr==NULL ? UINT32_MAX : headerIndex[bhptr]);
+   }
+
+   // Tx list of each header
+   for(uint32_t i=0; i<headerList.size(); i++)
+   {
+      vector<TxRef*> const & txList = headerList[i]->getTxRefPtrList();
+      bw.put_var_int(txList.size());
+      for(uint32_t t=0; t<txList.size(); t++)
+         bw.put_uint32_t(txIndex_.getIndexOfTxRef(txList[t]));
+   }
+
+   // Registered addresses/tx, so we don't have to rescan for them, either
+   bw.put_uint32_t(allRegAddrScannedUpToBlk_);
+
+   bw.put_uint32_t(registeredAddrMap_.size());
+   map<HashString, RegisteredAddress>::iterator raIter;
+   for(raIter  = registeredAddrMap_.begin();
+       raIter != registeredAddrMap_.end();
+       raIter++)
+      bw.put_BinaryData(raIter->first);
+
+   bw.put_uint32_t(registeredTxList_.size());
+   list<RegisteredTx>::iterator rtIter;
+   for(rtIter  = registeredTxList_.begin();
+       rtIter != registeredTxList_.end();
+       rtIter++)
+   {
+      bw.put_BinaryData(rtIter->txHash_);
+      bw.put_uint32_t(txIndex_.getIndexOfTxRef(rtIter->txrefPtr_));
+      bw.put_uint32_t(rtIter->blkNum_);
+      bw.put_uint32_t(rtIter->txIndex_);
+   }
+
+   bw.put_uint32_t(registeredOutPoints_.size());
+   set<OutPoint>::iterator opIter;
+   for(opIter  = registeredOutPoints_.begin();
+       opIter != registeredOutPoints_.end();
+       opIter++)
+   {
+      bw.put_BinaryData(opIter->getTxHash());
+      bw.put_uint32_t(opIter->getTxOutIndex());
+   }
+
+   // Address history, if we have it (all of it, nothing pending)
+   bool saveHistory = (useAddrHistory_ && addrHistory_.getNumPending() == 0 &&
+                       addrHistory_.getNumTx() == txIndex_.size());
+   bw.put_uint8_t(saveHistory ? 1 : 0);
+   if(saveHistory)
+      addrHistory_.serialize(bw);
+
+
+   // Write to a temp file first, so we never leave a half-written snapshot
+   BinaryData const & payload = bw.getData();
+   if(!writeChecksummedFile(filename, BDM_SNAPSHOT_MAGIC, 
+                            BDM_SNAPSHOT_VERSION, payload))
+   {
+      cout << "***ERROR:  Cannot write snapshot " << filename.c_str() << endl;
+      cerr << "***ERROR:  Cannot write snapshot " << filename.c_str() << endl;
+      TIMER_STOP("WriteSnapshot");
+      return false;
+   }
+
+   cout << "Wrote blockchain snapshot: " << headerList.size() << " headers, "
+        << txIndex_.size() << " tx, " << payload.getSize()/(1024*1024.0) 
+        << " MB" << endl;
+   TIMER_STOP("WriteSnapshot");
+   return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_FileRefs::readSnapshotFile(string filename)
+{
+   uint64_t snapSize = BtcUtils::GetFileSize(filename);
+   if(snapSize == FILE_DOES_NOT_EXIST)
+   {
+      cout << "No blockchain snapshot yet, doing a full load" << endl;
+      return false;
+   }
+
+   if(snapSize < 44 || snapSize > UINT32_MAX)
+   {
+      cout << "Blockchain snapshot is corrupt, doing a full load" << endl;
+      return false;
+   }
+
+   BinaryData snapData((uint32_t)snapSize);
+   ifstream is(filename.c_str(), ios::in | ios::binary);
+   is.read((char*)snapData.getPtr(), snapSize);
+   if((uint64_t)is.gcount() != snapSize)
+   {
+      cout << "Could not read blockchain snapshot, doing a full load" << endl;
+      return false;
+   }
+   is.close();
+
+   BinaryRefReader brr(snapData);
+   BinaryData magic((uint8_t const *)BDM_SNAPSHOT_MAGIC, 8);
+   if(!(brr.get_BinaryDataRef(8) == magic.getRef()))
+   {
+      cout << "Not a blockchain snapshot file, doing a full load" << endl;
+      return false;
+   }
+
+   uint32_t version = brr.get_uint32_t();
+   if(version != BDM_SNAPSHOT_VERSION)
+   {
+      cout << "Blockchain snapshot is version " << version << ", we need "
+           << BDM_SNAPSHOT_VERSION << ".  Doing a full load" << endl;
+      return false;
+   }
+
+   BinaryData checksum = brr.get_BinaryDataRef(32);
+   BinaryDataRef payload(brr.getCurrPtr(), brr.getSizeRemaining());
+   if(!(BtcUtils::getHash256(payload) == checksum))
+   {
+      cout << "Blockchain snapshot is corrupt, doing a full load" << endl;
+      return false;
+   }
+
+   // From here on, the checksum guarantees the data is exactly what we
+   // wrote, so the only checks are whether it's still valid for our files.
+   brr = BinaryRefReader(payload);
+   if(payload.getSize() < 36+4 ||
+      !(brr.get_BinaryDataRef(4)  == MagicBytes_.getRef()) ||
+      !(brr.get_BinaryDataRef(32) == GenesisHash_.getRef()) )
+   {
+      cout << "Blockchain snapshot is for another network, doing a full load" << endl;
+      return false;
+   }
+
+   uint32_t numFiles = brr.get_uint32_t();
+   if(numFiles == 0 || numFiles > blkFileList_.size())
+   {
+      cout << "Blockchain snapshot has more blk files than we do, "
+           << "doing a full load" << endl;
+      return false;
+   }
+
+   vector<uint32_t> parsedSizes(numFiles);
+   for(uint32_t i=0; i<numFiles; i++)
+   {
+      parsedSizes[i] = brr.get_uint32_t();
+      BinaryData digest = brr.get_BinaryDataRef(32);
+
+      // Only the last file should have grown since the snapshot
+      uint64_t currSize = BtcUtils::GetFileSize(blkFileList_[i]);
+      bool sizeOkay = (i+1==numFiles ? currSize >= parsedSizes[i] 
+                                     : currSize == parsedSizes[i]);
+      if(!sizeOkay || 
+         !(getSnapshotFileDigest(blkFileList_[i], parsedSizes[i]) == digest))
       {
-         HashString const & txHash = addr.getTxLedger()[i].getTxHash();
-         if(txJustInvalidated_.count(txHash) > 0)
-            addr.getTxLedger()[i].setValid(false);
-   
-         if(txJustAffected_.count(txHash) > 0) 
-            addr.getTxLedger()[i].changeBlkNum(getTxRefPtrByHash(txHash)->getBlockHeight());
+         cout << "Blockchain snapshot does not match " 
+              << blkFileList_[i].c_str() << ", doing a full load" << endl;
+         return false;
       }
    }
+
+   // Make sure the chain tip is still sitting where we said it was
+   BinaryData tipRaw = brr.get_BinaryDataRef(HEADER_SIZE);
+   FileDataPtr tipFdp = getSnapshotFilePtr(brr);
+   if(tipFdp.getFileIndex() >= numFiles ||
+      (uint64_t)tipFdp.getStartByte() + 8 + HEADER_SIZE > parsedSizes[tipFdp.getFileIndex()])
+   {
+      cout << "Blockchain snapshot is corrupt, doing a full load" << endl;
+      return false;
+   }
+
+   BinaryData tipOnDisk(HEADER_SIZE);
+   is.clear();
+   is.open(blkFileList_[tipFdp.getFileIndex()].c_str(), ios::in | ios::binary);
+   is.seekg(tipFdp.getStartByte() + 8, ios::beg);
+   is.read((char*)tipOnDisk.getPtr(), HEADER_SIZE);
+   is.close();
+   if(!(tipOnDisk == tipRaw))
+   {
+      cout << "Blockchain snapshot top block is not in the blk files, "
+           << "doing a full load" << endl;
+      return false;
+   }
+
+
+   // It's a match, restore everything.
+   headerStore_.clear();
+   txIndex_.clear();
+   headersByHeight_.clear();
+   topBlockPtr_ = NULL;
+   genBlockPtr_ = NULL;
+
+   // Headers -- prev/next can point forward in the list, so link them after
+   uint32_t numHeaders = brr.get_uint32_t();
+   vector<BlockHeader*> headerList(numHeaders);
+   vector<uint32_t> prevIndex(numHeaders);
+   vector<uint32_t> nextIndex(numHeaders);
+   for(uint32_t i=0; i<numHeaders; i++)
+   {
+      BlockHeader* bhptr = headerStore_.insertHeader(brr.getCurrPtr());
+      brr.advance(HEADER_SIZE);
+      headerList[i] = bhptr;
+
+      BlockHeaderMeta & meta = *(bhptr->meta_);
+      meta.thisBlockFilePtr_ = getSnapshotFilePtr(brr);
+      meta.blockHeight_      = brr.get_uint32_t();
+
+      uint64_t diffSumBits = brr.get_uint64_t();
+      memcpy(&meta.difficultySum_, &diffSumBits, 8);
+
+      uint8_t flags = brr.get_uint8_t();
+      meta.isMainBranch_   = (flags & 0x01) != 0;
+      meta.isOrphan_       = (flags & 0x02) != 0;
+      meta.isFinishedCalc_ = (flags & 0x04) != 0;
+      prevIndex[i] = brr.get_uint32_t();
+      nextIndex[i] = brr.get_uint32_t();
+   }
+   orphanHeaderPtrs_.clear();
+   for(uint32_t i=0; i<numHeaders; i++)
+   {
+      BlockHeaderMeta & meta = *(headerList[i]->meta_);
+      meta.prevHeaderPtr_ = (prevIndex[i] < numHeaders ? headerList[prevIndex[i]] : NULL);
+      meta.nextHeaderPtr_ = (nextIndex[i] < numHeaders ? headerList[nextIndex[i]] : NULL);
+
+      // Never traced down to genesis, so the next block might fix that
+      if(meta.difficultySum_ < 0)
+         orphanHeaderPtrs_.push_back(headerList[i]);
+   }
+
+   // Tx index -- adding them in the same order gives them the same indices
+   uint32_t numTx = brr.get_uint32_t();
+   for(uint32_t i=0; i<numTx; i++)
+   {
+      uint8_t const * hashPrefix = brr.getCurrPtr();
+      brr.advance(TXREF_HASH_PREFIX_BYTES);
+      FileDataPtr fdp = getSnapshotFilePtr(brr);
+      uint32_t hidx = brr.get_uint32_t();
+      txIndex_.insertTxRef(hashPrefix, fdp, 
+                           hidx < numHeaders ? headerList[hidx] : NULL);
+   }
+   numTx = txIndex_.size();
+
+   // Tx list of each header
+   for(uint32_t i=0; i<numHeaders; i++)
+   {
+      vector<TxRef*> & txPtrList = headerList[i]->getTxRefPtrList();
+      txPtrList.resize((uint32_t)brr.get_var_int());
+      for(uint32_t t=0; t<txPtrList.size(); t++)
+      {
+         uint32_t tidx = brr.get_uint32_t();
+         txPtrList[t] = (tidx < numTx ? txIndex_.getTxRefByIndex(tidx) : NULL);
+      }
+   }
+
+   // Chain organization:  rebuild headersByHeight_ from the tip down
+   topBlockPtr_ = headerStore_.findHeader(BtcUtils::getHash256(tipRaw).getPtr());
+   if(topBlockPtr_ == NULL)
+   {
+      cout << "***ERROR:  Blockchain snapshot is missing its top block!" << endl;
+      headerStore_.clear();
+      txIndex_.clear();
+      return false;
+   }
+   prevTopBlockPtr_ = topBlockPtr_;
+   headersByHeight_.resize(topBlockPtr_->getBlockHeight()+1);
+   BlockHeader* thisHeaderPtr = topBlockPtr_;
+   while(true)
+   {
+      headersByHeight_[thisHeaderPtr->getBlockHeight()] = thisHeaderPtr;
+      if(thisHeaderPtr->getBlockHeight() == 0)
+         break;
+
+      thisHeaderPtr = thisHeaderPtr->meta_->prevHeaderPtr_;
+      if(thisHeaderPtr == NULL)
+      {
+         cout << "***ERROR:  Blockchain snapshot has a broken chain!" << endl;
+         headerStore_.clear();
+         txIndex_.clear();
+         headersByHeight_.clear();
+         topBlockPtr_ = NULL;
+         return false;
+      }
+   }
+
+
+   // Registered-address scan results.  Addresses that were registered when
+   // the snapshot was written are good up to the same block they were then.
+   // Any others just keep their creation block, and will get rescanned 
+   // from there, same as if they were registered after the load.
+   uint32_t snapScannedUpToBlk = brr.get_uint32_t();
+   uint32_t numRegAddr = brr.get_uint32_t();
+   for(uint32_t i=0; i<numRegAddr; i++)
+   {
+      HashString addr160 = brr.get_BinaryDataRef(20);
+      map<HashString, RegisteredAddress>::iterator raIter;
+      raIter = registeredAddrMap_.find(addr160);
+      if(raIter != registeredAddrMap_.end())
+         raIter->second.alreadyScannedUpToBlk_ = snapScannedUpToBlk;
+   }
+   allRegAddrScannedUpToBlk_ = min(snapScannedUpToBlk, evalLowestBlockNextScan());
+
+   uint32_t numRegTx = brr.get_uint32_t();
+   for(uint32_t i=0; i<numRegTx; i++)
+   {
+      HashString txHash = brr.get_BinaryDataRef(32);
+      uint32_t tidx     = brr.get_uint32_t();
+      uint32_t blkNum   = brr.get_uint32_t();
+      uint32_t txIndex  = brr.get_uint32_t();
+      if(tidx >= numTx || registeredTxSet_.insert(txHash).second == false)
+         continue;
+
+      registeredTxList_.push_back(RegisteredTx(txIndex_.getTxRefByIndex(tidx), txHash, blkNum, txIndex));
+   }
+
+   uint32_t numRegOutPoints = brr.get_uint32_t();
+   for(uint32_t i=0; i<numRegOutPoints; i++)
+   {
+      HashString txHash = brr.get_BinaryDataRef(32);
+      insertRegisteredOutPoint(OutPoint(txHash, brr.get_uint32_t()));
+   }
+
+   // If there's no address history in here (or it doesn't fit the tx), 
+   // the caller rebuilds it
+   addrHistory_.clear();
+   if(brr.get_uint8_t() == 1 && useAddrHistory_)
+   {
+      if(!addrHistory_.unserialize(brr) || addrHistory_.getNumTx() != numTx)
+         addrHistory_.clear();
+   }
+
+
+   // Now pretend we parsed exactly up to where the snapshot was written
+   blkFileList_.resize(numFiles);
+   numBlkFiles_          = numFiles;
+   lastBlkFileBytes_     = parsedSizes[numFiles-1];
+   totalBlockchainBytes_ = FileDataPtr::getGlobalCacheRef().getCumulFileSize();
+
+   cout << "Loaded blockchain snapshot: " << numHeaders << " headers, " 
+        << numTx << " tx, top block " << getTopBlockHeight() << endl;
+   return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// Wallet scan state
+//
+// The snapshot gets the BDM going without re-reading the blockchain, but a
+// wallet still has to be scanned from block 0 before its ledger and balance
+// are there.  That's a pass over every registered tx (and over the whole
+// blockchain, for any address that isn't registered yet).  So we save what 
+// the scan put in the wallet too, and next time only the blocks after it 
+// need to be scanned.
+//
+// File layout is the same as the snapshot, with a different MAGIC/VERSION:
+//
+//    MAGIC(8)  VERSION(4)  CHECKSUM(32)  PAYLOAD
+//
+// and the PAYLOAD is:
+//
+//    Network:     MagicBytes_(4)  GenesisHash_(32)
+//    ChainTip:    scannedUpToBlk(4)  hash of block scannedUpToBlk-1 (32)
+//    TxIOs:       N(4), then N x { outPoint(36) txio }
+//    NonStdTxIOs: N(4), then N x { outPoint(36) txio }
+//    NonStdUtxos: N(4), then N x outPoint(36)
+//    Addresses:   N(4), then N x { addr(var_str) firstBlk(4) firstTime(4)
+//                                  lastBlk(4) lastTime(4)
+//                                  M(4), then M x txioIndex(4)
+//                                  ledger }
+//    Ledger:      the wallet ledger
+//
+// where a txio is amount(8) flags(1) [txOutPrefix(12) txOutIdx(4)]
+// [txInPrefix(12) txInIdx(4)], a ledger is N(4) then N x { addr(var_str)
+// value(8) blkNum(4) txHash(32) index(4) txTime(8) flags(1) color(4) },
+// and txioIndex is the position of the txio in the TxIOs list.
+//
+// The chain tip hash is what ties the state to the blockchain.  If that 
+// block is still in the main chain, we just continue after it.  If it isn't
+// (there was a reorg while we weren't running), the tx in the blocks that
+// dropped out of the main chain are marked invalid or moved, the same way 
+// updateWalletsAfterReorg would have done it, and we continue after the 
+// branch point.  Anything else and the wallet is scanned from the start.
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Puts the whole file in fileData, and returns a ref to the payload in it.
+// The ref is empty if it's not a wallet state file we can use.
+static BinaryDataRef readWalletStateFile(string filename, BinaryData & fileData)
+{
+   uint64_t fileSize = BtcUtils::GetFileSize(filename);
+   if(fileSize == FILE_DOES_NOT_EXIST || fileSize < 44 || fileSize > UINT32_MAX)
+      return BinaryDataRef();
+
+   fileData.resize((uint32_t)fileSize);
+   ifstream is(filename.c_str(), ios::in | ios::binary);
+   is.read((char*)fileData.getPtr(), fileSize);
+   if((uint64_t)is.gcount() != fileSize)
+      return BinaryDataRef();
+   is.close();
+
+   BinaryRefReader brr(fileData);
+   BinaryData magic((uint8_t const *)WALLET_STATE_MAGIC, 8);
+   if(!(brr.get_BinaryDataRef(8) == magic.getRef()) ||
+      brr.get_uint32_t() != WALLET_STATE_VERSION)
+      return BinaryDataRef();
+
+   BinaryData checksum = brr.get_BinaryDataRef(32);
+   BinaryDataRef payload(brr.getCurrPtr(), brr.getSizeRemaining());
+   if(!(BtcUtils::getHash256(payload) == checksum))
+      return BinaryDataRef();
+
+   return payload;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_FileRefs::writeWalletState(BtcWallet & wlt, string filename)
+{
+   uint32_t scannedUpTo = wlt.getScannedUpToBlk();
+   if(scannedUpTo == 0 || scannedUpTo > headersByHeight_.size())
+   {
+      cout << "***ERROR:  Wallet has not been scanned, cannot write its state!" << endl;
+      cerr << "***ERROR:  Wallet has not been scanned, cannot write its state!" << endl;
+      return false;
+   }
+
+   TIMER_START("WriteWalletState");
+   BinaryWriter bw;
+   bw.put_BinaryData(MagicBytes_);
+   bw.put_BinaryData(GenesisHash_);
+   bw.put_uint32_t(scannedUpTo);
+   bw.put_BinaryData(headersByHeight_[scannedUpTo-1]->getThisHash());
+   wlt.serializeState(bw);
+
+   if(!writeChecksummedFile(filename, WALLET_STATE_MAGIC, 
+                            WALLET_STATE_VERSION, bw.getData()))
+   {
+      cout << "***ERROR:  Cannot write wallet state " << filename.c_str() << endl;
+      cerr << "***ERROR:  Cannot write wallet state " << filename.c_str() << endl;
+      TIMER_STOP("WriteWalletState");
+      return false;
+   }
+   TIMER_STOP("WriteWalletState");
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t BlockDataManager_FileRefs::readWalletState(BtcWallet & wlt, string filename)
+{
+   BinaryData fileData;
+   BinaryDataRef payload = readWalletStateFile(filename, fileData);
+   if(payload.getSize() < 36+4+32)
+   {
+      cout << "No usable wallet state in " << filename.c_str() 
+           << ", wallet needs a full scan" << endl;
+      wlt.clearBlkData();
+      return 0;
+   }
+
+   TIMER_START("ReadWalletState");
+   BinaryRefReader brr(payload);
+   bool isOurNetwork = (brr.get_BinaryDataRef(4)  == MagicBytes_.getRef() &&
+                        brr.get_BinaryDataRef(32) == GenesisHash_.getRef());
+   uint32_t scannedUpTo = brr.get_uint32_t();
+   BlockHeader* tipPtr = getHeaderByHash(brr.get_BinaryDataRef(32));
+   if(!isOurNetwork || tipPtr == NULL || !wlt.unserializeState(brr))
+   {
+      cout << "Wallet state does not fit this wallet or blockchain, "
+           << "wallet needs a full scan" << endl;
+      wlt.clearBlkData();
+      TIMER_STOP("ReadWalletState");
+      return 0;
+   }
+
+   // If the tip isn't on the main chain anymore, walk back to where it
+   // branches off and fix up whatever was in the blocks in between
+   uint32_t startBlk = scannedUpTo;
+   if(!tipPtr->isMainBranch())
+   {
+      set<HashString> txInvalid;
+      map<HashString, uint32_t> newHeights;
+      BlockHeader* thisHeaderPtr = tipPtr;
+      while(thisHeaderPtr != NULL && !thisHeaderPtr->isMainBranch())
+      {
+         vector<TxRef*> & txList = thisHeaderPtr->getTxRefPtrList();
+         for(uint32_t i=0; i<txList.size(); i++)
+         {
+            // Same as reassessAfterReorg:  tx in both branches are only
+            // moved, the rest are invalid (and get UINT32_MAX for a height)
+            HashString txHash = txList[i]->getThisHash();
+            newHeights[txHash] = txList[i]->getBlockHeight();
+            if(!txList[i]->isMainBranch())
+               txInvalid.insert(txHash);
+         }
+         thisHeaderPtr = getHeaderByHash(thisHeaderPtr->getPrevHash());
+      }
+
+      if(thisHeaderPtr == NULL)
+      {
+         cout << "Wallet state is on a chain we don't have, "
+              << "wallet needs a full scan" << endl;
+         wlt.clearBlkData();
+         TIMER_STOP("ReadWalletState");
+         return 0;
+      }
+
+      wlt.updateLedgersAfterReorg(txInvalid, newHeights);
+      startBlk = thisHeaderPtr->getBlockHeight() + 1;
+      cout << "Wallet state was saved on a chain that has been reorganized, " 
+           << txInvalid.size() << " tx invalidated" << endl;
+   }
+   wlt.setScannedUpToBlk(startBlk);
+
+   // The registered tx/outpoints have to know about everything the wallet
+   // already has, before its addresses can count as scanned up to startBlk
+   if(!walletIsRegistered(wlt))
+      registerWallet(&wlt);
+
+   vector<LedgerEntry> ledger = wlt.getTxLedger();
+   for(uint32_t i=0; i<ledger.size(); i++)
+      if(getTxRefPtrByHash(ledger[i].getTxHash()) != NULL)
+         insertRegisteredTxIfNew(ledger[i].getTxHash());
+
+   map<OutPoint, TxIOPair>::iterator iter;
+   for(iter = wlt.getTxIOMap().begin(); iter != wlt.getTxIOMap().end(); iter++)
+      insertRegisteredOutPoint(iter->first);
+   for(iter  = wlt.getNonStdTxIO().begin(); 
+       iter != wlt.getNonStdTxIO().end(); 
+       iter++)
+   {
+      insertRegisteredTxIfNew(iter->first.getTxHash());
+      insertRegisteredOutPoint(iter->first);
+   }
+
+   for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+   {
+      map<HashString, RegisteredAddress>::iterator raIter;
+      raIter = registeredAddrMap_.find(wlt.getAddrByIndex(a).getAddrStr20());
+      if(raIter != registeredAddrMap_.end())
+         raIter->second.alreadyScannedUpToBlk_ = 
+                        max(raIter->second.alreadyScannedUpToBlk_, startBlk);
+   }
+   allRegAddrScannedUpToBlk_ = evalLowestBlockNextScan();
+
+   cout << "Loaded wallet state: " << wlt.getTxIOMap().size() << " txios, "
+        << ledger.size() << " ledger entries, scanning from block " 
+        << startBlk << endl;
+   TIMER_STOP("ReadWalletState");
+   return startBlk;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// BDM detects the reorg, but is wallet-agnostic so it can't update any wallets
+// You have to call this yourself after you check whether the last organizeChain
+// call indicated that a reorg happened
+void BlockDataManager_FileRefs::updateWalletAfterReorg(BtcWallet & wlt)
+{
+   vector<BtcWallet*> wltvect(1, &wlt);
+   updateWalletsAfterReorg(wltvect);
 }
 
 
 /////////////////////////////////////////////////////////////////////////////
+// The new height of each affected tx is looked up once, not once for every
+// ledger entry of every wallet it's in
 void BlockDataManager_FileRefs::updateWalletsAfterReorg(vector<BtcWallet*> wltvect)
 {
+   map<HashString, uint32_t> newHeights;
+   set<HashString>::iterator iter;
+   for(iter = txJustAffected_.begin(); iter != txJustAffected_.end(); iter++)
+   {
+      TxRef* txref = getTxRefPtrByHash(*iter);
+      if(txref != NULL)
+         newHeights[*iter] = txref->getBlockHeight();
+   }
+
    for(uint32_t i=0; i<wltvect.size(); i++)
-      updateWalletAfterReorg(*wltvect[i]);
+   {
+      wltvect[i]->updateLedgersAfterReorg(txJustInvalidated_, newHeights);
+
+      // Nothing after the branch point counts as scanned anymore
+      if(reorgBranchPoint_ != NULL)
+         wltvect[i]->setScannedUpToBlk(
+                         min(wltvect[i]->getScannedUpToBlk(),
+                             reorgBranchPoint_->getBlockHeight()+1));
+   }
 }
 
 /////////////////////////////////////////////////////////////////////////////
 void BlockDataManager_FileRefs::updateWalletsAfterReorg(set<BtcWallet*> wltset)
 {
-   set<BtcWallet*>::iterator iter;
-   for(iter = wltset.begin(); iter != wltset.end(); iter++)
-      updateWalletAfterReorg(**iter);
+   vector<BtcWallet*> wltvect(wltset.begin(), wltset.end());
+   updateWalletsAfterReorg(wltvect);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// What verifyBlkFileIntegrity found wrong with a block
+#define BLK_INTEGRITY_BAD_MERKLE   0x01
+#define BLK_INTEGRITY_BAD_POW      0x02
+#define BLK_INTEGRITY_BAD_TXDATA   0x04
+
+/////////////////////////////////////////////////////////////////////////////
+// The tx hashes come from the same code the parallel loader uses, then all
+// the header hashes are done in one more batch, and each block's merkle
+// root is rebuilt from its tx hashes
+static void verifyBlockFileChunk(BlockFileChunk & chunk)
+{
+   hashBlockFileChunk(chunk);
+
+   uint32_t nBlk = chunk.blkOffsets_.size();
+   vector<uint8_t const *> hdrPtrs(nBlk);
+   vector<uint32_t>        hdrSizes(nBlk);
+   for(uint32_t b=0; b<nBlk; b++)
+   {
+      hdrPtrs[b]  = chunk.rawData_.getPtr() + chunk.blkOffsets_[b] + 8;
+      hdrSizes[b] = min(chunk.blkSizes_[b], (uint32_t)HEADER_SIZE);
+   }
+   chunk.blkHashes_.resize(32*nBlk);
+   Sha256::doubleHashBatch(&hdrPtrs[0], &hdrSizes[0], nBlk, chunk.blkHashes_.getPtr());
+
+   chunk.blkStatus_.assign(nBlk, 0);
+   for(uint32_t b=0; b<nBlk; b++)
+   {
+      if(hdrSizes[b] < HEADER_SIZE)
+      {
+         chunk.blkStatus_[b] = BLK_INTEGRITY_BAD_TXDATA;
+         continue;
+      }
+
+      BinaryDataRef hdr(hdrPtrs[b], HEADER_SIZE);
+      BinaryDataRef hash(chunk.blkHashes_.getPtr() + 32*b, 32);
+      if(!BtcUtils::verifyProofOfWork(hdr, hash))
+         chunk.blkStatus_[b] |= BLK_INTEGRITY_BAD_POW;
+
+      uint32_t nTx = (uint32_t)BtcUtils::readVarInt(hdrPtrs[b] + HEADER_SIZE);
+      if(chunk.blkFirstTx_[b] == UINT32_MAX || nTx == 0)
+      {
+         chunk.blkStatus_[b] |= BLK_INTEGRITY_BAD_TXDATA;
+         continue;
+      }
+
+      BinaryData merkleRoot = BtcUtils::calculateMerkleRoot(
+                  chunk.txHashes_.getPtr() + 32*chunk.blkFirstTx_[b], nTx);
+      if(memcmp(merkleRoot.getPtr(), hdrPtrs[b] + 36, 32) != 0)
+         chunk.blkStatus_[b] |= BLK_INTEGRITY_BAD_MERKLE;
+   }
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// VERIFY stage, takes the place of the HASH stage in the load pipeline
+static void* blockVerifyStage(void* pipePtr)
+{
+   BlockLoadPipeline & pipe = *(BlockLoadPipeline*)pipePtr;
+   while(true)
+   {
+      BlockFileChunk* chunk = pipe.readQueue_.pop();
+      if(chunk == NULL)
+         break;
+
+      // After a cancel, just hand back whatever was already read
+      if(!pipe.isCancelled())
+         verifyBlockFileChunk(*chunk);
+      pipe.hashedQueue_.push(chunk);
+   }
+
+   pipe.hashedQueue_.push(NULL);
+   return NULL;
 }
 
 /////////////////////////////////////////////////////////////////////////////
-bool BlockDataManager_FileRefs::verifyBlkFileIntegrity(void)
-{
-   PDEBUG("Verifying blk0001.dat integrity");
-   bool isGood = true;
-   map<HashString, BlockHeader>::iterator headIter;
-   for(headIter  = headerMap_.begin();
-       headIter != headerMap_.end();
-       headIter++)
-   {
-      BlockHeader & bhr = headIter->second;
-      bool thisHeaderIsGood = bhr.verifyIntegrity();
-      if( !thisHeaderIsGood )
+// This used to walk the header map and re-read every tx through its TxRef,
+// one block at a time.  Now it reads the blk files straight through with
+// the same READ stage as the parallel loader, and the checking is spread
+// over the other threads.  The chunks come back here in whatever order
+// they finish, which doesn't matter since the failures get sorted.
+bool BlockDataManager_FileRefs::verifyBlkFileIntegrity(uint32_t nThreads)
+{
+   PDEBUG("Verifying blk file integrity");
+   if(blkFileList_.size() == 0)
+   {
+      cout << "***ERROR:  No blk files to verify, load the blockchain first" << endl;
+      cerr << "***ERROR:  No blk files to verify, load the blockchain first" << endl;
+      return false;
+   }
+
+   if(nThreads == 0)
+      nThreads = ThreadUtils::getNumCores();
+   uint32_t nVerifyThreads = (nThreads>1 ? nThreads-1 : 1);
+
+   uint64_t totalBytes = 0;
+   for(uint32_t f=0; f<blkFileList_.size(); f++)
+   {
+      uint64_t filesize = BtcUtils::GetFileSize(blkFileList_[f]);
+      if(filesize != FILE_DOES_NOT_EXIST)
+         totalBytes += filesize;
+   }
+
+   integrityMutex_.lock();
+   integrityBytesTotal_ = totalBytes;
+   integrityBytesDone_  = 0;
+   integrityBlocksDone_ = 0;
+   integrityCancel_     = false;
+   integrityFailures_.clear();
+   integrityMutex_.unlock();
+
+   uint32_t ringSize = 2*nVerifyThreads + 2;
+   BlockLoadPipeline pipe(ringSize, nVerifyThreads);
+   pipe.blkFileList_ = blkFileList_;
+   pipe.magicBytes_  = MagicBytes_;
+   pipe.cancelFlag_  = &integrityCancel_;
+   vector<BlockFileChunk> ring(ringSize);
+   for(uint32_t i=0; i<ringSize; i++)
+      pipe.freeQueue_.push(&ring[i]);
+
+   cout << "Verifying blk files using " << nVerifyThreads << " threads" << endl;
+   double tStart = ThreadUtils::getWallClockSec();
+
+   vector<ThreadHandle> verifyThreads(nVerifyThreads);
+   for(uint32_t i=0; i<nVerifyThreads; i++)
+   {
+      if(!ThreadUtils::startThread(verifyThreads[pipe.numHashThreads_], 
+                                   blockVerifyStage, &pipe))
+         break;
+      pipe.numHashThreads_++;
+   }
+
+   ThreadHandle readThread;
+   bool readStarted = (pipe.numHashThreads_ > 0 &&
+                       ThreadUtils::startThread(readThread, blockLoadReadStage, &pipe));
+   if(!readStarted)
+   {
+      cout << "***ERROR:  Could not start blk file verification threads" << endl;
+      cerr << "***ERROR:  Could not start blk file verification threads" << endl;
+      for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+         pipe.readQueue_.push(NULL);
+      for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+         ThreadUtils::joinThread(verifyThreads[i]);
+      return false;
+   }
+
+   uint32_t nVerifiersDone = 0;
+   while(nVerifiersDone < pipe.numHashThreads_)
+   {
+      BlockFileChunk* chunkPtr = pipe.hashedQueue_.pop();
+      if(chunkPtr == NULL)
       {
-         cout << "Blockfile contains incorrect header or tx data:" << endl;
-         cout << "  Block number:    " << bhr.getBlockHeight() << endl;
-         cout << "  Block hash (BE):   " << endl;
-         cout << "    " << bhr.getThisHash().copySwapEndian().toHexStr() << endl;
-         cout << "  Num Tx :         " << bhr.getNumTx() << endl;
-         cout << "  Tx Hash List: (compare to raw tx data on blockexplorer)" << endl;
-         for(uint32_t t=0; t<bhr.getNumTx(); t++)
-            cout << "    " << bhr.getTxRefPtrList()[t]->getThisHash().copySwapEndian().toHexStr() << endl;
+         nVerifiersDone++;
+         continue;
       }
-      isGood = isGood && thisHeaderIsGood;
+
+      BlockFileChunk & chunk = *chunkPtr;
+      if(integrityCancel_)
+      {
+         pipe.freeQueue_.push(chunkPtr);
+         continue;
+      }
+
+      vector<BlockIntegrityFailure> newFailures;
+      for(uint32_t b=0; b<chunk.blkOffsets_.size(); b++)
+      {
+         uint8_t status = chunk.blkStatus_[b];
+         if(status == 0)
+            continue;
+
+         BlockIntegrityFailure fail;
+         fail.fileIndex0Idx_  = chunk.fileIndex0Idx_;
+         fail.fileOffset_     = chunk.startByte_ + chunk.blkOffsets_[b] + 8;
+         fail.blockHash_      = chunk.blkHashes_.getSliceCopy(32*b, 32);
+         fail.badMerkleRoot_  = (status & BLK_INTEGRITY_BAD_MERKLE) != 0;
+         fail.badProofOfWork_ = (status & BLK_INTEGRITY_BAD_POW)    != 0;
+         fail.badTxData_      = (status & BLK_INTEGRITY_BAD_TXDATA) != 0;
+         BlockHeader* bhptr = getHeaderByHash(fail.blockHash_);
+         if(bhptr != NULL)
+            fail.blockHeight_ = bhptr->getBlockHeight();
+         newFailures.push_back(fail);
+      }
+
+      integrityMutex_.lock();
+      integrityBytesDone_  += chunk.numBytes_;
+      integrityBlocksDone_ += chunk.blkOffsets_.size();
+      integrityFailures_.insert(integrityFailures_.end(), 
+                                newFailures.begin(), newFailures.end());
+      integrityMutex_.unlock();
+
+      pipe.freeQueue_.push(chunkPtr);
+   }
+
+   ThreadUtils::joinThread(readThread);
+   for(uint32_t i=0; i<pipe.numHashThreads_; i++)
+      ThreadUtils::joinThread(verifyThreads[i]);
+
+   integrityMutex_.lock();
+   sort(integrityFailures_.begin(), integrityFailures_.end());
+   if(!integrityCancel_ && !pipe.readFailed_)
+      integrityBytesDone_ = integrityBytesTotal_;
+   vector<BlockIntegrityFailure> failures = integrityFailures_;
+   uint32_t nBlocksDone = integrityBlocksDone_;
+   integrityMutex_.unlock();
+
+   for(uint32_t i=0; i<failures.size(); i++)
+   {
+      BlockIntegrityFailure & fail = failures[i];
+      cout << "Blockfile contains incorrect header or tx data:" << endl;
+      cout << "  File, offset:    " << blkFileList_[fail.fileIndex0Idx_].c_str() 
+                                    << ", " << fail.fileOffset_ << endl;
+      if(fail.blockHeight_ == UINT32_MAX)
+         cout << "  Block number:    (unknown, orphan or not in the header map)" << endl;
+      else
+         cout << "  Block number:    " << fail.blockHeight_ << endl;
+      cout << "  Block hash (BE):   " << endl;
+      cout << "    " << fail.blockHash_.copySwapEndian().toHexStr() << endl;
+      cout << "  Problem:        " 
+           << (fail.badMerkleRoot_  ? " merkle-root"   : "")
+           << (fail.badProofOfWork_ ? " proof-of-work" : "")
+           << (fail.badTxData_      ? " tx-data"       : "") << endl;
    }
-   return isGood;
+
+   bool cancelled = integrityCancel_;
+   printf("Verified %d blocks in %0.2f s, %d bad%s\n", 
+          nBlocksDone, ThreadUtils::getWallClockSec() - tStart, 
+          (int)failures.size(), (cancelled ? " (cancelled)" : ""));
    PDEBUG("Done verifying blockfile integrity");
+   return (failures.size() == 0 && !cancelled && !pipe.readFailed_);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+double BlockDataManager_FileRefs::getIntegrityCheckProgress(void)
+{
+   integrityMutex_.lock();
+   double progress = (integrityBytesTotal_ == 0 ? 0.0 : 
+                      (double)integrityBytesDone_ / (double)integrityBytesTotal_);
+   integrityMutex_.unlock();
+   return progress;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+uint32_t BlockDataManager_FileRefs::getIntegrityCheckBlocksDone(void)
+{
+   integrityMutex_.lock();
+   uint32_t nBlocks = integrityBlocksDone_;
+   integrityMutex_.unlock();
+   return nBlocks;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+vector<BlockIntegrityFailure> BlockDataManager_FileRefs::getIntegrityFailures(void)
+{
+   integrityMutex_.lock();
+   vector<BlockIntegrityFailure> failures = integrityFailures_;
+   integrityMutex_.unlock();
+   return failures;
 }
 
 
@@ -3001,7 +5465,8 @@ bool BlockDataManager_FileRefs::verifyBlkFileIntegrity(void)
 bool BlockDataManager_FileRefs::parseNewBlockData(BinaryRefReader & brr,
                                                   uint32_t fileIndex0Idx,
                                                   uint32_t thisHeaderOffset,
-                                                  uint32_t blockSize)
+                                                  uint32_t blockSize,
+                                                  uint8_t const * preCalcTxHashes)
 {
    if(brr.getSizeRemaining() < blockSize || brr.isEndOfStream())
    {
@@ -3010,20 +5475,9 @@ bool BlockDataManager_FileRefs::parseNewBlockData(BinaryRefReader & brr,
       return false;
    }
 
-   // Create the objects once that will be used for insertion
-   // (txInsResult always succeeds--because multimap--so only iterator returns)
-   static pair<HashString, TxRef>                            txInputPair;
-   static pair<HashString, BlockHeader>                      bhInputPair;
-   static multimap<HashString, TxRef>::iterator              txInsResult;
-   static pair<map<HashString, BlockHeader>::iterator, bool> bhInsResult;
-   txInputPair.first.resize(4);
-
-   
    // Read off the header 
-   bhInputPair.second.unserialize(brr);
-   bhInputPair.first = bhInputPair.second.getThisHash();
-   bhInsResult = headerMap_.insert(bhInputPair);
-   BlockHeader * bhptr = &(bhInsResult.first->second);
+   BlockHeader * bhptr = headerStore_.insertHeader(brr.getCurrPtr());
+   brr.advance(HEADER_SIZE);
 
    // The pointer will be going out of scope, but keep the file location data
    FileDataPtr fdpThisBlock(fileIndex0Idx, thisHeaderOffset-8, blockSize+8); 
@@ -3033,16 +5487,75 @@ bool BlockDataManager_FileRefs::parseNewBlockData(BinaryRefReader & brr,
    uint8_t viSize;
    uint32_t nTx = (uint32_t)brr.get_var_int(&viSize);
 
+   // Every tx is at least one byte, so a bigger count means the block is
+   // corrupted.  Keep the header but don't go allocating billions of tx,
+   // verifyBlkFileIntegrity will point out the bad block.
+   if(nTx > blockSize)
+   {
+      cout << "***ERROR:  Block at offset " << thisHeaderOffset
+           << " claims " << nTx << " tx, skipping its tx" << endl;
+      nTx = 0;
+   }
+
    // The file offset of the first tx in this block is after the var_int
    uint32_t txOffset = thisHeaderOffset + HEADER_SIZE + viSize; 
 
    // Read each of the Tx
-   bhptr->txPtrList_.resize(nTx);
+   bhptr->txPtrList_->resize(nTx);
    uint32_t txSize;
    static vector<uint32_t> offsetsIn;
    static vector<uint32_t> offsetsOut;
    static BinaryData hashResult(32);
 
+   // Unless the parallel loader already did it, hash all the tx up front in
+   // one batch, so they go through the SIMD lanes side by side.  Only the tx
+   // that are really inside this block, if the tx sizes run off the end, the
+   // rest get hashed one at a time like before.  Same for the HASH160s of
+   // pay-to-pubkey TxOuts, if there's anything registered to check them for.
+   static vector<uint8_t const *> batchPtrs;
+   static vector<uint32_t>        batchSizes;
+   static BinaryData              batchHashes;
+   // If this block goes right on top of the UTXO set, apply it now while
+   // it's in memory.  Anything else waits for syncUtxoSet.
+   bool connectUtxos = useUtxoSet_ && extendsUtxoTop(bhptr);
+   uint32_t utxoPubKeyCursor = 0;
+   uint32_t histPubKeyCursor = 0;
+
+   bool hashTx      = (preCalcTxHashes == NULL);
+   bool hashPubKeys = (registeredAddrMap_.size() > 0 || connectUtxos ||
+                       useAddrHistory_);
+   uint32_t nBatch = 0;
+   if((hashTx || hashPubKeys) && nTx > 0)
+   {
+      batchPtrs.resize(nTx);
+      batchSizes.resize(nTx);
+      uint8_t const * txPtr = brr.getCurrPtr();
+      uint32_t txBytes   = blockSize - min(blockSize, (uint32_t)(HEADER_SIZE+viSize));
+      uint32_t bytesLeft = min(txBytes, brr.getSizeRemaining());
+      for(nBatch=0; nBatch<nTx; nBatch++)
+      {
+         txSize = BtcUtils::TxCalcLength(txPtr, NULL, hashPubKeys ? &offsetsOut : NULL);
+         if(txSize > bytesLeft)
+            break;
+         batchPtrs[nBatch]  = txPtr;
+         batchSizes[nBatch] = txSize;
+         if(hashPubKeys)
+            queuePubKeyTxOuts(txPtr, offsetsOut);
+         txPtr     += txSize;
+         bytesLeft -= txSize;
+      }
+
+      if(hashTx)
+      {
+         batchHashes.resize(32*nTx);
+         Sha256::doubleHashBatch(&batchPtrs[0], &batchSizes[0], nBatch, 
+                                 batchHashes.getPtr());
+      }
+
+      if(hashPubKeys)
+         hashPubKeyQueue();
+   }
+
    TIMER_START("parseNewBlockData_Scan_Tx_List");
    for(uint32_t i=0; i<nTx; i++)
    {
@@ -3053,15 +5566,36 @@ bool BlockDataManager_FileRefs::parseNewBlockData(BinaryRefReader & brr,
       txSize = BtcUtils::TxCalcLength(ptrToRawTx, &offsetsIn, &offsetsOut);
 
       FileDataPtr fdpThisTx(fileIndex0Idx, txOffset, txSize);
-      txInputPair.second.setBlkFilePtr(fdpThisTx);
 
-      // Insert the FileDataPtr into the multimap
-      BtcUtils::getHash256_NoSafetyCheck(ptrToRawTx, txSize, hashResult);
+      // Insert the FileDataPtr into the tx index
+      if(preCalcTxHashes != NULL)
+         hashResult.copyFrom(preCalcTxHashes + 32*i, 32);
+      else if(i < nBatch)
+         hashResult.copyFrom(batchHashes.getPtr() + 32*i, 32);
+      else
+         BtcUtils::getHash256_NoSafetyCheck(ptrToRawTx, txSize, hashResult);
 
-      // Insert TxRef into txHintMap_, making sure there's no duplicates 
+      // Insert TxRef into txIndex_, making sure there's no duplicates 
       // of this exactly transaction (which happens on one-block forks).
       // Store the pointer to the newly-added txref, save it with the header
-      bhptr->txPtrList_[i] = insertTxRef(hashResult, fdpThisTx, NULL);
+      uint32_t prevNumTx = txIndex_.size();
+      (*bhptr->txPtrList_)[i] = insertTxRef(hashResult, fdpThisTx, NULL);
+
+      // The spends go in now, even though we don't know if this block is
+      // on the main chain.  That gets sorted out after organizing the chain
+      uint32_t txIdx = prevNumTx;
+      if((useSpendIndex_ || connectUtxos) && txIndex_.size() == prevNumTx)
+         txIdx = txIndex_.getIndexOfTxRef((*bhptr->txPtrList_)[i]);
+
+      if(useAddrHistory_ && txIndex_.size() != prevNumTx)
+         indexTxAddrHistory(txIdx, ptrToRawTx, offsetsIn, offsetsOut, histPubKeyCursor);
+
+      if(useSpendIndex_)
+      {
+         if(txIndex_.size() != prevNumTx)
+            spendIndex_.addTx(txIdx, offsetsOut.size()-1);
+         spendIndex_.addSpends(txIndex_, txIdx, ptrToRawTx, offsetsIn, false);
+      }
 
       // We don't set this tx's headerPtr because there could be multiple
       // headers that reference this tx... we will wait until the chain
@@ -3073,11 +5607,18 @@ bool BlockDataManager_FileRefs::parseNewBlockData(BinaryRefReader & brr,
       // to any of the registered addresses.  Again, using pointers...
       registeredAddrScan(ptrToRawTx, txSize, &offsetsIn, &offsetsOut);
 
+      if(connectUtxos)
+         applyTxToUtxoSet(txIdx, ptrToRawTx, offsetsIn, offsetsOut, utxoPubKeyCursor);
+
       // Prepare for the next tx.  Manually advance brr since used ptr directly
       txOffset += txSize;
       brr.advance(txSize);
    }
    TIMER_STOP("parseNewBlockData_Scan_Tx_List");
+   clearPubKeyQueue();
+
+   if(connectUtxos)
+      utxoTopPtr_ = bhptr;
    return true;
 }
    
@@ -3121,9 +5662,13 @@ vector<bool> BlockDataManager_FileRefs::addNewBlockData(BinaryRefReader & brrRaw
    // Finally, let's re-assess the state of the blockchain with the new data
    // Check the lastBlockWasReorg_ variable to see if there was a reorg
    PDEBUG("New block!  Re-assess blockchain state after adding new data...");
-   bool prevTopBlockStillValid = organizeChain(); 
+   BlockHeader* newHeadPtr = getHeaderByHash(newHeadHash);
+   bool prevTopBlockStillValid = organizeChainIncremental(*newHeadPtr); 
    lastBlockWasReorg_ = false;
 
+   // Any cached balance could have changed (confirmations, reorg)
+   txioGeneration_++;
+
    // I cannot just do a rescan:  the user needs this to be done manually so
    // that we can identify headers/txs that were previously valid, but no more
    if(!prevTopBlockStillValid)
@@ -3137,7 +5682,24 @@ vector<bool> BlockDataManager_FileRefs::addNewBlockData(BinaryRefReader & brrRaw
 
    // Since this method only adds one block, if it's not on the main branch,
    // then it's not the new head
-   bool newBlockIsNewTop = getHeaderByHash(newHeadHash)->isMainBranch();
+   bool newBlockIsNewTop = newHeadPtr->isMainBranch();
+
+   // A reorg already fixed the spend index, otherwise the only spends that
+   // might not belong there are the new block's
+   if(useSpendIndex_)
+   {
+      if(!newBlockIsNewTop)
+         indexBlockSpends(newHeadPtr, false);
+      spendIndex_.resolvePending(txIndex_);
+   }
+
+   // Usually the new block was already applied to the UTXO set when it was
+   // parsed, this takes care of reorgs and blocks that weren't
+   if(useUtxoSet_)
+      syncUtxoSet();
+
+   if(useAddrHistory_)
+      addrHistory_.resolvePending(txIndex_);
 
    // Need to purge the zero-conf pool and re-evaluate -- the new block 
    // probably included some of the transactions in the pool
@@ -3226,6 +5788,21 @@ void BlockDataManager_FileRefs::reassessAfterReorg( BlockHeader* oldTopPtr,
       thisHeaderPtr = getHeaderByHash(thisHeaderPtr->getPrevHash());
    }
 
+   // Same thing for the spend index:  the old chain's spends come out, then
+   // the new chain's go in (replacing any double-spends from the old chain)
+   if(useSpendIndex_)
+   {
+      for(thisHeaderPtr = oldTopPtr; 
+          thisHeaderPtr != branchPtr;
+          thisHeaderPtr = getHeaderByHash(thisHeaderPtr->getPrevHash()))
+         indexBlockSpends(thisHeaderPtr, false);
+
+      for(thisHeaderPtr = newTopPtr; 
+          thisHeaderPtr != branchPtr;
+          thisHeaderPtr = getHeaderByHash(thisHeaderPtr->getPrevHash()))
+         indexBlockSpends(thisHeaderPtr, true);
+   }
+
    PDEBUG("Done reassessing tx validity");
 }
 
@@ -3234,13 +5811,11 @@ vector<BlockHeader*> BlockDataManager_FileRefs::getHeadersNotOnMainChain(void)
 {
    PDEBUG("Getting headers not on main chain");
    vector<BlockHeader*> out(0);
-   map<HashString, BlockHeader>::iterator iter;
-   for(iter  = headerMap_.begin(); 
-       iter != headerMap_.end(); 
-       iter++)
+   for(uint32_t h=0; h<headerStore_.size(); h++)
    {
-      if( ! iter->second.isMainBranch() )
-         out.push_back(&(iter->second));
+      BlockHeader* bhptr = headerStore_.getHeaderByIndex(h);
+      if( ! bhptr->isMainBranch() )
+         out.push_back(bhptr);
    }
    PDEBUG("Getting headers not on main chain");
    return out;
@@ -3255,40 +5830,52 @@ vector<BlockHeader*> BlockDataManager_FileRefs::getHeadersNotOnMainChain(void)
 bool BlockDataManager_FileRefs::organizeChain(bool forceRebuild)
 {
    PDEBUG2("Organizing chain", (forceRebuild ? "w/ rebuild" : ""));
+   txioGeneration_++;
+
    // If rebuild, we zero out any original organization data and do a 
    // rebuild of the chain from scratch.  This will need to be done in
    // the event that our first call to organizeChain returns false, which
    // means part of blockchain that was previously valid, has become
    // invalid.  Rather than get fancy, just rebuild all which takes less
    // than a second, anyway.
+   //
+   // (New blocks go through organizeChainIncremental now, which handles
+   //  reorgs itself, so this only happens when someone asks for it)
    if(forceRebuild)
    {
-      map<HashString, BlockHeader>::iterator iter;
-      for( iter  = headerMap_.begin(); 
-           iter != headerMap_.end(); 
-           iter++)
+      for(uint32_t h=0; h<headerStore_.size(); h++)
       {
-         iter->second.difficultySum_  = -1;
-         iter->second.blockHeight_    =  0;
-         iter->second.isFinishedCalc_ =  false;
-         iter->second.nextHash_       =  BtcUtils::EmptyHash_;
+         BlockHeaderMeta & meta = *(headerStore_.getHeaderByIndex(h)->meta_);
+         meta.difficultySum_  = -1;
+         meta.blockHeight_    =  0;
+         meta.isMainBranch_   =  false;
+         meta.isFinishedCalc_ =  false;
+         meta.nextHeaderPtr_  =  NULL;
       }
       topBlockPtr_ = NULL;
    }
 
-   // Set genesis block
+   // Set genesis block.  Without it there's no chain to organize, every
+   // header we have is an orphan
    BlockHeader & genBlock = getGenesisBlock();
-   genBlock.blockHeight_    = 0;
-   genBlock.difficultyDbl_  = 1.0;
-   genBlock.difficultySum_  = 1.0;
-   genBlock.isMainBranch_   = true;
-   genBlock.isOrphan_       = false;
-   genBlock.isFinishedCalc_ = true;
-   genBlock.isInitialized_  = true; 
-   genBlock.txPtrList_      = vector<TxRef*>(1);
-   genBlock.txPtrList_[0]   = getTxRefPtrByHash(GenesisTxHash_);
-   //genBlock.txPtrList_[0]->setMainBranch(true);
-   genBlock.txPtrList_[0]->setHeaderPtr(&genBlock);
+   if(genBlockPtr_ == NULL)
+   {
+      cout << "***ERROR:  Genesis block not found, can't organize chain" << endl;
+      cerr << "***ERROR:  Genesis block not found, can't organize chain" << endl;
+      return true;
+   }
+   BlockHeaderMeta & genMeta = *(genBlock.meta_);
+   genMeta.blockHeight_    = 0;
+   genMeta.difficultyDbl_  = 1.0;
+   genMeta.difficultySum_  = 1.0;
+   genMeta.isMainBranch_   = true;
+   genMeta.isOrphan_       = false;
+   genMeta.isFinishedCalc_ = true;
+   genMeta.isInitialized_  = true; 
+   genBlock.txPtrList_->resize(1);
+   (*genBlock.txPtrList_)[0] = getTxRefPtrByHash(GenesisTxHash_);
+   //(*genBlock.txPtrList_)[0]->setMainBranch(true);
+   (*genBlock.txPtrList_)[0]->setHeaderPtr(&genBlock);
 
 
    // If this is the first run, the topBlock is the genesis block
@@ -3300,37 +5887,104 @@ bool BlockDataManager_FileRefs::organizeChain(bool forceRebuild)
    prevTopBlockPtr_ = topBlockPtr_;
 
    // Iterate over all blocks, track the maximum difficulty-sum block
-   map<HashString, BlockHeader>::iterator iter;
    double   maxDiffSum     = prevTopBlockPtr_->getDifficultySum();
-   for( iter = headerMap_.begin(); iter != headerMap_.end(); iter ++)
+   orphanHeaderPtrs_.clear();
+   for(uint32_t h=0; h<headerStore_.size(); h++)
    {
+      BlockHeader & bh = *(headerStore_.getHeaderByIndex(h));
+
       // *** Walk down the chain following prevHash fields, until
       //     you find a "solved" block.  Then walk back up and 
       //     fill in the difficulty-sum values (do not set next-
       //     hash ptrs, as we don't know if this is the main branch)
       //     Method returns instantly if block is already "solved"
-      double thisDiffSum = traceChainDown(iter->second);
+      double thisDiffSum = traceChainDown(bh);
+      if(thisDiffSum <= 0)
+         orphanHeaderPtrs_.push_back(&bh);
       
       // Determine if this is the top block.  If it's the same diffsum
       // as the prev top block, don't do anything
       if(thisDiffSum > maxDiffSum)
       {
          maxDiffSum     = thisDiffSum;
-         topBlockPtr_   = &(iter->second);
+         topBlockPtr_   = &bh;
+      }
+   }
+
+   // Walk down the list one more time, set nextHash fields
+   // Also set headersByHeight_;
+   bool prevChainStillValid = markMainBranch();
+
+   // Let the caller know whether there was a reorg
+   PDEBUG("Done organizing chain");
+   return prevChainStillValid;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// When a block is added, the only difficulty sums that can change are the
+// new block's, and those of any orphans that were waiting for it as their 
+// parent.  So instead of tracing every header again, trace only those.  If
+// the new block's parent is the top block, traceChainDown stops after one
+// step, and so does markMainBranch.  If it's on a side branch, both only 
+// walk that branch down to where it forks off the main chain.
+bool BlockDataManager_FileRefs::organizeChainIncremental(BlockHeader & newHead)
+{
+   PDEBUG("Organizing chain (incremental)");
+
+   // Nothing organized yet, so there's nothing to be incremental about
+   if(topBlockPtr_ == NULL)
+      return organizeChain();
+
+   prevTopBlockPtr_ = topBlockPtr_;
+   double maxDiffSum = prevTopBlockPtr_->getDifficultySum();
+
+   vector<BlockHeader*> toTrace(1, &newHead);
+   toTrace.insert(toTrace.end(), orphanHeaderPtrs_.begin(), 
+                                 orphanHeaderPtrs_.end());
+   orphanHeaderPtrs_.clear();
+
+   for(uint32_t i=0; i<toTrace.size(); i++)
+   {
+      // The new block might've been one of the orphans (added twice)
+      if(i>0 && toTrace[i]==&newHead)
+         continue;
+
+      double thisDiffSum = traceChainDown(*toTrace[i]);
+      if(thisDiffSum <= 0)
+         orphanHeaderPtrs_.push_back(toTrace[i]);
+
+      // Same as organizeChain:  a tie with the top block doesn't count
+      if(thisDiffSum > maxDiffSum)
+      {
+         maxDiffSum     = thisDiffSum;
+         topBlockPtr_   = toTrace[i];
       }
    }
 
-   // Walk down the list one more time, set nextHash fields
-   // Also set headersByHeight_;
+   bool prevChainStillValid = markMainBranch();
+   PDEBUG("Done organizing chain (incremental)");
+   return prevChainStillValid;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Everything from the genesis block up to prevTopBlockPtr_ is already marked
+// (isFinishedCalc_), so we only have to walk down from the new top block
+// until we hit one of those.  If that's not prevTopBlockPtr_ itself, the 
+// chain forked below it:  the old branch above the fork gets un-marked, and
+// the new one has taken its place in headersByHeight_.
+bool BlockDataManager_FileRefs::markMainBranch(void)
+{
    bool prevChainStillValid = (topBlockPtr_ == prevTopBlockPtr_);
-   topBlockPtr_->nextHash_ = BtcUtils::EmptyHash_;
+   topBlockPtr_->meta_->nextHeaderPtr_ = NULL;
    BlockHeader* thisHeaderPtr = topBlockPtr_;
    headersByHeight_.resize(topBlockPtr_->getBlockHeight()+1);
-   while( !thisHeaderPtr->isFinishedCalc_ )
+   while( !thisHeaderPtr->meta_->isFinishedCalc_ )
    {
-      thisHeaderPtr->isFinishedCalc_ = true;
-      thisHeaderPtr->isMainBranch_   = true;
-      thisHeaderPtr->isOrphan_       = false;
+      thisHeaderPtr->meta_->isFinishedCalc_ = true;
+      thisHeaderPtr->meta_->isMainBranch_   = true;
+      thisHeaderPtr->meta_->isOrphan_       = false;
       headersByHeight_[thisHeaderPtr->getBlockHeight()] = thisHeaderPtr;
 
       // We need to guarantee that the txs are pointing to the right block
@@ -3342,38 +5996,38 @@ bool BlockDataManager_FileRefs::organizeChain(bool forceRebuild)
          //tx.setMainBranch(true);
       }
 
-      HashString & childHash    = thisHeaderPtr->thisHash_;
-      thisHeaderPtr             = &(headerMap_[thisHeaderPtr->getPrevHash()]);
-      thisHeaderPtr->nextHash_  = childHash;
+      BlockHeader* childPtr     = thisHeaderPtr;
+      thisHeaderPtr             = headerStore_.findPrevHeader(thisHeaderPtr);
+      thisHeaderPtr->meta_->nextHeaderPtr_ = childPtr;
 
       if(thisHeaderPtr == prevTopBlockPtr_)
          prevChainStillValid = true;
 
    }
    // Last header in the loop didn't get added (the genesis block on first run)
-   thisHeaderPtr->isMainBranch_ = true;
+   thisHeaderPtr->meta_->isMainBranch_ = true;
    headersByHeight_[thisHeaderPtr->getBlockHeight()] = thisHeaderPtr;
 
 
-   // Force a full rebuild to make sure everything is marked properly
-   // On a full rebuild, prevChainStillValid should ALWAYS be true
+   // The old top block is on a branch that's no longer the main chain.  The
+   // part of it above the fork point needs to stop looking like it is.  The 
+   // txs in it get dealt with by reassessAfterReorg.
    if( !prevChainStillValid )
    {
       PDEBUG("Reorg detected!");
       reorgBranchPoint_ = thisHeaderPtr;
 
-      // There was a dangerous bug -- prevTopBlockPtr_ is set correctly 
-      // RIGHT NOW, but won't be once I make the recursive call to organizeChain
-      // I need to save it now, and re-assign it after the organizeChain call.
-      // (I might consider finding a way to avoid this, but it's fine as-is)
-      BlockHeader* prevtopblk = prevTopBlockPtr_;
-      organizeChain(true); // force-rebuild blockchain (takes less than 1s)
-      prevTopBlockPtr_ = prevtopblk;
+      BlockHeader* oldHeaderPtr = prevTopBlockPtr_;
+      while(oldHeaderPtr != NULL && oldHeaderPtr != reorgBranchPoint_)
+      {
+         oldHeaderPtr->meta_->isMainBranch_   = false;
+         oldHeaderPtr->meta_->isFinishedCalc_ = false;
+         oldHeaderPtr->meta_->nextHeaderPtr_  = NULL;
+         oldHeaderPtr = headerStore_.findPrevHeader(oldHeaderPtr);
+      }
       return false;
    }
 
-   // Let the caller know that there was no reorg
-   PDEBUG("Done organizing chain");
    return true;
 }
 
@@ -3384,29 +6038,24 @@ bool BlockDataManager_FileRefs::organizeChain(bool forceRebuild)
 // this block.
 double BlockDataManager_FileRefs::traceChainDown(BlockHeader & bhpStart)
 {
-   if(bhpStart.difficultySum_ > 0)
-      return bhpStart.difficultySum_;
+   if(bhpStart.meta_->difficultySum_ > 0)
+      return bhpStart.meta_->difficultySum_;
 
-   // Prepare some data structures for walking down the chain
-   vector<BlockHeader*>   headerPtrStack(headerMap_.size());
-   vector<double>           difficultyStack(headerMap_.size());
-   uint32_t blkIdx = 0;
-   double thisDiff;
+   // The stack only gets as big as the path we walk, which is usually one
+   // block.  (This used to be sized to the entire header store, every call)
+   static vector<BlockHeader*> headerPtrStack;
+   headerPtrStack.clear();
 
    // Walk down the chain of prevHash_ values, until we find a block
    // that has a definitive difficultySum value (i.e. >0). 
    BlockHeader* thisPtr = &bhpStart;
-   map<HashString, BlockHeader>::iterator iter;
-   while( thisPtr->difficultySum_ < 0)
+   while( thisPtr->meta_->difficultySum_ < 0)
    {
-      thisDiff                = thisPtr->difficultyDbl_;
-      difficultyStack[blkIdx] = thisDiff;
-      headerPtrStack[blkIdx]  = thisPtr;
-      blkIdx++;
+      headerPtrStack.push_back(thisPtr);
 
-      iter = headerMap_.find(thisPtr->getPrevHash());
-      if( iter != headerMap_.end() )
-         thisPtr = &(iter->second);
+      BlockHeader* prevPtr = headerStore_.findPrevHeader(thisPtr);
+      if( prevPtr != NULL )
+         thisPtr = prevPtr;
       else
       {
          // We didn't hit a known block, but we don't have this block's
@@ -3418,22 +6067,21 @@ double BlockDataManager_FileRefs::traceChainDown(BlockHeader & bhpStart)
    }
 
 
-   // Now we have a stack of difficulties and pointers.  Walk back up
-   // (by pointer) and accumulate the difficulty values 
-   double   seedDiffSum = thisPtr->difficultySum_;
-   uint32_t blkHeight   = thisPtr->blockHeight_;
-   for(int32_t i=blkIdx-1; i>=0; i--)
+   // Now we have a stack of pointers.  Walk back up and accumulate the 
+   // difficulty values 
+   double   seedDiffSum = thisPtr->meta_->difficultySum_;
+   uint32_t blkHeight   = thisPtr->meta_->blockHeight_;
+   for(int32_t i=(int32_t)headerPtrStack.size()-1; i>=0; i--)
    {
-      seedDiffSum += difficultyStack[i];
+      thisPtr = headerPtrStack[i];
+      seedDiffSum += thisPtr->meta_->difficultyDbl_;
       blkHeight++;
-      thisPtr                 = headerPtrStack[i];
-      thisPtr->difficultyDbl_ = difficultyStack[i];
-      thisPtr->difficultySum_ = seedDiffSum;
-      thisPtr->blockHeight_   = blkHeight;
+      thisPtr->meta_->difficultySum_ = seedDiffSum;
+      thisPtr->meta_->blockHeight_   = blkHeight;
    }
    
    // Finally, we have all the difficulty sums calculated, return this one
-   return bhpStart.difficultySum_;
+   return bhpStart.meta_->difficultySum_;
   
 }
 
@@ -3442,31 +6090,30 @@ double BlockDataManager_FileRefs::traceChainDown(BlockHeader & bhpStart)
 void BlockDataManager_FileRefs::markOrphanChain(BlockHeader & bhpStart)
 {
    PDEBUG("Marking orphan chain");
-   bhpStart.isMainBranch_ = true;
-   map<HashString, BlockHeader>::iterator iter;
-   iter = headerMap_.find(bhpStart.getPrevHash());
-   HashStringRef lastHeadHash(32);
-   while( iter != headerMap_.end() )
+   bhpStart.meta_->isMainBranch_ = true;
+   BlockHeader* lastHeadPtr = &bhpStart;
+   BlockHeader* thisPtr = headerStore_.findPrevHeader(&bhpStart);
+   while( thisPtr != NULL )
    {
       // I don't see how it's possible to have a header that used to be 
       // in the main branch, but is now an ORPHAN (meaning it has no
       // parent).  It will be good to detect this case, though
-      if(iter->second.isMainBranch() == true)
+      if(thisPtr->isMainBranch() == true)
       {
          // NOTE: this actually gets triggered when we scan the testnet
          //       blk0001.dat file on main net, etc
          cout << "***ERROR: Block previously main branch, now orphan!?"
-              << iter->second.getThisHash().toHexStr() << endl;
+              << thisPtr->getThisHash().toHexStr() << endl;
          cerr << "***ERROR: Block previously main branch, now orphan!?"
-              << iter->second.getThisHash().toHexStr() << endl;
-         previouslyValidBlockHeaderPtrs_.push_back(&(iter->second));
+              << thisPtr->getThisHash().toHexStr() << endl;
+         previouslyValidBlockHeaderPtrs_.push_back(thisPtr);
       }
-      iter->second.isOrphan_ = true;
-      iter->second.isMainBranch_ = false;
-      lastHeadHash.setRef(iter->second.thisHash_);
-      iter = headerMap_.find(iter->second.getPrevHash());
+      thisPtr->meta_->isOrphan_ = true;
+      thisPtr->meta_->isMainBranch_ = false;
+      lastHeadPtr = thisPtr;
+      thisPtr = headerStore_.findPrevHeader(thisPtr);
    }
-   orphanChainStartBlocks_.push_back(&(headerMap_[lastHeadHash.copy()]));
+   orphanChainStartBlocks_.push_back(lastHeadPtr);
    PDEBUG("Done marking orphan chain");
 }
 
@@ -3507,6 +6154,487 @@ int64_t BlockDataManager_FileRefs::getSentValue(TxIn & txin)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::setUseSpendIndex(bool b)
+{
+   if(b == useSpendIndex_)
+      return;
+
+   useSpendIndex_ = b;
+   spendIndex_.clear();
+
+   // If the blockchain is already loaded, we missed our chance to do it
+   // during the parsing
+   if(useSpendIndex_ && txIndex_.size() > 0)
+      rebuildSpendIndex();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TxRef * BlockDataManager_FileRefs::getSpendingTxRef(BinaryData const & txHash,
+                                                    uint32_t txOutIndex)
+{
+   if(!useSpendIndex_)
+   {
+      cout << "***ERROR:  getSpendingTxRef needs setUseSpendIndex(true)" << endl;
+      cerr << "***ERROR:  getSpendingTxRef needs setUseSpendIndex(true)" << endl;
+      return NULL;
+   }
+
+   if(txHash.getSize() < TXREF_HASH_PREFIX_BYTES)
+      return NULL;
+
+   uint32_t txIdx = txIndex_.findTxIndex(txHash.getPtr());
+   if(txIdx == UINT32_MAX)
+      return NULL;
+
+   uint32_t spenderIdx = spendIndex_.getSpender(txIdx, txOutIndex);
+   if(spenderIdx == UINT32_MAX)
+      return NULL;
+
+   return txIndex_.getTxRefByIndex(spenderIdx);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TxRef * BlockDataManager_FileRefs::getSpendingTxRef(OutPoint const & op)
+{
+   return getSpendingTxRef(op.getTxHash(), op.getTxOutIndex());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BlockDataManager_FileRefs::isTxOutSpent(BinaryData const & txHash,
+                                             uint32_t txOutIndex)
+{
+   return getSpendingTxRef(txHash, txOutIndex) != NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// This reads the tx back from the blk files, so it's only for the few blocks
+// involved in a reorg (or a rebuild)
+void BlockDataManager_FileRefs::indexBlockSpends(BlockHeader* bhptr, bool isAdd)
+{
+   static vector<uint32_t> offsetsIn;
+   vector<TxRef*> & txList = bhptr->getTxRefPtrList();
+   for(uint32_t i=0; i<txList.size(); i++)
+   {
+      if(!isAdd && txList[i]->isMainBranch())
+         continue;
+
+      uint32_t txIdx = txIndex_.getIndexOfTxRef(txList[i]);
+      BinaryData rawTx = txList[i]->serialize();
+      if(rawTx.getSize() == 0)
+         continue;
+
+      BtcUtils::TxCalcLength(rawTx.getPtr(), &offsetsIn, NULL);
+      if(isAdd)
+         spendIndex_.addSpends(txIndex_, txIdx, rawTx.getPtr(), offsetsIn, true);
+      else
+         spendIndex_.removeSpends(txIndex_, txIdx, rawTx.getPtr(), offsetsIn);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// For when the tx index didn't come from parsing the blocks (the snapshot),
+// or the spend index was turned on late.  One pass over every tx to get the
+// number of outputs, then the main chain in order for the spends.
+void BlockDataManager_FileRefs::rebuildSpendIndex(void)
+{
+   TIMER_START("rebuildSpendIndex");
+   spendIndex_.clear();
+
+   static vector<uint32_t> offsetsOut;
+   for(uint32_t i=0; i<txIndex_.size(); i++)
+   {
+      BinaryData rawTx = txIndex_.getTxRefByIndex(i)->serialize();
+      uint32_t nTxOut = 0;
+      if(rawTx.getSize() > 0)
+      {
+         BtcUtils::TxCalcLength(rawTx.getPtr(), NULL, &offsetsOut);
+         nTxOut = offsetsOut.size()-1;
+      }
+      spendIndex_.addTx(i, nTxOut);
+   }
+
+   for(uint32_t h=0; h<headersByHeight_.size(); h++)
+      indexBlockSpends(headersByHeight_[h], true);
+   TIMER_STOP("rebuildSpendIndex");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::setUseUtxoSet(bool b)
+{
+   if(b == useUtxoSet_)
+      return;
+
+   useUtxoSet_ = b;
+   utxoSet_.clear();
+   utxoTopPtr_ = NULL;
+
+   // If the blockchain is already loaded, build it from the blk files
+   if(useUtxoSet_ && headersByHeight_.size() > 0)
+      syncUtxoSet();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t BlockDataManager_FileRefs::getAddrBalance(BinaryData const & addr160)
+{
+   if(!useUtxoSet_)
+   {
+      cout << "***ERROR:  getAddrBalance needs setUseUtxoSet(true)" << endl;
+      cerr << "***ERROR:  getAddrBalance needs setUseUtxoSet(true)" << endl;
+      return 0;
+   }
+
+   if(addr160.getSize() != 20)
+      return 0;
+
+   return utxoSet_.getBalanceForAddr(addr160.getPtr());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<UnspentTxOut> BlockDataManager_FileRefs::getUnspentTxOutsForAddr(
+                                                   BinaryData const & addr160)
+{
+   vector<UnspentTxOut> utxoList(0);
+   if(!useUtxoSet_)
+   {
+      cout << "***ERROR:  getUnspentTxOutsForAddr needs setUseUtxoSet(true)" << endl;
+      cerr << "***ERROR:  getUnspentTxOutsForAddr needs setUseUtxoSet(true)" << endl;
+      return utxoList;
+   }
+
+   if(addr160.getSize() != 20)
+      return utxoList;
+
+   vector<UtxoEntry> entries;
+   utxoSet_.getUtxosForAddr(addr160.getPtr(), entries);
+
+   uint32_t currBlk = getTopBlockHeight();
+   for(uint32_t i=0; i<entries.size(); i++)
+   {
+      TxRef* txref = txIndex_.getTxRefByIndex(entries[i].getTxIndex());
+      Tx tx = txref->getTxCopy();
+      TxOut txout = tx.getTxOut(entries[i].getTxOutIndex());
+      utxoList.push_back(UnspentTxOut(txout, currBlk));
+   }
+   return utxoList;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TXOUT_SCRIPT_TYPE BlockDataManager_FileRefs::getTxOutAddr160(
+                                                   uint8_t const * txOutPtr,
+                                                   uint8_t * addr160Out,
+                                                   uint32_t & pubKeyCursor)
+{
+   uint32_t viLen;
+   uint32_t scriptLen = (uint32_t)BtcUtils::readVarInt(txOutPtr+8, &viLen);
+   BinaryDataRef script(txOutPtr+8+viLen, scriptLen);
+
+   // The queue has every 67-byte script, even the ones that turn out not to
+   // be pay-to-pubkey, so the cursor has to step over those too
+   uint8_t const * pubkey = script.getPtr()+1;
+   uint8_t const * queuedHash = NULL;
+   if(pubKeyCursor < pubKeyQueuePtrs_.size() &&
+      pubKeyQueuePtrs_[pubKeyCursor] == pubkey)
+   {
+      queuedHash = pubKeyQueueHashes_.getPtr() + 20*pubKeyCursor;
+      pubKeyCursor++;
+   }
+
+   TXOUT_SCRIPT_TYPE scriptType = BtcUtils::getTxOutScriptType(script);
+   if(scriptType == TXOUT_SCRIPT_STANDARD)
+      memcpy(addr160Out, script.getPtr()+3, 20);
+   else if(scriptType == TXOUT_SCRIPT_COINBASE)
+   {
+      if(queuedHash != NULL)
+         memcpy(addr160Out, queuedHash, 20);
+      else
+      {
+         static BinaryData hash160(20);
+         getPubKeyHash160(pubkey, hash160);
+         memcpy(addr160Out, hash160.getPtr(), 20);
+      }
+   }
+   return scriptType;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Figure out the address of the TxOut (if it's one of the standard ones) and
+// put it in the set
+void BlockDataManager_FileRefs::addTxOutToUtxoSet(uint32_t txIdx,
+                                                  uint32_t txOutIdx,
+                                                  uint8_t const * txOutPtr,
+                                                  uint32_t & pubKeyCursor)
+{
+   uint8_t addr160[20];
+   uint64_t value = *(uint64_t*)txOutPtr;
+   TXOUT_SCRIPT_TYPE scriptType = getTxOutAddr160(txOutPtr, addr160, pubKeyCursor);
+   utxoSet_.add(txIdx, txOutIdx, value, scriptType, addr160);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Take out what the TxIns spend, then put in the TxOuts
+void BlockDataManager_FileRefs::applyTxToUtxoSet(uint32_t txIdx,
+                                                 uint8_t const * txPtr,
+                                                 vector<uint32_t> const & offsetsIn,
+                                                 vector<uint32_t> const & offsetsOut,
+                                                 uint32_t & pubKeyCursor)
+{
+   static uint8_t const zeros[32] = {0};
+   for(uint32_t i=0; i+1<offsetsIn.size(); i++)
+   {
+      uint8_t const * txinPtr = txPtr + offsetsIn[i];
+      uint32_t prevOutIdx = *(uint32_t*)(txinPtr+32);
+      if(prevOutIdx == UINT32_MAX && memcmp(txinPtr, zeros, 32) == 0)
+         continue;  // coinbase
+
+      uint32_t prevIdx = txIndex_.findTxIndex(txinPtr);
+      if(prevIdx != UINT32_MAX)
+         utxoSet_.remove(prevIdx, prevOutIdx);
+   }
+
+   for(uint32_t i=0; i+1<offsetsOut.size(); i++)
+      addTxOutToUtxoSet(txIdx, i, txPtr + offsetsOut[i], pubKeyCursor);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Read the block back from the blk files and apply it.  The pubkeys all get
+// hashed in one batch, same as when parsing.
+void BlockDataManager_FileRefs::connectBlockUtxos(BlockHeader* bhptr)
+{
+   static vector<uint32_t> offsetsIn;
+   static vector<uint32_t> offsetsOut;
+   static vector<BinaryData> rawTxs;
+
+   vector<TxRef*> & txList = bhptr->getTxRefPtrList();
+   bhptr->getBlockFilePtr().preCacheThisChunk();
+
+   rawTxs.resize(txList.size());
+   for(uint32_t i=0; i<txList.size(); i++)
+   {
+      rawTxs[i] = txList[i]->serialize();
+      if(rawTxs[i].getSize() == 0)
+         continue;
+      BtcUtils::TxCalcLength(rawTxs[i].getPtr(), NULL, &offsetsOut);
+      queuePubKeyTxOuts(rawTxs[i].getPtr(), offsetsOut);
+   }
+   hashPubKeyQueue();
+
+   uint32_t pubKeyCursor = 0;
+   for(uint32_t i=0; i<txList.size(); i++)
+   {
+      if(rawTxs[i].getSize() == 0)
+         continue;
+      uint32_t txIdx = txIndex_.getIndexOfTxRef(txList[i]);
+      BtcUtils::TxCalcLength(rawTxs[i].getPtr(), &offsetsIn, &offsetsOut);
+      applyTxToUtxoSet(txIdx, rawTxs[i].getPtr(), offsetsIn, offsetsOut, 
+                       pubKeyCursor);
+   }
+   clearPubKeyQueue();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The reverse of connectBlockUtxos, last tx first.  There's no undo data:  the
+// TxOuts that were spent are still in the blk files, so they're read back
+// from there.  This only happens for the few blocks of a reorg.
+void BlockDataManager_FileRefs::disconnectBlockUtxos(BlockHeader* bhptr)
+{
+   static uint8_t const zeros[32] = {0};
+   static vector<uint32_t> offsetsIn;
+   static vector<uint32_t> offsetsOut;
+   static vector<uint32_t> prevOffsetsOut;
+
+   vector<TxRef*> & txList = bhptr->getTxRefPtrList();
+   for(int32_t i=(int32_t)txList.size()-1; i>=0; i--)
+   {
+      BinaryData rawTx = txList[i]->serialize();
+      if(rawTx.getSize() == 0)
+         continue;
+
+      uint32_t txIdx = txIndex_.getIndexOfTxRef(txList[i]);
+      BtcUtils::TxCalcLength(rawTx.getPtr(), &offsetsIn, &offsetsOut);
+      for(uint32_t iout=0; iout+1<offsetsOut.size(); iout++)
+         utxoSet_.remove(txIdx, iout);
+
+      for(uint32_t iin=0; iin+1<offsetsIn.size(); iin++)
+      {
+         uint8_t const * txinPtr = rawTx.getPtr() + offsetsIn[iin];
+         uint32_t prevOutIdx = *(uint32_t*)(txinPtr+32);
+         if(prevOutIdx == UINT32_MAX && memcmp(txinPtr, zeros, 32) == 0)
+            continue;  // coinbase
+
+         uint32_t prevIdx = txIndex_.findTxIndex(txinPtr);
+         if(prevIdx == UINT32_MAX)
+            continue;
+
+         BinaryData prevTx = txIndex_.getTxRefByIndex(prevIdx)->serialize();
+         if(prevTx.getSize() == 0)
+            continue;
+
+         BtcUtils::TxCalcLength(prevTx.getPtr(), NULL, &prevOffsetsOut);
+         if(prevOutIdx+1 >= prevOffsetsOut.size())
+            continue;
+
+         uint32_t noQueue = UINT32_MAX;
+         addTxOutToUtxoSet(prevIdx, prevOutIdx, 
+                           prevTx.getPtr() + prevOffsetsOut[prevOutIdx], noQueue);
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Called while parsing, before we know anything about the main chain:  can
+// this block be applied right now?  Only if it's on top of what's there.
+bool BlockDataManager_FileRefs::extendsUtxoTop(BlockHeader* bhptr)
+{
+   if(utxoTopPtr_ == NULL)
+      return (bhptr->getThisHashRef() == GenesisHash_);
+
+   return (bhptr->getPrevHashRef() == utxoTopPtr_->getThisHashRef());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Call after the chain is organized.  Back out blocks from the top until it's
+// on the main chain, then apply the main chain from there to the top block.
+void BlockDataManager_FileRefs::syncUtxoSet(void)
+{
+   TIMER_START("syncUtxoSet");
+   while(utxoTopPtr_ != NULL && !utxoTopPtr_->isMainBranch())
+   {
+      disconnectBlockUtxos(utxoTopPtr_);
+      utxoTopPtr_ = headerStore_.findPrevHeader(utxoTopPtr_);
+   }
+
+   uint32_t h = (utxoTopPtr_ == NULL ? 0 : utxoTopPtr_->getBlockHeight()+1);
+   for(; h<headersByHeight_.size(); h++)
+   {
+      connectBlockUtxos(headersByHeight_[h]);
+      utxoTopPtr_ = headersByHeight_[h];
+   }
+   TIMER_STOP("syncUtxoSet");
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::setUseAddrHistory(bool b)
+{
+   if(b == useAddrHistory_)
+      return;
+
+   useAddrHistory_ = b;
+   addrHistory_.clear();
+
+   // If the blockchain is already loaded, build it from the blk files
+   if(useAddrHistory_ && txIndex_.size() > 0)
+      rebuildAddrHistory();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Every main-chain tx that pays or spends from this address, in the order
+// they're in the blockchain
+vector<TxRef*> BlockDataManager_FileRefs::getAddrTxList(BinaryData const & addr160)
+{
+   vector<TxRef*> txList(0);
+   if(!useAddrHistory_)
+   {
+      cout << "***ERROR:  getAddrTxList needs setUseAddrHistory(true)" << endl;
+      cerr << "***ERROR:  getAddrTxList needs setUseAddrHistory(true)" << endl;
+      return txList;
+   }
+
+   if(addr160.getSize() != 20)
+      return txList;
+
+   vector<AddrHistoryEntry> history;
+   addrHistory_.getHistory(addr160.getPtr(), history);
+
+   map<pair<uint32_t,uint32_t>, TxRef*> sortedTx;
+   for(uint32_t i=0; i<history.size(); i++)
+   {
+      TxRef* txref = txIndex_.getTxRefByIndex(history[i].getTxIndex());
+      if(!txref->isMainBranch())
+         continue;
+      pair<uint32_t,uint32_t> key(txref->getBlockHeight(), 
+                                  txref->getBlockTxIndex());
+      sortedTx[key] = txref;
+   }
+
+   map<pair<uint32_t,uint32_t>, TxRef*>::iterator iter;
+   for(iter = sortedTx.begin(); iter != sortedTx.end(); iter++)
+      txList.push_back(iter->second);
+   return txList;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BlockDataManager_FileRefs::indexTxAddrHistory(uint32_t txIdx,
+                                                   uint8_t const * txPtr,
+                                                   vector<uint32_t> const & offsetsIn,
+                                                   vector<uint32_t> const & offsetsOut,
+                                                   uint32_t & pubKeyCursor)
+{
+   if(!addrHistory_.addTx(txIdx, offsetsOut.size()-1))
+      return;
+
+   addrHistory_.addTxIns(txIndex_, txIdx, txPtr, offsetsIn);
+
+   uint8_t addr160[20];
+   for(uint32_t i=0; i+1<offsetsOut.size(); i++)
+   {
+      TXOUT_SCRIPT_TYPE scriptType = getTxOutAddr160(txPtr + offsetsOut[i], 
+                                                     addr160, pubKeyCursor);
+      addrHistory_.addTxOut(txIdx, i, 
+                            scriptType==TXOUT_SCRIPT_UNKNOWN ? NULL : addr160);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// For when the tx index didn't come from parsing the blocks (a snapshot
+// without the history), or the history was turned on late.  Every tx in the
+// order they were added, one block at a time so the pubkeys are batched.
+void BlockDataManager_FileRefs::rebuildAddrHistory(void)
+{
+   TIMER_START("rebuildAddrHistory");
+   addrHistory_.clear();
+
+   static vector<uint32_t> offsetsIn;
+   static vector<uint32_t> offsetsOut;
+   static vector<BinaryData> rawTxs;
+
+   uint32_t numTx = txIndex_.size();
+   uint32_t batchSize = 1024;
+   for(uint32_t start=0; start<numTx; start+=batchSize)
+   {
+      uint32_t end = min(numTx, start+batchSize);
+      rawTxs.resize(end-start);
+      for(uint32_t i=start; i<end; i++)
+      {
+         rawTxs[i-start] = txIndex_.getTxRefByIndex(i)->serialize();
+         if(rawTxs[i-start].getSize() == 0)
+            continue;
+         BtcUtils::TxCalcLength(rawTxs[i-start].getPtr(), NULL, &offsetsOut);
+         queuePubKeyTxOuts(rawTxs[i-start].getPtr(), offsetsOut);
+      }
+      hashPubKeyQueue();
+
+      uint32_t pubKeyCursor = 0;
+      for(uint32_t i=start; i<end; i++)
+      {
+         if(rawTxs[i-start].getSize() == 0)
+         {
+            addrHistory_.addTx(i, 0);
+            continue;
+         }
+         uint8_t const * txPtr = rawTxs[i-start].getPtr();
+         BtcUtils::TxCalcLength(txPtr, &offsetsIn, &offsetsOut);
+         indexTxAddrHistory(i, txPtr, offsetsIn, offsetsOut, pubKeyCursor);
+      }
+      clearPubKeyQueue();
+   }
+   addrHistory_.resolvePending(txIndex_);
+   TIMER_STOP("rebuildAddrHistory");
+}
+
+
 
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -3619,6 +6747,10 @@ void BlockDataManager_FileRefs::purgeZeroConfPool(void)
       zeroConfMap_.erase( *rmIter );
    }
 
+   // The wallets' txios may still point to the Tx we just removed
+   if(mapRmList.size() > 0)
+      txioGeneration_++;
+
    // Rewrite the zero-conf pool file
    if(mapRmList.size() > 0)
       rewriteZeroConfFile();
@@ -3695,6 +6827,7 @@ void BtcAddress::clearZeroConfPool(void)
 {
    ledgerZC_.clear();
    relevantTxIOPtrsZC_.clear();
+   balances_.invalidate();
 }
 
 
@@ -3702,6 +6835,7 @@ void BtcAddress::clearZeroConfPool(void)
 void BtcWallet::clearZeroConfPool(void)
 {
    ledgerAllAddrZC_.clear();
+   balances_.invalidate();
    for(uint32_t i=0; i<addrMap_.size(); i++)
       addrPtrVect_[i]->clearZeroConfPool();
 
@@ -3760,6 +6894,78 @@ vector<LedgerEntry> BtcWallet::getZeroConfLedger(HashString const * addr160)
    }
 }
 
+////////////////////////////////////////////////////////////////////////////////
+vector<LedgerEntry>* BtcWallet::getLedgerAndIndex(HashString const * addr160,
+                                                  LedgerIndex* & ledgerIndex)
+{
+   if(addr160==NULL)
+   {
+      ledgerIndex = &ledgerIndex_;
+      return &ledgerAllAddr_;
+   }
+
+   map<HashString, BtcAddress>::iterator iter = addrMap_.find(*addr160);
+   if(iter == addrMap_.end())
+      return NULL;
+
+   ledgerIndex = &(iter->second.ledgerIndex_);
+   return &(iter->second.ledger_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t BtcWallet::getTxLedgerSize(HashString const * addr160)
+{
+   LedgerIndex* ledgerIndex;
+   vector<LedgerEntry>* ledger = getLedgerAndIndex(addr160, ledgerIndex);
+   return (ledger==NULL ? 0 : ledger->size());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<LedgerEntry> BtcWallet::getTxLedgerPage(uint32_t startIdx, 
+                                               uint32_t numEntries,
+                                               HashString const * addr160)
+{
+   vector<LedgerEntry> entries(0);
+   LedgerIndex* ledgerIndex;
+   vector<LedgerEntry>* ledger = getLedgerAndIndex(addr160, ledgerIndex);
+   if(ledger != NULL)
+      ledgerIndex->getPage(*ledger, startIdx, numEntries, entries);
+   return entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<LedgerEntry> BtcWallet::getTxLedgerByBlock(uint32_t blkStart, 
+                                                  uint32_t blkEnd,
+                                                  HashString const * addr160)
+{
+   vector<LedgerEntry> entries(0);
+   LedgerIndex* ledgerIndex;
+   vector<LedgerEntry>* ledger = getLedgerAndIndex(addr160, ledgerIndex);
+   if(ledger != NULL)
+      ledgerIndex->getBlockRange(*ledger, blkStart, blkEnd, entries);
+   return entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<LedgerEntry> BtcWallet::getTxLedgerByTime(uint32_t timeStart, 
+                                                 uint32_t timeEnd,
+                                                 HashString const * addr160)
+{
+   vector<LedgerEntry> entries(0);
+   LedgerIndex* ledgerIndex;
+   vector<LedgerEntry>* ledger = getLedgerAndIndex(addr160, ledgerIndex);
+   if(ledger != NULL)
+      ledgerIndex->getTimeRange(*ledger, timeStart, timeEnd, entries);
+   return entries;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<LedgerEntry> BtcWallet::getTxLedgerSinceBlock(uint32_t blkStart,
+                                                     HashString const * addr160)
+{
+   return getTxLedgerByBlock(blkStart, UINT32_MAX, addr160);
+}
+
 
 /////////////////////////////////////////////////////////////////////////////
 bool BlockDataManager_FileRefs::isTxFinal(Tx & tx)
@@ -31,6 +31,12 @@
 #include "BinaryData.h"
 #include "BtcUtils.h"
 #include "BlockObj.h"
+#include "TxHashIndex.h"
+#include "TxOutSpendIndex.h"
+#include "UtxoSet.h"
+#include "AddrHistoryIndex.h"
+#include "BlockHeaderStore.h"
+#include "BloomFilter.h"
 
 #include "cryptlib.h"
 #include "sha.h"
@@ -47,6 +53,26 @@
 #define MIN_CONFIRMATIONS   6
 #define COINBASE_MATURITY 120
 
+// The parallel loader reads the blkXXXX.dat files in pieces of this size, 
+// and passes them between its pipeline stages
+#define PARALLEL_LOAD_CHUNK_SIZE (16*1048576)
+
+// Blockchain index snapshot file.  Bump the version whenever the layout of
+// the file changes, old snapshots will simply be ignored (full load).
+// The DIGEST_BYTES are the bytes at the end of each blk file that are 
+// hashed to make sure the file hasn't been replaced since the snapshot.
+#define BDM_SNAPSHOT_MAGIC         "ARMIDXSN"
+#define BDM_SNAPSHOT_VERSION       4
+#define BDM_SNAPSHOT_DIGEST_BYTES  4096
+
+// Per-wallet scan state file, same idea (and same rules for the version)
+#define WALLET_STATE_MAGIC         "ARMWLTST"
+#define WALLET_STATE_VERSION       1
+
+// addImportedAddresses/registerImportedAddresses take this many bytes per
+// address:  the 20-byte hash160, then the creation block as a uint32_t
+#define ADDR_IMPORT_BYTES          24
+
 using namespace std;
 
 class BlockDataManager_FileRefs;
@@ -135,6 +161,12 @@ public:
    IdxColorID getColor();
    bool matchesColor(IdxColorID color);
 
+   // For the wallet state file.  TxRefs are saved as their hash prefix, the
+   // same way the BDM finds them, so unserialize fails if the BDM doesn't
+   // have the tx.  The zero-conf fields aren't saved.
+   void serialize(BinaryWriter & bw) const;
+   bool unserialize(BinaryRefReader & brr);
+
 private:
    uint64_t  amount_;
    TxRef*    txPtrOfOutput_;
@@ -252,6 +284,9 @@ public:
    IdxColorID getColor() { return color_; }
    bool matchesColor(IdxColorID color);
 
+   void serialize(BinaryWriter & bw) const;
+   void unserialize(BinaryRefReader & brr);
+
 private:
    
 
@@ -447,11 +482,115 @@ private:
 };
 
 
+////////////////////////////////////////////////////////////////////////////////
+//
+// BalanceCache
+//
+// Keeps the full/spendable/unconfirmed balances of an address or wallet, so
+// the GUI polling them doesn't walk every TxIOPair on every call.  Whether a
+// txio counts depends on main-branch and zero-conf state that lives in the
+// BDM, and a txio doesn't know which addresses/wallets point to it, so we
+// don't try to keep running sums with deltas.  Instead, the owner calls
+// invalidate() when it changes its own txios, and the BDM bumps its txio
+// generation for everything else (new blocks, reorgs, zero-conf purges).
+// The next query after either one recomputes all three balances in one pass.
+//
+// Spendable and unconfirmed also depend on currBlk, so those are recomputed
+// when they're asked for with a different one (i.e. when the top block
+// changes).  Per-color sums are only collected once a specific color has
+// been asked for.
+//
+////////////////////////////////////////////////////////////////////////////////
+class BalanceCache
+{
+public:
+   BalanceCache(void) : generation_(0), blk_(0) { invalidate(); }
+
+   void     invalidate(void) { isValid_ = false; colorsValid_ = false; }
+
+   // Returns true if the caller needs to pass all its txios to addTxIO()
+   // and then call finishRecompute(), before reading the balances
+   bool     startQuery(uint32_t currBlk, bool needBlk, IdxColorID color);
+   void     addTxIO(TxIOPair & txio);
+   void     finishRecompute(void);
+
+   uint64_t getFull(IdxColorID color) const;
+   uint64_t getSpendable(IdxColorID color) const;
+   uint64_t getUnconfirmed(IdxColorID color) const;
+
+private:
+   struct Sums
+   {
+      Sums(void) : full_(0), spendable_(0), unconfirmed_(0) {}
+      uint64_t full_;
+      uint64_t spendable_;
+      uint64_t unconfirmed_;
+   };
+
+   Sums const * getSums(IdxColorID color) const;
+
+   uint32_t              generation_;
+   bool                  isValid_;
+   bool                  colorsValid_;
+   bool                  withColors_;
+   bool                  colorsResolved_;
+   uint32_t              blk_;
+   Sums                  total_;
+   map<IdxColorID, Sums> byColor_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+//
+// LedgerIndex
+//
+// Paged and range queries on a ledger, so the GUI can ask for the rows it's
+// about to show instead of copying the whole vector through SWIG on every
+// refresh.  The ledger is still the owner's vector<LedgerEntry>, this keeps
+// it sorted by (block, index) and remembers how much of it was already
+// checked.  New entries are nearly always appended in order, so keeping it
+// sorted only costs a comparison per new entry.  The owner calls
+// invalidate() when entries that were already there change (reorg, sort,
+// removing invalid entries, clearing).
+//
+// Timestamps aren't quite in block order, so time ranges go through a list
+// of positions sorted by time.  It's built by the first time query, and new
+// entries are merged into it after that.
+//
+////////////////////////////////////////////////////////////////////////////////
+class LedgerIndex
+{
+public:
+   LedgerIndex(void) { invalidate(); }
+
+   void invalidate(void) { numChecked_ = 0; timeOrder_.clear(); }
+
+   // These add the matching entries to the end of entries.  Block and time 
+   // ranges include the start and exclude the end.
+   void getPage(vector<LedgerEntry> & ledger,
+                uint32_t startIdx, uint32_t numEntries,
+                vector<LedgerEntry> & entries);
+   void getBlockRange(vector<LedgerEntry> & ledger,
+                      uint32_t blkStart, uint32_t blkEnd,
+                      vector<LedgerEntry> & entries);
+   void getTimeRange(vector<LedgerEntry> & ledger,
+                     uint32_t timeStart, uint32_t timeEnd,
+                     vector<LedgerEntry> & entries);
+
+private:
+   void update(vector<LedgerEntry> & ledger);
+   void updateTimeOrder(vector<LedgerEntry> & ledger);
+
+   uint32_t         numChecked_;
+   vector<uint32_t> timeOrder_;
+};
+
+
 class BtcWallet;
 
 ////////////////////////////////////////////////////////////////////////////////
 //
-// BtcAddress  
+// BtcAddress
 //
 // This class is only for scanning the blockchain (information only).  It has
 // no need to keep track of the public and private keys of various addresses,
@@ -534,6 +673,11 @@ private:
    vector<TxIOPair*>     relevantTxIOPtrsZC_;
    vector<LedgerEntry>   ledger_;
    vector<LedgerEntry>   ledgerZC_;
+
+   LedgerIndex           ledgerIndex_;
+
+   BalanceCache          balances_;
+   void updateBalances(uint32_t currBlk, bool needBlk, IdxColorID color);
 };
 
 
@@ -547,7 +691,7 @@ private:
 class BtcWallet
 {
 public:
-   BtcWallet(void) : bdmPtr_(NULL) {}
+   BtcWallet(void) : scannedUpToBlk_(0), bdmPtr_(NULL) {}
    ~BtcWallet(void);
 
    /////////////////////////////////////////////////////////////////////////////
@@ -585,6 +729,13 @@ public:
                       uint32_t      lastTimestamp,
                       uint32_t      lastBlockNum);
 
+   // Lots of imported addresses at once (ADDR_IMPORT_BYTES each, creation
+   // block UINT32_MAX for "don't know").  The wallet and the BDM both get 
+   // them in one pass in address order, and nothing is scanned until the 
+   // next scanBlockchainForTx, which does one rescan for all of them from 
+   // the lowest creation block.  Returns how many the wallet didn't have.
+   uint32_t addImportedAddresses(BinaryData const & packedAddrs);
+
    bool hasAddr(BinaryData const & addr20);
 
 
@@ -613,6 +764,7 @@ public:
    // only a convenience, if you want to be able to calculate numConf from
    // the Utxos in the list.  If you don't care (i.e. you only want to 
    // know what TxOuts are available to spend, you can pass in 0 for currBlk
+   uint64_t getFullBalance(void);
    uint64_t getFullBalanceX(IdxColorID color);
    uint64_t getSpendableBalance(uint32_t currBlk=0);
    uint64_t getSpendableBalanceX(IdxColorID color,uint32_t currBlk=0);
@@ -633,6 +785,23 @@ public:
 
    vector<LedgerEntry>       getZeroConfLedger(BinaryData const * addr160=NULL);
    vector<LedgerEntry>       getTxLedger(BinaryData const * addr160=NULL); 
+
+   // The same entries as getTxLedger, sorted by (block, index), but only the
+   // ones asked for.  These cost about the number of entries returned, not
+   // the size of the ledger.  For "what's new since I last looked", pass 
+   // one more than the last block you've already got to SinceBlock.
+   uint32_t                  getTxLedgerSize(BinaryData const * addr160=NULL);
+   vector<LedgerEntry>       getTxLedgerPage(uint32_t startIdx, 
+                                             uint32_t numEntries,
+                                             BinaryData const * addr160=NULL);
+   vector<LedgerEntry>       getTxLedgerByBlock(uint32_t blkStart, 
+                                                uint32_t blkEnd,
+                                                BinaryData const * addr160=NULL);
+   vector<LedgerEntry>       getTxLedgerByTime(uint32_t timeStart, 
+                                               uint32_t timeEnd,
+                                               BinaryData const * addr160=NULL);
+   vector<LedgerEntry>       getTxLedgerSinceBlock(uint32_t blkStart,
+                                                   BinaryData const * addr160=NULL);
    map<OutPoint, TxIOPair> & getTxIOMap(void)    {return txioMap_;}
    map<OutPoint, TxIOPair> & getNonStdTxIO(void) {return nonStdTxioMap_;}
 
@@ -643,22 +812,52 @@ public:
 
    void setBdmPtr(BlockDataManager_FileRefs * bdmptr) {bdmPtr_=bdmptr;}
    void clearBlkData(void);
+   void updateLedgersAfterReorg(set<HashString> const & txInvalid,
+                                map<HashString, uint32_t> const & newHeights);
    
    vector<AddressBookEntry> createAddressBook(void);
 
+   // Every block before this one has been scanned into the wallet
+   uint32_t getScannedUpToBlk(void) const   { return scannedUpToBlk_; }
+   void     setScannedUpToBlk(uint32_t blk) { scannedUpToBlk_ = blk; }
+
+   // What the blockchain scans put in the wallet (not zero-conf), for the 
+   // BDM's wallet state file.  unserializeState fails, and leaves the wallet
+   // empty, if the wallet doesn't have the same addresses it had when saved
+   void serializeState(BinaryWriter & bw);
+   bool unserializeState(BinaryRefReader & brr);
+
 private:
    vector<BtcAddress*>          addrPtrVect_;
    map<HashString, BtcAddress>  addrMap_;
    map<OutPoint, TxIOPair>      txioMap_;
-
+   BalanceCache                 balances_;
+   void updateBalances(uint32_t currBlk, bool needBlk, IdxColorID color);
+
+   // Almost nothing isMineBulkFilter looks at is in addrMap_ or txioMap_, so
+   // it checks these first.  They're only ever added to, an address or txio
+   // that was removed just stays a false positive.
+   BloomFilter                  addrBloom_;
+   BloomFilter                  txioBloom_;
+   void addToAddrBloom(HashString const & addr160);
+   BtcAddress* findAddrPtr(HashString const & addr20);
+   void addToTxioBloom(OutPoint const & op);
 
    vector<LedgerEntry>          ledgerAllAddr_;  
    vector<LedgerEntry>          ledgerAllAddrZC_;  
+   LedgerIndex                  ledgerIndex_;
+
+   // The wallet ledger, or one of the address ledgers.  NULL if addr160
+   // isn't in this wallet
+   vector<LedgerEntry>* getLedgerAndIndex(BinaryData const * addr160,
+                                          LedgerIndex* & ledgerIndex);
 
    // For non-std transactions
    map<OutPoint, TxIOPair>      nonStdTxioMap_;
    set<OutPoint>                nonStdUnspentOutPoints_;
 
+   uint32_t                     scannedUpToBlk_;
+
    BlockDataManager_FileRefs*       bdmPtr_;
 };
 
@@ -710,6 +909,41 @@ public:
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Remembers the HASH160 of pubkeys from pay-to-pubkey TxOuts that we already
+// hashed, so that a rescan doesn't have to hash them all again.  It's
+// direct-mapped:  each pubkey has exactly one slot it can go in (picked from
+// its x-coordinate, which is already random), and a new one just overwrites
+// whatever was there.  So a lookup is one compare and the memory is fixed,
+// but it only helps a full rescan as much as it can hold.  Off (0 slots)
+// unless the BDM is told otherwise.
+class PubKeyHashMemo
+{
+public:
+   PubKeyHashMemo(void) : numSlots_(0), numHits_(0), numMisses_(0) {}
+
+   // Rounded down to a power of 2.  0 turns it off and frees the memory.
+   void     setNumSlots(uint32_t n);
+   uint32_t getNumSlots(void) const { return numSlots_; }
+
+   bool     lookup(uint8_t const * pubkey65, uint8_t * hash160Out);
+   void     store(uint8_t const * pubkey65, uint8_t const * hash160);
+
+   uint64_t getNumHits(void) const   { return numHits_; }
+   uint64_t getNumMisses(void) const { return numMisses_; }
+
+private:
+   uint8_t* getSlot(uint8_t const * pubkey65);
+
+   // Each slot is a flag byte (1 if used), the pubkey, then its hash
+   vector<uint8_t> slots_;
+   uint32_t        numSlots_;
+   uint64_t        numHits_;
+   uint64_t        numMisses_;
+};
+
+
+
 
 
 
@@ -756,6 +990,37 @@ typedef enum
 class BlockDataManager_FileRefs;
 
 
+////////////////////////////////////////////////////////////////////////////////
+// One block that failed verifyBlkFileIntegrity.  The check reads the blk
+// files directly, so this could be a block that never made it into the
+// header map at all.  blockHeight_ is UINT32_MAX for those, and orphans.
+class BlockIntegrityFailure
+{
+public:
+   BlockIntegrityFailure(void) :
+         fileIndex0Idx_(0),
+         fileOffset_(0),
+         blockHash_(0),
+         blockHeight_(UINT32_MAX),
+         badMerkleRoot_(false),
+         badProofOfWork_(false),
+         badTxData_(false) { }
+
+   uint32_t      fileIndex0Idx_;
+   uint32_t      fileOffset_;       // where the header starts
+   HashString    blockHash_;
+   uint32_t      blockHeight_;
+   bool          badMerkleRoot_;
+   bool          badProofOfWork_;
+   bool          badTxData_;        // the tx list couldn't even be parsed
+
+   bool operator<(BlockIntegrityFailure const & f2) const 
+   { 
+      if(fileIndex0Idx_ != f2.fileIndex0Idx_)
+         return fileIndex0Idx_ < f2.fileIndex0Idx_;
+      return fileOffset_ < f2.fileOffset_;
+   }
+};
 
 
 
@@ -773,16 +1038,29 @@ private:
    // All blkXXXX.dat files stored in this directory
    string                             blkFileDir_;
 
-   // Store the full BlockHeaders in this map.  Store TxRefs in another map
-   map<HashString, BlockHeader>       headerMap_;
+   // All the BlockHeaders, by hash.  Same deal as the txIndex_ below, the
+   // headers live in slabs in the store so pointers to them stay valid
+   BlockHeaderStore                   headerStore_;
 
-   // We index Tx in a multimap, indexed by first X bytes of the hash
-   // If we need to get a tx by hash, get list of all of the ones with the
-   // matching prefix, and then compute hashes to find it.
-   // Saves a ton of space relative at the expense of search time
-   multimap<HashString, TxRef>        txHintMap_;
+   // Every tx in the blockchain, by hash.  The TxRefs live in slabs inside
+   // the index, so pointers to them are good until the next Reset()
+   TxHashIndex                        txIndex_;
    map<HashString, Tx>                selectedTxMap_;
 
+   // Which tx spends each TxOut on the main chain, if it's turned on
+   bool                               useSpendIndex_;
+   TxOutSpendIndex                    spendIndex_;
+
+   // Every unspent TxOut on the main chain, if it's turned on.  It's up to
+   // date through utxoTopPtr_, which is NULL if nothing's in it yet
+   bool                               useUtxoSet_;
+   UtxoSet                            utxoSet_;
+   BlockHeader*                       utxoTopPtr_;
+
+   // Every address in the blockchain and the tx that touch it, if it's on
+   bool                               useAddrHistory_;
+   AddrHistoryIndex                   addrHistory_;
+
    
    // Need a separate memory pool just for zero-confirmation transactions
    // We need the second map to make sure we can find the data to remove
@@ -810,14 +1088,38 @@ private:
    set<HashString>                    txJustInvalidated_;
    set<HashString>                    txJustAffected_;
 
+   // Bumped whenever something changes whether the TxIOPairs held by the
+   // wallets count toward a balance, see BalanceCache
+   uint32_t                           txioGeneration_;
+
    // Store info on orphan chains
    vector<BlockHeader*>               previouslyValidBlockHeaderPtrs_;
    vector<BlockHeader*>               orphanChainStartBlocks_;
 
+   // Headers that didn't trace down to genesis the last time we looked.
+   // organizeChainIncremental retries these, in case the new block is the
+   // parent they were missing
+   vector<BlockHeader*>               orphanHeaderPtrs_;
+
    static BlockDataManager_FileRefs*  theOnlyBDM_;
    static bool                        bdmCreatedYet_;
    bool                               isInitialized_;
 
+   // 1 means the original single-threaded load, 0 means use all cores
+   uint32_t                           numLoadThreads_;
+
+   // Where the blockchain index snapshot is kept (empty means don't use one)
+   string                             snapshotFile_;
+
+   // Progress of verifyBlkFileIntegrity, which other threads can check on
+   // (or cancel) while it runs
+   Mutex                              integrityMutex_;
+   uint64_t                           integrityBytesTotal_;
+   uint64_t                           integrityBytesDone_;
+   uint32_t                           integrityBlocksDone_;
+   bool volatile                      integrityCancel_;
+   vector<BlockIntegrityFailure>      integrityFailures_;
+
 
    // These will be set for the specific network we are testing
    BinaryData GenesisHash_;
@@ -835,6 +1137,26 @@ private:
    set<OutPoint>                      registeredOutPoints_;
    uint32_t                           allRegAddrScannedUpToBlk_; // one past top
 
+   // registeredAddrScan checks every address and outpoint it sees against
+   // these before the map/set above, and almost all of them stop here.
+   // They have to see every insert into registeredAddrMap_ and
+   // registeredOutPoints_, so always go through these functions.
+   BloomFilter                        regAddrBloom_;
+   BloomFilter                        regOutPointBloom_;
+   void     addRegisteredAddrToBloom(HashString const & addr160);
+   void     registerTxFromAddrHistory(HashString const & addr160);
+   void     insertRegisteredOutPoint(OutPoint const & op);
+   void     rebuildRegisteredBlooms(void);
+
+   // Pay-to-pubkey TxOuts have to be HASH160'd before registeredAddrScan
+   // can check them.  The callers that scan a whole block queue up all of
+   // them first and hash them in one batch, and registeredAddrScan takes
+   // the hashes off the front of the queue as it gets to each pubkey.
+   vector<uint8_t const *>            pubKeyQueuePtrs_;
+   BinaryData                         pubKeyQueueHashes_;
+   uint32_t                           pubKeyQueueNext_;
+   PubKeyHashMemo                     pubKeyMemo_;
+
    ColorMan                           colorMan_;
 
 private:
@@ -876,8 +1198,8 @@ public:
    uint32_t getTopBlockHeight(void) {return getTopBlockHeader().getBlockHeight();}
 
 
-   uint32_t getNumTx(void) { return txHintMap_.size(); }
-   uint32_t getNumHeaders(void) { return headerMap_.size(); }
+   uint32_t getNumTx(void) { return txIndex_.size(); }
+   uint32_t getNumHeaders(void) { return headerStore_.size(); }
 
    /////////////////////////////////////////////////////////////////////////////
    // If you register you wallet with the BDM, it will automatically maintain 
@@ -892,6 +1214,14 @@ public:
    bool     registerNewAddress(HashString addr160);
    bool     registerImportedAddress(HashString addr160, uint32_t createBlk=0);
    bool     unregisterAddress(HashString addr160);
+
+   // The same as addImportedAddresses, without a wallet.  The list version
+   // wants (hash160, createBlk) sorted by address with no duplicates, which
+   // is what addImportedAddresses already has.  Both return how many 
+   // weren't registered yet.
+   uint32_t registerImportedAddresses(BinaryData const & packedAddrs);
+   uint32_t registerImportedAddressList(
+                     vector<pair<HashString, uint32_t> > const & sortedAddrs);
    uint32_t evalLowestBlockNextScan(void);
    uint32_t evalLowestAddressCreationBlock(void);
    bool     evalRescanIsRequired(void);
@@ -899,22 +1229,37 @@ public:
    void     updateRegisteredAddresses(uint32_t newTopBlk);
 
    bool     walletIsRegistered(BtcWallet & wlt);
-   bool     addressIsRegistered(HashString addr160);
+   bool     addressIsRegistered(HashString const & addr160);
    void     insertRegisteredTxIfNew(HashString txHash);
    void     registeredAddrScan( Tx & theTx );
    void     registeredAddrScan( uint8_t const * txptr,
                                 uint32_t txSize=0,
                                 vector<uint32_t> * txInOffsets=NULL,
                                 vector<uint32_t> * txOutOffsets=NULL);
+   void     queuePubKeyTxOuts(uint8_t const * txptr,
+                              vector<uint32_t> const & txOutOffsets);
+   void     hashPubKeyQueue(void);
+   void     clearPubKeyQueue(void);
+   void     getPubKeyHash160(uint8_t const * pubkey65, BinaryData & hash160);
+
+   // Remember up to this many pubkey->HASH160 results between scans, so a
+   // rescan can skip hashing them again (0, the default, turns it off)
+   void     setPubKeyHashMemoSize(uint32_t n) { pubKeyMemo_.setNumSlots(n); }
+   uint32_t getPubKeyHashMemoSize(void)       { return pubKeyMemo_.getNumSlots(); }
+   uint64_t getPubKeyHashMemoHits(void)       { return pubKeyMemo_.getNumHits(); }
+   uint64_t getPubKeyHashMemoMisses(void)     { return pubKeyMemo_.getNumMisses(); }
+
    void     resetRegisteredWallets(void);
    void     pprintRegisteredWallets(void);
 
    // Parsing requires the data TO ALREADY BE IN ITS PERMANENT MEMORY LOCATION
-   // Pass in a wallet if you want to update the initialScanTxHashes_/OutPoints_
+   // If the tx hashes were already computed (by the parallel loader), pass
+   // them in as one flat array of 32-byte hashes and they won't be redone
    bool     parseNewBlockData(BinaryRefReader & rawBlockDataReader,
                               uint32_t fileIndex,
                               uint32_t thisHeaderOffset,
-                              uint32_t blockSize);
+                              uint32_t blockSize,
+                              uint8_t const * preCalcTxHashes=NULL);
                      
 
 
@@ -922,6 +1267,47 @@ public:
    uint32_t parseEntireBlockchain(string blkdir, 
                                   uint32_t cacheSz=DEFAULT_CACHE_SIZE);
 
+   // Set this before parseEntireBlockchain to spread the initial load over
+   // multiple threads.  The result is identical to the single-threaded load.
+   // 1 (default) is single-threaded, 0 picks the number of cores
+   void     setNumLoadThreads(uint32_t n) { numLoadThreads_ = n; }
+   uint32_t getNumLoadThreads(void)       { return numLoadThreads_; }
+
+   // Access the blk files through read-only memory maps instead of the
+   // ifstream+cache.  Much faster on 64-bit, don't use it on 32-bit once
+   // the blockchain gets big (the ifstream is used for any file that
+   // can't be mapped, though).  Can be set any time.
+   void setUseMemoryMappedFiles(bool b)
+                  { FileDataPtr::getGlobalCacheRef().setUseMemoryMap(b); }
+   bool getUseMemoryMappedFiles(void)
+                  { return FileDataPtr::getGlobalCacheRef().getUseMemoryMap(); }
+
+   // Set this before parseEntireBlockchain, and the headers, tx locations, 
+   // chain organization and registered-address scan results will be saved
+   // to this file after the load.  On the next load, they're read back from
+   // the snapshot and only the blocks added since then are parsed.  If the
+   // snapshot doesn't match the blk files, we just do the full load again.
+   void     setSnapshotFile(string filename) { snapshotFile_ = filename; }
+   string   getSnapshotFile(void)            { return snapshotFile_; }
+
+   // parseEntireBlockchain calls this, but you may want to call it again 
+   // before shutting down, to save any blocks that came in after the load
+   bool     writeSnapshotFile(string filename);
+
+   // The scan results of one wallet, so it doesn't have to be rescanned
+   // from scratch on every launch.  readWalletState puts them back in the
+   // (registered) wallet and returns the block to continue scanning from:
+   //
+   //    uint32_t startBlk = bdm.readWalletState(wlt, filename);
+   //    bdm.scanBlockchainForTx(wlt, startBlk);
+   //
+   // It returns 0 if the file is missing, or no good for this wallet or
+   // blockchain.  If the blocks it was saved at were reorganized away since
+   // then, the wallet ledgers are fixed up the same as after any other
+   // reorg, and the block after the branch point is returned.
+   bool     writeWalletState(BtcWallet & wlt, string filename);
+   uint32_t readWalletState(BtcWallet & wlt, string filename);
+
    // When we add new block data, we will need to store/copy it to its
    // permanent memory location before parsing it.
    // These methods return (blockAddSucceeded, newBlockIsTop, didCauseReorg)
@@ -937,8 +1323,8 @@ public:
    bool hasTxWithHash(BinaryData const & txhash, bool inclZeroConf=true);
    bool hasHeaderWithHash(BinaryData const & txhash) const;
 
-   uint32_t getNumBlocks(void) const { return headerMap_.size(); }
-   uint32_t getNumTx(void) const { return txHintMap_.size(); }
+   uint32_t getNumBlocks(void) const { return headerStore_.size(); }
+   uint32_t getNumTx(void) const { return txIndex_.size(); }
 
    vector<BlockHeader*> getHeadersNotOnMainChain(void);
 
@@ -959,12 +1345,68 @@ public:
                                    uint32_t blkStart=0,
                                    uint32_t blkEnd=UINT32_MAX);
 
+   // Same as the two above, for many wallets at once.  Every registered tx
+   // is read from disk only once, for all of them.
+   void scanBlockchainForWallets(vector<BtcWallet*> wltList,
+                                 uint32_t startBlknum=0,
+                                 uint32_t endBlknum=UINT32_MAX);
+   void scanRegisteredTxForWallets(vector<BtcWallet*> & wltList,
+                                   uint32_t blkStart=0,
+                                   uint32_t blkEnd=UINT32_MAX);
+
 
  
-   // This is extremely slow and RAM-hungry, but may be useful on occasion
    uint32_t       readBlkFileUpdate(void);
-   bool           verifyBlkFileIntegrity(void);
+
+   // Reads every blk file straight through and checks the merkle root and
+   // proof-of-work of every block in it, using nThreads (0 means one per 
+   // core).  Returns true if nothing was wrong.  The blockchain has to be
+   // loaded first, that's how it knows where the files are.  The rest of
+   // these can be called from another thread while it's running.
+   bool           verifyBlkFileIntegrity(uint32_t nThreads=0);
+   void           cancelIntegrityCheck(void)   { integrityCancel_ = true; }
+   bool           integrityCheckWasCancelled(void) { return integrityCancel_; }
+   double         getIntegrityCheckProgress(void);
+   uint32_t       getIntegrityCheckBlocksDone(void);
+   vector<BlockIntegrityFailure> getIntegrityFailures(void);
    //vector<TxRef*> findAllNonStdTx(void);
+
+
+   // Keep track of which tx spends every TxOut in the blockchain (not just
+   // the registered ones), so that "is this spent?" doesn't need a scan.
+   // Costs about 4 bytes per tx and per TxOut.  Best to turn it on before
+   // parseEntireBlockchain, so it's built while the blocks are parsed.  If
+   // it's turned on afterwards, it has to read through the blockchain again.
+   // Only the main chain counts, zero-conf tx don't.
+   void     setUseSpendIndex(bool b);
+   bool     getUseSpendIndex(void) { return useSpendIndex_; }
+   TxRef *  getSpendingTxRef(OutPoint const & op);
+   TxRef *  getSpendingTxRef(BinaryData const & txHash, uint32_t txOutIndex);
+   bool     isTxOutSpent(BinaryData const & txHash, uint32_t txOutIndex);
+
+
+   // Keep the set of all unspent TxOuts, so the balance and UTXOs of any
+   // address are one lookup, even one that was just imported and hasn't
+   // been scanned for yet (its wallet still has to scan for its history,
+   // the set doesn't know about spent TxOuts).  Costs about 48 bytes per 
+   // UTXO plus the tables.  Like the spend index, best turned on before the
+   // blockchain is loaded, otherwise it's built by reading the whole chain
+   // again.
+   void     setUseUtxoSet(bool b);
+   bool     getUseUtxoSet(void) { return useUtxoSet_; }
+   uint64_t getAddrBalance(BinaryData const & addr160);
+   vector<UnspentTxOut> getUnspentTxOutsForAddr(BinaryData const & addr160);
+
+
+   // Keep the history of every address in the blockchain:  which tx pay it
+   // and which spend from it.  Then prefixSearchAddress works, and any
+   // address imported into a registered wallet gets its whole ledger without
+   // a rescan.  Costs about 4 bytes per TxOut, a few bytes per TxIn/TxOut 
+   // of history, and ~70 bytes per address.  Best turned on before the load,
+   // so it's built in the same pass (and saved in the snapshot).
+   void     setUseAddrHistory(bool b);
+   bool     getUseAddrHistory(void) { return useAddrHistory_; }
+   vector<TxRef*> getAddrTxList(BinaryData const & addr160);
    
 
    // For zero-confirmation tx-handling
@@ -984,6 +1426,11 @@ public:
    //        blockchain containing two equal-length chains
    bool organizeChain(bool forceRebuild=false);
 
+   // Same as organizeChain(), but only looks at what could have changed by
+   // adding newHead:  O(1) if it extends the top block, otherwise only its
+   // branch.  Returns false on a reorg, just like organizeChain
+   bool organizeChainIncremental(BlockHeader & newHead);
+
    /////////////////////////////////////////////////////////////////////////////
    bool             isLastBlockReorg(void)     {return lastBlockWasReorg_;}
    set<HashString>  getTxJustInvalidated(void) {return txJustInvalidated_;}
@@ -992,6 +1439,10 @@ public:
    void             updateWalletsAfterReorg(vector<BtcWallet*> wltvect);
    void             updateWalletsAfterReorg(set<BtcWallet*> wltset);
 
+   // Cached wallet/address balances from an older generation are recomputed
+   uint32_t         getTxioGeneration(void) const {return txioGeneration_;}
+   void             bumpTxioGeneration(void)      {txioGeneration_++;}
+
    // Use these two methods to get ALL information about your unused TxOuts
    //vector<UnspentTxOut> getUnspentTxOutsForWallet(BtcWallet & wlt, int sortType=-1);
    //vector<UnspentTxOut> getNonStdUnspentTxOutsForWallet(BtcWallet & wlt);
@@ -1008,8 +1459,11 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    // A couple random methods to expose internal data structures for testing.
    // These methods should not be used for nominal operation.
-   multimap<HashString, TxRef> &  getTxHintMapRef(void) { return txHintMap_; }
-   map<HashString, BlockHeader> & getHeaderMapRef(void) { return headerMap_; }
+   TxHashIndex &                  getTxIndexRef(void) { return txIndex_; }
+   TxOutSpendIndex &              getSpendIndexRef(void) { return spendIndex_; }
+   UtxoSet &                      getUtxoSetRef(void) { return utxoSet_; }
+   AddrHistoryIndex &             getAddrHistoryRef(void) { return addrHistory_; }
+   BlockHeaderStore &             getHeaderStoreRef(void) { return headerStore_; }
    deque<BlockHeader*> &          getHeadersByHeightRef(void) { return headersByHeight_;}
 
 private:
@@ -1021,6 +1475,51 @@ private:
    double traceChainDown(BlockHeader & bhpStart);
    void   markOrphanChain(BlockHeader & bhpStart);
 
+   // Walk down from topBlockPtr_ to the first block already on the main
+   // branch, marking the new part.  Returns false (and un-marks the old
+   // branch) if prevTopBlockPtr_ is no longer on the main chain
+   bool   markMainBranch(void);
+
+   // Used by parseEntireBlockchain when numLoadThreads_ != 1
+   bool   parseBlockFilesParallel(uint32_t numFiles, uint32_t & nBlkRead);
+
+   // Add or remove the spends of every tx in the block.  Removing skips any
+   // tx that is still on the main chain (it can be in two blocks on a fork)
+   void   indexBlockSpends(BlockHeader* bhptr, bool isAdd);
+   void   rebuildSpendIndex(void);
+
+   // The UTXO set goes forward one block at a time from utxoTopPtr_, and
+   // back again (re-reading the spent TxOuts from the blk files) when the
+   // top block turns out not to be on the main chain.  The pubkey cursor
+   // is for using the HASH160s in the pubkey queue while parsing.
+   // Script type and addr160 of a (serialized) TxOut.  Pay-to-pubkey takes
+   // the HASH160 from the pubkey queue if the cursor is on it
+   TXOUT_SCRIPT_TYPE getTxOutAddr160(uint8_t const * txOutPtr,
+                                     uint8_t * addr160Out,
+                                     uint32_t & pubKeyCursor);
+
+   void   addTxOutToUtxoSet(uint32_t txIdx, uint32_t txOutIdx, 
+                            uint8_t const * txOutPtr, uint32_t & pubKeyCursor);
+   void   applyTxToUtxoSet(uint32_t txIdx, uint8_t const * txPtr,
+                           vector<uint32_t> const & offsetsIn,
+                           vector<uint32_t> const & offsetsOut,
+                           uint32_t & pubKeyCursor);
+   void   connectBlockUtxos(BlockHeader* bhptr);
+   void   disconnectBlockUtxos(BlockHeader* bhptr);
+   bool   extendsUtxoTop(BlockHeader* bhptr);
+   void   syncUtxoSet(void);
+
+   // Only called for tx that are new to the txIndex_
+   void   indexTxAddrHistory(uint32_t txIdx, uint8_t const * txPtr,
+                             vector<uint32_t> const & offsetsIn,
+                             vector<uint32_t> const & offsetsOut,
+                             uint32_t & pubKeyCursor);
+   void   rebuildAddrHistory(void);
+
+   // Used by parseEntireBlockchain when snapshotFile_ is set.  Returns false
+   // (leaving the maps empty) if there's no valid snapshot for these files
+   bool   readSnapshotFile(string filename);
+
 
    
 };
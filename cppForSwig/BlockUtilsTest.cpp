@@ -14,8 +14,10 @@
 #include "BinaryData.h"
 #include "BtcUtils.h"
 #include "BlockUtils.h"
+#include "CoinSelection.h"
 #include "EncryptionUtils.h"
 #include "FileDataPtr.h"
+#include "Sha256.h"
 
 
 using namespace std;
@@ -34,8 +36,29 @@ void TestZeroConf(void);
 void TestCrypto(void);
 void TestECDSA(void);
 void TestPointCompression(void);
+void TestSha256(void);
+void TestHash160Batch(void);
 void TestFileCache(void);
+void TestFileCacheEviction(void);
+void TestFileCacheThreads(uint32_t nThreads=0);
 void TestMemoryUsage_UseSystemMonitor(string blkdir);
+void TestParallelLoad(string blkdir, uint32_t nThreads=0);
+void TestBlockchainSnapshot(string blkdir);
+void TestTxLookupSpeed(string blkdir, uint32_t nLookups=100000);
+void TestVerifyBlkFileIntegrity(string blkdir, uint32_t nThreads=0);
+void TestBlkFileUpdateSpeed(string blkdir, string tempBlkDir, uint32_t nBlocks=200);
+void TestSpendIndex(string blkdir, string tempBlkDir);
+void TestUtxoSet(string blkdir, string tempBlkDir);
+void TestAddrHistory(string blkdir, string tempBlkDir);
+void TestRegisteredAddrBloom(string blkdir, uint32_t nRandAddr=100000);
+void TestScanTxWalletSize(string blkdir);
+void TestMultiWalletScan(string blkdir, string tempBlkDir, uint32_t nWallets=20);
+void TestIncrementalBalances(string blkdir, string tempBlkDir, uint32_t nPolls=1000);
+void TestPagedLedger(string blkdir, uint32_t nQueries=1000);
+void TestWalletState(string blkdir, string tempBlkDir);
+void TestCoinSelection(uint32_t nUtxos=100000);
+void TestBulkAddressImport(string blkdir, uint32_t nRandAddr=1000000);
+void TestRegisterBeforeLoad(string blkdir);
 
 void CreateMultiBlkFile(string blkdir);
 ////////////////////////////////////////////////////////////////////////////////
@@ -129,8 +152,71 @@ int main(void)
    //printTestHeader("ECDSA Point Compression");
    //TestPointCompression();
 
+   //printTestHeader("SHA256-Engines");
+   //TestSha256();
+
+   //printTestHeader("Batched-HASH160");
+   //TestHash160Batch();
+
    //printTestHeader("Testing file cache");
    //TestFileCache();
+
+   //printTestHeader("File-Cache-Eviction");
+   //TestFileCacheEviction();
+
+   //printTestHeader("File-Cache-Threads");
+   //TestFileCacheThreads();
+
+   //printTestHeader("Parallel-Blockchain-Load");
+   //TestParallelLoad(blkdir);
+
+   //printTestHeader("Blockchain-Snapshot");
+   //TestBlockchainSnapshot(blkdir);
+
+   //printTestHeader("Tx-Lookup-Speed");
+   //TestTxLookupSpeed(blkdir);
+
+   //printTestHeader("Verify-Blkfile-Integrity");
+   //TestVerifyBlkFileIntegrity(blkdir);
+
+   //printTestHeader("Blkfile-Update-Speed");
+   //TestBlkFileUpdateSpeed(blkdir, "./blkupdatetest");
+
+   //printTestHeader("TxOut-Spend-Index");
+   //TestSpendIndex(blkdir, "./spendindextest");
+
+   //printTestHeader("UTXO-Set");
+   //TestUtxoSet(blkdir, "./utxotest");
+
+   //printTestHeader("Address-History-Index");
+   //TestAddrHistory(blkdir, "./addrhisttest");
+
+   //printTestHeader("Registered-Address-Bloom-Filter");
+   //TestRegisteredAddrBloom(blkdir);
+
+   //printTestHeader("ScanTx-Wallet-Size");
+   //TestScanTxWalletSize(blkdir);
+
+   //printTestHeader("Multi-Wallet-Scan");
+   //TestMultiWalletScan(blkdir, "./multiwallettest");
+
+   //printTestHeader("Incremental-Balances");
+   //TestIncrementalBalances(blkdir, "./balancetest");
+
+   //printTestHeader("Paged-Ledger");
+   //TestPagedLedger(blkdir);
+
+   //printTestHeader("Wallet-State");
+   //TestWalletState(blkdir, "./walletstatetest");
+
+   //printTestHeader("Coin-Selection");
+   //TestCoinSelection(100000);
+
+   //printTestHeader("Bulk-Address-Import");
+   //TestBulkAddressImport(blkdir, 1000000);
+
+   //printTestHeader("Register-Before-Load");
+   //TestRegisterBeforeLoad(blkdir);
    
    
    /////////////////////////////////////////////////////////////////////////////
@@ -1312,6 +1398,280 @@ void TestPointCompression(void)
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Known-answer tests for every SHA256 engine this CPU supports, each one also
+// checked against Crypto++ on random messages of all sizes.  Then how fast
+// each engine is, next to the Crypto++ SHA256 we used to use.
+void TestSha256(void)
+{
+   // The NIST examples, plus the genesis block header (double-SHA256)
+   string kat1M(1000000, 'a');
+   char const * katMsg[4] = 
+   { 
+      "", 
+      "abc", 
+      "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+      kat1M.c_str()
+   };
+   char const * katHash[4] = 
+   {
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855",
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1",
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0"
+   };
+   BinaryData genesisHeader = BinaryData::CreateFromHex(
+      "0100000000000000000000000000000000000000000000000000000000000000"
+      "000000003ba3edfd7a7b12b27ac72c3e67768f617fc81bc3888a51323a9fb8aa"
+      "4b1e5e4a29ab5f49ffff001d1dac2b7c");
+   BinaryData genesisHash = BinaryData::CreateFromHex(MAINNET_GENESIS_HASH_HEX);
+
+   CryptoPP::SHA256 cryptoppSha;
+   BinaryData hashOut(32);
+   BinaryData hashRef(32);
+   Sha256::Engine bestEngine = Sha256::getEngine();
+   for(uint32_t e=0; e<Sha256::NUM_ENGINES; e++)
+   {
+      Sha256::Engine eng = (Sha256::Engine)e;
+      if(!Sha256::setEngine(eng))
+      {
+         cout << Sha256::getEngineName(eng) << ":  not supported by this CPU" << endl;
+         continue;
+      }
+
+      bool katOkay = true;
+      for(uint32_t i=0; i<4; i++)
+      {
+         Sha256::hash((uint8_t const *)katMsg[i], strlen(katMsg[i]), hashOut.getPtr());
+         if(hashOut.toHexStr() != string(katHash[i]))
+            katOkay = false;
+      }
+      Sha256::doubleHash(genesisHeader.getPtr(), HEADER_SIZE, hashOut.getPtr());
+      if(!(hashOut == genesisHash))
+         katOkay = false;
+
+      // Every length up to a few blocks, to hit all the padding cases
+      bool randOkay = true;
+      BinaryData msg(4096);
+      for(uint32_t i=0; i<msg.getSize(); i++)
+         msg[i] = (uint8_t)(rand() % 256);
+      for(uint32_t len=0; len<msg.getSize(); len += (len<300 ? 1 : 37))
+      {
+         cryptoppSha.CalculateDigest(hashRef.getPtr(), msg.getPtr(), len);
+         cryptoppSha.CalculateDigest(hashRef.getPtr(), hashRef.getPtr(), 32);
+         Sha256::doubleHash(msg.getPtr(), len, hashOut.getPtr());
+         if(!(hashOut == hashRef))
+            randOkay = false;
+      }
+
+      // Batches of different sizes, with messages of all different lengths
+      // so the lanes finish at different times
+      bool batchOkay = true;
+      for(uint32_t nMsg=0; nMsg<70; nMsg+=3)
+      {
+         vector<uint8_t const *> ptrs(nMsg+1);
+         vector<uint32_t>        sizes(nMsg+1);
+         BinaryData batchOut(32*nMsg+32);
+         for(uint32_t i=0; i<nMsg; i++)
+         {
+            sizes[i] = (i%5==0 ? rand()%2000 : rand()%300);
+            ptrs[i]  = msg.getPtr() + rand()%(msg.getSize()-sizes[i]);
+         }
+         Sha256::doubleHashBatch(&ptrs[0], &sizes[0], nMsg, batchOut.getPtr());
+         for(uint32_t i=0; i<nMsg; i++)
+         {
+            Sha256::doubleHash(ptrs[i], sizes[i], hashOut.getPtr());
+            if(!(hashOut == batchOut.getSliceCopy(32*i, 32)))
+               batchOkay = false;
+         }
+      }
+
+      cout << Sha256::getEngineName(eng) << ":" << endl;
+      cout << "   Known-answer tests:   " << (katOkay ? "PASSED" : "***FAILED***") << endl;
+      cout << "   Matches Crypto++:     " << (randOkay ? "PASSED" : "***FAILED***") << endl;
+      cout << "   Batch matches single: " << (batchOkay ? "PASSED" : "***FAILED***") << endl;
+   }
+
+   // Speed for tx-sized messages, and for one big one.  Engine -1 is Crypto++
+   uint32_t msgSizes[2]  = { 250, 1024*1024 };
+   uint32_t totalBytes   = 64*1024*1024;
+   BinaryData bigMsg(msgSizes[1]);
+   for(uint32_t i=0; i<bigMsg.getSize(); i++)
+      bigMsg[i] = (uint8_t)(i%256);
+
+   for(uint32_t s=0; s<2; s++)
+   {
+      uint32_t msgSize = msgSizes[s];
+      uint32_t nMsg    = totalBytes / msgSize;
+      cout << endl << "Double-SHA256 speed, " << msgSize << "-byte messages:" << endl;
+      double cryptoppMBps = 0;
+      for(int32_t e=-1; e<(int32_t)Sha256::NUM_ENGINES; e++)
+      {
+         if(e>=0 && !Sha256::setEngine((Sha256::Engine)e))
+            continue;
+
+         double t0 = ThreadUtils::getWallClockSec();
+         for(uint32_t i=0; i<nMsg; i++)
+         {
+            // Move around a bit so it's not the same bytes every time
+            uint8_t const * ptr = bigMsg.getPtr() + (s==0 ? (i*61)%(bigMsg.getSize()-msgSize) : 0);
+            if(e<0)
+            {
+               cryptoppSha.CalculateDigest(hashOut.getPtr(), ptr, msgSize);
+               cryptoppSha.CalculateDigest(hashOut.getPtr(), hashOut.getPtr(), 32);
+            }
+            else
+               Sha256::doubleHash(ptr, msgSize, hashOut.getPtr());
+         }
+         double sec  = ThreadUtils::getWallClockSec() - t0;
+         double MBps = (double)nMsg * msgSize / (1024*1024) / max(sec, 1e-6);
+         if(e<0)
+            cryptoppMBps = MBps;
+
+         cout << "   " << (e<0 ? "Crypto++" : Sha256::getEngineName((Sha256::Engine)e))
+              << ":  " << MBps << " MB/s  (" << MBps/cryptoppMBps << "x)" << endl;
+      }
+   }
+
+   // Batched, tx-sized messages, like a block full of small tx
+   uint32_t nBatch = totalBytes / msgSizes[0];
+   vector<uint8_t const *> batchPtrs(nBatch);
+   vector<uint32_t>        batchSizes(nBatch, msgSizes[0]);
+   BinaryData              batchOut(32*nBatch);
+   for(uint32_t i=0; i<nBatch; i++)
+      batchPtrs[i] = bigMsg.getPtr() + (i*61)%(bigMsg.getSize()-msgSizes[0]);
+
+   cout << endl << "Batched double-SHA256 speed, " << msgSizes[0] << "-byte messages:" << endl;
+   for(uint32_t e=0; e<Sha256::NUM_ENGINES; e++)
+   {
+      if(!Sha256::setEngine((Sha256::Engine)e))
+         continue;
+
+      double t0 = ThreadUtils::getWallClockSec();
+      for(uint32_t i=0; i<nBatch; i++)
+         Sha256::doubleHash(batchPtrs[i], batchSizes[i], batchOut.getPtr()+32*i);
+      double t1 = ThreadUtils::getWallClockSec();
+      Sha256::doubleHashBatch(&batchPtrs[0], &batchSizes[0], nBatch, batchOut.getPtr());
+      double t2 = ThreadUtils::getWallClockSec();
+
+      double mb = (double)nBatch * msgSizes[0] / (1024*1024);
+      double singleMBps = mb / max(t1-t0, 1e-6);
+      double batchMBps  = mb / max(t2-t1, 1e-6);
+      cout << "   " << Sha256::getEngineName((Sha256::Engine)e) << ":  " 
+           << singleMBps << " MB/s one at a time,  " 
+           << batchMBps  << " MB/s batched  ("
+           << batchMBps/singleMBps << "x)" << endl;
+   }
+
+   Sha256::setEngine(bestEngine);
+   cout << endl << "Using engine: " << Sha256::getEngineName(Sha256::getEngine()) << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The batched HASH160 (used for pay-to-pubkey TxOuts) against the regular
+// one, for every engine, and how much faster it is on 65-byte pubkeys.  Also
+// that the pubkey memo gives back what was put in it.
+void TestHash160Batch(void)
+{
+   // The genesis coinbase pubkey and its address
+   BinaryData genesisPubKey = BinaryData::CreateFromHex(
+      "04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb6"
+      "49f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f");
+   BinaryData genesisAddr = BinaryData::CreateFromHex(
+      "62e907b15cbf27d5425399ebf6f0fb50ebb88f18");
+
+   uint32_t nKeys = 100000;
+   BinaryData pubKeys(65*nKeys);
+   for(uint32_t i=0; i<pubKeys.getSize(); i++)
+      pubKeys[i] = (uint8_t)(rand() % 256);
+   for(uint32_t i=0; i<nKeys; i++)
+      pubKeys[65*i] = 0x04;
+   vector<uint8_t const *> keyPtrs(nKeys);
+   vector<uint32_t>        keySizes(nKeys, 65);
+   for(uint32_t i=0; i<nKeys; i++)
+      keyPtrs[i] = pubKeys.getPtr() + 65*i;
+
+   BinaryData hashOut(20);
+   BinaryData batchOut(20*nKeys);
+   Sha256::Engine bestEngine = Sha256::getEngine();
+   for(uint32_t e=0; e<Sha256::NUM_ENGINES; e++)
+   {
+      Sha256::Engine eng = (Sha256::Engine)e;
+      if(!Sha256::setEngine(eng))
+      {
+         cout << Sha256::getEngineName(eng) << ":  not supported by this CPU" << endl;
+         continue;
+      }
+
+      bool katOkay = true;
+      uint8_t const * genPtr  = genesisPubKey.getPtr();
+      uint32_t        genSize = 65;
+      BtcUtils::getHash160Batch(&genPtr, &genSize, 1, hashOut.getPtr());
+      if(!(hashOut == genesisAddr))
+         katOkay = false;
+
+      // Every batch size up to a few full sets of lanes, so the leftovers
+      // that don't fill the lanes get checked too, plus some other lengths
+      bool batchOkay = true;
+      for(uint32_t nMsg=0; nMsg<40; nMsg++)
+      {
+         vector<uint32_t> sizes(keySizes.begin(), keySizes.begin()+nMsg+1);
+         for(uint32_t i=0; i<nMsg; i+=3)
+            sizes[i] = rand() % 65;
+         BtcUtils::getHash160Batch(&keyPtrs[0], &sizes[0], nMsg, batchOut.getPtr());
+         for(uint32_t i=0; i<nMsg; i++)
+         {
+            BtcUtils::getHash160(keyPtrs[i], sizes[i], hashOut);
+            if(!(hashOut == batchOut.getSliceCopy(20*i, 20)))
+               batchOkay = false;
+         }
+      }
+
+      double t0 = ThreadUtils::getWallClockSec();
+      for(uint32_t i=0; i<nKeys; i++)
+         BtcUtils::getHash160_NoSafetyCheck(keyPtrs[i], 65, hashOut);
+      double t1 = ThreadUtils::getWallClockSec();
+      BtcUtils::getHash160Batch(&keyPtrs[0], &keySizes[0], nKeys, batchOut.getPtr());
+      double t2 = ThreadUtils::getWallClockSec();
+
+      cout << Sha256::getEngineName(eng) << ":" << endl;
+      cout << "   Genesis address:      " << (katOkay ? "PASSED" : "***FAILED***") << endl;
+      cout << "   Batch matches single: " << (batchOkay ? "PASSED" : "***FAILED***") << endl;
+      cout << "   " << nKeys << " pubkeys:  " 
+           << t1-t0 << "s one at a time,  " 
+           << t2-t1 << "s batched  ("
+           << (t1-t0)/max(t2-t1, 1e-6) << "x)" << endl;
+   }
+   Sha256::setEngine(bestEngine);
+
+   // The memo, with more keys than slots so some get overwritten
+   PubKeyHashMemo memo;
+   memo.setNumSlots(1000);
+   bool memoOkay = (memo.getNumSlots() == 512);
+   BtcUtils::getHash160Batch(&keyPtrs[0], &keySizes[0], 2000, batchOut.getPtr());
+   for(uint32_t i=0; i<2000; i++)
+      memo.store(keyPtrs[i], batchOut.getPtr() + 20*i);
+   uint32_t nFound = 0;
+   for(uint32_t i=0; i<2000; i++)
+   {
+      if(!memo.lookup(keyPtrs[i], hashOut.getPtr()))
+         continue;
+      nFound++;
+      if(!(hashOut == batchOut.getSliceCopy(20*i, 20)))
+         memoOkay = false;
+   }
+   if(nFound == 0 || nFound > 512 || memo.getNumHits() != nFound)
+      memoOkay = false;
+   memo.setNumSlots(0);
+   if(memo.lookup(keyPtrs[0], hashOut.getPtr()))
+      memoOkay = false;
+
+   cout << endl << "PubKey memo:  " << (memoOkay ? "PASSED" : "***FAILED***") 
+        << "  (" << nFound << " of 2000 still in 512 slots)" << endl;
+}
+
+
 
 void TestFileCache(void)
 {
@@ -1424,9 +1784,260 @@ void TestFileCache(void)
       cout << fdrefs[i].getDataCopy().toHexStr() << endl;
 
 
-      
+   // Now the same requests through memory-mapped files, should be identical
+   // (requests bigger than the cache are read straight from the file above,
+   // so those should match, too)
+   vector<BinaryData> fromStream(fdrefs.size());
+   for(uint32_t i=0; i<fdrefs.size(); i++)
+      fromStream[i] = fdrefs[i].getDataCopy();
+
+   fdcache.setUseMemoryMap(true);
+   bool allMatch = true;
+   for(uint32_t i=0; i<nTestFiles; i++)
+      cout << "File " << i << " mapped: " << fdcache.isFileMapped(i) << endl;
+   for(uint32_t i=0; i<fdrefs.size(); i++)
+      if( fromStream[i].getSize() > 0 && 
+          !(fdrefs[i].getDataCopy() == fromStream[i]) )
+         allMatch = false;
+   cout << "Memory-mapped data matches: " << (allMatch ? "YES" : "NO") << endl;
+
+   TIMER_START("MmapHit_50000");
+   for(uint32_t i=0; i<50000; i++)
+   {
+      fdrMiss1.getUnsafeDataPtr();
+      fdrMiss2.getUnsafeDataPtr();
+   }
+   TIMER_STOP("MmapHit_50000");
+
+   // Append to the last file, and make sure the remap picks it up
+   ofstream os(filenames[nTestFiles-1].c_str(), ios::app | ios::binary);
+   os << "mmapgrow";
+   os.close();
+   uint32_t oldSize = fdcache.getLastFileSize();
+   fdcache.refreshLastFile();
+   FileDataPtr fdrGrow(nTestFiles-1, oldSize, 8);
+   cout << "Remapped after grow: " << fdrGrow.getDataCopy().toHexStr() << endl;
+   fdcache.setUseMemoryMap(false);
+
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Uses its own 16 kB cache, not the global one.  A full cache should only
+// evict as much as it needs to, and a few chunks that keep getting used 
+// should survive a scan that's bigger than the whole cache.
+void TestFileCacheEviction(void)
+{
+   string fn("test_file_cache_evict.dat");
+   uint32_t fileSize = 256*1024;
+   ofstream os(fn.c_str(), ios::out | ios::binary);
+   for(uint32_t j=0; j<fileSize; j++)
+      os << (uint8_t)(j%256);
+   os.close();
+
+   FileDataCache fdc(16*1024);
+   fdc.openFile(0, fn);
+   bool dataOkay = true;
+
+   // Fill it up exactly, then one more chunk
+   for(uint32_t i=0; i<17; i++)
+      fdc.getCachedDataPtr(FileDataPtr(0, i*1024, 1024));
+   cout << "Evictions when full: " << fdc.getNumEvictions() << endl;
+   cout << "Only evicted what was needed:  " 
+        << (fdc.getNumEvictions()==1 ? "PASSED" : "***FAILED***") << endl;
+
+   // A piece out of the middle of a cached chunk is still a hit
+   uint64_t hitsBefore = fdc.getNumCacheHits();
+   uint8_t* ptr = fdc.getCachedDataPtr(FileDataPtr(0, 16*1024+100, 50));
+   if(ptr==NULL || ptr[0] != (16*1024+100)%256)
+      dataOkay = false;
+   cout << "Sub-range of cached chunk hits: " 
+        << (fdc.getNumCacheHits()==hitsBefore+1 ? "PASSED" : "***FAILED***") << endl;
+
+   // Each round uses the same 4 hot chunks twice, with 24 kB of scan in 
+   // between (in 1 kB chunks, each read twice in a row, like a pre-cached 
+   // chunk would be).  After the first round the hot chunks should always 
+   // hit, even though the scan alone would push everything out of an LRU.
+   fdc.resetCacheCounters();
+   uint32_t scanOffset = 64*1024;
+   uint32_t hotMisses = 0;
+   for(uint32_t round=0; round<20; round++)
+   {
+      for(uint32_t pass=0; pass<2; pass++)
+      {
+         for(uint32_t h=0; h<4; h++)
+         {
+            FileDataPtr fdp(0, 8*1024 + h*1024, 1024);
+            uint64_t missesBefore = fdc.getNumCacheMisses();
+            ptr = fdc.getCachedDataPtr(fdp);
+            if(ptr==NULL || ptr[0] != (fdp.getStartByte()%256))
+               dataOkay = false;
+            if(round>0 && fdc.getNumCacheMisses() > missesBefore)
+               hotMisses++;
+         }
+
+         uint32_t nScan = (pass==0 ? 4 : 20);
+         for(uint32_t c=0; c<nScan; c++)
+         {
+            FileDataPtr fdp(0, scanOffset, 1024);
+            FileDataPtr fdpPart(0, scanOffset+512, 256);
+            ptr = fdc.getCachedDataPtr(fdp);
+            if(ptr==NULL || ptr[7] != ((scanOffset+7)%256))
+               dataOkay = false;
+            ptr = fdc.getCachedDataPtr(fdpPart);
+            if(ptr==NULL || ptr[0] != ((scanOffset+512)%256))
+               dataOkay = false;
+            scanOffset += 1024;
+            if(scanOffset+1024 > fileSize)
+               scanOffset = 64*1024;
+         }
+      }
+   }
+   fdc.pprintCacheState();
+   cout << "Hot-chunk misses after 1st round: " << hotMisses << endl;
+   cout << "Hot chunks survive the scan:   " 
+        << (hotMisses==0 ? "PASSED" : "***FAILED***") << endl;
+   cout << "Cache never over its size:     "
+        << (fdc.getCacheUsed() <= fdc.getCacheSize() ? "PASSED" : "***FAILED***") << endl;
+   cout << "All data read correctly:       " 
+        << (dataOkay ? "PASSED" : "***FAILED***") << endl;
+
+   fdc.clear();
+   remove(fn.c_str());
+
+   // A cache too small to give every shard CACHE_MIN_SHARD_SIZE has to use
+   // fewer of them, not go over its size.  The same file opened as every 
+   // file index puts the reads in every shard there is.
+   string bigFn("test_file_cache_shards.dat");
+   ofstream osBig(bigFn.c_str(), ios::out | ios::binary);
+   osBig.seekp(CACHE_MIN_SHARD_SIZE-1);
+   osBig.put(0);
+   osBig.close();
+
+   FileDataCache fdcSmall(3*CACHE_MIN_SHARD_SIZE);
+   for(uint32_t f=0; f<CACHE_MAX_SHARDS; f++)
+      fdcSmall.openFile(f, bigFn);
+   uint64_t mostUsed = 0;
+   for(uint32_t f=0; f<CACHE_MAX_SHARDS; f++)
+   {
+      for(uint32_t c=0; c<CACHE_MIN_SHARD_SIZE; c+=64*1024)
+         fdcSmall.getCachedDataPtr(FileDataPtr(f, c, 64*1024));
+      mostUsed = max(mostUsed, fdcSmall.getCacheUsed());
+   }
+   bool wholeBlockOkay = (fdcSmall.getCachedDataPtr(
+                           FileDataPtr(0, 0, CACHE_MIN_SHARD_SIZE)) != NULL);
+   cout << "Most used by a " << fdcSmall.getCacheSize()/(1024*1024.0) 
+        << " MB cache: " << mostUsed/(1024*1024.0) << " MB" << endl;
+   cout << "Small cache never over size:   "
+        << (mostUsed <= fdcSmall.getCacheSize() ? "PASSED" : "***FAILED***") << endl;
+   cout << "Still room for a whole block:  "
+        << (wholeBlockOkay ? "PASSED" : "***FAILED***") << endl;
+   fdcSmall.clear();
+   remove(bigFn.c_str());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+struct CacheThreadArgs
+{
+   FileDataCache* cache_;
+   uint32_t       fileSize_;
+   uint32_t       nReads_;
+   uint32_t       seed_;
+   uint32_t       nBad_;
+};
+
+// Random reads, each one checked against the known byte pattern.  Half of
+// them go through copyData, half through getThreadSafeDataPtr.
+void* cacheReaderThread(void* arg)
+{
+   CacheThreadArgs & cta = *(CacheThreadArgs*)arg;
+   uint32_t rnd = cta.seed_;
+   BinaryData buffer;
+   BinaryData dst(4096);
+   cta.nBad_ = 0;
+   for(uint32_t i=0; i<cta.nReads_; i++)
+   {
+      rnd = rnd*1103515245 + 12345;
+      uint32_t nBytes = 1 + (rnd>>8) % 4000;
+      rnd = rnd*1103515245 + 12345;
+      uint32_t start = (rnd>>4) % (cta.fileSize_ - nBytes);
+      FileDataPtr fdp(0, start, nBytes);
+
+      uint8_t const * ptr;
+      if(i%2==0)
+         ptr = (cta.cache_->copyData(fdp, dst.getPtr()) ? dst.getPtr() : NULL);
+      else
+         ptr = cta.cache_->getThreadSafeDataPtr(fdp, buffer);
+
+      if(ptr==NULL || ptr[0] != start%256 || ptr[nBytes-1] != (start+nBytes-1)%256)
+         cta.nBad_++;
+   }
+   return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Hammer one small cache from a bunch of threads at once, both through the
+// cache and through the memory mapping.  Every read is checked, and the 
+// throughput is compared against doing the same reads in one thread.
+void TestFileCacheThreads(uint32_t nThreads)
+{
+   if(nThreads==0)
+      nThreads = ThreadUtils::getNumCores();
+
+   string fn("test_file_cache_threads.dat");
+   uint32_t fileSize = 64*1024*1024;
+   ofstream os(fn.c_str(), ios::out | ios::binary);
+   BinaryData pattern(1024*1024);
+   for(uint32_t j=0; j<pattern.getSize(); j++)
+      pattern[j] = (uint8_t)(j%256);
+   for(uint32_t j=0; j<fileSize/pattern.getSize(); j++)
+      os.write((char*)pattern.getPtr(), pattern.getSize());
+   os.close();
 
+   uint32_t nReadsTotal = 400000;
+   for(uint32_t mmap=0; mmap<2; mmap++)
+   {
+      FileDataCache fdc(4*1024*1024);
+      fdc.setUseMemoryMap(mmap==1);
+      fdc.openFile(0, fn);
 
+      for(uint32_t pass=0; pass<2; pass++)
+      {
+         uint32_t nThr = (pass==0 ? 1 : nThreads);
+         vector<CacheThreadArgs> args(nThr);
+         vector<ThreadHandle>    threads(nThr);
+         vector<bool>            started(nThr);
+         double t0 = ThreadUtils::getWallClockSec();
+         for(uint32_t t=0; t<nThr; t++)
+         {
+            args[t].cache_    = &fdc;
+            args[t].fileSize_ = fileSize;
+            args[t].nReads_   = nReadsTotal / nThr;
+            args[t].seed_     = 1000 + t;
+            started[t] = ThreadUtils::startThread(threads[t], cacheReaderThread, &args[t]);
+            if(!started[t])
+               cacheReaderThread(&args[t]);
+         }
+         uint32_t nBad = 0;
+         for(uint32_t t=0; t<nThr; t++)
+         {
+            if(started[t])
+               ThreadUtils::joinThread(threads[t]);
+            nBad += args[t].nBad_;
+         }
+         double sec = ThreadUtils::getWallClockSec() - t0;
+
+         cout << (mmap==1 ? "Mapped, " : "Cached, ") << nThr << " thread(s): "
+              << nReadsTotal/max(sec,1e-6) << " reads/s, bad reads: " << nBad 
+              << "  " << (nBad==0 ? "PASSED" : "***FAILED***") << endl;
+      }
+      cout << "   hits: " << fdc.getNumCacheHits() 
+           << "  misses: " << fdc.getNumCacheMisses()
+           << "  evictions: " << fdc.getNumEvictions() << endl;
+      fdc.clear();
+   }
+   remove(fn.c_str());
 }
 
 
@@ -1521,10 +2132,10 @@ void TestMemoryUsage_UseSystemMonitor(string blkdir)
    bdm.parseEntireBlockchain(blkdir);  
 
    char a[256];
-   cout << "About to clear txHintMap" << endl;
+   cout << "About to clear txIndex" << endl;
    cin >> a;
    
-   bdm.getTxHintMapRef().clear();
+   bdm.getTxIndexRef().clear();
 
    cin >> a;
    cout << "About to clear txPtrs in headers" << endl;
@@ -1534,25 +2145,2062 @@ void TestMemoryUsage_UseSystemMonitor(string blkdir)
       bdm.getHeadersByHeightRef()[i]->getTxRefPtrList().clear();
       
    cin >> a;
-   cout << "About to clear Headers datacopy" << endl;
+   cout << "About to clear header store" << endl;
    cin >> a;
 
-   for(uint32_t i=0; i<bdm.getTopBlockHeight(); i++)
-      bdm.getHeadersByHeightRef()[i]->clearDataCopy();
+   bdm.getHeaderStoreRef().clear();
 
    cin >> a;
 }
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Dump everything the BDM knows about the blockchain into a string, so that
+// two different ways of loading it can be compared
+string getBlockchainStateString(BlockDataManager_FileRefs & bdm)
+{
+   stringstream ss;
+   // Headers and tx are both sorted by hash, so it doesn't matter what 
+   // order they were added in
+   BlockHeaderStore & hstore = bdm.getHeaderStoreRef();
+   vector<string> hdrLines(hstore.size());
+   for(uint32_t h=0; h<hstore.size(); h++)
+   {
+      BlockHeader & bh = *(hstore.getHeaderByIndex(h));
+      FileDataPtr fdp = bh.getBlockFilePtr();
+      stringstream hss;
+      hss << bh.getThisHash().toHexStr() << " " << bh.getBlockHeight() << " "
+          << bh.isMainBranch() << " " << bh.getNextHash().toHexStr() << " "
+          << fdp.getFileIndex() << " " << fdp.getStartByte() << endl;
+      for(uint32_t i=0; i<bh.getNumTx(); i++)
+      {
+         FileDataPtr txfdp = bh.getTxRefPtrList()[i]->getBlkFilePtr();
+         hss << "   " << txfdp.getFileIndex() << " " << txfdp.getStartByte() 
+             << " " << txfdp.getNumBytes() << endl;
+      }
+      hdrLines[h] = hss.str();
+   }
+   sort(hdrLines.begin(), hdrLines.end());
+   for(uint32_t h=0; h<hdrLines.size(); h++)
+      ss << hdrLines[h];
+
+   TxHashIndex & txIndex = bdm.getTxIndexRef();
+   vector<string> txLines(txIndex.size());
+   for(uint32_t i=0; i<txIndex.size(); i++)
+   {
+      TxRef* txptr = txIndex.getTxRefByIndex(i);
+      stringstream txss;
+      txss << txptr->getHashPrefixRef().toHexStr() << " " 
+           << txptr->getBlkFilePtr().getStartByte() << " "
+           << txptr->getBlockHeight() << endl;
+      txLines[i] = txss.str();
+   }
+   sort(txLines.begin(), txLines.end());
+   for(uint32_t i=0; i<txLines.size(); i++)
+      ss << txLines[i];
+
+   for(uint32_t h=0; h<bdm.getHeadersByHeightRef().size(); h++)
+      ss << h << " " << bdm.getHeaderByHeight(h)->getThisHash().toHexStr() << endl;
+
+   ss << "Top: " << bdm.getTopBlockHeight() << endl;
+   return ss.str();
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Load the blockchain single-threaded, then again with the parallel loader,
+// and make sure we end up with exactly the same headers, tx and chain
+void TestParallelLoad(string blkdir, uint32_t nThreads)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   
+   vector<string> results(2);
+   for(uint32_t pass=0; pass<2; pass++)
+   {
+      bdm.Reset();
+      bdm.setNumLoadThreads(pass==0 ? 1 : nThreads);
+      string timerName = (pass==0 ? "LoadBlockchain_Serial" : "LoadBlockchain_Parallel");
+      TIMER_START(timerName);
+      bdm.parseEntireBlockchain(blkdir);  
+      TIMER_STOP(timerName);
+      results[pass] = getBlockchainStateString(bdm);
+   }
+   bdm.setNumLoadThreads(1);
+
+   cout << "Serial:   " << TIMER_READ_SEC("LoadBlockchain_Serial") << "s" << endl;
+   cout << "Parallel: " << TIMER_READ_SEC("LoadBlockchain_Parallel") << "s" << endl;
+   cout << "Parallel load matches serial load:  " 
+        << (results[0]==results[1] ? "PASSED" : "***FAILED***") << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Full load that writes a snapshot, then a load from that snapshot, which
+// should give exactly the same thing.  Then break the snapshot and make sure
+// we notice, and fall back to the full load.
+void TestBlockchainSnapshot(string blkdir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   string snapFile("blockchain_snapshot_test.bin");
+   remove(snapFile.c_str());
+   bdm.setSnapshotFile(snapFile);
+
+   vector<string> results(3);
+   for(uint32_t pass=0; pass<3; pass++)
+   {
+      // Before the last pass, flip a byte in the middle of the snapshot
+      if(pass==2)
+      {
+         fstream fs(snapFile.c_str(), ios::in | ios::out | ios::binary);
+         fs.seekg(0, ios::end);
+         uint32_t mid = (uint32_t)fs.tellg() / 2;
+         fs.seekg(mid, ios::beg);
+         char c = fs.get();
+         fs.seekp(mid, ios::beg);
+         fs.put(c ^ 0x01);
+         fs.close();
+      }
+
+      bdm.Reset();
+      string timerName = (pass==1 ? "LoadBlockchain_Snapshot" : "LoadBlockchain_Full");
+      TIMER_START(timerName);
+      bdm.parseEntireBlockchain(blkdir);  
+      TIMER_STOP(timerName);
+      results[pass] = getBlockchainStateString(bdm);
+   }
+   bdm.setSnapshotFile("");
+   remove(snapFile.c_str());
+
+   cout << "Full:     " << TIMER_READ_SEC("LoadBlockchain_Full")/2 << "s" << endl;
+   cout << "Snapshot: " << TIMER_READ_SEC("LoadBlockchain_Snapshot") << "s" << endl;
+   cout << "Snapshot load matches full load:     " 
+        << (results[0]==results[1] ? "PASSED" : "***FAILED***") << endl;
+   cout << "Corrupt snapshot falls back to full: " 
+        << (results[0]==results[2] ? "PASSED" : "***FAILED***") << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Time tx lookups by hash, in random order.  The hashes are collected from
+// the headers first, so the timed part is only the lookups themselves.
+// getTxRefPtrByHash is the pure index lookup, getTxByHash also has to read
+// the tx from the blk file.
+void TestTxLookupSpeed(string blkdir, uint32_t nLookups)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   vector<BinaryData> txHashes;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+         txHashes.push_back(txList[i]->getThisHash());
+   }
+
+   vector<BinaryData> lookups(nLookups);
+   vector<BinaryData> missing(nLookups);
+   srand(0);
+   for(uint32_t i=0; i<nLookups; i++)
+   {
+      lookups[i] = txHashes[rand() % txHashes.size()];
+      // Same 4-byte prefix as a real tx, so these still have to be checked
+      missing[i] = lookups[i];
+      missing[i][4] ^= 0xff;
+   }
+   cout << "Looking up " << nLookups << " of " << txHashes.size() << " tx" << endl;
+
+   uint32_t nFound = 0;
+   TIMER_START("getTxRefPtrByHash");
+   for(uint32_t i=0; i<nLookups; i++)
+      if(bdm.getTxRefPtrByHash(lookups[i]) != NULL)
+         nFound++;
+   TIMER_STOP("getTxRefPtrByHash");
+
+   uint32_t nMissing = 0;
+   TIMER_START("getTxRefPtrByHash_Missing");
+   for(uint32_t i=0; i<nLookups; i++)
+      if(bdm.getTxRefPtrByHash(missing[i]) == NULL)
+         nMissing++;
+   TIMER_STOP("getTxRefPtrByHash_Missing");
+
+   uint32_t nTxBytes = 0;
+   TIMER_START("getTxByHash");
+   for(uint32_t i=0; i<nLookups; i++)
+      nTxBytes += bdm.getTxByHash(lookups[i]).getSize();
+   TIMER_STOP("getTxByHash");
+
+   double secRef  = TIMER_READ_SEC("getTxRefPtrByHash");
+   double secMiss = TIMER_READ_SEC("getTxRefPtrByHash_Missing");
+   double secTx   = TIMER_READ_SEC("getTxByHash");
+   cout << "Found " << nFound << ", correctly missing " << nMissing << endl;
+   cout << "getTxRefPtrByHash:          " << nLookups/max(secRef, 1e-6)  << " /s" << endl;
+   cout << "getTxRefPtrByHash (absent): " << nLookups/max(secMiss, 1e-6) << " /s" << endl;
+   cout << "getTxByHash:                " << nLookups/max(secTx, 1e-6)   << " /s" << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Cancels the integrity check from another thread, once it's a little ways in
+static void* cancelIntegrityCheckThread(void* bdmPtr)
+{
+   BlockDataManager_FileRefs & bdm = *(BlockDataManager_FileRefs*)bdmPtr;
+   while(bdm.getIntegrityCheckBlocksDone() == 0)
+      ;
+   bdm.cancelIntegrityCheck();
+   return NULL;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Verify every block in the blk files, which should all be good, then do it
+// again and cancel it partway through from another thread
+void TestVerifyBlkFileIntegrity(string blkdir, uint32_t nThreads)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   TIMER_START("verifyBlkFileIntegrity");
+   bool isGood = bdm.verifyBlkFileIntegrity(nThreads);
+   TIMER_STOP("verifyBlkFileIntegrity");
+   uint32_t nBlocks = bdm.getIntegrityCheckBlocksDone();
+   cout << "Verified " << nBlocks << " blocks in " 
+        << TIMER_READ_SEC("verifyBlkFileIntegrity") << "s" << endl;
+   cout << "All blocks good:        " 
+        << (isGood && bdm.getIntegrityFailures().size()==0 ? "PASSED" : "***FAILED***") << endl;
+   cout << "Progress at the end:    " 
+        << (bdm.getIntegrityCheckProgress()==1.0 ? "PASSED" : "***FAILED***") << endl;
+
+   ThreadHandle cancelThread;
+   ThreadUtils::startThread(cancelThread, cancelIntegrityCheckThread, &bdm);
+   isGood = bdm.verifyBlkFileIntegrity(nThreads);
+   ThreadUtils::joinThread(cancelThread);
+   cout << "Cancelled partway:      " 
+        << (!isGood && bdm.integrityCheckWasCancelled() &&
+            bdm.getIntegrityCheckBlocksDone() < nBlocks ? "PASSED" : "***FAILED***") 
+        << "  (" << bdm.getIntegrityCheckBlocksDone() << " blocks, " 
+        << 100*bdm.getIntegrityCheckProgress() << "%)" << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Copy the blockchain into tempBlkDir (which must exist), minus the last 
+// nBlocks blocks.  Load that, then append the missing blocks to the blk file
+// one at a time, calling readBlkFileUpdate after each, which is what happens
+// when Armory is running and bitcoind gets new blocks.  The end result needs
+// to be exactly the same as loading the whole thing at once.  For comparison,
+// a full organizeChain(true) is timed too -- that's roughly what each new 
+// block used to cost, before organizeChainIncremental.
+void TestBlkFileUpdateSpeed(string blkdir, string tempBlkDir, uint32_t nBlocks)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+
+   uint32_t numBlkFiles = 0;
+   while(BtcUtils::GetFileSize(BtcUtils::getBlkFilename(blkdir, numBlkFiles+1)) 
+                                                      != FILE_DOES_NOT_EXIST)
+      numBlkFiles++;
+   if(numBlkFiles == 0)
+   {
+      cout << "***ERROR:  No blk files in " << blkdir << endl;
+      return;
+   }
+
+   // Everything but the last file gets copied as-is
+   for(uint32_t f=1; f<numBlkFiles; f++)
+      copyFile(BtcUtils::getBlkFilename(blkdir,     f), 
+               BtcUtils::getBlkFilename(tempBlkDir, f));
+
+   // Find where each block starts in the last file
+   string lastFile = BtcUtils::getBlkFilename(blkdir, numBlkFiles);
+   uint32_t lastFileSize = (uint32_t)BtcUtils::GetFileSize(lastFile);
+   BinaryData lastFileData(lastFileSize);
+   ifstream is(lastFile.c_str(), ios::in | ios::binary);
+   is.read((char*)lastFileData.getPtr(), lastFileSize);
+   is.close();
+
+   vector<uint32_t> blkStarts;
+   BinaryRefReader brr(lastFileData);
+   while(brr.getSizeRemaining() >= 8)
+   {
+      blkStarts.push_back(brr.getPosition());
+      brr.advance(4);
+      uint32_t blkSize = brr.get_uint32_t();
+      if(blkSize==0 || blkSize > brr.getSizeRemaining())
+      {
+         blkStarts.pop_back();
+         break;
+      }
+      brr.advance(blkSize);
+   }
+   blkStarts.push_back(brr.getPosition());
+   nBlocks = min(nBlocks, (uint32_t)blkStarts.size()-2);
+
+   string tempLastFile = BtcUtils::getBlkFilename(tempBlkDir, numBlkFiles);
+   uint32_t firstNewBlk = blkStarts.size()-1-nBlocks;
+   ofstream os(tempLastFile.c_str(), ios::out | ios::binary);
+   os.write((char*)lastFileData.getPtr(), blkStarts[firstNewBlk]);
+   os.close();
+
+   bdm.Reset();
+   bdm.parseEntireBlockchain(tempBlkDir);
+   uint32_t startHeight = bdm.getTopBlockHeight();
+
+   uint32_t nAdded = 0;
+   for(uint32_t b=firstNewBlk; b<blkStarts.size()-1; b++)
+   {
+      ofstream osApp(tempLastFile.c_str(), ios::out | ios::binary | ios::app);
+      osApp.write((char*)lastFileData.getPtr() + blkStarts[b], 
+                  blkStarts[b+1] - blkStarts[b]);
+      osApp.close();
+
+      TIMER_START("readBlkFileUpdate_OneBlock");
+      nAdded += bdm.readBlkFileUpdate();
+      TIMER_STOP("readBlkFileUpdate_OneBlock");
+   }
+   string updatedState = getBlockchainStateString(bdm);
+
+   TIMER_START("organizeChain_FullRebuild");
+   bdm.organizeChain(true);
+   TIMER_STOP("organizeChain_FullRebuild");
+   string rebuiltState = getBlockchainStateString(bdm);
+
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   string fullState = getBlockchainStateString(bdm);
+
+   double secUpdate  = TIMER_READ_SEC("readBlkFileUpdate_OneBlock");
+   double secRebuild = TIMER_READ_SEC("organizeChain_FullRebuild");
+   cout << "Added " << nAdded << " blocks on top of block " << startHeight << endl;
+   cout << "readBlkFileUpdate:    " << 1000*secUpdate/max(nAdded,(uint32_t)1) 
+        << " ms/block" << endl;
+   cout << "organizeChain(true):  " << 1000*secRebuild << " ms" << endl;
+   cout << "Updates match full load:             " 
+        << (updatedState==fullState ? "PASSED" : "***FAILED***") << endl;
+   cout << "Full rebuild matches full load:      " 
+        << (rebuiltState==fullState ? "PASSED" : "***FAILED***") << endl;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The reorgTest blocks have a double-spend that gets reversed when 5A makes
+// the A-chain longer.  loadReorgTestChain starts tempBlkDir over with blocks
+// 0-4 and loads them, then appendReorgTestBlocks adds 3A, 4A and 5A to the
+// blk file one at a time, like new blocks coming in, and calls checkFn(bdm)
+// after each one.  Returns true if all of the checks passed.
+char const * reorgTestNewBlks[3] = { "reorgTest/blk_3A.dat", 
+                                     "reorgTest/blk_4A.dat", 
+                                     "reorgTest/blk_5A.dat" };
+
+void loadReorgTestChain(BlockDataManager_FileRefs & bdm, string tempBlkDir)
+{
+   copyFile("reorgTest/blk_0_to_4.dat", BtcUtils::getBlkFilename(tempBlkDir, 1));
+   bdm.Reset();
+   bdm.parseEntireBlockchain(tempBlkDir);
+}
+
+bool noReorgTestCheck(BlockDataManager_FileRefs & bdm) { return true; }
+
+template<class CheckFn>
+bool appendReorgTestBlocks(BlockDataManager_FileRefs & bdm, 
+                           string tempBlkDir, 
+                           CheckFn checkFn)
+{
+   string blk0001 = BtcUtils::getBlkFilename(tempBlkDir, 1);
+   bool allPassed = true;
+   for(uint32_t b=0; b<3; b++)
+   {
+      BinaryData blk;
+      blk.readBinaryFile(reorgTestNewBlks[b]);
+      ofstream os(blk0001.c_str(), ios::out | ios::binary | ios::app);
+      os.write((char*)blk.getPtr(), blk.getSize());
+      os.close();
+      bdm.readBlkFileUpdate();
+      allPassed = checkFn(bdm) && allPassed;
+   }
+   return allPassed;
+}
 
+bool appendReorgTestBlocks(BlockDataManager_FileRefs & bdm, string tempBlkDir)
+{
+   return appendReorgTestBlocks(bdm, tempBlkDir, noReorgTestCheck);
+}
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Every TxIn on the main chain should show up as the spender of its OutPoint,
+// and nothing else should be marked spent
+bool spendIndexMatchesChain(BlockDataManager_FileRefs & bdm)
+{
+   uint32_t nTxIn = 0;
+   uint32_t nBad  = 0;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+         {
+            TxIn txin = tx.getTxIn(j);
+            if(txin.isCoinbase())
+               continue;
+            nTxIn++;
+            if(bdm.getSpendingTxRef(txin.getOutPoint()) != txList[i])
+               nBad++;
+         }
+      }
+   }
+   return (nBad==0 && nTxIn==bdm.getSpendIndexRef().getNumSpent());
+}
 
+////////////////////////////////////////////////////////////////////////////////
+void TestSpendIndex(string blkdir, string tempBlkDir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.setUseSpendIndex(true);
+   TIMER_START("LoadWithSpendIndex");
+   bdm.parseEntireBlockchain(blkdir);
+   TIMER_STOP("LoadWithSpendIndex");
+
+   TxOutSpendIndex & spendIndex = bdm.getSpendIndexRef();
+   cout << "Loaded in " << TIMER_READ_SEC("LoadWithSpendIndex") << "s, "
+        << spendIndex.getNumSpent() << " of " << spendIndex.getNumTxOut() 
+        << " TxOuts spent, index is " 
+        << spendIndex.getMemoryUsage()/(1024*1024.0) << " MB" << endl;
+   cout << "Matches the main chain:       " 
+        << (spendIndexMatchesChain(bdm) ? "PASSED" : "***FAILED***") << endl;
+
+   // Ask about a bunch of random outputs
+   vector<BinaryData> txHashes;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+         txHashes.push_back(txList[i]->getThisHash());
+   }
+   uint32_t nLookups = 100000;
+   uint32_t nSpent = 0;
+   srand(0);
+   TIMER_START("isTxOutSpent");
+   for(uint32_t i=0; i<nLookups; i++)
+      if(bdm.isTxOutSpent(txHashes[rand() % txHashes.size()], rand() % 2))
+         nSpent++;
+   TIMER_STOP("isTxOutSpent");
+   cout << "isTxOutSpent:  " << nLookups/max(TIMER_READ_SEC("isTxOutSpent"),1e-6)
+        << " /s  (" << nSpent << " of " << nLookups << " spent)" << endl;
+
+   // Turning it on after the load has to build it from the blk files
+   uint32_t nSpentFromLoad = spendIndex.getNumSpent();
+   bdm.setUseSpendIndex(false);
+   bdm.setUseSpendIndex(true);
+   cout << "Rebuilt in " << TIMER_READ_SEC("rebuildSpendIndex") << "s" << endl;
+   cout << "Rebuild matches the load:     " 
+        << (spendIndex.getNumSpent()==nSpentFromLoad && spendIndexMatchesChain(bdm) ? 
+                                                "PASSED" : "***FAILED***") << endl;
+
+   // Spends that get reversed by a reorg have to come out of the index
+   loadReorgTestChain(bdm, tempBlkDir);
+   bool allMatch = spendIndexMatchesChain(bdm);
+   allMatch = appendReorgTestBlocks(bdm, tempBlkDir, spendIndexMatchesChain) && allMatch;
+   cout << "Reorg happened:               " 
+        << (bdm.isLastBlockReorg() ? "PASSED" : "***FAILED***") << endl;
+   cout << "Matches the chain after reorg: " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+   bdm.setUseSpendIndex(false);
+}
 
 
+////////////////////////////////////////////////////////////////////////////////
+// Work out every address balance the slow way, from the main chain, and make
+// sure the UTXO set agrees.  Returns one of the addresses with the most UTXOs.
+bool utxoSetMatchesChain(BlockDataManager_FileRefs & bdm, BinaryData & busyAddr)
+{
+   map<OutPoint, TxOut> unspent;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+         {
+            TxIn txin = tx.getTxIn(j);
+            if(!txin.isCoinbase())
+               unspent.erase(txin.getOutPoint());
+         }
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+            unspent[OutPoint(tx.getThisHash(), j)] = tx.getTxOut(j);
+      }
+   }
 
+   map<BinaryData, uint64_t> balances;
+   map<BinaryData, uint32_t> numUtxos;
+   map<OutPoint, TxOut>::iterator iter;
+   for(iter = unspent.begin(); iter != unspent.end(); iter++)
+   {
+      if(!iter->second.isStandard())
+         continue;
+      balances[iter->second.getRecipientAddr()] += iter->second.getValue();
+      numUtxos[iter->second.getRecipientAddr()]++;
+   }
 
+   uint32_t nBad = 0;
+   uint32_t mostUtxos = 0;
+   map<BinaryData, uint64_t>::iterator bIter;
+   for(bIter = balances.begin(); bIter != balances.end(); bIter++)
+   {
+      if(bdm.getAddrBalance(bIter->first) != bIter->second)
+         nBad++;
+      if(numUtxos[bIter->first] > mostUtxos)
+      {
+         mostUtxos = numUtxos[bIter->first];
+         busyAddr  = bIter->first;
+      }
+   }
 
+   UtxoSet & utxoSet = bdm.getUtxoSetRef();
+   return (nBad==0 && 
+           utxoSet.size()==unspent.size() && 
+           utxoSet.getNumAddresses()==balances.size());
+}
 
+////////////////////////////////////////////////////////////////////////////////
+// For appendReorgTestBlocks, which doesn't need the busiest address
+bool utxoSetMatchesChainAfterBlk(BlockDataManager_FileRefs & bdm)
+{
+   BinaryData busyAddr;
+   return utxoSetMatchesChain(bdm, busyAddr);
+}
 
+////////////////////////////////////////////////////////////////////////////////
+// Number of main-chain tx that send to or spend from the address, which is
+// how many entries its ledger should have
+uint32_t countTxForAddr(BlockDataManager_FileRefs & bdm, BinaryData const & addr160)
+{
+   set<OutPoint> addrOutPoints;
+   uint32_t nTx = 0;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         bool touchesAddr = false;
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+         {
+            TxIn txin = tx.getTxIn(j);
+            if(!txin.isCoinbase() && addrOutPoints.count(txin.getOutPoint()) > 0)
+               touchesAddr = true;
+         }
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard() && txout.getRecipientAddr() == addr160)
+            {
+               addrOutPoints.insert(OutPoint(tx.getThisHash(), j));
+               touchesAddr = true;
+            }
+         }
+         if(touchesAddr)
+            nTx++;
+      }
+   }
+   return nTx;
+}
 
+////////////////////////////////////////////////////////////////////////////////
+void TestUtxoSet(string blkdir, string tempBlkDir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.setUseUtxoSet(false);
+   TIMER_START("LoadWithoutUtxoSet");
+   bdm.parseEntireBlockchain(blkdir);
+   TIMER_STOP("LoadWithoutUtxoSet");
+
+   bdm.Reset();
+   bdm.setUseUtxoSet(true);
+   TIMER_START("LoadWithUtxoSet");
+   bdm.parseEntireBlockchain(blkdir);
+   TIMER_STOP("LoadWithUtxoSet");
+
+   UtxoSet & utxoSet = bdm.getUtxoSetRef();
+   cout << "Loaded in " << TIMER_READ_SEC("LoadWithUtxoSet") << "s (" 
+        << TIMER_READ_SEC("LoadWithoutUtxoSet") << "s without), "
+        << utxoSet.size() << " UTXOs for " << utxoSet.getNumAddresses() 
+        << " addresses, " << utxoSet.getMemoryUsage()/(1024*1024.0) << " MB" 
+        << endl;
+
+   BinaryData busyAddr;
+   cout << "Matches the main chain:       " 
+        << (utxoSetMatchesChain(bdm, busyAddr) ? "PASSED" : "***FAILED***") << endl;
+
+   // Turning it on after the load has to build it from the blk files
+   uint32_t nUtxoFromLoad = utxoSet.size();
+   bdm.setUseUtxoSet(false);
+   bdm.setUseUtxoSet(true);
+   cout << "Rebuilt in " << TIMER_READ_SEC("syncUtxoSet") << "s" << endl;
+   cout << "Rebuild matches the load:     " 
+        << (utxoSet.size()==nUtxoFromLoad && utxoSetMatchesChain(bdm, busyAddr) ? 
+                                                "PASSED" : "***FAILED***") << endl;
+
+   // An address imported into a registered wallet has its balance and UTXOs
+   // right away, but the UTXO set doesn't have its spent TxOuts, so the 
+   // wallet still has to scan for the rest of its ledger
+   BtcWallet wlt;
+   bdm.registerWallet(&wlt);
+   bdm.scanBlockchainForTx(wlt);
+   TIMER_START("ImportAddress");
+   wlt.addAddress(busyAddr);
+   TIMER_STOP("ImportAddress");
+   vector<UnspentTxOut> utxoList = bdm.getUnspentTxOutsForAddr(busyAddr);
+   uint64_t importBal = 0;
+   for(uint32_t i=0; i<utxoList.size(); i++)
+      importBal += utxoList[i].getValue();
+   bool needRescan = bdm.evalRescanIsRequired();
+   bdm.scanBlockchainForTx(wlt);
+   cout << "Imported address with " << utxoList.size() << " UTXOs in "
+        << TIMER_READ_SEC("ImportAddress") << "s" << endl;
+   cout << "UTXOs before the scan:        " 
+        << (utxoList.size() > 0 && importBal == bdm.getAddrBalance(busyAddr) ? 
+                                                "PASSED" : "***FAILED***") << endl;
+   cout << "Rescan needed for history:    " 
+        << (needRescan ? "PASSED" : "***FAILED***") << endl;
+   cout << "Wallet balance matches:       " 
+        << (wlt.getSpendableBalance() == bdm.getAddrBalance(busyAddr) ? 
+                                                "PASSED" : "***FAILED***") << endl;
+   cout << "Wallet ledger matches:        " 
+        << (wlt.getTxLedger().size() == countTxForAddr(bdm, busyAddr) ? 
+                                                "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt);
+
+   // The double-spend in the reorg has to put back the UTXO it spent
+   loadReorgTestChain(bdm, tempBlkDir);
+   bool allMatch = utxoSetMatchesChain(bdm, busyAddr);
+   allMatch = appendReorgTestBlocks(bdm, tempBlkDir, utxoSetMatchesChainAfterBlk) && allMatch;
+   cout << "Reorg happened:               " 
+        << (bdm.isLastBlockReorg() ? "PASSED" : "***FAILED***") << endl;
+   cout << "Matches the chain after reorg: " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+   bdm.setUseUtxoSet(false);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Go through the main chain the slow way, collecting the tx of every address,
+// and make sure getAddrTxList agrees for all of them
+bool addrHistoryMatchesChain(BlockDataManager_FileRefs & bdm, 
+                             vector<BinaryData> & allAddrs)
+{
+   map<BinaryData, set<BinaryData> > addrTx;
+   map<OutPoint, BinaryData> outAddr;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         BinaryData txHash = tx.getThisHash();
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+         {
+            TxIn txin = tx.getTxIn(j);
+            if(txin.isCoinbase())
+               continue;
+            map<OutPoint, BinaryData>::iterator iter;
+            iter = outAddr.find(txin.getOutPoint());
+            if(iter != outAddr.end())
+               addrTx[iter->second].insert(txHash);
+         }
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(!txout.isStandard())
+               continue;
+            outAddr[OutPoint(txHash, j)] = txout.getRecipientAddr();
+            addrTx[txout.getRecipientAddr()].insert(txHash);
+         }
+      }
+   }
+
+   uint32_t nBad = 0;
+   allAddrs.clear();
+   map<BinaryData, set<BinaryData> >::iterator aIter;
+   for(aIter = addrTx.begin(); aIter != addrTx.end(); aIter++)
+   {
+      allAddrs.push_back(aIter->first);
+      vector<TxRef*> txList = bdm.getAddrTxList(aIter->first);
+      set<BinaryData> txSet;
+      for(uint32_t i=0; i<txList.size(); i++)
+         txSet.insert(txList[i]->getThisHash());
+      if(txList.size() != txSet.size() || !(txSet == aIter->second))
+         nBad++;
+   }
+   return (nBad == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// For appendReorgTestBlocks, which doesn't need the address list
+bool addrHistoryMatchesChainAfterBlk(BlockDataManager_FileRefs & bdm)
+{
+   vector<BinaryData> allAddrs;
+   return addrHistoryMatchesChain(bdm, allAddrs);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TestAddrHistory(string blkdir, string tempBlkDir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.setUseAddrHistory(false);
+   TIMER_START("LoadWithoutAddrHistory");
+   bdm.parseEntireBlockchain(blkdir);
+   TIMER_STOP("LoadWithoutAddrHistory");
+
+   bdm.Reset();
+   bdm.setUseAddrHistory(true);
+   TIMER_START("LoadWithAddrHistory");
+   bdm.parseEntireBlockchain(blkdir);
+   TIMER_STOP("LoadWithAddrHistory");
+
+   AddrHistoryIndex & addrHist = bdm.getAddrHistoryRef();
+   cout << "Loaded in " << TIMER_READ_SEC("LoadWithAddrHistory") << "s (" 
+        << TIMER_READ_SEC("LoadWithoutAddrHistory") << "s without), "
+        << addrHist.getNumAddresses() << " addresses with " 
+        << addrHist.getNumEntries() << " TxIns/TxOuts, "
+        << addrHist.getMemoryUsage()/(1024*1024.0) << " MB" << endl;
+
+   vector<BinaryData> allAddrs;
+   cout << "Matches the main chain:       " 
+        << (addrHistoryMatchesChain(bdm, allAddrs) ? "PASSED" : "***FAILED***") << endl;
+
+   // Every address in the blockchain, by its first byte
+   BinaryData prefix = allAddrs[allAddrs.size()/2].getSliceCopy(0,1);
+   uint32_t nWithPrefix = 0;
+   for(uint32_t i=0; i<allAddrs.size(); i++)
+      if(allAddrs[i].getSliceRef(0,1) == prefix)
+         nWithPrefix++;
+   vector<BinaryData> found = bdm.prefixSearchAddress(prefix);
+   cout << "prefixSearchAddress found " << found.size() << " of " 
+        << nWithPrefix << ":     " 
+        << (found.size()==nWithPrefix ? "PASSED" : "***FAILED***") << endl;
+
+   TIMER_START("getAddrTxList");
+   uint32_t nTx = 0;
+   for(uint32_t i=0; i<allAddrs.size(); i++)
+      nTx += bdm.getAddrTxList(allAddrs[i]).size();
+   TIMER_STOP("getAddrTxList");
+   cout << "getAddrTxList:  " 
+        << allAddrs.size()/max(TIMER_READ_SEC("getAddrTxList"),1e-6) 
+        << " addresses/s  (" << nTx << " tx)" << endl;
+
+   // The busiest address gets imported into a registered wallet, and should
+   // come with its whole ledger without a rescan
+   BinaryData busyAddr;
+   uint32_t mostTx = 0;
+   for(uint32_t i=0; i<allAddrs.size(); i++)
+   {
+      uint32_t n = bdm.getAddrTxList(allAddrs[i]).size();
+      if(n > mostTx)
+      {
+         mostTx = n;
+         busyAddr = allAddrs[i];
+      }
+   }
+   BtcWallet wlt;
+   bdm.registerWallet(&wlt);
+   bdm.scanBlockchainForTx(wlt);
+   TIMER_START("ImportAddress");
+   wlt.addAddress(busyAddr);
+   TIMER_STOP("ImportAddress");
+   bool needRescan = bdm.evalRescanIsRequired();
+   bdm.scanBlockchainForTx(wlt);
+   cout << "Imported address with " << mostTx << " tx in "
+        << TIMER_READ_SEC("ImportAddress") << "s" << endl;
+   cout << "No rescan needed:             " 
+        << (needRescan ? "***FAILED***" : "PASSED") << endl;
+   cout << "Wallet ledger matches:        " 
+        << (wlt.getTxLedger().size()==mostTx ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt);
+
+   // Turning it on after the load has to build it from the blk files
+   uint64_t nEntriesFromLoad = addrHist.getNumEntries();
+   bdm.setUseAddrHistory(false);
+   bdm.setUseAddrHistory(true);
+   cout << "Rebuilt in " << TIMER_READ_SEC("rebuildAddrHistory") << "s" << endl;
+   cout << "Rebuild matches the load:     " 
+        << (addrHist.getNumEntries()==nEntriesFromLoad && 
+            addrHistoryMatchesChain(bdm, allAddrs) ? "PASSED" : "***FAILED***") << endl;
+
+   // It's saved in the snapshot, too
+   string snapFile = tempBlkDir + "/addrhist_snapshot.bin";
+   remove(snapFile.c_str());
+   bdm.Reset();
+   bdm.setSnapshotFile(snapFile);
+   bdm.parseEntireBlockchain(blkdir);
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   cout << "Restored from the snapshot:   " 
+        << (addrHist.getNumEntries()==nEntriesFromLoad && 
+            addrHistoryMatchesChain(bdm, allAddrs) ? "PASSED" : "***FAILED***") << endl;
+   bdm.setSnapshotFile("");
+   remove(snapFile.c_str());
+
+   // Tx that drop out of the main chain have to drop out of the history
+   loadReorgTestChain(bdm, tempBlkDir);
+   bool allMatch = addrHistoryMatchesChain(bdm, allAddrs);
+   allMatch = appendReorgTestBlocks(bdm, tempBlkDir, addrHistoryMatchesChainAfterBlk) && allMatch;
+   cout << "Reorg happened:               " 
+        << (bdm.isLastBlockReorg() ? "PASSED" : "***FAILED***") << endl;
+   cout << "Matches the chain after reorg: " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+   bdm.setUseAddrHistory(false);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// A wallet with a lot of imported addresses (nRandAddr random ones, and a few
+// real ones from the blockchain).  First the lookup itself, the registered
+// addresses in a map like the BDM/wallet keep them, with and without the
+// bloom filter in front, on every address in the blockchain.  Then the whole
+// rescan for the wallet, which should find exactly the tx of the real ones.
+void TestRegisteredAddrBloom(string blkdir, uint32_t nRandAddr)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   // Every std TxOut address, in blockchain order
+   vector<BinaryData> chainAddrs;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard())
+               chainAddrs.push_back(txout.getRecipientAddr());
+         }
+      }
+   }
+
+   srand(0);
+   set<BinaryData> realAddrs;
+   for(uint32_t i=0; i<20; i++)
+      realAddrs.insert(chainAddrs[rand() % chainAddrs.size()]);
+
+   map<BinaryData, uint32_t> regMap;
+   set<BinaryData>::iterator rIter;
+   for(rIter = realAddrs.begin(); rIter != realAddrs.end(); rIter++)
+      regMap[*rIter] = 0;
+   vector<BinaryData> randAddrs(nRandAddr);
+   for(uint32_t i=0; i<nRandAddr; i++)
+   {
+      randAddrs[i].resize(20);
+      for(uint32_t j=0; j<20; j++)
+         randAddrs[i][j] = (uint8_t)(rand() & 0xff);
+      regMap[randAddrs[i]] = 0;
+   }
+
+   BloomFilter bloom;
+   bloom.reset(regMap.size());
+   map<BinaryData, uint32_t>::iterator mIter;
+   for(mIter = regMap.begin(); mIter != regMap.end(); mIter++)
+      bloom.insert(mIter->first.getPtr());
+
+   uint32_t nHitMap = 0;
+   TIMER_START("MapLookup");
+   for(uint32_t i=0; i<chainAddrs.size(); i++)
+      if(regMap.find(chainAddrs[i]) != regMap.end())
+         nHitMap++;
+   TIMER_STOP("MapLookup");
+
+   uint32_t nHitBloom = 0;
+   uint32_t nMaybe = 0;
+   TIMER_START("BloomThenMapLookup");
+   for(uint32_t i=0; i<chainAddrs.size(); i++)
+   {
+      if(!bloom.mayContain(chainAddrs[i].getPtr()))
+         continue;
+      nMaybe++;
+      if(regMap.find(chainAddrs[i]) != regMap.end())
+         nHitBloom++;
+   }
+   TIMER_STOP("BloomThenMapLookup");
+
+   double secMap   = TIMER_READ_SEC("MapLookup");
+   double secBloom = TIMER_READ_SEC("BloomThenMapLookup");
+   cout << chainAddrs.size() << " TxOut addresses against " << regMap.size()
+        << " registered" << endl;
+   cout << "map only:      " << chainAddrs.size()/max(secMap,1e-6)   << " /s" << endl;
+   cout << "bloom, then map: " << chainAddrs.size()/max(secBloom,1e-6) << " /s" << endl;
+   cout << "False positive rate: " 
+        << 100.0*(nMaybe-nHitBloom)/(chainAddrs.size()-nHitBloom) << "%" << endl;
+   cout << "Same addresses found:         " 
+        << (nHitMap==nHitBloom ? "PASSED" : "***FAILED***") << endl;
+
+   // The tx of the real addresses, straight from the blockchain
+   set<BinaryData> realTx;
+   set<OutPoint> realOutPoints;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         BinaryData txHash = tx.getThisHash();
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+            if(realOutPoints.count(tx.getTxIn(j).getOutPoint()) > 0)
+               realTx.insert(txHash);
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard() && realAddrs.count(txout.getRecipientAddr()))
+            {
+               realTx.insert(txHash);
+               realOutPoints.insert(OutPoint(txHash, j));
+            }
+         }
+      }
+   }
+
+   BtcWallet wlt;
+   bdm.registerWallet(&wlt);
+   TIMER_START("ImportAddresses");
+   for(mIter = regMap.begin(); mIter != regMap.end(); mIter++)
+      wlt.addAddress(mIter->first);
+   TIMER_STOP("ImportAddresses");
+
+   TIMER_START("RescanWithManyAddresses");
+   bdm.scanBlockchainForTx(wlt);
+   TIMER_STOP("RescanWithManyAddresses");
+
+   vector<LedgerEntry> ledger = wlt.getTxLedger();
+   set<BinaryData> ledgerTx;
+   for(uint32_t i=0; i<ledger.size(); i++)
+      ledgerTx.insert(ledger[i].getTxHash());
+   cout << "Imported " << regMap.size() << " addresses in " 
+        << TIMER_READ_SEC("ImportAddresses") << "s, rescan took "
+        << TIMER_READ_SEC("RescanWithManyAddresses") << "s" << endl;
+   cout << "Found the " << realTx.size() << " tx of the real addresses: "
+        << (ledgerTx==realTx ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The same 10 real addresses from the blockchain, in wallets padded out to
+// 10, 1k and 100k addresses with random ones.  Every wallet scans the same
+// tx, so the time shouldn't depend on the wallet size, and every one has to
+// come out with the ledger the blockchain says it should.
+void TestScanTxWalletSize(string blkdir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   vector<BinaryData> chainAddrs;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard())
+               chainAddrs.push_back(txout.getRecipientAddr());
+         }
+      }
+   }
+
+   srand(0);
+   set<BinaryData> realAddrs;
+   while(realAddrs.size() < 10)
+      realAddrs.insert(chainAddrs[rand() % chainAddrs.size()]);
+
+   // What each tx does to the balance of the real addresses, and the tx
+   // themselves in blockchain order
+   map<BinaryData, int64_t> txValue;
+   map<OutPoint, int64_t> realOutPoints;
+   vector<Tx> realTx;
+   vector<uint32_t> realTxBlk;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         BinaryData txHash = tx.getThisHash();
+         bool isOurs = false;
+         int64_t val = 0;
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+         {
+            map<OutPoint, int64_t>::iterator iter;
+            iter = realOutPoints.find(tx.getTxIn(j).getOutPoint());
+            if(iter != realOutPoints.end())
+            {
+               isOurs = true;
+               val -= iter->second;
+            }
+         }
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard() && realAddrs.count(txout.getRecipientAddr()))
+            {
+               isOurs = true;
+               val += txout.getValue();
+               realOutPoints[OutPoint(txHash, j)] = txout.getValue();
+            }
+         }
+         if(isOurs)
+         {
+            txValue[txHash] = val;
+            realTx.push_back(tx);
+            realTxBlk.push_back(h);
+         }
+      }
+   }
+   cout << realAddrs.size() << " real addresses with " << realTx.size() 
+        << " tx" << endl;
+
+   // The first scan of anything pays for looking up the coin colors, so get
+   // that out of the way before timing
+   BtcWallet warmupWlt;
+   warmupWlt.addAddress(*realAddrs.begin());
+   for(uint32_t i=0; i<realTx.size(); i++)
+      warmupWlt.scanTx(realTx[i], realTx[i].getBlockTxIndex(), 0, realTxBlk[i]);
+
+   uint32_t walletSizes[3] = {10, 1000, 100000};
+   string   timerNames[3]  = {"ScanTx_10Addr", "ScanTx_1kAddr", "ScanTx_100kAddr"};
+   for(uint32_t w=0; w<3; w++)
+   {
+      BtcWallet wlt;
+      set<BinaryData>::iterator rIter;
+      for(rIter = realAddrs.begin(); rIter != realAddrs.end(); rIter++)
+         wlt.addAddress(*rIter);
+      BinaryData randAddr(20);
+      while(wlt.getNumAddr() < walletSizes[w])
+      {
+         for(uint32_t j=0; j<20; j++)
+            randAddr[j] = (uint8_t)(rand() & 0xff);
+         wlt.addAddress(randAddr);
+      }
+
+      string timerName = timerNames[w];
+      TIMER_START(timerName);
+      for(uint32_t i=0; i<realTx.size(); i++)
+      {
+         BlockHeader* bhptr = bdm.getHeaderByHeight(realTxBlk[i]);
+         wlt.scanTx(realTx[i], 
+                    realTx[i].getBlockTxIndex(), 
+                    bhptr->getTimestamp(), 
+                    realTxBlk[i]);
+      }
+      TIMER_STOP(timerName);
+
+      // A tx could get more than one ledger entry if it had colored coins
+      map<BinaryData, int64_t> ledgerValue;
+      vector<LedgerEntry> ledger = wlt.getTxLedger();
+      for(uint32_t i=0; i<ledger.size(); i++)
+         ledgerValue[ledger[i].getTxHash()] += ledger[i].getValue();
+
+      cout << "Wallet with " << walletSizes[w] << " addresses:  " 
+           << TIMER_READ_SEC(timerName) << "s, ledger "
+           << (ledgerValue==txValue ? "PASSED" : "***FAILED***") << endl;
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+bool ledgersMatch(vector<LedgerEntry> const & a, vector<LedgerEntry> const & b)
+{
+   if(a.size() != b.size())
+      return false;
+   for(uint32_t i=0; i<a.size(); i++)
+   {
+      if(!(a[i].getTxHash() == b[i].getTxHash()) ||
+           a[i].getValue()    != b[i].getValue()    ||
+           a[i].getBlockNum() != b[i].getBlockNum() ||
+           a[i].isValid()     != b[i].isValid())
+         return false;
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// A bunch of wallets with addresses from the blockchain, scanned one at a time
+// and then all together, which should give the same ledgers.  Then a reorg
+// with two wallets registered, which should mark the reversed tx invalid in
+// both of them.
+void TestMultiWalletScan(string blkdir, string tempBlkDir, uint32_t nWallets)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   vector<BinaryData> chainAddrs;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard())
+               chainAddrs.push_back(txout.getRecipientAddr());
+         }
+      }
+   }
+
+   // Two copies of each wallet
+   srand(0);
+   vector<BtcWallet> wltsOneAtATime(nWallets);
+   vector<BtcWallet> wltsTogether(nWallets);
+   for(uint32_t w=0; w<nWallets; w++)
+   {
+      for(uint32_t i=0; i<10; i++)
+      {
+         BinaryData addr = chainAddrs[rand() % chainAddrs.size()];
+         wltsOneAtATime[w].addAddress(addr);
+         wltsTogether[w].addAddress(addr);
+      }
+   }
+
+   // The first scan fills the registered tx list for all the addresses,
+   // after that it's just the registered tx
+   vector<BtcWallet*> wltPtrs(nWallets);
+   for(uint32_t w=0; w<nWallets; w++)
+   {
+      bdm.registerWallet(&wltsOneAtATime[w]);
+      bdm.registerWallet(&wltsTogether[w]);
+      wltPtrs[w] = &wltsTogether[w];
+   }
+   bdm.scanBlockchainForTx(wltsOneAtATime[0]);
+   wltsOneAtATime[0].clearBlkData();
+
+   TIMER_START("ScanWalletsOneAtATime");
+   for(uint32_t w=0; w<nWallets; w++)
+      bdm.scanBlockchainForTx(wltsOneAtATime[w]);
+   TIMER_STOP("ScanWalletsOneAtATime");
+
+   TIMER_START("ScanWalletsTogether");
+   bdm.scanBlockchainForWallets(wltPtrs);
+   TIMER_STOP("ScanWalletsTogether");
+
+   bool allMatch = true;
+   uint32_t nLedger = 0;
+   for(uint32_t w=0; w<nWallets; w++)
+   {
+      allMatch = allMatch && ledgersMatch(wltsOneAtATime[w].getTxLedger(),
+                                          wltsTogether[w].getTxLedger());
+      for(uint32_t a=0; a<wltsTogether[w].getNumAddr(); a++)
+         allMatch = allMatch && 
+            ledgersMatch(wltsOneAtATime[w].getAddrByIndex(a).getTxLedger(),
+                         wltsTogether[w].getAddrByIndex(a).getTxLedger());
+      nLedger += wltsTogether[w].getTxLedger().size();
+   }
+   cout << nWallets << " wallets, " << nLedger << " ledger entries" << endl;
+   cout << "One at a time: " << TIMER_READ_SEC("ScanWalletsOneAtATime") 
+        << "s, all together: " << TIMER_READ_SEC("ScanWalletsTogether") << "s" << endl;
+   cout << "Same ledgers:                 " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+   for(uint32_t w=0; w<nWallets; w++)
+   {
+      bdm.unregisterWallet(&wltsOneAtATime[w]);
+      bdm.unregisterWallet(&wltsTogether[w]);
+   }
+
+   // Both wallets go through the reorgTest reorg together
+   BtcWallet wltA, wltB;
+   wltA.addAddress(BinaryData::CreateFromHex("62e907b15cbf27d5425399ebf6f0fb50ebb88f18"));
+   wltA.addAddress(BinaryData::CreateFromHex("ee26c56fc1d942be8d7a24b2a1001dd894693980"));
+   wltB.addAddress(BinaryData::CreateFromHex("cb2abde8bccacc32e893df3a054b9ef7f227a4ce"));
+   wltB.addAddress(BinaryData::CreateFromHex("c522664fb0e55cdc5c0cea73b4aad97ec8343232"));
+
+   loadReorgTestChain(bdm, tempBlkDir);
+   vector<BtcWallet*> reorgWlts;
+   reorgWlts.push_back(&wltA);
+   reorgWlts.push_back(&wltB);
+   bdm.scanBlockchainForWallets(reorgWlts);
+   appendReorgTestBlocks(bdm, tempBlkDir);
+   bdm.updateWalletsAfterReorg(reorgWlts);
+
+   // Every invalidated tx has to be marked in the wallet ledgers and the 
+   // address ledgers, and nothing else
+   set<BinaryData> txInvalid = bdm.getTxJustInvalidated();
+   bool reorgOkay = (txInvalid.size() > 0);
+   for(uint32_t w=0; w<reorgWlts.size(); w++)
+   {
+      vector<LedgerEntry> ledger = reorgWlts[w]->getTxLedger();
+      for(uint32_t i=0; i<ledger.size(); i++)
+         if(ledger[i].isValid() == (txInvalid.count(ledger[i].getTxHash()) > 0))
+            reorgOkay = false;
+
+      for(uint32_t a=0; a<reorgWlts[w]->getNumAddr(); a++)
+      {
+         vector<LedgerEntry> & addrLedger = 
+                              reorgWlts[w]->getAddrByIndex(a).getTxLedger();
+         for(uint32_t i=0; i<addrLedger.size(); i++)
+            if(addrLedger[i].isValid() == 
+                                 (txInvalid.count(addrLedger[i].getTxHash()) > 0))
+               reorgOkay = false;
+      }
+   }
+   cout << "Reorg happened:               " 
+        << (bdm.isLastBlockReorg() ? "PASSED" : "***FAILED***") << endl;
+   cout << "The " << txInvalid.size() << " invalidated tx marked:    "
+        << (reorgOkay ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wltA);
+   bdm.unregisterWallet(&wltB);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The balances the way they were computed before they were cached:  walk all
+// the txios every time
+void bruteForceBalances(BtcWallet & wlt, uint32_t currBlk, IdxColorID color,
+                        uint64_t & full, uint64_t & spd, uint64_t & ucn)
+{
+   full = spd = ucn = 0;
+   map<OutPoint, TxIOPair> & txioMap = wlt.getTxIOMap();
+   map<OutPoint, TxIOPair>::iterator iter;
+   for(iter = txioMap.begin(); iter != txioMap.end(); iter++)
+   {
+      TxIOPair & txio = iter->second;
+      if(txio.isUnspent() && txio.matchesColor(color))
+         full += txio.getValue();
+      if(txio.isSpendable(currBlk) && txio.matchesColor(color))
+         spd += txio.getValue();
+      if(txio.isMineButUnconfirmed(currBlk) && txio.matchesColor(color))
+         ucn += txio.getValue();
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The address ZC txios aren't visible from here, so addresses with any ZC
+// history are only checked through the wallet
+bool cachedBalancesMatch(BtcWallet & wlt, uint32_t currBlk)
+{
+   IdxColorID colors[2] = { COLOR_UNKNOWN, COLOR_UNCOLORED };
+   for(uint32_t c=0; c<2; c++)
+   {
+      uint64_t full, spd, ucn;
+      bruteForceBalances(wlt, currBlk, colors[c], full, spd, ucn);
+      if(wlt.getFullBalanceX(colors[c])                 != full ||
+         wlt.getSpendableBalanceX(colors[c], currBlk)   != spd  ||
+         wlt.getUnconfirmedBalanceX(colors[c], currBlk) != ucn)
+         return false;
+   }
+   
+   for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+   {
+      BtcAddress & addr = wlt.getAddrByIndex(a);
+      if(addr.getZeroConfLedger().size() > 0)
+         continue;
+
+      uint64_t full=0, spd=0, ucn=0;
+      vector<TxIOPair*> & txioList = addr.getTxIOList();
+      for(uint32_t i=0; i<txioList.size(); i++)
+      {
+         if(txioList[i]->isUnspent())                   full += txioList[i]->getValue();
+         if(txioList[i]->isSpendable(currBlk))          spd  += txioList[i]->getValue();
+         if(txioList[i]->isMineButUnconfirmed(currBlk)) ucn  += txioList[i]->getValue();
+      }
+      if(addr.getFullBalance()                != full ||
+         addr.getSpendableBalance(currBlk)    != spd  ||
+         addr.getUnconfirmedBalance(currBlk)  != ucn)
+         return false;
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// cachedBalancesMatch for one wallet, after each appendReorgTestBlocks block
+class CachedBalancesCheck
+{
+public:
+   CachedBalancesCheck(BtcWallet & wlt) : wlt_(wlt) {}
+   bool operator()(BlockDataManager_FileRefs & bdm)
+            { return cachedBalancesMatch(wlt_, bdm.getTopBlockHeight()); }
+private:
+   BtcWallet & wlt_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// The GUI polls the wallet balances over and over, which used to walk every
+// txio each time.  Check that the cached balances stay right while the
+// wallet is scanned in pieces, as the top block moves, and through zero-conf
+// tx and a reorg on the reorgTest blocks.  Then time the polling.
+void TestIncrementalBalances(string blkdir, string tempBlkDir, uint32_t nPolls)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   uint32_t topBlk = bdm.getTopBlockHeight();
+
+   // A wallet with a few thousand addresses that are actually used
+   BtcWallet wlt;
+   srand(0);
+   for(uint32_t h=0; h<=topBlk; h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         TxOut txout = tx.getTxOut(0);
+         if(txout.isStandard() && rand()%8==0 && !wlt.hasAddr(txout.getRecipientAddr()))
+            wlt.addAddress(txout.getRecipientAddr());
+      }
+   }
+   bdm.registerWallet(&wlt);
+
+   // Ask for the balances halfway through, so they're cached when the rest 
+   // of the tx come in
+   bdm.scanBlockchainForTx(wlt, 0, topBlk/2);
+   bool allMatch = cachedBalancesMatch(wlt, topBlk/2);
+   bdm.scanBlockchainForTx(wlt, topBlk/2, topBlk+1);
+   allMatch = allMatch && cachedBalancesMatch(wlt, topBlk);
+   cout << wlt.getNumAddr() << " addresses, " 
+        << wlt.getTxIOMap().size() << " txios" << endl;
+   cout << "Match after scanning more:    " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+
+   // Coinbase maturity and confirmations move with the top block
+   allMatch = true;
+   uint32_t heights[4] = { topBlk, topBlk+5, topBlk+200, topBlk };
+   for(uint32_t i=0; i<4; i++)
+      allMatch = allMatch && cachedBalancesMatch(wlt, heights[i]);
+   cout << "Match as top block moves:     " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+
+   uint64_t full, spd, ucn, total = 0;
+   TIMER_START("PollBalancesWalkTxios");
+   for(uint32_t i=0; i<nPolls; i++)
+   {
+      bruteForceBalances(wlt, topBlk, COLOR_UNKNOWN, full, spd, ucn);
+      total += full + spd + ucn;
+   }
+   TIMER_STOP("PollBalancesWalkTxios");
+
+   TIMER_START("PollBalancesCached");
+   for(uint32_t i=0; i<nPolls; i++)
+   {
+      total -= wlt.getFullBalance();
+      total -= wlt.getSpendableBalance(topBlk);
+      total -= wlt.getUnconfirmedBalance(topBlk);
+   }
+   TIMER_STOP("PollBalancesCached");
+   cout << nPolls << " polls, walking txios: " 
+        << TIMER_READ_SEC("PollBalancesWalkTxios") << "s, cached: "
+        << TIMER_READ_SEC("PollBalancesCached") << "s" << endl;
+   cout << "Same totals:                  " 
+        << (total==0 ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt);
+
+
+   // Zero-conf tx and then a reorg, on the reorgTest blocks
+   BtcWallet wltR;
+   wltR.addAddress(BinaryData::CreateFromHex("62e907b15cbf27d5425399ebf6f0fb50ebb88f18"));
+   wltR.addAddress(BinaryData::CreateFromHex("ee26c56fc1d942be8d7a24b2a1001dd894693980"));
+   wltR.addAddress(BinaryData::CreateFromHex("cb2abde8bccacc32e893df3a054b9ef7f227a4ce"));
+   wltR.addAddress(BinaryData::CreateFromHex("c522664fb0e55cdc5c0cea73b4aad97ec8343232"));
+
+   loadReorgTestChain(bdm, tempBlkDir);
+   bdm.registerWallet(&wltR);
+   bdm.scanBlockchainForTx(wltR);
+   allMatch = cachedBalancesMatch(wltR, bdm.getTopBlockHeight());
+   uint64_t balBefore = wltR.getFullBalance();
+
+   // The non-coinbase tx of the A-chain blocks go in the zero-conf pool first
+   for(uint32_t b=0; b<3; b++)
+   {
+      BinaryData blk;
+      blk.readBinaryFile(reorgTestNewBlks[b]);
+      BinaryRefReader brr(blk);
+      brr.advance(8 + HEADER_SIZE);
+      uint32_t numTx = (uint32_t)brr.get_var_int();
+      for(uint32_t i=0; i<numTx; i++)
+      {
+         BinaryData rawTx;
+         brr.get_BinaryData(rawTx, BtcUtils::TxCalcLength(brr.getCurrPtr()));
+         if(i > 0)
+            bdm.addNewZeroConfTx(rawTx, 0, false);
+      }
+   }
+   bdm.rescanWalletZeroConf(wltR);
+   allMatch = allMatch && cachedBalancesMatch(wltR, bdm.getTopBlockHeight());
+   uint64_t balZC = wltR.getFullBalance();
+
+   // The blocks themselves, which reorg and then purge the zero-conf pool
+   CachedBalancesCheck checkWltR(wltR);
+   allMatch = appendReorgTestBlocks(bdm, tempBlkDir, checkWltR) && allMatch;
+   bdm.rescanWalletZeroConf(wltR);
+   bdm.scanBlockchainForTx(wltR);
+   allMatch = allMatch && cachedBalancesMatch(wltR, bdm.getTopBlockHeight());
+   cout << "Balance before ZC: " << balBefore << ", with ZC: " << balZC 
+        << ", after reorg: " << wltR.getFullBalance() << endl;
+   cout << "Match through ZC and reorg:   " 
+        << (allMatch ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wltR);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+bool ledgerTimeLess(LedgerEntry const & a, LedgerEntry const & b)
+{
+   return a.getTxTime() < b.getTxTime();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The paged/range ledger queries against filtering a sorted copy of the whole
+// ledger.  The wallet is scanned in two halves with queries in between, so the
+// second half goes in as new entries.  Then time the GUI refresh both ways.
+void TestPagedLedger(string blkdir, uint32_t nQueries)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   uint32_t topBlk = bdm.getTopBlockHeight();
+
+   BtcWallet wlt;
+   srand(0);
+   for(uint32_t h=0; h<=topBlk; h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         TxOut txout = tx.getTxOut(0);
+         if(txout.isStandard() && rand()%8==0 && !wlt.hasAddr(txout.getRecipientAddr()))
+            wlt.addAddress(txout.getRecipientAddr());
+      }
+   }
+   bdm.registerWallet(&wlt);
+
+   bdm.scanBlockchainForTx(wlt, 0, topBlk/2);
+   uint32_t halfSize = wlt.getTxLedgerSize();
+   wlt.getTxLedgerByTime(0, UINT32_MAX);
+   for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+      wlt.getTxLedgerByTime(0, UINT32_MAX, &wlt.getAddrByIndex(a).getAddrStr20());
+   bdm.scanBlockchainForTx(wlt, topBlk/2, topBlk+1);
+
+   vector<LedgerEntry> ledger = wlt.getTxLedger();
+   stable_sort(ledger.begin(), ledger.end());
+   cout << "Ledger entries: " << halfSize << " after the first half, "
+        << ledger.size() << " after all of it" << endl;
+
+   vector<LedgerEntry> paged;
+   uint32_t pageSize = 100;
+   for(uint32_t p=0; p*pageSize < wlt.getTxLedgerSize(); p++)
+   {
+      vector<LedgerEntry> page = wlt.getTxLedgerPage(p*pageSize, pageSize);
+      paged.insert(paged.end(), page.begin(), page.end());
+   }
+   cout << "Pages add up to the ledger:   " 
+        << (ledgersMatch(paged, ledger) ? "PASSED" : "***FAILED***") << endl;
+
+   uint32_t firstTime = ledger.front().getTxTime();
+   uint32_t lastTime  = ledger.back().getTxTime();
+   bool blkOkay = true, timeOkay = true, sinceOkay = true;
+   for(uint32_t q=0; q<100; q++)
+   {
+      uint32_t blkStart = rand() % (topBlk+1);
+      uint32_t blkEnd   = blkStart + rand() % 500;
+      vector<LedgerEntry> expect;
+      for(uint32_t i=0; i<ledger.size(); i++)
+         if(ledger[i].getBlockNum() >= blkStart && ledger[i].getBlockNum() < blkEnd)
+            expect.push_back(ledger[i]);
+      blkOkay = blkOkay && 
+                ledgersMatch(wlt.getTxLedgerByBlock(blkStart, blkEnd), expect);
+
+      expect.clear();
+      for(uint32_t i=0; i<ledger.size(); i++)
+         if(ledger[i].getBlockNum() >= blkStart)
+            expect.push_back(ledger[i]);
+      sinceOkay = sinceOkay && 
+                  ledgersMatch(wlt.getTxLedgerSinceBlock(blkStart), expect);
+
+      uint32_t timeStart = firstTime + rand() % (lastTime-firstTime+1);
+      uint32_t timeEnd   = timeStart + rand() % 86400;
+      expect.clear();
+      for(uint32_t i=0; i<ledger.size(); i++)
+         if(ledger[i].getTxTime() >= timeStart && ledger[i].getTxTime() < timeEnd)
+            expect.push_back(ledger[i]);
+      stable_sort(expect.begin(), expect.end(), ledgerTimeLess);
+      timeOkay = timeOkay && 
+                 ledgersMatch(wlt.getTxLedgerByTime(timeStart, timeEnd), expect);
+   }
+   cout << "Block ranges:                 " 
+        << (blkOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Since block:                  " 
+        << (sinceOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Time ranges:                  " 
+        << (timeOkay ? "PASSED" : "***FAILED***") << endl;
+
+   // Address ledgers, which don't come in sorted within a block
+   bool addrOkay = true;
+   for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+   {
+      BinaryData const & addr160 = wlt.getAddrByIndex(a).getAddrStr20();
+      vector<LedgerEntry> addrLedger = wlt.getTxLedger(&addr160);
+      stable_sort(addrLedger.begin(), addrLedger.end());
+      addrOkay = addrOkay && 
+        ledgersMatch(wlt.getTxLedgerByBlock(0, UINT32_MAX, &addr160), addrLedger);
+
+      stable_sort(addrLedger.begin(), addrLedger.end(), ledgerTimeLess);
+      addrOkay = addrOkay && 
+        ledgersMatch(wlt.getTxLedgerByTime(0, UINT32_MAX, &addr160), addrLedger);
+   }
+   cout << "Address ledgers:              " 
+        << (addrOkay ? "PASSED" : "***FAILED***") << endl;
+
+   // What the GUI does on every refresh:  the whole ledger, or the last page
+   // and whatever showed up in the last few blocks
+   uint64_t nCopied = 0;
+   TIMER_START("LedgerWholeCopy");
+   for(uint32_t q=0; q<nQueries; q++)
+      nCopied += wlt.getTxLedger().size();
+   TIMER_STOP("LedgerWholeCopy");
+
+   TIMER_START("LedgerPageQuery");
+   for(uint32_t q=0; q<nQueries; q++)
+   {
+      nCopied += wlt.getTxLedgerPage(wlt.getTxLedgerSize()-50, 50).size();
+      nCopied += wlt.getTxLedgerSinceBlock(topBlk-10).size();
+   }
+   TIMER_STOP("LedgerPageQuery");
+   cout << nQueries << " refreshes, whole ledger: " 
+        << TIMER_READ_SEC("LedgerWholeCopy") << "s, last page + new blocks: "
+        << TIMER_READ_SEC("LedgerPageQuery") << "s" << endl;
+   bdm.unregisterWallet(&wlt);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The balances and ledgers a wallet ended up with, to compare after the BDM
+// (and every TxRef the wallet pointed to) has been reset.  The ledgers are
+// re-sorted, since entries invalidated by a reorg stay wherever they were.
+struct WalletResult
+{
+   uint64_t full_;
+   uint64_t spendable_;
+   uint64_t unconfirmed_;
+   uint32_t numTxio_;
+   vector<LedgerEntry> ledger_;
+   vector< vector<LedgerEntry> > addrLedgers_;
+
+   WalletResult(BtcWallet & wlt, uint32_t currBlk)
+   {
+      full_        = wlt.getFullBalance();
+      spendable_   = wlt.getSpendableBalance(currBlk);
+      unconfirmed_ = wlt.getUnconfirmedBalance(currBlk);
+      numTxio_     = wlt.getTxIOMap().size();
+      ledger_      = wlt.getTxLedger();
+      stable_sort(ledger_.begin(), ledger_.end());
+      for(uint32_t a=0; a<wlt.getNumAddr(); a++)
+      {
+         addrLedgers_.push_back(wlt.getAddrByIndex(a).getTxLedger());
+         stable_sort(addrLedgers_.back().begin(), addrLedgers_.back().end());
+      }
+   }
+
+   bool operator==(WalletResult const & wr) const
+   {
+      if(full_        != wr.full_      || spendable_ != wr.spendable_ ||
+         unconfirmed_ != wr.unconfirmed_ || numTxio_ != wr.numTxio_ ||
+         addrLedgers_.size() != wr.addrLedgers_.size() ||
+         !ledgersMatch(ledger_, wr.ledger_))
+         return false;
+      for(uint32_t a=0; a<addrLedgers_.size(); a++)
+         if(!ledgersMatch(addrLedgers_[a], wr.addrLedgers_[a]))
+            return false;
+      return true;
+   }
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Save the wallet state some blocks before the top, then "restart":  reset
+// the BDM, load the state into a new wallet and scan the rest.  It has to
+// come out the same as scanning the new wallet from scratch.  Then the same
+// thing with a reorg while we weren't running, on the reorgTest blocks.
+void TestWalletState(string blkdir, string tempBlkDir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   uint32_t topBlk = bdm.getTopBlockHeight();
+   string stateFile = tempBlkDir + "/wallet_state.bin";
+
+   vector<BinaryData> addrList;
+   set<BinaryData> addrSet;
+   srand(0);
+   for(uint32_t h=0; h<=topBlk; h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         TxOut txout = tx.getTxOut(0);
+         if(txout.isStandard() && rand()%8==0 && 
+            addrSet.insert(txout.getRecipientAddr()).second)
+            addrList.push_back(txout.getRecipientAddr());
+      }
+   }
+
+   BtcWallet wltSaved;
+   for(uint32_t i=0; i<addrList.size(); i++)
+      wltSaved.addAddress(addrList[i]);
+   bdm.registerWallet(&wltSaved);
+   bdm.scanBlockchainForTx(wltSaved, 0, topBlk-100);
+   bool wroteOkay = bdm.writeWalletState(wltSaved, stateFile);
+   bdm.unregisterWallet(&wltSaved);
+   cout << "Wrote state for " << addrList.size() << " addresses at block " 
+        << wltSaved.getScannedUpToBlk() << ":   "
+        << (wroteOkay ? "PASSED" : "***FAILED***") << endl;
+
+   // What we'd have to do without the saved state
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   BtcWallet wltFull;
+   for(uint32_t i=0; i<addrList.size(); i++)
+      wltFull.addAddress(addrList[i]);
+   TIMER_START("WalletFullScan");
+   bdm.scanBlockchainForTx(wltFull);
+   TIMER_STOP("WalletFullScan");
+   WalletResult fullResult(wltFull, topBlk);
+   bdm.unregisterWallet(&wltFull);
+
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+   BtcWallet wltLoaded;
+   for(uint32_t i=0; i<addrList.size(); i++)
+      wltLoaded.addAddress(addrList[i]);
+   TIMER_START("WalletLoadState");
+   uint32_t startBlk = bdm.readWalletState(wltLoaded, stateFile);
+   bdm.scanBlockchainForTx(wltLoaded, startBlk);
+   TIMER_STOP("WalletLoadState");
+   WalletResult loadedResult(wltLoaded, topBlk);
+   cout << fullResult.numTxio_ << " txios, " << fullResult.ledger_.size() 
+        << " ledger entries" << endl;
+   cout << "Full scan: " << TIMER_READ_SEC("WalletFullScan") 
+        << "s, load state and scan " << topBlk+1-startBlk << " blocks: " 
+        << TIMER_READ_SEC("WalletLoadState") << "s" << endl;
+   cout << "Continued from saved block:   " 
+        << (startBlk == topBlk-100 ? "PASSED" : "***FAILED***") << endl;
+   cout << "Same as a full scan:          " 
+        << (loadedResult == fullResult ? "PASSED" : "***FAILED***") << endl;
+
+   // A state file for some other wallet is no good
+   BtcWallet wltOther;
+   wltOther.addAddress(addrList[0]);
+   cout << "Other wallet scans from 0:    " 
+        << (bdm.readWalletState(wltOther, stateFile) == 0 ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wltLoaded);
+
+
+   // Save on the chain with blocks 3 and 4, then 3A/4A/5A show up before
+   // the next load.  It should end up the same as a wallet that was running
+   // when they came in, and went through the reorg the usual way.
+   vector<BinaryData> reorgAddrs;
+   reorgAddrs.push_back(BinaryData::CreateFromHex("62e907b15cbf27d5425399ebf6f0fb50ebb88f18"));
+   reorgAddrs.push_back(BinaryData::CreateFromHex("ee26c56fc1d942be8d7a24b2a1001dd894693980"));
+   reorgAddrs.push_back(BinaryData::CreateFromHex("cb2abde8bccacc32e893df3a054b9ef7f227a4ce"));
+   reorgAddrs.push_back(BinaryData::CreateFromHex("c522664fb0e55cdc5c0cea73b4aad97ec8343232"));
+
+   loadReorgTestChain(bdm, tempBlkDir);
+   BtcWallet wltR1;
+   for(uint32_t i=0; i<reorgAddrs.size(); i++)
+      wltR1.addAddress(reorgAddrs[i]);
+   bdm.scanBlockchainForTx(wltR1);
+   bdm.writeWalletState(wltR1, stateFile);
+
+   appendReorgTestBlocks(bdm, tempBlkDir);
+   bdm.scanBlockchainForTx(wltR1);
+   bdm.updateWalletAfterReorg(wltR1);
+   WalletResult runningResult(wltR1, bdm.getTopBlockHeight());
+   bdm.unregisterWallet(&wltR1);
+
+   bdm.Reset();
+   bdm.parseEntireBlockchain(tempBlkDir);
+   BtcWallet wltR2;
+   for(uint32_t i=0; i<reorgAddrs.size(); i++)
+      wltR2.addAddress(reorgAddrs[i]);
+   startBlk = bdm.readWalletState(wltR2, stateFile);
+   bdm.scanBlockchainForTx(wltR2, startBlk);
+
+   // Every entry for a tx that isn't in the main chain anymore is invalid
+   uint32_t numInvalid = 0;
+   bool reorgOkay = (startBlk > 0 && startBlk < 5);
+   vector<LedgerEntry> ledger = wltR2.getTxLedger();
+   for(uint32_t i=0; i<ledger.size(); i++)
+   {
+      TxRef* txref = bdm.getTxRefPtrByHash(ledger[i].getTxHash());
+      bool inMain = (txref != NULL && txref->isMainBranch());
+      if(ledger[i].isValid() != inMain)
+         reorgOkay = false;
+      if(!ledger[i].isValid())
+         numInvalid++;
+   }
+   WalletResult loadedReorgResult(wltR2, bdm.getTopBlockHeight());
+   cout << "Continued from block " << startBlk << ", " << numInvalid 
+        << " entries invalidated" << endl;
+   cout << "Invalid tx marked:            " 
+        << (reorgOkay && numInvalid > 0 ? "PASSED" : "***FAILED***") << endl;
+   cout << "Same as going through reorg:  " 
+        << (loadedReorgResult == runningResult ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wltR2);
+   remove(stateFile.c_str());
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Random P2PKH coins from 500 addresses, with values anywhere from 0.00001
+// to 100 BTC and a few zero-conf.  Every method has to pay the target and
+// fee exactly, without dust change, at 10% and 100% of nUtxos coins.
+void TestCoinSelection(uint32_t nUtxos)
+{
+   srand(0);
+   vector<BinaryData> addrList(500);
+   for(uint32_t i=0; i<addrList.size(); i++)
+   {
+      addrList[i].resize(20);
+      for(uint32_t j=0; j<20; j++)
+         addrList[i][j] = (uint8_t)(rand() & 0xff);
+   }
+
+   vector<UnspentTxOut> allUtxos(nUtxos);
+   for(uint32_t i=0; i<nUtxos; i++)
+   {
+      UnspentTxOut & utxo = allUtxos[i];
+      utxo.txHash_.resize(32);
+      for(uint32_t j=0; j<32; j++)
+         utxo.txHash_[j] = (uint8_t)(rand() & 0xff);
+      utxo.txOutIndex_ = rand() % 4;
+      utxo.numConfirm_ = (rand() % 50 == 0 ? 0 : rand() % 5000 + 1);
+      utxo.value_ = (uint64_t)(rand() % 1000 + 1);
+      for(uint32_t p=rand() % 7; p>0; p--)
+         utxo.value_ *= 10;
+      utxo.value_ *= 1000;
+
+      BinaryWriter bw;
+      bw.put_uint8_t(0x76);
+      bw.put_uint8_t(0xa9);
+      bw.put_uint8_t(0x14);
+      bw.put_BinaryData(addrList[rand() % addrList.size()]);
+      bw.put_uint8_t(0x88);
+      bw.put_uint8_t(0xac);
+      utxo.script_ = bw.getData();
+   }
+
+   char const * names[COINSEL_NUM_METHODS] = { "BranchAndBound",
+                                               "Knapsack",
+                                               "Priority" };
+   uint64_t targets[4] = { 50000000, 1234567890, 10000000000ULL, 
+                           250000000000ULL };
+   uint32_t sizes[2] = { nUtxos/10, nUtxos };
+   bool allValid = true;
+   for(uint32_t s=0; s<2; s++)
+   {
+      vector<UnspentTxOut> utxos(allUtxos.begin(), allUtxos.begin()+sizes[s]);
+      uint64_t totalAvail = 0;
+      for(uint32_t i=0; i<utxos.size(); i++)
+         totalAvail += utxos[i].getValue();
+
+      CoinSelector cs;
+      cs.setUtxoList(utxos);
+      cs.setFeePerKb(10000);
+      cout << endl << sizes[s] << " coins, " << totalAvail/1e8 << " BTC" << endl;
+      for(uint32_t m=0; m<COINSEL_NUM_METHODS; m++)
+      {
+         string timerName = string(names[m]) + "_" + 
+                            (s==0 ? "small" : "large");
+         for(uint32_t t=0; t<4; t++)
+         {
+            cs.setTarget(targets[t]);
+            TIMER_START(timerName);
+            CoinSelection sel = cs.selectCoins(m);
+            TIMER_STOP(timerName);
+
+            bool valid = sel.isValid();
+            uint64_t minFee = (10000*sel.getTxSize() + 999) / 1000;
+            if(valid)
+            {
+               uint64_t sum = 0;
+               for(uint32_t i=0; i<sel.getNumInputs(); i++)
+                  sum += sel.getSelection()[i].getValue();
+               valid = (sum == sel.getTotalValue() &&
+                        sum == targets[t] + sel.getFee() + sel.getChange() &&
+                        sel.getFee() >= minFee &&
+                        (sel.getChange() == 0 || 
+                         sel.getChange() >= cs.getMinChange()));
+               if(m == COINSEL_BRANCH_AND_BOUND)
+                  valid = valid && sel.getChange() == 0 &&
+                          sel.getFee() - minFee <= cs.getExactSlack();
+            }
+            else if(m != COINSEL_BRANCH_AND_BOUND)
+               valid = false;  // there's always enough here
+
+            // Branch-and-bound doesn't have to find a changeless solution
+            if(m != COINSEL_BRANCH_AND_BOUND || sel.isValid())
+               allValid = allValid && valid;
+
+            printf("   %-15s %10.4f BTC: %s %5d inputs, fee %.8f, change %14.8f,"
+                   " score %.0f\n", names[m], targets[t]/1e8, 
+                   (!sel.isValid() ? "none" : (valid ? "    " : "BAD ")), sel.getNumInputs(),
+                   sel.getFee()/1e8, sel.getChange()/1e8, sel.getScore());
+         }
+         cout << "   " << names[m] << ": " 
+              << TIMER_READ_SEC(timerName)/4*1000 << " ms per selection" << endl;
+      }
+
+      // More than there is can't be done, by any of them
+      cs.setTarget(totalAvail + 1);
+      CoinSelection tooMuch = cs.selectBest();
+      allValid = allValid && !tooMuch.isValid() && tooMuch.getScore() < 0;
+
+      string bestTimer = string("SelectBest_") + (s==0 ? "small" : "large");
+      cs.setTarget(targets[1]);
+      TIMER_START(bestTimer);
+      CoinSelection best = cs.selectBest();
+      TIMER_STOP(bestTimer);
+      cout << "   Best of all three, in " 
+           << TIMER_READ_SEC(bestTimer)*1000 << " ms:" << endl;
+      best.pprint();
+   }
+
+   cout << "All selections pay target+fee with no dust change: "
+        << (allValid ? "PASSED" : "***FAILED***") << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// 20 real addresses, created at the first block they show up in, padded out
+// with nRandAddr random ones.  One wallet adds them one at a time, another
+// gets all of them (with different random ones) in one addImportedAddresses.
+// The bulk one should only rescan from the lowest creation block, and both
+// have to end up with the tx of the real addresses.
+void TestBulkAddressImport(string blkdir, uint32_t nRandAddr)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+   bdm.parseEntireBlockchain(blkdir);
+
+   // Every std TxOut address, in the order they first show up
+   vector<BinaryData> chainAddrs;
+   map<BinaryData, uint32_t> firstSeen;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(!txout.isStandard())
+               continue;
+            BinaryData addr160 = txout.getRecipientAddr();
+            if(firstSeen.find(addr160) == firstSeen.end())
+            {
+               firstSeen[addr160] = h;
+               chainAddrs.push_back(addr160);
+            }
+         }
+      }
+   }
+
+   // Only the newer half of them, so there's something to not rescan
+   srand(0);
+   set<BinaryData> realAddrs;
+   uint32_t lowestCreate = UINT32_MAX;
+   uint32_t newerHalf = chainAddrs.size() / 2;
+   while(realAddrs.size() < 20)
+   {
+      uint32_t i = newerHalf + rand() % (chainAddrs.size() - newerHalf);
+      if(realAddrs.insert(chainAddrs[i]).second)
+         lowestCreate = min(lowestCreate, firstSeen[chainAddrs[i]]);
+   }
+
+   // The random ones are all "created" after the real ones
+   vector<BinaryData> randAddrs(2*nRandAddr);
+   for(uint32_t i=0; i<randAddrs.size(); i++)
+   {
+      randAddrs[i].resize(20);
+      for(uint32_t j=0; j<20; j++)
+         randAddrs[i][j] = (uint8_t)(rand() & 0xff);
+   }
+   uint32_t randCreate = bdm.getTopBlockHeight();
+
+   // The tx of the real addresses, straight from the blockchain
+   set<BinaryData> realTx;
+   set<OutPoint> realOutPoints;
+   for(uint32_t h=0; h<=bdm.getTopBlockHeight(); h++)
+   {
+      vector<TxRef*> & txList = bdm.getHeaderByHeight(h)->getTxRefPtrList();
+      for(uint32_t i=0; i<txList.size(); i++)
+      {
+         Tx tx = txList[i]->getTxCopy();
+         BinaryData txHash = tx.getThisHash();
+         for(uint32_t j=0; j<tx.getNumTxIn(); j++)
+            if(realOutPoints.count(tx.getTxIn(j).getOutPoint()) > 0)
+               realTx.insert(txHash);
+         for(uint32_t j=0; j<tx.getNumTxOut(); j++)
+         {
+            TxOut txout = tx.getTxOut(j);
+            if(txout.isStandard() && realAddrs.count(txout.getRecipientAddr()))
+            {
+               realTx.insert(txHash);
+               realOutPoints.insert(OutPoint(txHash, j));
+            }
+         }
+      }
+   }
+
+   // All at once, packed the way python would with struct.pack('<I', blk)
+   BtcWallet wlt2;
+   bdm.registerWallet(&wlt2);
+   BinaryWriter bw;
+   set<BinaryData>::iterator rIter;
+   for(rIter = realAddrs.begin(); rIter != realAddrs.end(); rIter++)
+   {
+      bw.put_BinaryData(*rIter);
+      bw.put_uint32_t(firstSeen[*rIter]);
+   }
+   for(uint32_t i=nRandAddr; i<2*nRandAddr; i++)
+   {
+      bw.put_BinaryData(randAddrs[i]);
+      bw.put_uint32_t(randCreate);
+   }
+   // Duplicates don't count twice
+   bw.put_BinaryData(randAddrs[nRandAddr]);
+   bw.put_uint32_t(randCreate);
+
+   TIMER_START("ImportBulk");
+   uint32_t nAdded = wlt2.addImportedAddresses(bw.getData());
+   TIMER_STOP("ImportBulk");
+   uint32_t rescanFrom = bdm.evalLowestBlockNextScan();
+
+   TIMER_START("RescanBulk");
+   bdm.scanBlockchainForTx(wlt2);
+   TIMER_STOP("RescanBulk");
+
+   // One at a time.  The real addresses are already registered now, so
+   // there's nothing to time on its rescan
+   BtcWallet wlt1;
+   bdm.registerWallet(&wlt1);
+   TIMER_START("ImportOneAtATime");
+   for(rIter = realAddrs.begin(); rIter != realAddrs.end(); rIter++)
+      wlt1.addAddress(*rIter, 0, firstSeen[*rIter]);
+   for(uint32_t i=0; i<nRandAddr; i++)
+      wlt1.addAddress(randAddrs[i], 0, randCreate);
+   TIMER_STOP("ImportOneAtATime");
+
+   bdm.scanBlockchainForTx(wlt1);
+
+   bool bulkOkay = (nAdded == nRandAddr + realAddrs.size() &&
+                    wlt2.getNumAddr() == nAdded &&
+                    wlt2.addImportedAddresses(bw.getData()) == 0);
+   for(uint32_t i=nRandAddr; i<2*nRandAddr && bulkOkay; i+=1000)
+      bulkOkay = wlt2.hasAddr(randAddrs[i]) && bdm.addressIsRegistered(randAddrs[i]);
+
+   // Not a multiple of ADDR_IMPORT_BYTES
+   BinaryData badList(ADDR_IMPORT_BYTES+1);
+   bool badOkay = (wlt2.addImportedAddresses(badList) == 0);
+
+   BtcWallet* wltList[2] = { &wlt1, &wlt2 };
+   bool sameTx[2];
+   for(uint32_t w=0; w<2; w++)
+   {
+      vector<LedgerEntry> ledger = wltList[w]->getTxLedger();
+      set<BinaryData> ledgerTx;
+      for(uint32_t i=0; i<ledger.size(); i++)
+         ledgerTx.insert(ledger[i].getTxHash());
+      sameTx[w] = (ledgerTx == realTx);
+   }
+
+   double secOne  = TIMER_READ_SEC("ImportOneAtATime");
+   double secBulk = TIMER_READ_SEC("ImportBulk");
+   cout << "Imported " << nRandAddr + realAddrs.size() << " addresses" << endl;
+   cout << "   one at a time: " << secOne  << "s" << endl;
+   cout << "   bulk:          " << secBulk << "s, rescan took " 
+        << TIMER_READ_SEC("RescanBulk") << "s, from block " << rescanFrom 
+        << " of " << bdm.getTopBlockHeight() << endl;
+   cout << "   bulk import is " << secOne/max(secBulk,1e-6) << "x faster" << endl;
+   cout << "All addresses in wallet and BDM:  " 
+        << (bulkOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Bad import list rejected:         " 
+        << (badOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Rescan from lowest creation blk:  " 
+        << (rescanFrom == lowestCreate ? "PASSED" : "***FAILED***") << endl;
+   cout << "Found the " << realTx.size() << " tx of the real addresses: "
+        << (sameTx[0] && sameTx[1] ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt1);
+   bdm.unregisterWallet(&wlt2);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Python registers a new wallet before the blockchain is loaded.  Without a
+// genesis block, the BDM should act like a chain of height 0, not crash.
+void TestRegisterBeforeLoad(string blkdir)
+{
+   BlockDataManager_FileRefs & bdm = BlockDataManager_FileRefs::GetInstance(); 
+   bdm.Reset();
+
+   BinaryData newAddr1(20), newAddr2(20), newAddr3(20);
+   for(uint32_t i=0; i<20; i++)
+   {
+      newAddr1[i] = (uint8_t)(i+1);
+      newAddr2[i] = (uint8_t)(i+101);
+      newAddr3[i] = (uint8_t)(i+201);
+   }
+
+   BtcWallet wlt;
+   wlt.addNewAddress(newAddr1);
+   bdm.registerWallet(&wlt, true);
+   wlt.addNewAddress(newAddr2);
+   bdm.registerAddress(newAddr3, true, 0);
+
+   uint32_t topBefore = bdm.getTopBlockHeight();
+   bool emptyOkay = (topBefore == 0 &&
+                     !bdm.getTopBlockHeader().isInitialized() &&
+                     !bdm.getTopBlockHeader().isMainBranch() &&
+                     bdm.addressIsRegistered(newAddr1) &&
+                     bdm.addressIsRegistered(newAddr2) &&
+                     bdm.addressIsRegistered(newAddr3));
+
+   bdm.parseEntireBlockchain(blkdir);
+   bdm.scanBlockchainForTx(wlt);
+   bool loadOkay = (bdm.getTopBlockHeight() > 0 &&
+                    bdm.getGenesisBlock().isMainBranch() &&
+                    wlt.getFullBalance() == 0);
+
+   // Same for a header made from nothing, like python can do through SWIG
+   BlockHeader bh;
+   bool defaultOkay = (bh.getBlockHeight() == 0 && 
+                       !bh.isInitialized() && 
+                       !bh.isMainBranch() &&
+                       bh.getNumTx() == 0);
+   BlockHeader bhCopy(bh);
+   bhCopy = bdm.getGenesisBlock();
+   defaultOkay = defaultOkay && bhCopy.getThisHash() == bdm.getGenesisHash();
+
+   cout << "Top block before load: " << topBefore << endl;
+   cout << "Default BlockHeader:   " 
+        << (defaultOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Register before load:  " 
+        << (emptyOkay ? "PASSED" : "***FAILED***") << endl;
+   cout << "Load after register:   " 
+        << (loadOkay ? "PASSED" : "***FAILED***") << endl;
+   bdm.unregisterWallet(&wlt);
+}
@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "BloomFilter.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+void BloomFilter::reset(uint32_t expectedItems)
+{
+   uint64_t wantBits = (uint64_t)expectedItems * BLOOM_BITS_PER_ITEM;
+   uint64_t numBits  = BLOOM_MIN_BITS;
+   while(numBits < wantBits && numBits < ((uint64_t)1<<34))
+      numBits *= 2;
+
+   numBlocks_ = (uint32_t)(numBits / (64*BLOOM_BLOCK_WORDS));
+   capacity_  = (uint32_t)min(numBits / BLOOM_BITS_PER_ITEM, (uint64_t)UINT32_MAX);
+   numItems_  = 0;
+
+   // Swap with an empty one to actually give the memory back
+   vector<uint64_t>().swap(bits_);
+   bits_.resize(numBlocks_ * BLOOM_BLOCK_WORDS, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BloomFilter::getProbes(uint8_t const * key, uint32_t salt,
+                            uint32_t & blockStart, uint64_t & probeBits) const
+{
+   uint32_t w[3];
+   memcpy(w, key, 12);
+
+   // Outpoints of the same tx only differ by the salt, so it has to move
+   // both the block and the bits
+   w[0] ^= salt * 0x9e3779b9U;
+   w[1] ^= salt * 0x85ebca6bU;
+
+   blockStart = (w[0] & (numBlocks_-1)) * BLOOM_BLOCK_WORDS;
+   probeBits  = ((uint64_t)w[2] << 32) | w[1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void BloomFilter::insert(uint8_t const * key, uint32_t salt)
+{
+   uint32_t blockStart;
+   uint64_t probeBits;
+   getProbes(key, salt, blockStart, probeBits);
+
+   uint64_t* block = &bits_[blockStart];
+   for(uint32_t i=0; i<BLOOM_NUM_PROBES; i++)
+   {
+      uint32_t pos = (uint32_t)(probeBits >> (9*i)) & 511;
+      block[pos >> 6] |= ((uint64_t)1 << (pos & 63));
+   }
+   numItems_++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool BloomFilter::mayContain(uint8_t const * key, uint32_t salt) const
+{
+   uint32_t blockStart;
+   uint64_t probeBits;
+   getProbes(key, salt, blockStart, probeBits);
+
+   uint64_t const * block = &bits_[blockStart];
+   for(uint32_t i=0; i<BLOOM_NUM_PROBES; i++)
+   {
+      uint32_t pos = (uint32_t)(probeBits >> (9*i)) & 511;
+      if((block[pos >> 6] & ((uint64_t)1 << (pos & 63))) == 0)
+         return false;
+   }
+   return true;
+}
@@ -0,0 +1,71 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// A Bloom filter to put in front of the registered address/outpoint lookups.
+// Almost every address and outpoint we check during a scan is not ours, and
+// a std::map/set lookup for each one is a tree walk through the heap.  The
+// filter answers "definitely not" with a few bit tests, and only the "maybe"
+// answers go on to the real lookup.  There are no false negatives, so it
+// never changes the result.
+//
+// The keys are already hashes (addr160s, tx hashes), so the probe positions
+// come straight from the key's bytes, there's nothing to hash.  All the
+// probes for a key are in the same 64-byte block, so it's one cache miss at
+// most, and at BLOOM_BITS_PER_ITEM bits per item, 100k addresses fit in
+// 200 kB.
+//
+// Items can't be removed, and the filter doesn't grow by itself.  When
+// isFull() the owner should reset() it bigger and insert everything again
+// (same thing after removing items, if it cares about the false positives).
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _BLOOMFILTER_H_
+#define _BLOOMFILTER_H_
+
+#include <vector>
+#include "BinaryData.h"
+
+
+#define BLOOM_BITS_PER_ITEM   16
+#define BLOOM_MIN_BITS        32768
+#define BLOOM_NUM_PROBES      4
+
+// 512-bit blocks
+#define BLOOM_BLOCK_WORDS     8
+
+
+class BloomFilter
+{
+public:
+   BloomFilter(void) { reset(0); }
+
+   // Empty, with room for this many items (more if it's small)
+   void     reset(uint32_t expectedItems);
+
+   // The key must have at least 12 bytes that look random (a hash).  The
+   // salt goes with it, like the TxOut index of an outpoint.
+   void     insert(uint8_t const * key, uint32_t salt=0);
+   bool     mayContain(uint8_t const * key, uint32_t salt=0) const;
+
+   uint32_t getNumItems(void) const { return numItems_; }
+   uint32_t getCapacity(void) const { return capacity_; }
+   bool     isFull(void) const      { return numItems_ > capacity_; }
+
+private:
+   // Which word in bits_ the block starts at, and the 4 9-bit probe positions
+   void     getProbes(uint8_t const * key, uint32_t salt,
+                      uint32_t & blockStart, uint64_t & probeBits) const;
+
+   vector<uint64_t> bits_;
+   uint32_t         numBlocks_;   // power of 2
+   uint32_t         numItems_;
+   uint32_t         capacity_;
+};
+
+
+#endif
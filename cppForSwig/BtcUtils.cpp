@@ -7,7 +7,17 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "BtcUtils.h"
+#include "osrng.h"
 
 BinaryData BtcUtils::BadAddress_    = BinaryData::CreateFromHex("0000000000000000000000000000000000000000");
 BinaryData BtcUtils::EmptyHash_     = BinaryData::CreateFromHex("0000000000000000000000000000000000000000000000000000000000000000");
 
+static uint64_t generateBucketHashSeed(void)
+{
+   CryptoPP::AutoSeededRandomPool prng;
+   uint64_t seed;
+   prng.GenerateBlock((uint8_t*)&seed, 8);
+   return seed;
+}
+uint64_t   BtcUtils::BucketHashSeed_ = generateBucketHashSeed();
+
@@ -31,6 +31,8 @@
 #include "cryptlib.h"
 #include "sha.h"
 #include "ripemd.h"
+#include "Sha256.h"
+#include "Ripemd160.h"
 #include "UniversalTimer.h"
 
 #define HEADER_SIZE 80
@@ -237,6 +239,25 @@ public:
    static BinaryData        BadAddress_;
    static BinaryData        EmptyHash_;
 
+   // Random for each run, see hashToBucket()
+   static uint64_t          BucketHashSeed_;
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Which of numBuckets (a power of 2) buckets a 4-byte key goes in, for the
+   // open-addressing tables (TxHashIndex, UtxoSet, etc).  The keys are the
+   // first bytes of a tx hash or an addr160, and anyone can grind those to
+   // share as many low bits as they like.  So we can't just mask the key, or
+   // a multiple of it:  the low bits of a product only depend on the low 
+   // bits of the key.  Instead take the high bits of a 64-bit multiply, 
+   // which depend on all of them, with a seed nobody knows mixed in first.
+   // (For a power of 2, the multiply-shift at the end is the same as taking
+   // the top log2(numBuckets) bits of the product)
+   static uint32_t hashToBucket(uint32_t key, uint32_t numBuckets)
+   {
+      uint64_t h = ((uint64_t)key ^ BucketHashSeed_) * 0x9E3779B97F4A7C15ULL;
+      return (uint32_t)(((h >> 32) * numBuckets) >> 32);
+   }
+
    /////////////////////////////////////////////////////////////////////////////
    static uint64_t readVarInt(uint8_t const * strmPtr, uint32_t* lenOutPtr=NULL)
    {
@@ -323,16 +344,17 @@ public:
 
 
    /////////////////////////////////////////////////////////////////////////////
+   // All the SHA256 goes through our own Sha256 class, which picks the
+   // fastest version the CPU supports (see Sha256.h).  Unlike the static
+   // Crypto++ hashers that used to be here, it's safe to use from threads.
    static void getHash256(uint8_t const * strToHash,
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
       if(hashOutput.getSize() != 32)
          hashOutput.resize(32);
 
-      sha256_.CalculateDigest(hashOutput.getPtr(), strToHash, nBytes);
-      sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
+      Sha256::doubleHash(strToHash, nBytes, hashOutput.getPtr());
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -341,21 +363,15 @@ public:
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
-
-      sha256_.CalculateDigest(hashOutput.getPtr(), strToHash, nBytes);
-      sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
+      Sha256::doubleHash(strToHash, nBytes, hashOutput.getPtr());
    }
 
    /////////////////////////////////////////////////////////////////////////////
    static BinaryData getHash256(uint8_t const * strToHash,
                                 uint32_t        nBytes)
    {
-      static CryptoPP::SHA256 sha256_;
-
       BinaryData hashOutput(32);
-      sha256_.CalculateDigest(hashOutput.getPtr(), strToHash, nBytes);
-      sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
+      Sha256::doubleHash(strToHash, nBytes, hashOutput.getPtr());
       return hashOutput;
    }
 
@@ -395,14 +411,13 @@ public:
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
       static CryptoPP::RIPEMD160 ripemd160_;
-      static BinaryData bd32(32);
+      uint8_t hash32[32];
       if(hashOutput.getSize() != 20)
          hashOutput.resize(20);
 
-      sha256_.CalculateDigest(bd32.getPtr(), strToHash, nBytes);
-      ripemd160_.CalculateDigest(hashOutput.getPtr(), bd32.getPtr(), 32);
+      Sha256::hash(strToHash, nBytes, hash32);
+      ripemd160_.CalculateDigest(hashOutput.getPtr(), hash32, 32);
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -411,13 +426,32 @@ public:
                           uint32_t        nBytes,
                           BinaryData &    hashOutput)
    {
-      static CryptoPP::SHA256 sha256_;
       static CryptoPP::RIPEMD160 ripemd160_;
-      static BinaryData bd32(32);
+      uint8_t hash32[32];
 
-      sha256_.CalculateDigest(bd32.getPtr(), strToHash, nBytes);
-      ripemd160_.CalculateDigest(hashOutput.getPtr(), bd32.getPtr(), 32);
+      Sha256::hash(strToHash, nBytes, hash32);
+      ripemd160_.CalculateDigest(hashOutput.getPtr(), hash32, 32);
+
+   }
 
+   /////////////////////////////////////////////////////////////////////////////
+   // HASH160 of nMsg separate messages, the 20-byte results are written one
+   // after another to hashesOut.  Both the SHA256 and the RIPEMD160 go
+   // through the SIMD lanes, so this is a lot faster than one at a time when
+   // there are many of them, like the pay-to-pubkey TxOuts in a block.
+   static void getHash160Batch(uint8_t const * const * msgPtrs,
+                               uint32_t const *        msgSizes,
+                               uint32_t                nMsg,
+                               uint8_t *               hashesOut)
+   {
+      // A chunk at a time so the intermediate SHA256s fit on the stack
+      uint8_t hash32s[32*64];
+      for(uint32_t i=0; i<nMsg; i+=64)
+      {
+         uint32_t n = (nMsg-i < 64 ? nMsg-i : 64);
+         Sha256::hashBatch(msgPtrs+i, msgSizes+i, n, hash32s);
+         Ripemd160::hash32Batch(hash32s, n, hashesOut + 20*i);
+      }
    }
 
    /////////////////////////////////////////////////////////////////////////////
@@ -483,51 +517,82 @@ public:
    /////////////////////////////////////////////////////////////////////////////
    static vector<BinaryData> calculateMerkleTree(vector<BinaryData> const & txhashlist)
    {
-      // Don't know in advance how big this list will be, make a list too big
-      // and copy the result to the right size list afterwards
       uint32_t numTx = txhashlist.size();
-      vector<BinaryData> merkleTree(3*numTx);
-      static CryptoPP::SHA256 sha256_;
-      BinaryData hashInput(64);
-      BinaryData hashOutput(32);
-   
+      BinaryData txHashes(32*numTx);
       for(uint32_t i=0; i<numTx; i++)
-         merkleTree[i] = txhashlist[i];
-   
+         txhashlist[i].copyTo(txHashes.getPtr() + 32*i, 32);
+
+      BinaryData tree;
+      uint32_t nNodes = calculateMerkleTree(txHashes.getPtr(), numTx, tree);
+
+      vector<BinaryData> merkleTree(nNodes);
+      for(uint32_t i=0; i<nNodes; i++)
+         merkleTree[i].copyFrom(tree.getPtr() + 32*i, 32);
+      return merkleTree;
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // Same thing, from numTx hashes back-to-back in memory
+   static BinaryData calculateMerkleRoot(uint8_t const * txHashes, uint32_t numTx)
+   {
+      BinaryData tree;
+      uint32_t nNodes = calculateMerkleTree(txHashes, numTx, tree);
+      if(nNodes == 0)
+         return BinaryData(0);
+      return BinaryData(tree.getPtr() + 32*(nNodes-1), 32);
+   }
+
+   /////////////////////////////////////////////////////////////////////////////
+   // The whole tree goes into treeOut, one level after another, 32 bytes per
+   // node, and the return value is the number of nodes (the root is last).
+   // Each level is one call to Sha256::doubleHashBatch, since the pairs of
+   // hashes being combined are already sitting next to each other.  The odd
+   // one out at the end of a level gets paired with itself.
+   static uint32_t calculateMerkleTree(uint8_t const * txHashes, 
+                                       uint32_t        numTx,
+                                       BinaryData    & treeOut)
+   {
+      uint32_t nNodes = numTx;
+      for(uint32_t levelSize=numTx; levelSize>1; levelSize=(levelSize+1)/2)
+         nNodes += (levelSize+1)/2;
+
+      treeOut.resize(32*nNodes);
+      if(numTx == 0)
+         return 0;
+      memcpy(treeOut.getPtr(), txHashes, 32*numTx);
+
+      vector<uint8_t const *> pairPtrs;
+      vector<uint32_t>        pairSizes;
+      uint8_t lastPair[64];
+
       uint32_t thisLevelStart = 0;
       uint32_t nextLevelStart = numTx;
       uint32_t levelSize = numTx;
       while(levelSize>1)
       {
-         for(uint32_t j=0; j<(levelSize+1)/2; j++)
+         uint32_t nPairs = (levelSize+1)/2;
+         uint8_t const * levelPtr = treeOut.getPtr() + 32*thisLevelStart;
+         pairPtrs.resize(nPairs);
+         pairSizes.assign(nPairs, 64);
+         for(uint32_t j=0; j<levelSize/2; j++)
+            pairPtrs[j] = levelPtr + 64*j;
+
+         if(levelSize % 2 == 1)
          {
-            uint8_t* half1Ptr = hashInput.getPtr();
-            uint8_t* half2Ptr = hashInput.getPtr()+32;
-         
-            if(j < levelSize/2)
-            {
-               merkleTree[thisLevelStart+(2*j)  ].copyTo(half1Ptr, 32);
-               merkleTree[thisLevelStart+(2*j)+1].copyTo(half2Ptr, 32);
-            }
-            else 
-            {
-               merkleTree[nextLevelStart-1].copyTo(half1Ptr, 32);
-               merkleTree[nextLevelStart-1].copyTo(half2Ptr, 32);
-            }
-            
-            sha256_.CalculateDigest(hashOutput.getPtr(), hashInput.getPtr(),  64);
-            sha256_.CalculateDigest(hashOutput.getPtr(), hashOutput.getPtr(), 32);
-            merkleTree[nextLevelStart+j] = hashOutput;
+            memcpy(lastPair,    levelPtr + 32*(levelSize-1), 32);
+            memcpy(lastPair+32, levelPtr + 32*(levelSize-1), 32);
+            pairPtrs[nPairs-1] = lastPair;
          }
-         levelSize = (levelSize+1)/2;
+
+         Sha256::doubleHashBatch(&pairPtrs[0], &pairSizes[0], nPairs,
+                                 treeOut.getPtr() + 32*nextLevelStart);
+
+         levelSize = nPairs;
          thisLevelStart = nextLevelStart;
          nextLevelStart = nextLevelStart+levelSize;
       }
 
-      // nextLevelStart is the size of the merkle tree
-      merkleTree.erase(merkleTree.begin()+nextLevelStart, merkleTree.end());
-      return merkleTree;
-   
+      return nNodes;
    }
    
    /////////////////////////////////////////////////////////////////////////////
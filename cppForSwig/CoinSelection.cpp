@@ -0,0 +1,562 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include <functional>
+#include <set>
+#include <cmath>
+#include "BtcUtils.h"
+#include "CoinSelection.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fee for this many bytes, rounded up so the searches never come up short
+static uint64_t sizeFee(uint64_t feePerKb, uint64_t numBytes)
+{
+   return (feePerKb * numBytes + 999) / 1000;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same as countTrailingZeros in getSelectCoinsScores
+static int countTrailingZeros(uint64_t val)
+{
+   uint64_t pow10 = 10;
+   for(int i=1; i<20; i++)
+   {
+      if(val % pow10 != 0)
+         return i-1;
+      pow10 *= 10;
+   }
+   return 0;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void CoinSelection::pprint(void) const
+{
+   char const * names[COINSEL_NUM_METHODS] = { "BranchAndBound",
+                                               "Knapsack",
+                                               "Priority" };
+   cout << "CoinSelection: "
+        << (method_ < COINSEL_NUM_METHODS ? names[method_] : "None") << endl;
+   cout << "   Inputs:  " << selection_.size() << " (" << totalIn_/1e8
+        << " BTC)" << endl;
+   cout << "   Fee:     " << fee_/1e8    << " BTC" << endl;
+   cout << "   Change:  " << change_/1e8 << " BTC" << endl;
+   cout << "   TxSize:  " << txSize_ << " bytes" << endl;
+   cout << "   Score:   " << score_ << endl;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+CoinSelector::CoinSelector(void) :
+   target_(0),
+   fee_(0),
+   feePerKb_(0),
+   minChange_(COINSEL_CENT),
+   exactSlack_(COINSEL_MIN_RELAY_FEE),
+   seed_(0),
+   randState_(1)
+{
+   // Same as WEIGHTS in armoryengine.py
+   weights_[COINSEL_IDX_ALLOWFREE]  =  100000;
+   weights_[COINSEL_IDX_NOZEROCONF] = 1000000;
+   weights_[COINSEL_IDX_PRIORITY]   =      50;
+   weights_[COINSEL_IDX_NUMADDR]    =  100000;
+   weights_[COINSEL_IDX_TXSIZE]     =     100;
+   weights_[COINSEL_IDX_OUTANONYM]  =      30;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int64_t CoinSelector::getInputCost(void) const
+{
+   return (int64_t)sizeFee(feePerKb_, COINSEL_TXIN_BYTES);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Target plus the fee for everything but the inputs, with no change output
+int64_t CoinSelector::getNeeded(void) const
+{
+   return (int64_t)(target_ + fee_ +
+                    sizeFee(feePerKb_, COINSEL_TX_BYTES + COINSEL_TXOUT_BYTES));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+int64_t CoinSelector::getChangeCost(void) const
+{
+   return (int64_t)sizeFee(feePerKb_, COINSEL_TXOUT_BYTES);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// xorshift32, so the same seed always gives the same knapsack result
+uint32_t CoinSelector::nextRandom(void)
+{
+   randState_ ^= randState_ << 13;
+   randState_ ^= randState_ >> 17;
+   randState_ ^= randState_ << 5;
+   return randState_;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Coins that are worth less than it costs to spend them are left out
+void CoinSelector::getCandidates(bool withZeroConf, vector<Candidate> & cands)
+{
+   int64_t inputCost = getInputCost();
+   cands.clear();
+   cands.reserve(utxos_.size());
+   for(uint32_t i=0; i<utxos_.size(); i++)
+   {
+      if(!withZeroConf && utxos_[i].getNumConfirm() == 0)
+         continue;
+
+      Candidate c;
+      c.effValue_ = (int64_t)utxos_[i].getValue() - inputCost;
+      c.utxoIdx_  = i;
+      if(c.effValue_ > 0)
+         cands.push_back(c);
+   }
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+CoinSelection CoinSelector::selectCoins(uint32_t method)
+{
+   // Without the zero-conf coins first, then with them if that didn't work
+   for(uint32_t pass=0; pass<2; pass++)
+   {
+      vector<Candidate> cands;
+      getCandidates(pass==1, cands);
+      randState_ = seed_ * 2654435761U + 1;
+
+      vector<uint32_t> chosen;
+      bool found = false;
+      switch(method)
+      {
+      case COINSEL_BRANCH_AND_BOUND: found = selectBranchAndBound(cands, chosen); break;
+      case COINSEL_KNAPSACK:         found = selectKnapsack(cands, chosen); break;
+      case COINSEL_PRIORITY:         found = selectPriority(cands, chosen); break;
+      default:
+         cout << "***ERROR:  Unknown coin selection method " << method << endl;
+         cerr << "***ERROR:  Unknown coin selection method " << method << endl;
+         return CoinSelection();
+      }
+
+      if(found)
+      {
+         CoinSelection sel = makeSelection(method, chosen);
+         if(sel.isValid())
+            return sel;
+      }
+   }
+
+   CoinSelection none;
+   none.method_ = method;
+   return none;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+CoinSelection CoinSelector::selectBest(void)
+{
+   CoinSelection best;
+   for(uint32_t m=0; m<COINSEL_NUM_METHODS; m++)
+   {
+      CoinSelection sel = selectCoins(m);
+      if(sel.isValid() && (!best.isValid() || sel.getScore() > best.getScore()))
+         best = sel;
+   }
+   return best;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Depth-first over include/exclude for each coin, biggest coins first, for a
+// total in [needed, needed+exactSlack].  A branch is dropped as soon as it
+// overshoots, or when all the coins left after it can't make up the rest.
+// Of the solutions it finds in COINSEL_BNB_MAX_TRIES steps, it keeps the one
+// with the least left over (which goes to the fee).
+bool CoinSelector::selectBranchAndBound(vector<Candidate> & cands,
+                                        vector<uint32_t> & chosen)
+{
+   int64_t needed  = getNeeded();
+   int64_t maxOver = needed + (int64_t)exactSlack_;
+
+   // A coin bigger than needed+exactSlack can't be in any solution, and
+   // with lots of big coins the search would use up all its tries on them
+   vector<Candidate> fits;
+   for(uint32_t i=0; i<cands.size(); i++)
+      if(cands[i].effValue_ <= maxOver)
+         fits.push_back(cands[i]);
+   cands.swap(fits);
+
+   sort(cands.begin(), cands.end(), greater<Candidate>());
+   int64_t available = 0;
+   for(uint32_t i=0; i<cands.size(); i++)
+      available += cands[i].effValue_;
+   if(available < needed)
+      return false;
+
+   vector<uint32_t> currSel;
+   vector<uint32_t> bestSel;
+   int64_t currValue = 0;
+   int64_t bestWaste = INT64_MAX;
+   uint32_t idx = 0;
+   for(uint32_t tries=0; tries<COINSEL_BNB_MAX_TRIES; tries++, idx++)
+   {
+      bool backtrack = false;
+      if(currValue + available < needed || currValue > maxOver)
+         backtrack = true;
+      else if(currValue >= needed)
+      {
+         if(currValue - needed < bestWaste)
+         {
+            bestWaste = currValue - needed;
+            bestSel   = currSel;
+            if(bestWaste == 0)
+               break;
+         }
+         backtrack = true;
+      }
+
+      if(backtrack)
+      {
+         if(currSel.empty())
+            break;
+
+         // Everything after the last coin we included goes back in the
+         // lookahead, then we try the branch without that coin
+         for(idx--; idx > currSel.back(); idx--)
+            available += cands[idx].effValue_;
+         currValue -= cands[idx].effValue_;
+         currSel.pop_back();
+      }
+      else
+      {
+         // Include this coin, unless it's the same value as the previous
+         // one which we just excluded:  that's a branch we already tried
+         available -= cands[idx].effValue_;
+         if(currSel.empty() || currSel.back() == idx-1 ||
+            cands[idx].effValue_ != cands[idx-1].effValue_)
+         {
+            currSel.push_back(idx);
+            currValue += cands[idx].effValue_;
+         }
+      }
+   }
+
+   if(bestSel.empty())
+      return false;
+
+   for(uint32_t i=0; i<bestSel.size(); i++)
+      chosen.push_back(cands[bestSel[i]].utxoIdx_);
+   return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Random passes over the coins (biggest first), each one adding coins at
+// random until it reaches the target, then the ones it skipped.  Returns the
+// smallest total that reached the target, and which coins those were.
+uint64_t CoinSelector::approximateBestSubset(vector<Candidate> const & cands,
+                                             uint64_t totalValue,
+                                             uint64_t target,
+                                             vector<bool> & best)
+{
+   best.assign(cands.size(), true);
+   uint64_t bestValue = totalValue;
+
+   uint32_t rounds = COINSEL_KNAPSACK_MAX_WORK / max((uint32_t)cands.size(), 1U);
+   rounds = max(min(rounds, (uint32_t)COINSEL_KNAPSACK_ROUNDS), 1U);
+
+   vector<bool> included(cands.size());
+   for(uint32_t r=0; r<rounds && bestValue != target; r++)
+   {
+      included.assign(cands.size(), false);
+      uint64_t total = 0;
+      bool reachedTarget = false;
+      for(uint32_t pass=0; pass<2 && !reachedTarget; pass++)
+      {
+         for(uint32_t i=0; i<cands.size(); i++)
+         {
+            bool take = (pass==0 ? (nextRandom() & 1)==1 : !included[i]);
+            if(!take)
+               continue;
+
+            total += cands[i].effValue_;
+            included[i] = true;
+            if(total >= target)
+            {
+               reachedTarget = true;
+               if(total < bestValue)
+               {
+                  bestValue = total;
+                  best = included;
+               }
+               total -= cands[i].effValue_;
+               included[i] = false;
+            }
+         }
+      }
+   }
+   return bestValue;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool CoinSelector::selectKnapsack(vector<Candidate> & cands,
+                                  vector<uint32_t> & chosen)
+{
+   uint64_t needed     = (uint64_t)getNeeded();
+   uint64_t maxExact   = needed + exactSlack_;
+   uint64_t withChange = needed + getChangeCost() + minChange_;
+
+   // One coin that pays it exactly, the coins too small to pay it (with
+   // change) by themselves, and the smallest one that can
+   vector<Candidate> smaller;
+   uint64_t totalSmaller = 0;
+   Candidate const * lowestLarger = NULL;
+   for(uint32_t i=0; i<cands.size(); i++)
+   {
+      uint64_t val = (uint64_t)cands[i].effValue_;
+      if(val >= needed && val <= maxExact)
+      {
+         chosen.push_back(cands[i].utxoIdx_);
+         return true;
+      }
+      else if(val < withChange)
+      {
+         smaller.push_back(cands[i]);
+         totalSmaller += val;
+      }
+      else if(lowestLarger == NULL || cands[i].effValue_ < lowestLarger->effValue_)
+         lowestLarger = &cands[i];
+   }
+
+   if(totalSmaller >= needed && totalSmaller <= maxExact)
+   {
+      for(uint32_t i=0; i<smaller.size(); i++)
+         chosen.push_back(smaller[i].utxoIdx_);
+      return true;
+   }
+
+   if(totalSmaller < needed)
+   {
+      if(lowestLarger == NULL)
+         return false;
+      chosen.push_back(lowestLarger->utxoIdx_);
+      return true;
+   }
+
+   // Try for no change first, then for change of at least minChange
+   sort(smaller.begin(), smaller.end(), greater<Candidate>());
+   vector<bool> best;
+   uint64_t bestValue = approximateBestSubset(smaller, totalSmaller, needed, best);
+   if(bestValue > maxExact && totalSmaller >= withChange)
+      bestValue = approximateBestSubset(smaller, totalSmaller, withChange, best);
+
+   // The one bigger coin is better if we're stuck with tiny change anyway,
+   // or if it's no more than the subset
+   if(lowestLarger != NULL &&
+      ((bestValue > maxExact && bestValue < withChange) ||
+       (uint64_t)lowestLarger->effValue_ <= bestValue))
+   {
+      chosen.push_back(lowestLarger->utxoIdx_);
+      return true;
+   }
+
+   for(uint32_t i=0; i<smaller.size(); i++)
+      if(best[i])
+         chosen.push_back(smaller[i].utxoIdx_);
+   return true;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Highest value*numConf first, like PySortCoins(utxos, 0), and take them
+// until there's enough.  If the change would be dust, keep going until it
+// isn't (or we run out, and the dust goes to the fee).
+struct PriorityCandidate
+{
+   double   priority_;
+   uint64_t value_;
+   uint32_t candIdx_;
+
+   bool operator<(PriorityCandidate const & pc2) const
+   {
+      if(priority_ != pc2.priority_)
+         return priority_ > pc2.priority_;
+      return value_ > pc2.value_;
+   }
+};
+
+bool CoinSelector::selectPriority(vector<Candidate> & cands,
+                                  vector<uint32_t> & chosen)
+{
+   int64_t needed     = getNeeded();
+   int64_t maxExact   = needed + (int64_t)exactSlack_;
+   int64_t withChange = needed + getChangeCost() + (int64_t)minChange_;
+
+   vector<PriorityCandidate> sorted(cands.size());
+   for(uint32_t i=0; i<cands.size(); i++)
+   {
+      UnspentTxOut const & utxo = utxos_[cands[i].utxoIdx_];
+      sorted[i].priority_ = (double)utxo.getValue() * utxo.getNumConfirm();
+      sorted[i].value_    = utxo.getValue();
+      sorted[i].candIdx_  = i;
+   }
+   sort(sorted.begin(), sorted.end());
+
+   int64_t total = 0;
+   for(uint32_t i=0; i<sorted.size(); i++)
+   {
+      Candidate const & c = cands[sorted[i].candIdx_];
+      chosen.push_back(c.utxoIdx_);
+      total += c.effValue_;
+      if(total >= needed && (total <= maxExact || total >= withChange))
+         return true;
+   }
+   return total >= needed;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+CoinSelection CoinSelector::makeSelection(uint32_t method,
+                                          vector<uint32_t> const & chosen)
+{
+   CoinSelection sel;
+   sel.method_ = method;
+   for(uint32_t i=0; i<chosen.size(); i++)
+   {
+      sel.selection_.push_back(utxos_[chosen[i]]);
+      sel.totalIn_ += utxos_[chosen[i]].getValue();
+   }
+
+   uint32_t sizeNoChange = COINSEL_TX_BYTES + COINSEL_TXOUT_BYTES +
+                           COINSEL_TXIN_BYTES * chosen.size();
+   uint64_t feeNoChange  = fee_ + sizeFee(feePerKb_, sizeNoChange);
+   if(sel.totalIn_ < target_ + feeNoChange)
+   {
+      sel.selection_.clear();
+      sel.totalIn_ = 0;
+      return sel;
+   }
+
+   // A little extra (or a change output that would be dust) goes to the fee
+   uint64_t leftover      = sel.totalIn_ - target_ - feeNoChange;
+   uint32_t sizeChange    = sizeNoChange + COINSEL_TXOUT_BYTES;
+   uint64_t feeWithChange = fee_ + sizeFee(feePerKb_, sizeChange);
+   if(leftover > exactSlack_ &&
+      sel.totalIn_ >= target_ + feeWithChange + minChange_ &&
+      sel.totalIn_ >  target_ + feeWithChange)
+   {
+      sel.txSize_ = sizeChange;
+      sel.fee_    = feeWithChange;
+      sel.change_ = sel.totalIn_ - target_ - feeWithChange;
+   }
+   else
+   {
+      sel.txSize_ = sizeNoChange;
+      sel.fee_    = sel.totalIn_ - target_;
+      sel.change_ = 0;
+   }
+
+   scoreSelection(sel);
+   return sel;
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+// getSelectCoinsScores and PyEvalCoinSelect, with the actual change and tx
+// size instead of python's guess at them
+void CoinSelector::scoreSelection(CoinSelection & sel)
+{
+   double * factors = sel.factors_;
+   uint64_t change  = sel.change_;
+   double   numBytes = (double)sel.txSize_;
+
+   // Zero-conf inputs, and how many addresses get linked together
+   set<BinaryData> addrSet;
+   bool noZeroConf = true;
+   double dPriority = 0;
+   for(uint32_t i=0; i<sel.selection_.size(); i++)
+   {
+      UnspentTxOut const & utxo = sel.selection_[i];
+      addrSet.insert(utxo.getRecipientAddr());
+      if(utxo.getNumConfirm() == 0)
+         noZeroConf = false;
+      else
+         dPriority += (double)utxo.getValue() * utxo.getNumConfirm();
+   }
+   factors[COINSEL_IDX_NOZEROCONF] = (noZeroConf ? 1 : 0);
+   factors[COINSEL_IDX_NUMADDR] = 4.0 / ((addrSet.size()+1)*(addrSet.size()+1));
+
+   // Output anonymity:  can you tell which output is the change by its
+   // trailing zeros, or by how different the two outputs are
+   double outAnon = 0;
+   int zeroDiff = countTrailingZeros(target_) - countTrailingZeros(change);
+   if(change == 0)
+      outAnon = 1;
+   else if(zeroDiff == 2)
+      outAnon = 0.2;
+   else if(zeroDiff == 1)
+      outAnon = 0.7;
+   else if(zeroDiff < 1)
+      outAnon = abs(zeroDiff) + 1;
+
+   if(outAnon > 0 && outAnon <= 1 && change != 0)
+   {
+      double outValDiff = fabs((double)change - (double)target_);
+      double diffPct = outValDiff / (double)max(change, target_);
+      if(diffPct < 0.20)
+         outAnon *= 1;
+      else if(diffPct < 0.50)
+         outAnon *= 0.7;
+      else if(diffPct < 1.0)
+         outAnon *= 0.3;
+      else
+         outAnon = 0;
+   }
+   factors[COINSEL_IDX_OUTANONYM] = outAnon;
+
+   // Priority, relative to the 1-BTC-for-1-day free-tx threshold
+   dPriority /= numBytes;
+   double priorityThresh = (double)CONVERTBTC * 144 / 250.0;
+   if(dPriority < priorityThresh)
+      factors[COINSEL_IDX_PRIORITY] = 0;
+   else if(dPriority < 10.0*priorityThresh)
+      factors[COINSEL_IDX_PRIORITY] = 0.7;
+   else if(dPriority < 100.0*priorityThresh)
+      factors[COINSEL_IDX_PRIORITY] = 0.9;
+   else
+      factors[COINSEL_IDX_PRIORITY] = 1.0;
+
+   bool haveDust = ((change > 0 && change < COINSEL_CENT) || target_ < COINSEL_CENT);
+   bool isFreeAllowed = (!haveDust && dPriority >= priorityThresh &&
+                         sel.txSize_ <= 3500);
+   factors[COINSEL_IDX_ALLOWFREE] = (isFreeAllowed ? 1 : 0);
+
+   // If it can go free, the size doesn't matter
+   uint32_t numKb = sel.txSize_ / 1000;
+   if(isFreeAllowed || numKb < 1)
+      factors[COINSEL_IDX_TXSIZE] = 1;
+   else if(numKb < 2)
+      factors[COINSEL_IDX_TXSIZE] = 0.2;
+   else if(numKb < 3)
+      factors[COINSEL_IDX_TXSIZE] = 0.1;
+   else if(numKb < 4)
+      factors[COINSEL_IDX_TXSIZE] = 0;
+   else
+      factors[COINSEL_IDX_TXSIZE] = -1;
+
+   sel.score_ = 0;
+   for(uint32_t i=0; i<COINSEL_NUM_FACTORS; i++)
+   {
+      // If we're already paying a fee, being allowed free doesn't matter
+      if(i == COINSEL_IDX_ALLOWFREE && fee_ > 0)
+         continue;
+      sel.score_ += weights_[i] * factors[i];
+   }
+}
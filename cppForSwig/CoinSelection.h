@@ -0,0 +1,205 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// Coin selection in C++, for wallets with too many unspent TxOuts for
+// PySelectCoins.  The python version tries ~30 sort/accumulate combinations
+// and picks the best by PyEvalCoinSelect, and every one of those walks the
+// whole list in python.  This does three real searches instead:
+//
+//    Branch-and-bound  -- depth-first search for a set of inputs that pays
+//                         the target and fee with (almost) nothing left
+//                         over, so there's no change output at all
+//    Knapsack          -- random approximation (the one the Satoshi client
+//                         uses):  the subset of the smaller coins that comes
+//                         closest to target+minChange, or the one smallest
+//                         coin that's bigger than that
+//    Priority          -- oldest/biggest first, by value*numConf, the same
+//                         as PySortCoins(utxos, 0)
+//
+// and scores the results with the same factors and weights as
+// getSelectCoinsScores/PyEvalCoinSelect, so the scores can be compared
+// with the python ones.
+//
+// Fees work like this (all in satoshis):
+//
+//    fee    = the fixed fee (minFee in PySelectCoins)
+//           + feePerKb * estimated tx size / 1000
+//
+// with the same size estimate as python:  10 bytes, plus 180 per TxIn and
+// 35 per TxOut.  Whatever is left after the target and fee is the change,
+// but if it's no more than exactSlack, or the change output would be less
+// than minChange, there's no change output and it all goes to the fee
+// instead.  Branch-and-bound only takes solutions that leave at most
+// exactSlack like that.
+//
+// Usage:
+//
+//    CoinSelector cs;
+//    cs.setUtxoList(wlt.getSpendableTxOutListX(COLOR_UNKNOWN, topBlk));
+//    cs.setTarget(amount);
+//    cs.setFee(minFee);
+//    CoinSelection sel = cs.selectBest();
+//    if(sel.isValid())
+//       ... sel.getSelection(), sel.getChange(), sel.getFee() ...
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _COINSELECTION_H_
+#define _COINSELECTION_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "BlockObj.h"
+
+
+// Same numbers as armoryengine.py
+#define COINSEL_CENT              1000000
+#define COINSEL_TX_BYTES          10
+#define COINSEL_TXIN_BYTES        180
+#define COINSEL_TXOUT_BYTES       35
+#define COINSEL_MIN_RELAY_FEE     10000
+
+// How much branch-and-bound searches before it gives up, and how much work
+// the knapsack gets (it does fewer rounds when there are lots of coins)
+#define COINSEL_BNB_MAX_TRIES     100000
+#define COINSEL_KNAPSACK_ROUNDS   1000
+#define COINSEL_KNAPSACK_MAX_WORK 20000000
+
+#define COINSEL_BRANCH_AND_BOUND  0
+#define COINSEL_KNAPSACK          1
+#define COINSEL_PRIORITY          2
+#define COINSEL_NUM_METHODS       3
+
+// Score factors, in the same order as getSelectCoinsScores
+#define COINSEL_IDX_ALLOWFREE     0
+#define COINSEL_IDX_NOZEROCONF    1
+#define COINSEL_IDX_PRIORITY      2
+#define COINSEL_IDX_NUMADDR       3
+#define COINSEL_IDX_TXSIZE        4
+#define COINSEL_IDX_OUTANONYM     5
+#define COINSEL_NUM_FACTORS       6
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The result of one selection.  An invalid one (not enough coins) has no
+// inputs and a score of -1, like PyEvalCoinSelect.
+class CoinSelection
+{
+public:
+   CoinSelection(void) : method_(UINT32_MAX), totalIn_(0), fee_(0),
+                         change_(0), txSize_(0), score_(-1)
+   {
+      for(uint32_t i=0; i<COINSEL_NUM_FACTORS; i++)
+         factors_[i] = 0;
+   }
+
+   bool     isValid(void) const       { return selection_.size() > 0; }
+   uint32_t getMethod(void) const     { return method_; }
+   uint32_t getNumInputs(void) const  { return selection_.size(); }
+   uint64_t getTotalValue(void) const { return totalIn_; }
+   uint64_t getFee(void) const        { return fee_; }
+   uint64_t getChange(void) const     { return change_; }
+   uint32_t getTxSize(void) const     { return txSize_; }
+   double   getScore(void) const      { return score_; }
+
+   vector<UnspentTxOut> const & getSelection(void) const { return selection_; }
+   double   getScoreFactor(uint32_t idx) const { return factors_[idx]; }
+
+   void pprint(void) const;
+
+private:
+   friend class CoinSelector;
+
+   vector<UnspentTxOut> selection_;
+   uint32_t method_;
+   uint64_t totalIn_;
+   uint64_t fee_;
+   uint64_t change_;
+   uint32_t txSize_;
+   double   factors_[COINSEL_NUM_FACTORS];
+   double   score_;
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class CoinSelector
+{
+public:
+   CoinSelector(void);
+
+   // The coins to pick from.  Their getNumConfirm() should be up to date
+   // (getSpendableTxOutList does that), zero-conf coins are only used if
+   // there isn't enough without them.
+   void setUtxoList(vector<UnspentTxOut> const & utxos) { utxos_ = utxos; }
+
+   void setTarget(uint64_t target)     { target_    = target;    }
+   void setFee(uint64_t fee)           { fee_       = fee;       }
+   void setFeePerKb(uint64_t feePerKb) { feePerKb_  = feePerKb;  }
+   void setMinChange(uint64_t minChg)  { minChange_ = minChg;    }
+   void setExactSlack(uint64_t slack)  { exactSlack_ = slack;    }
+   void setRandomSeed(uint32_t seed)   { seed_      = seed;      }
+   void setWeight(uint32_t idx, double w) { weights_[idx] = w; }
+
+   uint64_t getTarget(void) const      { return target_;     }
+   uint64_t getFee(void) const         { return fee_;        }
+   uint64_t getFeePerKb(void) const    { return feePerKb_;   }
+   uint64_t getMinChange(void) const   { return minChange_;  }
+   uint64_t getExactSlack(void) const  { return exactSlack_; }
+   double   getWeight(uint32_t idx) const { return weights_[idx]; }
+
+   CoinSelection selectCoins(uint32_t method);
+
+   // All the methods, and the one with the highest score
+   CoinSelection selectBest(void);
+
+private:
+   // A coin as the searches see it:  what it adds after paying for its own
+   // TxIn, and where it is in utxos_
+   struct Candidate
+   {
+      int64_t  effValue_;
+      uint32_t utxoIdx_;
+
+      bool operator>(Candidate const & c2) const
+                                       { return effValue_ > c2.effValue_; }
+   };
+
+   void     getCandidates(bool withZeroConf, vector<Candidate> & cands);
+   int64_t  getInputCost(void) const;
+   int64_t  getNeeded(void) const;
+   int64_t  getChangeCost(void) const;
+
+   bool     selectBranchAndBound(vector<Candidate> & cands,
+                                 vector<uint32_t> & chosen);
+   bool     selectKnapsack(vector<Candidate> & cands,
+                           vector<uint32_t> & chosen);
+   bool     selectPriority(vector<Candidate> & cands,
+                           vector<uint32_t> & chosen);
+   uint64_t approximateBestSubset(vector<Candidate> const & cands,
+                                  uint64_t totalValue,
+                                  uint64_t target,
+                                  vector<bool> & best);
+
+   // Figures out the fee and change for these coins, and scores it
+   CoinSelection makeSelection(uint32_t method, vector<uint32_t> const & chosen);
+   void     scoreSelection(CoinSelection & sel);
+
+   uint32_t nextRandom(void);
+
+   vector<UnspentTxOut> utxos_;
+   uint64_t target_;
+   uint64_t fee_;
+   uint64_t feePerKb_;
+   uint64_t minChange_;
+   uint64_t exactSlack_;
+   uint32_t seed_;
+   uint32_t randState_;
+   double   weights_[COINSEL_NUM_FACTORS];
+};
+
+
+#endif
@@ -15,6 +15,7 @@
 #define SWIG_PYTHON_EXTRA_NATIVE_CONTAINERS
 #include "BlockObj.h"
 #include "BlockUtils.h"
+#include "CoinSelection.h"
 #include "BtcUtils.h"
 #include "EncryptionUtils.h"
 %}
@@ -49,6 +50,7 @@ namespace std
    %template(vector_AddressBookEntry) std::vector<AddressBookEntry>;
    %template(vector_RegisteredTx) std::vector<RegisteredTx>;
    %template(vector_ColorIssue) std::vector<ColorIssue>;
+   %template(vector_BlockIntegrityFailure) std::vector<BlockIntegrityFailure>;
 }
 /******************************************************************************/
 /* Convert Python(str) to C++(BinaryData) */
@@ -100,6 +102,7 @@ namespace std
 /* With our typemaps, we can finally include our other objects */
 %include "BlockObj.h"
 %include "BlockUtils.h"
+%include "CoinSelection.h"
 %include "BtcUtils.h"
 %include "EncryptionUtils.h"
 
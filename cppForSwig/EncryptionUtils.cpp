@@ -599,14 +599,11 @@ SecureBinaryData CryptoECDSA::SignData(SecureBinaryData const & binToSign,
    // We trick the Crypto++ ECDSA module by passing it a single-hashed
    // message, it will do the second hash before it signs it.  This is 
    // exactly what we need.
-   static CryptoPP::SHA256  sha256;
    static BTC_PRNG prng;
 
    // Execute the first sha256 op -- the signer will do the other one
    SecureBinaryData hashVal(32);
-   sha256.CalculateDigest(hashVal.getPtr(), 
-                          binToSign.getPtr(), 
-                          binToSign.getSize());
+   Sha256::hash(binToSign.getPtr(), binToSign.getSize(), hashVal.getPtr());
 
    string signature;
    BTC_SIGNER signer(cppPrivKey);
@@ -643,16 +640,13 @@ bool CryptoECDSA::VerifyData(SecureBinaryData const & binMessage,
 {
 
 
-   static CryptoPP::SHA256  sha256;
    static CryptoPP::AutoSeededRandomPool prng;
 
    assert(cppPubKey.Validate(prng, 3));
 
    // We execute the first SHA256 op, here.  Next one is done by Verifier
    SecureBinaryData hashVal(32);
-   sha256.CalculateDigest(hashVal.getPtr(), 
-                          binMessage.getPtr(), 
-                          binMessage.getSize());
+   Sha256::hash(binMessage.getPtr(), binMessage.getSize(), hashVal.getPtr());
 
    // Verifying message 
    BTC_VERIFIER verifier(cppPubKey); 
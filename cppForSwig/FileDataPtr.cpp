@@ -10,6 +10,16 @@
 
 #include "FileDataPtr.h"
 
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   #include <windows.h>
+#else
+   #include <sys/mman.h>
+   #include <sys/types.h>
+   #include <fcntl.h>
+   #include <unistd.h>
+   #include <errno.h>
+#endif
+
 FileDataCache FileDataPtr::globalCache_;
 
 
@@ -30,8 +40,624 @@ BinaryData FileDataPtr::getDataCopy(void) const
    return globalCache_.getData(*this); 
 }
 
+uint8_t const * FileDataPtr::getThreadSafeDataPtr(BinaryData & buffer) const
+{ 
+   return globalCache_.getThreadSafeDataPtr(*this, buffer); 
+}
+
 void FileDataPtr::preCacheThisChunk(void) const
 { 
    globalCache_.getCachedDataPtr(*this); 
 }
 
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// FileDataCacheShard methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCacheShard::clear(void)
+{
+   probation_.clear();
+   protected_.clear();
+   cacheMap_.clear();
+   cacheSize_      = 0;
+   cacheUsed_      = 0;
+   protectedUsed_  = 0;
+   cacheHits_      = 0;
+   cacheMisses_    = 0;
+   cacheEvictions_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same sub-range lookup as always:  find the last chunk starting at or 
+// before this data, in the same file, and see if it covers all of it
+uint8_t* FileDataCacheShard::findData(FileDataPtr const & fdref)
+{
+   map<FileDataPtr, CacheIter>::iterator iter = cacheMap_.upper_bound(fdref);
+   if(iter==cacheMap_.begin())
+      return NULL;
+   
+   iter--;
+   uint32_t cidx   = iter->first.getFileIndex();
+   uint32_t cstart = iter->first.getStartByte();
+   uint32_t crefsz = iter->second->data_.getSize();
+
+   if(cidx != fdref.getFileIndex())
+      return NULL;
+
+   // We have cached data in the same file, and starting before fdref...
+   uint32_t coffset = fdref.getStartByte() - cstart;
+   if(coffset + fdref.getNumBytes() > crefsz)
+      return NULL;
+
+   touchCacheData(iter->second);
+   return iter->second->data_.getPtr() + coffset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The data is swapped into the cache, not copied, so data is empty after 
+uint8_t* FileDataCacheShard::insertData(FileDataPtr const & fdref, 
+                                        BinaryData & data)
+{
+   uint32_t nbytes = data.getSize();
+   clearExcessCacheData(nbytes);
+
+   // New data always starts out on probation
+   probation_.push_back(CacheData());
+   CacheIter iter = probation_.end();
+   iter--;
+   iter->fdp_ = fdref;
+   iter->data_.swap(data);
+   iter->isProtected_ = false;
+
+   cacheMap_[fdref] = iter;
+   cacheUsed_ += nbytes;
+   return iter->data_.getPtr();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Make room for incomingBytes, evicting least-recently-used data until it
+// fits:  probation first, and protected only if probation is empty.
+void FileDataCacheShard::clearExcessCacheData(uint64_t incomingBytes)
+{
+   demoteExcessProtected();
+
+   while(cacheUsed_+incomingBytes > cacheSize_ && cacheMap_.size() > 0)
+   {
+      list<CacheData> & segment = (probation_.size() > 0 ? probation_ 
+                                                         : protected_);
+      CacheIter lru = segment.begin();
+      uint32_t nbytes = lru->data_.getSize();
+      cacheUsed_ -= nbytes;
+      if(lru->isProtected_)
+         protectedUsed_ -= nbytes;
+
+      cacheMap_.erase(lru->fdp_);
+      segment.erase(lru);
+      cacheEvictions_++;
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Lists are in LRU order (front is the oldest), so all the bookkeeping for a
+// hit is just a splice.  A hit on the newest probation data doesn't count,
+// because that's usually just more reads out of the same chunk that was 
+// just pre-cached, not a real second use.
+void FileDataCacheShard::touchCacheData(CacheIter iter)
+{
+   if(iter->isProtected_)
+   {
+      protected_.splice(protected_.end(), protected_, iter);
+      return;
+   }
+
+   CacheIter newest = probation_.end();
+   newest--;
+   if(iter == newest)
+      return;
+
+   protected_.splice(protected_.end(), probation_, iter);
+   iter->isProtected_ = true;
+   protectedUsed_ += iter->data_.getSize();
+   demoteExcessProtected();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// If protected got too big, its oldest data goes back on probation (as the
+// newest there), it doesn't get evicted outright
+void FileDataCacheShard::demoteExcessProtected(void)
+{
+   uint64_t maxProtected = cacheSize_ * CACHE_PROTECTED_PCT / 100;
+   while(protectedUsed_ > maxProtected && protected_.size() > 0)
+   {
+      CacheIter lru = protected_.begin();
+      lru->isProtected_ = false;
+      protectedUsed_ -= lru->data_.getSize();
+      probation_.splice(probation_.end(), protected_, lru);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCacheShard::pprintCachedData(void)
+{
+   map<FileDataPtr, CacheIter>::iterator mapIter;
+   for(mapIter = cacheMap_.begin(); mapIter != cacheMap_.end();  mapIter++)
+   {
+      cout << "       (";
+      cout << mapIter->first.getFileIndex() << ", ";
+      cout << mapIter->first.getStartByte() << ", ";
+      cout << mapIter->first.getNumBytes() << ") ";
+      if(mapIter->second->isProtected_)
+         cout << "(protected) ";
+      cout << endl;
+   }
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+//
+// FileDataCache methods
+//
+////////////////////////////////////////////////////////////////////////////////
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::clear(void)
+{
+   for(uint32_t i=0; i<fileHandles_.size(); i++)
+   {
+      unmapFile(i);
+      closeRawFile(i);
+   }
+
+   fileHandles_.clear();
+   fileSizes_.clear();
+   cumulSizes_.clear();
+   fileNames_.clear();
+   mappedPtrs_.clear();
+   mappedSizes_.clear();
+   for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+      shards_[i].clear();
+   cacheSize_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::setCacheSize(uint64_t newSize)
+{
+   uint64_t nShards = newSize / CACHE_MIN_SHARD_SIZE;
+   nShards = max((uint64_t)1, min(nShards, (uint64_t)CACHE_MAX_SHARDS));
+
+   // Data would be looked for in a different shard than it's in
+   if(nShards != numShards_)
+   {
+      for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+      {
+         shards_[i].mutex_.lock();
+         shards_[i].cacheSize_ = 0;
+         shards_[i].clearExcessCacheData();
+         shards_[i].mutex_.unlock();
+      }
+      numShards_ = (uint32_t)nShards;
+   }
+
+   cacheSize_ = newSize;
+   for(uint32_t i=0; i<numShards_; i++)
+      shards_[i].cacheSize_ = newSize / numShards_;
+   clearExcessCacheData();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::clearExcessCacheData(uint64_t incomingBytes)
+{
+   for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+   {
+      shards_[i].mutex_.lock();
+      shards_[i].clearExcessCacheData(incomingBytes);
+      shards_[i].mutex_.unlock();
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::resetCacheCounters(void)
+{
+   for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+   {
+      shards_[i].mutex_.lock();
+      shards_[i].cacheHits_      = 0;
+      shards_[i].cacheMisses_    = 0;
+      shards_[i].cacheEvictions_ = 0;
+      shards_[i].mutex_.unlock();
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t FileDataCache::openFile(uint32_t fIndex, string filename)
+{
+   // Make sure file exists
+   if(BtcUtils::GetFileSize(filename) == UINT64_MAX)
+      return UINT32_MAX;
+
+   while(fIndex >= fileHandles_.size())
+   {
+#if defined(_MSC_VER) || defined(__MINGW32__)
+      fileHandles_.push_back(INVALID_HANDLE_VALUE);
+#else
+      fileHandles_.push_back(-1);
+#endif
+      fileSizes_.push_back((uint32_t)0);
+      fileNames_.push_back(string(""));
+      cumulSizes_.push_back((uint64_t)0);
+      mappedPtrs_.push_back(NULL);
+      mappedSizes_.push_back((uint32_t)0);
+   }
+
+   // If the file was mapped, the mapping is stale (this is how the last
+   // file gets remapped after it grows, in refreshLastFile)
+   unmapFile(fIndex);
+
+   if(!isFileOpen(fIndex))
+      cout << "Opening file " << fIndex+1 << ": " << filename.c_str() << endl;
+   else
+      closeRawFile(fIndex);
+
+   // Bitcoin-Qt is still appending to the last file, so on Windows we have
+   // to share write access or the open will fail
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   fileHandles_[fIndex] = CreateFileA(filename.c_str(), 
+                                      GENERIC_READ, 
+                                      FILE_SHARE_READ | FILE_SHARE_WRITE, 
+                                      NULL, 
+                                      OPEN_EXISTING, 
+                                      FILE_ATTRIBUTE_NORMAL, 
+                                      NULL);
+#else
+   fileHandles_[fIndex] = open(filename.c_str(), O_RDONLY);
+#endif
+
+   if( !isFileOpen(fIndex) )
+   {
+      cout << "***ERROR:  Could not open file! : " << filename << endl;
+      return UINT32_MAX;
+   }
+
+   fileNames_[fIndex] = filename;
+
+   // Get the filesize
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   fileSizes_[fIndex] = (uint32_t)::GetFileSize(fileHandles_[fIndex], NULL);
+#else
+   fileSizes_[fIndex] = (uint32_t)lseek(fileHandles_[fIndex], 0, SEEK_END);
+#endif
+
+   // If this fails, we just use pread for this file
+   if(useMemoryMap_)
+      mapFile(fIndex);
+
+   // Update the cumulative filesize list
+   uint64_t csize = 0;
+   for(uint32_t i=0; i<fileHandles_.size(); i++)
+   {
+      csize += fileSizes_[i];
+      cumulSizes_[i] = csize;
+   }
+
+   // Return the size of the file we just opened
+   return fileSizes_[fIndex];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool FileDataCache::isFileOpen(uint32_t fIndex)
+{
+   if(fIndex >= fileHandles_.size())
+      return false;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   return fileHandles_[fIndex] != INVALID_HANDLE_VALUE;
+#else
+   return fileHandles_[fIndex] >= 0;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::closeRawFile(uint32_t fIndex)
+{
+   if(!isFileOpen(fIndex))
+      return;
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   CloseHandle(fileHandles_[fIndex]);
+   fileHandles_[fIndex] = INVALID_HANDLE_VALUE;
+#else
+   close(fileHandles_[fIndex]);
+   fileHandles_[fIndex] = -1;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Reads at an offset without moving any shared file position, so any number
+// of threads can do this on the same file at once
+bool FileDataCache::readRawFile(uint32_t fIndex, 
+                                uint32_t start, 
+                                uint32_t nBytes, 
+                                uint8_t* dst)
+{
+   if(!isFileOpen(fIndex) || (uint64_t)start + nBytes > fileSizes_[fIndex])
+      return false;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   while(nBytes > 0)
+   {
+      OVERLAPPED ov;
+      memset(&ov, 0, sizeof(OVERLAPPED));
+      ov.Offset = start;
+      DWORD nRead = 0;
+      if(!ReadFile(fileHandles_[fIndex], dst, nBytes, &nRead, &ov) || nRead==0)
+         return false;
+      start  += nRead;
+      dst    += nRead;
+      nBytes -= nRead;
+   }
+#else
+   while(nBytes > 0)
+   {
+      ssize_t nRead = pread(fileHandles_[fIndex], dst, nBytes, (off_t)start);
+      if(nRead < 0 && errno == EINTR)
+         continue;
+      if(nRead <= 0)
+         return false;
+      start  += (uint32_t)nRead;
+      dst    += nRead;
+      nBytes -= (uint32_t)nRead;
+   }
+#endif
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint8_t* FileDataCache::findAndLock(FileDataPtr const & fdref, 
+                                    FileDataCacheShard* & shard)
+{
+   uint32_t fidx   = fdref.getFileIndex();
+   uint32_t region = fdref.getStartByte() >> CACHE_SHARD_RANGE_BITS;
+
+   shard = &getShard(fidx, region);
+   shard->mutex_.lock();
+   uint8_t* ptr = shard->findData(fdref);
+   if(ptr != NULL || region == 0)
+      return ptr;
+   shard->mutex_.unlock();
+
+   shard = &getShard(fidx, region-1);
+   shard->mutex_.lock();
+   return shard->findData(fdref);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The file read happens without holding any lock, so if two threads miss on
+// the same data at once they'll both read it, and the second one just uses
+// what the first one put in the cache.
+uint8_t* FileDataCache::readAndCache(FileDataPtr const & fdref, uint8_t* dst)
+{
+   uint32_t fidx = fdref.getFileIndex();
+   FileDataCacheShard & shard = getShard(fidx, 
+                           fdref.getStartByte() >> CACHE_SHARD_RANGE_BITS);
+   if(fdref.getNumBytes() > shard.cacheSize_)
+      return NULL;
+
+   BinaryData newData(fdref.getNumBytes());
+   if(!readRawFile(fidx, fdref.getStartByte(), fdref.getNumBytes(), 
+                   newData.getPtr()))
+      return NULL;
+
+   if(dst != NULL)
+      memcpy(dst, newData.getPtr(), fdref.getNumBytes());
+
+   shard.mutex_.lock();
+   uint8_t* ptr = shard.findData(fdref);
+   if(ptr == NULL)
+      ptr = shard.insertData(fdref, newData);
+   shard.mutex_.unlock();
+   return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint8_t* FileDataCache::dataIsCached(FileDataPtr const & fdref)
+{
+   FileDataCacheShard* shard;
+   uint8_t* ptr = findAndLock(fdref, shard);
+   shard->mutex_.unlock();
+   return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint8_t* FileDataCache::getCachedDataPtr(FileDataPtr const & fdref)
+{
+   // Mapped files don't need the cache at all, the OS is doing it for us
+   uint32_t fidx = fdref.getFileIndex();
+   if(fidx < mappedPtrs_.size() && mappedPtrs_[fidx] != NULL)
+   {
+      if(fdref.getStartByte() + fdref.getNumBytes() > mappedSizes_[fidx])
+         return NULL;
+      return mappedPtrs_[fidx] + fdref.getStartByte();
+   }
+
+   FileDataCacheShard* shard;
+   uint8_t* ptr = findAndLock(fdref, shard);
+   if(ptr != NULL)
+      shard->cacheHits_++;
+   else
+      shard->cacheMisses_++;
+   shard->mutex_.unlock();
+
+   // Wasn't in the cache yet, let's get it into the cache...
+   if(ptr == NULL)
+      ptr = readAndCache(fdref, NULL);
+   return ptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Same as getCachedDataPtr, except the copy happens while the shard is still
+// locked, so nobody can evict the data out from under us
+bool FileDataCache::copyData(FileDataPtr const & fdref, uint8_t* dst)
+{
+   uint32_t fidx = fdref.getFileIndex();
+   uint32_t nBytes = fdref.getNumBytes();
+   if(fidx < mappedPtrs_.size() && mappedPtrs_[fidx] != NULL)
+   {
+      if(fdref.getStartByte() + nBytes > mappedSizes_[fidx])
+         return false;
+      memcpy(dst, mappedPtrs_[fidx] + fdref.getStartByte(), nBytes);
+      return true;
+   }
+
+   FileDataCacheShard* shard;
+   uint8_t* ptr = findAndLock(fdref, shard);
+   if(ptr != NULL)
+   {
+      shard->cacheHits_++;
+      memcpy(dst, ptr, nBytes);
+      shard->mutex_.unlock();
+      return true;
+   }
+   shard->cacheMisses_++;
+   shard->mutex_.unlock();
+
+   // Too big for the cache, but we can still read it straight into dst
+   if(nBytes > getShard(fidx, 0).cacheSize_)
+      return readRawFile(fidx, fdref.getStartByte(), nBytes, dst);
+
+   return (readAndCache(fdref, dst) != NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint8_t const * FileDataCache::getThreadSafeDataPtr(FileDataPtr const & fdref,
+                                                    BinaryData & buffer)
+{
+   uint32_t fidx = fdref.getFileIndex();
+   if(fidx < mappedPtrs_.size() && mappedPtrs_[fidx] != NULL)
+   {
+      if(fdref.getStartByte() + fdref.getNumBytes() > mappedSizes_[fidx])
+         return NULL;
+      return mappedPtrs_[fidx] + fdref.getStartByte();
+   }
+
+   buffer.resize(fdref.getNumBytes());
+   if(!copyData(fdref, buffer.getPtr()))
+      return NULL;
+   return buffer.getPtr();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::pprintCacheState(void)
+{
+   uint32_t nFile = fileSizes_.size();
+   cout << "FileDataCache information:" << endl;
+   cout << "   Cache Size: " << cacheSize_/1024.0 << " KiB" << endl;
+   cout << "   Cache Used: " << getCacheUsed()/1024.0 << " KiB" << endl;
+   cout << "   Hits:       " << getNumCacheHits() << endl;
+   cout << "   Misses:     " << getNumCacheMisses() << endl;
+   cout << "   Evictions:  " << getNumEvictions() << endl;
+   cout << "   Files Repr: " << cumulSizes_[nFile-1]/1024.0 << " KiB" << endl;
+   cout << "   Files" << endl;
+   for(uint32_t i=0; i<nFile; i++)
+   {
+      cout << "      ";
+      cout << fileNames_[i].c_str() << " : ";
+      cout << fileSizes_[i]/1024.0 << " KiB (sum: ";
+      cout << cumulSizes_[i]/1024.0 << " KiB)" << endl;
+   }
+   cout << endl;
+
+   for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+   {
+      shards_[i].mutex_.lock();
+      if(shards_[i].cacheUsed_ > 0)
+      {
+         cout << "   Shard " << i << ": " << shards_[i].cacheUsed_/1024.0 
+              << " KiB (" << shards_[i].protectedUsed_/1024.0 
+              << " KiB protected)" << endl;
+         shards_[i].pprintCachedData();
+      }
+      shards_[i].mutex_.unlock();
+   }
+   cout << endl;
+}
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+bool FileDataCache::mapFile(uint32_t fIndex)
+{
+   mappedPtrs_[fIndex]  = NULL;
+   mappedSizes_[fIndex] = 0;
+
+   // Can't map an empty file, but there's nothing to read in it anyway
+   uint32_t fsize = fileSizes_[fIndex];
+   if(fsize == 0)
+      return false;
+
+   string const & filename = fileNames_[fIndex];
+   uint8_t* ptr = NULL;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   // Bitcoin-Qt is still appending to the last file, so we have to share
+   // write access or the open will fail.  The view keeps its own reference
+   // to the mapping, so both handles can be closed right away.
+   HANDLE hFile = CreateFileA(filename.c_str(), 
+                              GENERIC_READ, 
+                              FILE_SHARE_READ | FILE_SHARE_WRITE, 
+                              NULL, 
+                              OPEN_EXISTING, 
+                              FILE_ATTRIBUTE_NORMAL, 
+                              NULL);
+   if(hFile == INVALID_HANDLE_VALUE)
+      return false;
+
+   HANDLE hMap = CreateFileMapping(hFile, NULL, PAGE_READONLY, 0, fsize, NULL);
+   if(hMap != NULL)
+   {
+      ptr = (uint8_t*)MapViewOfFile(hMap, FILE_MAP_READ, 0, 0, fsize);
+      CloseHandle(hMap);
+   }
+   CloseHandle(hFile);
+#else
+   int fd = open(filename.c_str(), O_RDONLY);
+   if(fd < 0)
+      return false;
+
+   void* mptr = mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+   if(mptr != MAP_FAILED)
+      ptr = (uint8_t*)mptr;
+#endif
+
+   if(ptr == NULL)
+   {
+      cout << "***WARNING:  Could not map file, using cached reads: " 
+           << filename.c_str() << endl;
+      return false;
+   }
+
+   mappedPtrs_[fIndex]  = ptr;
+   mappedSizes_[fIndex] = fsize;
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void FileDataCache::unmapFile(uint32_t fIndex)
+{
+   if(fIndex >= mappedPtrs_.size() || mappedPtrs_[fIndex] == NULL)
+      return;
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   UnmapViewOfFile(mappedPtrs_[fIndex]);
+#else
+   munmap(mappedPtrs_[fIndex], mappedSizes_[fIndex]);
+#endif
+
+   mappedPtrs_[fIndex]  = NULL;
+   mappedSizes_[fIndex] = 0;
+}
+
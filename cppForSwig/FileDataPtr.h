@@ -15,10 +15,24 @@
 #include <string>
 #include "BinaryData.h"
 #include "BtcUtils.h"
+#include "ThreadUtils.h"
 
 
 #define DEFAULT_CACHE_SIZE (1*1024*1024)
 
+// Most of the cache can be "protected" (data that's been used more than once)
+// and the rest is for new data, so a long scan can't push out everything
+#define CACHE_PROTECTED_PCT 80
+
+// The cache is split up so that threads don't all wait on the same lock.
+// Each file is divided into regions of 2^CACHE_SHARD_RANGE_BITS bytes 
+// (16 MB), and each region's data goes in one of the shards.  Every shard
+// gets at least CACHE_MIN_SHARD_SIZE, enough for any whole block, so a 
+// small cache is split into fewer shards (down to just one).
+#define CACHE_MAX_SHARDS       16
+#define CACHE_SHARD_RANGE_BITS 24
+#define CACHE_MIN_SHARD_SIZE   (2*1024*1024)
+
 ////////////////////////////////////////////////////////////////////////////////
 //
 // The goal of this class is to replace mmap on OSes/architectures where it 
@@ -35,6 +49,34 @@
 // so this solution doesn't need to accommodate high-volume accesses.
 //
 //
+// UPDATE:  The cache used to just clear itself completely whenever it got
+//          full, which is fine for pre-caching one chunk at a time, but 
+//          a working set just a little bigger than the cache would get 
+//          thrown out over and over.  Now it's a segmented LRU:  new data
+//          goes into the "probation" segment, and only gets moved to the
+//          "protected" segment when it's used again later.  When there's
+//          no room, the least-recently-used probation data is evicted
+//          first, and only as much as is needed.  That way a big scan only
+//          cycles through probation, and whatever we keep coming back to
+//          stays put.  The hit/miss/eviction counts are kept, too.
+//
+//
+// UPDATE:  On 64-bit systems, mmap is actually the better option, because
+//          the OS page cache does all the caching for us and there's no
+//          copying at all.  So there is now a memory-mapped mode (off by
+//          default, see setUseMemoryMap()) where each blkXXXX.dat file is
+//          mapped read-only and getUnsafeDataPtr() points straight into the
+//          mapping.  Any file that can't be mapped (such as when we run out
+//          of address space on 32-bit) just falls back to the ifstream.
+//
+//
+// UPDATE:  Reads are now thread-safe, so scans can run in parallel with each
+//          other and with UI queries.  The ifstreams (which each had one 
+//          seek position for everybody) are replaced by raw file handles
+//          and pread, and the cache is sharded with a lock per shard.  See
+//          the FileDataCache comments for which calls are safe.
+//
+//
 // NOTE: I made start-byte a uint32_t because one of the reasons for
 //       designing this class the way I did was that the blockchain 
 //       files never exceed 2 GB.  Therefore, the file offset will never
@@ -101,8 +143,16 @@ public:
    // is removed from the cache... 
    // It can be used safely only if you guarantee that no other cache ops
    // will be executed between calling this method and using the pointer.
+   // It can also only be used when a single thread is using the cache, 
+   // unless the file is memory-mapped.
    uint8_t* getUnsafeDataPtr(void) const;
 
+   // Thread-safe version of the above:  if the file is memory-mapped, this
+   // is a pointer straight into the mapping, otherwise the data is copied
+   // into buffer and this points to that.  Same cost as getUnsafeDataPtr()
+   // when mapped, and one copy when not.  NULL if the data isn't there.
+   uint8_t const * getThreadSafeDataPtr(BinaryData & buffer) const;
+
    // This is always safe.  If the data is cached, it is copied to the 
    // return value.  If not, it's retrieved from disk and then copied.
    BinaryData getDataCopy(void) const;  
@@ -135,12 +185,75 @@ private:
 
 
 
+////////////////////////////////////////////////////////////////////////////////
+// The cache is split into up to CACHE_MAX_SHARDS independent pieces, each 
+// with its own lock, LRU lists and counters, so threads reading different 
+// parts of the blockchain don't wait on each other.  Data goes to a shard 
+// based on its file index and which CACHE_SHARD_RANGE_BITS-sized region of
+// the file it starts in.  
+class FileDataCacheShard
+{
+public:
+   FileDataCacheShard(void) { clear(); }
+
+   // None of these lock anything, the FileDataCache does that
+   void      clear(void);
+   uint8_t*  findData(FileDataPtr const & fdref);
+   uint8_t*  insertData(FileDataPtr const & fdref, BinaryData & data);
+   void      clearExcessCacheData(uint64_t incomingBytes=0);
+   void      pprintCachedData(void);
+
+   Mutex     mutex_;
+   uint64_t  cacheSize_;
+   uint64_t  cacheUsed_;
+   uint64_t  protectedUsed_;
+   uint64_t  cacheHits_;
+   uint64_t  cacheMisses_;
+   uint64_t  cacheEvictions_;
+
+private:
+   // Not copyable, it has a mutex
+   FileDataCacheShard(FileDataCacheShard const &);
+   FileDataCacheShard & operator=(FileDataCacheShard const &);
+
+   struct CacheData
+   {
+      FileDataPtr fdp_;
+      BinaryData  data_;
+      bool        isProtected_;
+   };
+   typedef list<CacheData>::iterator   CacheIter;
+
+   void touchCacheData(CacheIter iter);
+   void demoteExcessProtected(void);
+
+   list<CacheData>               probation_;
+   list<CacheData>               protected_;
+   map<FileDataPtr, CacheIter>   cacheMap_;
+};
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Reading data (getData, copyData, getThreadSafeDataPtr) is safe from any 
+// number of threads at once.  Files are read with pread (ReadFile with an 
+// offset, on Windows), so there's no shared seek position to fight over.
+// Memory-mapped files don't touch the cache or any locks at all.
+//
+// Everything that changes the set of files or the settings -- openFile, 
+// refreshLastFile, setUseMemoryMap, setCacheSize, clear -- still has to be
+// done while nobody else is reading.
+//
+// getCachedDataPtr/dataIsCached hand out pointers into the cache, which 
+// another thread could evict at any time, so they're only safe when one 
+// thread is using the cache (or the file is mapped).
 class FileDataCache
 {
 public:
 
    /////////////////////////////////////////////////////////////////////////////
-   FileDataCache(uint64_t maxSize=DEFAULT_CACHE_SIZE)
+   FileDataCache(uint64_t maxSize=DEFAULT_CACHE_SIZE) : 
+      numShards_(1), useMemoryMap_(false)
    { 
       clear(); 
       setCacheSize(maxSize); 
@@ -152,92 +265,45 @@ public:
       clear(); 
    }
 
+   void clear(void);
+
+   // Split evenly between as many shards as can have CACHE_MIN_SHARD_SIZE
+   // each (at least one, even if newSize is smaller), so a whole block can
+   // still be pre-cached, and the total never goes over newSize.  If that
+   // changes the number of shards, everything cached is dropped.
+   void setCacheSize(uint64_t newSize);
+
    /////////////////////////////////////////////////////////////////////////////
-   void clear(void)
+   // Switch between memory-mapped files and the pread+cache.  Files that
+   // are already open are mapped/unmapped right away.  Any pointers that 
+   // were previously retrieved with getUnsafeDataPtr() are invalidated.
+   void setUseMemoryMap(bool useMmap)
    {
-      for(uint8_t i=0; i<openFiles_.size(); i++)
-         if(openFiles_[i] != NULL)
-            delete openFiles_[i];
-
-      openFiles_.clear();
-      cachedData_.clear();
-      cacheMap_.clear();
-      cacheUsed_ = 0;
-      cacheSize_ = 0;
+      useMemoryMap_ = useMmap;
+      for(uint32_t i=0; i<fileHandles_.size(); i++)
+      {
+         unmapFile(i);
+         if(useMemoryMap_ && isFileOpen(i))
+            mapFile(i);
+      }
    }
 
-   /////////////////////////////////////////////////////////////////////////////
-   void setCacheSize(uint64_t newSize)
+   bool getUseMemoryMap(void) { return useMemoryMap_; }
+
+   // True if this file is actually being accessed through a mapping
+   bool isFileMapped(uint32_t fIndex)
    {
-      cacheSize_ = newSize;
-      clearExcessCacheData();
+      return (fIndex < mappedPtrs_.size() && mappedPtrs_[fIndex] != NULL);
    }
 
    /////////////////////////////////////////////////////////////////////////////
    uint32_t refreshLastFile(void)
    {
-      uint32_t lastIndex = openFiles_.size()-1;
+      uint32_t lastIndex = fileHandles_.size()-1;
       return openFile(lastIndex, fileNames_[lastIndex]);
    }
 
-   /////////////////////////////////////////////////////////////////////////////
-   uint32_t openFile(uint32_t fIndex, string filename)
-   {
-
-      // Make sure file exists
-      if(BtcUtils::GetFileSize(filename) == UINT64_MAX)
-         return UINT32_MAX;
-
-      while(fIndex >= openFiles_.size())
-      {
-         openFiles_.push_back(NULL);
-         fileSizes_.push_back((uint32_t)0);
-         fileNames_.push_back(string(""));
-         cumulSizes_.push_back((uint64_t)0);
-      }
-
-      
-      ifstream* istrmPtr = openFiles_[fIndex];
-      if(istrmPtr==NULL)
-      {
-         cout << "Opening file " << fIndex+1 << ": " << filename.c_str() << endl;
-         openFiles_[fIndex] = new ifstream;
-      }
-      else
-      {
-         if(istrmPtr->is_open())
-            istrmPtr->close();
-      }
-
-
-      istrmPtr = openFiles_[fIndex];
-      istrmPtr->open(filename.c_str(), ios::in|ios::binary);
-
-      if( !istrmPtr->is_open() )
-      {
-         cout << "***ERROR:  Could not open file! : " << filename << endl;
-         return UINT32_MAX;
-      }
-
-      fileNames_[fIndex] = filename;
-
-      // Get the filesize
-      istrmPtr->seekg(0, ios::end);
-      fileSizes_[fIndex] = istrmPtr->tellg();
-      istrmPtr->seekg(0, ios::beg);
-
-      // Update the cumulative filesize list
-      uint64_t csize = 0;
-      for(uint32_t i=0; i<openFiles_.size(); i++)
-      {
-         csize += fileSizes_[i];
-         cumulSizes_[i] = csize;
-      }
-
-      // Return the size of the file we just opened
-      return fileSizes_[fIndex];
-   }
-   
+   uint32_t openFile(uint32_t fIndex, string filename);
 
    /////////////////////////////////////////////////////////////////////////////
    void closeFile(uint32_t fidx)
@@ -245,136 +311,48 @@ public:
       
    }
 
-   /////////////////////////////////////////////////////////////////////////////
-   uint8_t* dataIsCached(FileDataPtr const & fdref)
-   {
-      static map<FileDataPtr, list<CacheData>::iterator>::iterator iter;
+   // If the data is anywhere in the cache (could be part of a bigger chunk)
+   // returns a pointer to it, and counts that as a use of the chunk
+   uint8_t* dataIsCached(FileDataPtr const & fdref);
 
-      // Retrieve one above the top.
-      iter = cacheMap_.upper_bound(fdref);
-      if(iter==cacheMap_.begin())
-         return NULL;
-      
-      iter--;
-      uint32_t cidx   = iter->first.getFileIndex();
-      uint32_t cstart = iter->first.getStartByte();
-      uint32_t crefsz = iter->second->second.getSize();
-
-      if(cidx != fdref.getFileIndex())
-         return NULL;
-
-      // We have cached data in the same file, and starting before fdref...
-      uint32_t coffset = fdref.getStartByte() - cstart;
-      if(coffset + fdref.getNumBytes() > crefsz)
-         return NULL;
+   // Pulls the data into the cache if it's not there, and returns a pointer
+   // into the cache (or the mapping).  See the note above about threads
+   uint8_t* getCachedDataPtr(FileDataPtr const & fdref);
 
-      return iter->second->second.getPtr() + coffset;
-   }
-
-
-   /////////////////////////////////////////////////////////////////////////////
-   uint8_t* getCachedDataPtr(FileDataPtr const & fdref)
-   {
-      uint8_t* ptr = dataIsCached(fdref);
-      if(ptr != NULL || fdref.getNumBytes() > cacheSize_)
-         return ptr;
-
-      // Wasn't in the cache yet, let's get it into the cache...
-      uint32_t cidx   = fdref.getFileIndex();
-      uint32_t cstart = fdref.getStartByte();
-      uint32_t cbytes = fdref.getNumBytes();
-
-      clearExcessCacheData(cbytes);
-
-      if( cidx >= openFiles_.size() || cstart + cbytes > fileSizes_[cidx] )
-         return NULL;
-
-      openFiles_[cidx]->seekg(cstart);
-      cachedData_.push_back( CacheData(fdref, BinaryData(cbytes)) );
-      list<CacheData>::iterator iter = cachedData_.end();
-      iter--;
-      uint8_t* newDataPtr = iter->second.getPtr();
-      openFiles_[cidx]->read((char*)newDataPtr, cbytes);
-      cacheMap_[fdref] = iter;
-      cacheUsed_ += cbytes;
-
-      return newDataPtr;
-   }
+   // The thread-safe ways to get data.  copyData copies it into dst, which
+   // has to have room for fdref.getNumBytes().  getThreadSafeDataPtr gives 
+   // a pointer straight into the mapping if the file is mapped, otherwise
+   // it copies into buffer and returns buffer's pointer.  Both return
+   // false/NULL if the data isn't in the file.
+   bool           copyData(FileDataPtr const & fdref, uint8_t* dst);
+   uint8_t const* getThreadSafeDataPtr(FileDataPtr const & fdref, 
+                                       BinaryData & buffer);
 
    /////////////////////////////////////////////////////////////////////////////
    BinaryData getData(FileDataPtr const & fdref)
    {
-      uint8_t* cachePtr = getCachedDataPtr(fdref);
-      if(cachePtr==NULL)
+      BinaryData out(fdref.getNumBytes());
+      if(!copyData(fdref, out.getPtr()))
       {
          cout << "***ERROR:  Could not retrieve cache!" << endl;
          return BinaryData(0);
       }
-
-      return BinaryData(cachePtr, fdref.getNumBytes());
+      return out;
    }
 
-   /////////////////////////////////////////////////////////////////////////////
-   void clearExcessCacheData(uint64_t incomingBytes=0)
-   {
-      // TODO:  This turned out to be ridiculously slow!  
-      //        every single one of these lines should
-      //        be efficient, but I must've missed something!
-      //while(cacheUsed_+incomingBytes > cacheSize_ )
-      //{
-         //list<CacheData>::iterator cIter = cachedData_.begin();
-         //FileDataPtr & toRemove = cIter->first;
-         //cacheUsed_ -= toRemove.getNumBytes();
-         //cacheMap_.erase(toRemove);
-         //cachedData_.erase(cIter);
-      //}
-
-      // This is a very "dumb" version that works great for pre-caching
-      // which is the really important part.  If the cache is full, just
-      // clear it completely!
-      //
-      if(cacheUsed_+incomingBytes > cacheSize_ )
-      {
-         cachedData_.clear();
-         cacheMap_.clear();
-         cacheUsed_ = 0;
-      }
-               
-      
-   }
+   // Evicts from every shard until each one has room for incomingBytes
+   void clearExcessCacheData(uint64_t incomingBytes=0);
 
    /////////////////////////////////////////////////////////////////////////////
-   void pprintCacheState(void)
-   {
-      uint32_t nFile = fileSizes_.size();
-      cout << "FileDataCache information:" << endl;
-      cout << "   Cache Size: " << cacheSize_/1024.0 << " KiB" << endl;
-      cout << "   Cache Used: " << cacheUsed_/1024.0 << " KiB" << endl;
-      cout << "   Files Repr: " << cumulSizes_[nFile-1]/1024.0 << " KiB" << endl;
-      cout << "   Files" << endl;
-      for(uint32_t i=0; i<nFile; i++)
-      {
-         cout << "      ";
-         cout << fileNames_[i].c_str() << " : ";
-         cout << fileSizes_[i]/1024.0 << " KiB (sum: ";
-         cout << cumulSizes_[i]/1024.0 << " KiB)" << endl;
-      }
-      cout << endl;
+   // These are summed over all the shards
+   uint64_t getCacheSize(void)      { return cacheSize_; }
+   uint64_t getCacheUsed(void)      { return sumShards(&FileDataCacheShard::cacheUsed_); }
+   uint64_t getNumCacheHits(void)   { return sumShards(&FileDataCacheShard::cacheHits_); }
+   uint64_t getNumCacheMisses(void) { return sumShards(&FileDataCacheShard::cacheMisses_); }
+   uint64_t getNumEvictions(void)   { return sumShards(&FileDataCacheShard::cacheEvictions_); }
+   void     resetCacheCounters(void);
 
-      cout << "   Cached Data: " << cachedData_.size() << " cache chunks " << endl;
-
-      map<FileDataPtr, list<CacheData>::iterator>::iterator mapIter;
-      uint32_t i=0;
-      for(mapIter = cacheMap_.begin(); mapIter != cacheMap_.end();  mapIter++)
-      {
-         cout << "       " << i++ << " : (";
-         cout << mapIter->first.getFileIndex() << ", ";
-         cout << mapIter->first.getStartByte() << ", ";
-         cout << mapIter->first.getNumBytes() << ") ";
-         cout << endl;
-      }
-      cout << endl;
-   }
+   void pprintCacheState(void);
 
    uint32_t getFileSize(uint32_t i) {return fileSizes_[i]; }
    uint32_t getLastFileSize(void) {return fileSizes_[fileSizes_.size()-1]; }
@@ -388,18 +366,68 @@ public:
 
 
 private:
-   typedef pair<FileDataPtr, BinaryData>   CacheData;
 
+   /////////////////////////////////////////////////////////////////////////////
+   // Consecutive regions of a file go to consecutive shards, so a scan 
+   // moves through them instead of piling up in one
+   FileDataCacheShard & getShard(uint32_t fIndex, uint32_t region)
+   {
+      return shards_[(fIndex*31 + region) % numShards_];
+   }
+
+   uint64_t sumShards(uint64_t FileDataCacheShard::* member)
+   {
+      uint64_t sum = 0;
+      for(uint32_t i=0; i<CACHE_MAX_SHARDS; i++)
+      {
+         shards_[i].mutex_.lock();
+         sum += shards_[i].*member;
+         shards_[i].mutex_.unlock();
+      }
+      return sum;
+   }
 
-   vector<ifstream*>                             openFiles_;
+   // Looks in the shard for the region the data starts in, and the one 
+   // before it (a chunk can start in one region and run into the next).  
+   // If found, returns the pointer with that shard still locked.
+   uint8_t* findAndLock(FileDataPtr const & fdref, FileDataCacheShard* & shard);
+
+   // Reads the data from the file and adds it to the cache, unless some
+   // other thread beat us to it.  The data is copied to dst if not NULL.
+   // Returns the pointer into the cache (don't use it with more than one
+   // thread), or NULL if it can't be read or is too big to cache (and 
+   // then nothing is copied to dst, either)
+   uint8_t* readAndCache(FileDataPtr const & fdref, uint8_t* dst);
+
+   // These are in the .cpp, to keep the OS-specific stuff there
+   bool isFileOpen(uint32_t fIndex);
+   void closeRawFile(uint32_t fIndex);
+   bool readRawFile(uint32_t fIndex, uint32_t start, uint32_t nBytes, uint8_t* dst);
+
+   // Map the whole file read-only, or leave mappedPtrs_[fIndex] as NULL if 
+   // we can't.
+   bool mapFile(uint32_t fIndex);
+   void unmapFile(uint32_t fIndex);
+
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   vector<HANDLE>                                fileHandles_;
+#else
+   vector<int>                                   fileHandles_;
+#endif
    vector<uint32_t>                              fileSizes_;
    vector<uint64_t>                              cumulSizes_;
    vector<string>                                fileNames_;
-   list<CacheData>                               cachedData_;
-   map<FileDataPtr, list<CacheData>::iterator>   cacheMap_;
-   uint64_t                                      cacheUsed_;
    uint64_t                                      cacheSize_;
 
+   // Only the first numShards_ are used
+   FileDataCacheShard                            shards_[CACHE_MAX_SHARDS];
+   uint32_t                                      numShards_;
+
+   bool                                          useMemoryMap_;
+   vector<uint8_t*>                              mappedPtrs_;
+   vector<uint32_t>                              mappedSizes_;
+
 };
 
 
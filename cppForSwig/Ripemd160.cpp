@@ -0,0 +1,326 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "Ripemd160.h"
+#include "Sha256.h"
+
+
+// Same conditions as the SIMD kernels in Sha256.cpp
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && \
+    ( defined(__clang__) || \
+      (defined(_MSC_VER) && _MSC_VER >= 1900) || \
+      (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) )
+   #define RMD160_X86_KERNELS
+#endif
+
+#ifdef RMD160_X86_KERNELS
+   #include <immintrin.h>
+   #if defined(_MSC_VER)
+      #define RMD160_TARGET(x)
+   #else
+      #define RMD160_TARGET(x) __attribute__((target(x)))
+   #endif
+#endif
+
+
+static uint32_t const RMD160_INIT[5] =
+{
+   0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+};
+
+// Which message word, and how far to rotate, for each of the 80 steps of the
+// left and right lines
+static uint8_t const RMD160_RL[80] =
+{
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15,
+    7,  4, 13,  1, 10,  6, 15,  3, 12,  0,  9,  5,  2, 14, 11,  8,
+    3, 10, 14,  4,  9, 15,  8,  1,  2,  7,  0,  6, 13, 11,  5, 12,
+    1,  9, 11, 10,  0,  8, 12,  4, 13,  3,  7, 15, 14,  5,  6,  2,
+    4,  0,  5,  9,  7, 12,  2, 10, 14,  1,  3,  8, 11,  6, 15, 13
+};
+
+static uint8_t const RMD160_RR[80] =
+{
+    5, 14,  7,  0,  9,  2, 11,  4, 13,  6, 15,  8,  1, 10,  3, 12,
+    6, 11,  3,  7,  0, 13,  5, 10, 14, 15,  8, 12,  4,  9,  1,  2,
+   15,  5,  1,  3,  7, 14,  6,  9, 11,  8, 12,  2, 10,  0,  4, 13,
+    8,  6,  4,  1,  3, 11, 15,  0,  5, 12,  2, 13,  9,  7, 10, 14,
+   12, 15, 10,  4,  1,  5,  8,  7,  6,  2, 13, 14,  0,  3,  9, 11
+};
+
+static uint8_t const RMD160_SL[80] =
+{
+   11, 14, 15, 12,  5,  8,  7,  9, 11, 13, 14, 15,  6,  7,  9,  8,
+    7,  6,  8, 13, 11,  9,  7, 15,  7, 12, 15,  9, 11,  7, 13, 12,
+   11, 13,  6,  7, 14,  9, 13, 15, 14,  8, 13,  6,  5, 12,  7,  5,
+   11, 12, 14, 15, 14, 15,  9,  8,  9, 14,  5,  6,  8,  6,  5, 12,
+    9, 15,  5, 11,  6,  8, 13, 12,  5, 12, 13, 14, 11,  8,  5,  6
+};
+
+static uint8_t const RMD160_SR[80] =
+{
+    8,  9,  9, 11, 13, 15, 15,  5,  7,  7,  8, 11, 14, 14, 12,  6,
+    9, 13, 15,  7, 12,  8,  9, 11,  7,  7, 12,  7,  6, 15, 13, 11,
+    9,  7, 15, 11,  8,  6,  6, 14, 12, 13,  5, 14, 13, 13,  7,  5,
+   15,  5,  8, 11, 14, 14,  6, 14,  6,  9, 12,  9, 12,  5, 15,  8,
+    8,  5, 12,  9, 12,  5, 14,  6,  8, 13,  6,  5, 15, 13, 11, 11
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The compression function is written once, in terms of V_* operations on a
+// VEC type, and each kernel below defines those for its register width.  The
+// five boolean functions, with V_ANDNOT(x,y) meaning (~x & y):
+#define RMD_F1(x,y,z)   V_XOR(V_XOR(x,y),z)
+#define RMD_F2(x,y,z)   V_OR(V_AND(x,y),V_ANDNOT(x,z))
+#define RMD_F3(x,y,z)   V_XOR(V_OR(x,V_NOT(y)),z)
+#define RMD_F4(x,y,z)   V_OR(V_AND(x,z),V_ANDNOT(z,y))
+#define RMD_F5(x,y,z)   V_XOR(x,V_OR(y,V_NOT(z)))
+
+#define RMD_STEP(F, a,b,c,d,e, xw, k, s)                                     \
+   {                                                                         \
+      VEC t = V_ADD(V_ROTL(V_ADD(V_ADD(a, F(b,c,d)), V_ADD(xw, k)), s), e);  \
+      a = e;  e = d;  d = V_ROTL(c,10);  c = b;  b = t;                      \
+   }
+
+// Sixteen steps of both lines.  The right line uses the functions in the
+// opposite order.
+#define RMD_GROUP(FL, KL, FR, KR, g)                                         \
+   {                                                                         \
+      VEC kl = V_SET1(KL);                                                   \
+      VEC kr = V_SET1(KR);                                                   \
+      for(uint32_t j=16*(g); j<16*(g)+16; j++)                               \
+      {                                                                      \
+         RMD_STEP(FL, al,bl,cl,dl,el, x[RMD160_RL[j]], kl, RMD160_SL[j]);    \
+         RMD_STEP(FR, ar,br,cr,dr,er, x[RMD160_RR[j]], kr, RMD160_SR[j]);    \
+      }                                                                      \
+   }
+
+// h[5] is the state and x[16] is the block, both already in VECs
+#define RMD_COMPRESS(h, x)                                                   \
+   {                                                                         \
+      VEC al = h[0], bl = h[1], cl = h[2], dl = h[3], el = h[4];             \
+      VEC ar = h[0], br = h[1], cr = h[2], dr = h[3], er = h[4];             \
+      RMD_GROUP(RMD_F1, 0x00000000, RMD_F5, 0x50a28be6, 0);                  \
+      RMD_GROUP(RMD_F2, 0x5a827999, RMD_F4, 0x5c4dd124, 1);                  \
+      RMD_GROUP(RMD_F3, 0x6ed9eba1, RMD_F3, 0x6d703ef3, 2);                  \
+      RMD_GROUP(RMD_F4, 0x8f1bbcdc, RMD_F2, 0x7a6d76e9, 3);                  \
+      RMD_GROUP(RMD_F5, 0xa953fd4e, RMD_F1, 0x00000000, 4);                  \
+      VEC t = V_ADD(V_ADD(h[1], cl), dr);                                    \
+      h[1]  = V_ADD(V_ADD(h[2], dl), er);                                    \
+      h[2]  = V_ADD(V_ADD(h[3], el), ar);                                    \
+      h[3]  = V_ADD(V_ADD(h[4], al), br);                                    \
+      h[4]  = V_ADD(V_ADD(h[0], bl), cr);                                    \
+      h[0]  = t;                                                             \
+   }
+
+// A 32-byte message pads out to the same last eight words every time:  the
+// 0x80 byte, zeros, and the length of 256 bits (little-endian, like all of
+// RIPEMD160)
+#define RMD_PAD_32BYTE_MSG(x)                                                \
+   x[ 8] = V_SET1(0x00000080);                                               \
+   x[ 9] = x[10] = x[11] = x[12] = x[13] = x[15] = V_SET1(0);                \
+   x[14] = V_SET1(256);
+
+
+////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t readUint32LE(uint8_t const * ptr)
+{
+   return ((uint32_t)ptr[0]      ) | ((uint32_t)ptr[1] <<  8) |
+          ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static inline void writeUint32LE(uint8_t * ptr, uint32_t val)
+{
+   ptr[0] = (uint8_t)(val      );
+   ptr[1] = (uint8_t)(val >>  8);
+   ptr[2] = (uint8_t)(val >> 16);
+   ptr[3] = (uint8_t)(val >> 24);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+#define VEC              uint32_t
+#define V_SET1(k)        ((uint32_t)(k))
+#define V_ADD(x,y)       ((x) + (y))
+#define V_XOR(x,y)       ((x) ^ (y))
+#define V_AND(x,y)       ((x) & (y))
+#define V_OR(x,y)        ((x) | (y))
+#define V_NOT(x)         (~(x))
+#define V_ANDNOT(x,y)    (~(x) & (y))
+#define V_ROTL(x,n)      (((x) << (n)) | ((x) >> (32-(n))))
+
+static void rmd160Generic(uint8_t const * msg32, uint8_t * hashOut)
+{
+   uint32_t x[16];
+   for(uint32_t i=0; i<8; i++)
+      x[i] = readUint32LE(msg32 + 4*i);
+   RMD_PAD_32BYTE_MSG(x);
+
+   uint32_t h[5];
+   for(uint32_t i=0; i<5; i++)
+      h[i] = RMD160_INIT[i];
+
+   RMD_COMPRESS(h, x);
+
+   for(uint32_t i=0; i<5; i++)
+      writeUint32LE(hashOut + 4*i, h[i]);
+}
+
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_ANDNOT
+#undef V_ROTL
+
+
+#ifdef RMD160_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+// Four messages, one in each 32-bit lane.  The words are already in the
+// right byte order, they just have to be gathered into the lanes.
+#define VEC              __m128i
+#define V_SET1(k)        _mm_set1_epi32((int)(k))
+#define V_ADD(x,y)       _mm_add_epi32(x,y)
+#define V_XOR(x,y)       _mm_xor_si128(x,y)
+#define V_AND(x,y)       _mm_and_si128(x,y)
+#define V_OR(x,y)        _mm_or_si128(x,y)
+#define V_NOT(x)         _mm_xor_si128(x, _mm_set1_epi32(-1))
+#define V_ANDNOT(x,y)    _mm_andnot_si128(x,y)
+#define V_ROTL(x,n)      _mm_or_si128(_mm_sll_epi32(x, _mm_cvtsi32_si128(n)),     \
+                                      _mm_srl_epi32(x, _mm_cvtsi32_si128(32-(n))))
+
+RMD160_TARGET("sse2")
+static void rmd160Sse4x4(uint8_t const * msgs32, uint8_t * hashesOut)
+{
+   __m128i x[16];
+   for(uint32_t i=0; i<8; i++)
+      x[i] = _mm_set_epi32((int)readUint32LE(msgs32 + 96 + 4*i),
+                           (int)readUint32LE(msgs32 + 64 + 4*i),
+                           (int)readUint32LE(msgs32 + 32 + 4*i),
+                           (int)readUint32LE(msgs32 +      4*i));
+   RMD_PAD_32BYTE_MSG(x);
+
+   __m128i h[5];
+   for(uint32_t i=0; i<5; i++)
+      h[i] = V_SET1(RMD160_INIT[i]);
+
+   RMD_COMPRESS(h, x);
+
+   uint32_t out[5][4];
+   for(uint32_t i=0; i<5; i++)
+      _mm_storeu_si128((__m128i*)out[i], h[i]);
+   for(uint32_t l=0; l<4; l++)
+      for(uint32_t i=0; i<5; i++)
+         writeUint32LE(hashesOut + 20*l + 4*i, out[i][l]);
+}
+
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_ANDNOT
+#undef V_ROTL
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Eight messages, one in each 32-bit lane of a 256-bit register
+#define VEC              __m256i
+#define V_SET1(k)        _mm256_set1_epi32((int)(k))
+#define V_ADD(x,y)       _mm256_add_epi32(x,y)
+#define V_XOR(x,y)       _mm256_xor_si256(x,y)
+#define V_AND(x,y)       _mm256_and_si256(x,y)
+#define V_OR(x,y)        _mm256_or_si256(x,y)
+#define V_NOT(x)         _mm256_xor_si256(x, _mm256_set1_epi32(-1))
+#define V_ANDNOT(x,y)    _mm256_andnot_si256(x,y)
+#define V_ROTL(x,n)      _mm256_or_si256(_mm256_sll_epi32(x, _mm_cvtsi32_si128(n)),     \
+                                         _mm256_srl_epi32(x, _mm_cvtsi32_si128(32-(n))))
+
+RMD160_TARGET("avx2")
+static void rmd160Avx2x8(uint8_t const * msgs32, uint8_t * hashesOut)
+{
+   __m256i x[16];
+   for(uint32_t i=0; i<8; i++)
+      x[i] = _mm256_set_epi32((int)readUint32LE(msgs32 + 224 + 4*i),
+                              (int)readUint32LE(msgs32 + 192 + 4*i),
+                              (int)readUint32LE(msgs32 + 160 + 4*i),
+                              (int)readUint32LE(msgs32 + 128 + 4*i),
+                              (int)readUint32LE(msgs32 +  96 + 4*i),
+                              (int)readUint32LE(msgs32 +  64 + 4*i),
+                              (int)readUint32LE(msgs32 +  32 + 4*i),
+                              (int)readUint32LE(msgs32 +       4*i));
+   RMD_PAD_32BYTE_MSG(x);
+
+   __m256i h[5];
+   for(uint32_t i=0; i<5; i++)
+      h[i] = V_SET1(RMD160_INIT[i]);
+
+   RMD_COMPRESS(h, x);
+
+   uint32_t out[5][8];
+   for(uint32_t i=0; i<5; i++)
+      _mm256_storeu_si256((__m256i*)out[i], h[i]);
+   for(uint32_t l=0; l<8; l++)
+      for(uint32_t i=0; i<5; i++)
+         writeUint32LE(hashesOut + 20*l + 4*i, out[i][l]);
+}
+
+#undef VEC
+#undef V_SET1
+#undef V_ADD
+#undef V_XOR
+#undef V_AND
+#undef V_OR
+#undef V_NOT
+#undef V_ANDNOT
+#undef V_ROTL
+
+#endif  // RMD160_X86_KERNELS
+
+
+
+////////////////////////////////////////////////////////////////////////////////
+void Ripemd160::hash32(uint8_t const * msg32, uint8_t * hashOut)
+{
+   rmd160Generic(msg32, hashOut);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Ripemd160::hash32Batch(uint8_t const * msgs32,
+                            uint32_t        nMsg,
+                            uint8_t *       hashesOut)
+{
+   uint32_t i = 0;
+
+#ifdef RMD160_X86_KERNELS
+   Sha256::Engine eng = Sha256::getEngine();
+   bool useAvx2 = (eng == Sha256::ENGINE_AVX2 || eng == Sha256::ENGINE_SHANI) &&
+                  Sha256::isEngineSupported(Sha256::ENGINE_AVX2);
+   bool useSse  = (eng != Sha256::ENGINE_GENERIC);
+
+   if(useAvx2)
+      for(; i+8<=nMsg; i+=8)
+         rmd160Avx2x8(msgs32 + 32*i, hashesOut + 20*i);
+
+   if(useSse)
+      for(; i+4<=nMsg; i+=4)
+         rmd160Sse4x4(msgs32 + 32*i, hashesOut + 20*i);
+#endif
+
+   // Whatever doesn't fill up the lanes
+   for(; i<nMsg; i++)
+      rmd160Generic(msgs32 + 32*i, hashesOut + 20*i);
+}
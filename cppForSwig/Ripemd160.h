@@ -0,0 +1,44 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// RIPEMD160, but only for what HASH160 needs:  the second half of
+// RIPEMD160(SHA256(x)), where the input is always a 32-byte SHA256 hash.
+// That makes it exactly one block with the padding known in advance, so a
+// batch of them can go through the SIMD lanes side by side, the same way as
+// Sha256::hashBatch.  Anything else should keep using CryptoPP::RIPEMD160.
+//
+// The number of lanes follows the Sha256 engine, so that forcing that to
+// GENERIC (for testing) turns this off, too:
+//
+//    SHANI/AVX2  -- 8 hashes at once in 256-bit registers (there are no
+//                   RIPEMD instructions, so SHANI uses AVX2 when it can)
+//    SSE4        -- 4 hashes at once in 128-bit registers
+//    GENERIC     -- Plain C, one at a time
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _RIPEMD160_H_
+#define _RIPEMD160_H_
+
+#include "BinaryData.h"
+
+
+class Ripemd160
+{
+public:
+   // RIPEMD160 of one 32-byte message, 20 bytes written to hashOut
+   static void hash32(uint8_t const * msg32, uint8_t * hashOut);
+
+   // nMsg 32-byte messages one after another in msgs32, the 20-byte
+   // results are written one after another to hashesOut (20*nMsg bytes)
+   static void hash32Batch(uint8_t const * msgs32,
+                           uint32_t        nMsg,
+                           uint8_t *       hashesOut);
+};
+
+
+#endif
@@ -0,0 +1,1027 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include "Sha256.h"
+
+
+// Only try the SIMD versions where we know the compiler has the intrinsics
+#if (defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)) && \
+    ( defined(__clang__) || \
+      (defined(_MSC_VER) && _MSC_VER >= 1900) || \
+      (defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))) )
+   #define SHA256_X86_KERNELS
+#endif
+
+#ifdef SHA256_X86_KERNELS
+   #include <immintrin.h>
+   #if defined(_MSC_VER)
+      #include <intrin.h>
+      // MSVC lets you use any intrinsic anywhere
+      #define SHA256_TARGET(x)
+   #else
+      #include <cpuid.h>
+      // gcc/clang need to be told which functions are allowed to use them,
+      // the rest of the code is still compiled for the baseline CPU
+      #define SHA256_TARGET(x) __attribute__((target(x)))
+   #endif
+#endif
+
+
+static uint32_t const SHA256_INIT[8] =
+{
+   0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+static uint32_t const SHA256_K[64] =
+{
+   0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+   0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+   0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+   0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+   0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+   0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+   0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+   0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+   0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+   0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+   0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+   0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+   0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+   0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+   0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+   0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+
+#define SHA_ROTR(x,n)    (((x) >> (n)) | ((x) << (32-(n))))
+#define SHA_CH(x,y,z)    ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA_MAJ(x,y,z)   (((x) & (y)) | ((z) & ((x) | (y))))
+#define SHA_BSIG0(x)     (SHA_ROTR(x, 2) ^ SHA_ROTR(x,13) ^ SHA_ROTR(x,22))
+#define SHA_BSIG1(x)     (SHA_ROTR(x, 6) ^ SHA_ROTR(x,11) ^ SHA_ROTR(x,25))
+#define SHA_SSIG0(x)     (SHA_ROTR(x, 7) ^ SHA_ROTR(x,18) ^ ((x) >>  3))
+#define SHA_SSIG1(x)     (SHA_ROTR(x,17) ^ SHA_ROTR(x,19) ^ ((x) >> 10))
+
+// Instead of shuffling the eight working variables every round, we rename
+// them:  the call for the next round just shifts the argument list by one
+#define SHA_ROUND(a,b,c,d,e,f,g,h,wk)                          \
+   {                                                           \
+      uint32_t t1 = h + SHA_BSIG1(e) + SHA_CH(e,f,g) + (wk);   \
+      d += t1;                                                 \
+      h  = t1 + SHA_BSIG0(a) + SHA_MAJ(a,b,c);                 \
+   }
+
+
+////////////////////////////////////////////////////////////////////////////////
+static inline uint32_t readUint32BE(uint8_t const * ptr)
+{
+   return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) |
+          ((uint32_t)ptr[2] <<  8) | ((uint32_t)ptr[3]      );
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static inline void writeUint32BE(uint8_t * ptr, uint32_t val)
+{
+   ptr[0] = (uint8_t)(val >> 24);
+   ptr[1] = (uint8_t)(val >> 16);
+   ptr[2] = (uint8_t)(val >>  8);
+   ptr[3] = (uint8_t)(val      );
+}
+
+// Eight rounds starting at round i, after which the variables are back in
+// their original places
+#define SHA_ROUNDS8(wk, i)                        \
+   SHA_ROUND(a,b,c,d,e,f,g,h, (wk)[(i)  ]);      \
+   SHA_ROUND(h,a,b,c,d,e,f,g, (wk)[(i)+1]);      \
+   SHA_ROUND(g,h,a,b,c,d,e,f, (wk)[(i)+2]);      \
+   SHA_ROUND(f,g,h,a,b,c,d,e, (wk)[(i)+3]);      \
+   SHA_ROUND(e,f,g,h,a,b,c,d, (wk)[(i)+4]);      \
+   SHA_ROUND(d,e,f,g,h,a,b,c, (wk)[(i)+5]);      \
+   SHA_ROUND(c,d,e,f,g,h,a,b, (wk)[(i)+6]);      \
+   SHA_ROUND(b,c,d,e,f,g,h,a, (wk)[(i)+7]);
+
+#define SHA_LOAD_STATE(state)                                     \
+   uint32_t a = state[0], b = state[1], c = state[2], d = state[3]; \
+   uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+#define SHA_ADD_STATE(state)                                       \
+   state[0] += a;  state[1] += b;  state[2] += c;  state[3] += d;  \
+   state[4] += e;  state[5] += f;  state[6] += g;  state[7] += h;
+
+
+////////////////////////////////////////////////////////////////////////////////
+// The 64 rounds, given the message schedule with the round constants already
+// added in
+static inline void sha256Rounds(uint32_t* state, uint32_t const * wk)
+{
+   SHA_LOAD_STATE(state);
+   for(uint32_t i=0; i<64; i+=8)
+   {
+      SHA_ROUNDS8(wk, i);
+   }
+   SHA_ADD_STATE(state);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void transformGeneric(uint32_t*       state,
+                             uint8_t const * blocks,
+                             size_t          nBlocks)
+{
+   uint32_t w[16];
+   uint32_t wk[64];
+   for(size_t blk=0; blk<nBlocks; blk++, blocks+=64)
+   {
+      for(uint32_t i=0; i<16; i++)
+      {
+         w[i]  = readUint32BE(blocks + 4*i);
+         wk[i] = w[i] + SHA256_K[i];
+      }
+
+      // Same as the SIMD versions, the schedule is computed 16 rounds
+      // ahead, only keeping the last 16 words of it
+      SHA_LOAD_STATE(state);
+      for(uint32_t t=0; t<64; t+=8)
+      {
+         for(uint32_t i=t+16; i<t+24 && i<64; i++)
+         {
+            w[i&15] += SHA_SSIG1(w[(i-2)&15]) + w[(i-7)&15] + SHA_SSIG0(w[(i-15)&15]);
+            wk[i]    = w[i&15] + SHA256_K[i];
+         }
+         SHA_ROUNDS8(wk, t);
+      }
+      SHA_ADD_STATE(state);
+   }
+}
+
+
+
+#ifdef SHA256_X86_KERNELS
+
+////////////////////////////////////////////////////////////////////////////////
+// SSE4 & AVX2:  the message schedule is 4 words at a time.  The only snag is
+// that W[t+2] and W[t+3] need sigma1 of W[t] and W[t+1], which are in the
+// same register, so the sigma1 part is added in two halves.
+//
+// These are macros rather than functions so they don't each need their own
+// target attribute.  X0..X3 hold W[t-16..t-1] and X0 is replaced by W[t..t+3]
+////////////////////////////////////////////////////////////////////////////////
+#define SSE_ROTR(x,n)   _mm_or_si128(_mm_srli_epi32(x,n), _mm_slli_epi32(x,32-(n)))
+#define SSE_SSIG0(x)    _mm_xor_si128(_mm_xor_si128(SSE_ROTR(x, 7), SSE_ROTR(x,18)), \
+                                      _mm_srli_epi32(x, 3))
+#define SSE_SSIG1(x)    _mm_xor_si128(_mm_xor_si128(SSE_ROTR(x,17), SSE_ROTR(x,19)), \
+                                      _mm_srli_epi32(x,10))
+
+#define SSE_SCHEDULE(X0,X1,X2,X3)                                             \
+   X0 = _mm_add_epi32(_mm_add_epi32(X0, SSE_SSIG0(_mm_alignr_epi8(X1,X0,4))), \
+                      _mm_alignr_epi8(X3,X2,4));                              \
+   X0 = _mm_add_epi32(X0, _mm_srli_si128(SSE_SSIG1(X3), 8));                  \
+   X0 = _mm_add_epi32(X0, _mm_slli_si128(SSE_SSIG1(X0), 8));
+
+#define AVX_ROTR(x,n)   _mm256_or_si256(_mm256_srli_epi32(x,n), _mm256_slli_epi32(x,32-(n)))
+#define AVX_SSIG0(x)    _mm256_xor_si256(_mm256_xor_si256(AVX_ROTR(x, 7), AVX_ROTR(x,18)), \
+                                         _mm256_srli_epi32(x, 3))
+#define AVX_SSIG1(x)    _mm256_xor_si256(_mm256_xor_si256(AVX_ROTR(x,17), AVX_ROTR(x,19)), \
+                                         _mm256_srli_epi32(x,10))
+
+// The 256-bit byte shifts and alignr work on each 128-bit half separately,
+// which is exactly what we want with a different block in each half
+#define AVX_SCHEDULE(X0,X1,X2,X3)                                                   \
+   X0 = _mm256_add_epi32(_mm256_add_epi32(X0, AVX_SSIG0(_mm256_alignr_epi8(X1,X0,4))), \
+                         _mm256_alignr_epi8(X3,X2,4));                                 \
+   X0 = _mm256_add_epi32(X0, _mm256_srli_si256(AVX_SSIG1(X3), 8));                     \
+   X0 = _mm256_add_epi32(X0, _mm256_slli_si256(AVX_SSIG1(X0), 8));
+
+
+////////////////////////////////////////////////////////////////////////////////
+SHA256_TARGET("ssse3,sse4.1")
+static void transformSse4(uint32_t*       state,
+                          uint8_t const * blocks,
+                          size_t          nBlocks)
+{
+   __m128i const BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   uint32_t wk[64];
+
+   for(size_t blk=0; blk<nBlocks; blk++, blocks+=64)
+   {
+      __m128i X0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks   )), BSWAP);
+      __m128i X1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks+16)), BSWAP);
+      __m128i X2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks+32)), BSWAP);
+      __m128i X3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks+48)), BSWAP);
+
+      _mm_storeu_si128((__m128i*)(wk   ), _mm_add_epi32(X0, _mm_loadu_si128((__m128i const *)(SHA256_K   ))));
+      _mm_storeu_si128((__m128i*)(wk+ 4), _mm_add_epi32(X1, _mm_loadu_si128((__m128i const *)(SHA256_K+ 4))));
+      _mm_storeu_si128((__m128i*)(wk+ 8), _mm_add_epi32(X2, _mm_loadu_si128((__m128i const *)(SHA256_K+ 8))));
+      _mm_storeu_si128((__m128i*)(wk+12), _mm_add_epi32(X3, _mm_loadu_si128((__m128i const *)(SHA256_K+12))));
+
+      // The schedule for 16 rounds ahead is mixed in with the rounds, so
+      // the vector unit is busy at the same time as the regular registers
+      #define SSE_SCHEDULE_WK(X0,X1,X2,X3, t)                                     \
+         SSE_SCHEDULE(X0,X1,X2,X3);                                              \
+         _mm_storeu_si128((__m128i*)(wk+(t)), _mm_add_epi32(X0,                  \
+                          _mm_loadu_si128((__m128i const *)(SHA256_K+(t)))));
+
+      SHA_LOAD_STATE(state);
+      for(uint32_t t=0; t<48; t+=16)
+      {
+         SSE_SCHEDULE_WK(X0,X1,X2,X3, t+16);
+         SSE_SCHEDULE_WK(X1,X2,X3,X0, t+20);
+         SHA_ROUNDS8(wk, t);
+         SSE_SCHEDULE_WK(X2,X3,X0,X1, t+24);
+         SSE_SCHEDULE_WK(X3,X0,X1,X2, t+28);
+         SHA_ROUNDS8(wk, t+8);
+      }
+      #undef SSE_SCHEDULE_WK
+      SHA_ROUNDS8(wk, 48);
+      SHA_ROUNDS8(wk, 56);
+      SHA_ADD_STATE(state);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Two blocks' message schedules at once, then the rounds for each in turn.
+// An odd block at the end goes through the SSE4 version.
+SHA256_TARGET("avx2")
+static void transformAvx2(uint32_t*       state,
+                          uint8_t const * blocks,
+                          size_t          nBlocks)
+{
+   __m256i const BSWAP = _mm256_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL,
+                                           0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   uint32_t wk0[64];
+   uint32_t wk1[64];
+
+   for(; nBlocks >= 2; nBlocks-=2, blocks+=128)
+   {
+      #define AVX_LOAD2(off) _mm256_shuffle_epi8(_mm256_inserti128_si256(            \
+                  _mm256_castsi128_si256(_mm_loadu_si128((__m128i const *)(blocks+(off)))), \
+                  _mm_loadu_si128((__m128i const *)(blocks+64+(off))), 1), BSWAP)
+      __m256i X0 = AVX_LOAD2( 0);
+      __m256i X1 = AVX_LOAD2(16);
+      __m256i X2 = AVX_LOAD2(32);
+      __m256i X3 = AVX_LOAD2(48);
+      #undef AVX_LOAD2
+
+      #define AVX_STOREWK(X, idx)                                               \
+         {                                                                      \
+            __m128i k = _mm_loadu_si128((__m128i const *)(SHA256_K+(idx)));     \
+            __m256i v = _mm256_add_epi32(X,                                     \
+                  _mm256_inserti128_si256(_mm256_castsi128_si256(k), k, 1));    \
+            _mm_storeu_si128((__m128i*)(wk0+(idx)), _mm256_castsi256_si128(v)); \
+            _mm_storeu_si128((__m128i*)(wk1+(idx)), _mm256_extracti128_si256(v,1)); \
+         }
+
+      // The first block's rounds are mixed in with both schedules, the
+      // second block's rounds go after
+      AVX_STOREWK(X0,  0);
+      AVX_STOREWK(X1,  4);
+      AVX_STOREWK(X2,  8);
+      AVX_STOREWK(X3, 12);
+
+      SHA_LOAD_STATE(state);
+      for(uint32_t t=0; t<48; t+=16)
+      {
+         AVX_SCHEDULE(X0,X1,X2,X3);  AVX_STOREWK(X0, t+16);
+         AVX_SCHEDULE(X1,X2,X3,X0);  AVX_STOREWK(X1, t+20);
+         SHA_ROUNDS8(wk0, t);
+         AVX_SCHEDULE(X2,X3,X0,X1);  AVX_STOREWK(X2, t+24);
+         AVX_SCHEDULE(X3,X0,X1,X2);  AVX_STOREWK(X3, t+28);
+         SHA_ROUNDS8(wk0, t+8);
+      }
+      #undef AVX_STOREWK
+      SHA_ROUNDS8(wk0, 48);
+      SHA_ROUNDS8(wk0, 56);
+      SHA_ADD_STATE(state);
+
+      sha256Rounds(state, wk1);
+   }
+
+   if(nBlocks > 0)
+      transformSse4(state, blocks, nBlocks);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The SHA extensions keep the state as ABEF/CDGH instead of ABCD/EFGH, and
+// do two rounds per instruction.  Each group of 4 rounds also finishes the
+// message schedule for the group 3 steps ahead (msg2), and starts the one
+// 3 steps after that (msg1).
+////////////////////////////////////////////////////////////////////////////////
+// One group of 4 rounds on state registers S0/S1.  MP is the message group
+// before M, MA the one after it.
+#define SHANI_GROUP(S0, S1, TMSG, MP, M, MA, g, doMsg2, doMsg1)                \
+   TMSG = _mm_add_epi32(M, _mm_loadu_si128((__m128i const *)(SHA256_K+4*(g)))); \
+   S1   = _mm_sha256rnds2_epu32(S1, S0, TMSG);                                  \
+   if(doMsg2)                                                                   \
+   {                                                                            \
+      MA = _mm_add_epi32(MA, _mm_alignr_epi8(M, MP, 4));                        \
+      MA = _mm_sha256msg2_epu32(MA, M);                                         \
+   }                                                                            \
+   TMSG = _mm_shuffle_epi32(TMSG, 0x0E);                                        \
+   S0   = _mm_sha256rnds2_epu32(S0, S1, TMSG);                                  \
+   if(doMsg1)                                                                   \
+      MP = _mm_sha256msg1_epu32(MP, M);
+
+// All 16 groups, for one set of registers.  SHANI_GROUPS_X2 does two blocks
+// with their groups interleaved:  each rnds2 has to wait for the one before
+// it, so the CPU has something else to do in the meantime.
+#define SHANI_GROUP_N(R, n, g, m2, m1)                                          \
+   SHANI_GROUP(R##S0, R##S1, R##MSG, R##M##n##P, R##M##n, R##M##n##A, g, m2, m1)
+
+#define SHANI_MSG_ALIASES(R)                                                    \
+   __m128i & R##M0P = R##M3;   __m128i & R##M0A = R##M1;                        \
+   __m128i & R##M1P = R##M0;   __m128i & R##M1A = R##M2;                        \
+   __m128i & R##M2P = R##M1;   __m128i & R##M2A = R##M3;                        \
+   __m128i & R##M3P = R##M2;   __m128i & R##M3A = R##M0;
+
+#define SHANI_STEP(R, n, g, m2, m1)   SHANI_GROUP_N(R, n, g, m2, m1)
+
+#define SHANI_ALL_GROUPS(STEP)                                                  \
+   STEP(0,  0, false, false);                                                   \
+   STEP(1,  1, false, true );                                                   \
+   STEP(2,  2, false, true );                                                   \
+   STEP(3,  3, true,  true );                                                   \
+   STEP(0,  4, true,  true );                                                   \
+   STEP(1,  5, true,  true );                                                   \
+   STEP(2,  6, true,  true );                                                   \
+   STEP(3,  7, true,  true );                                                   \
+   STEP(0,  8, true,  true );                                                   \
+   STEP(1,  9, true,  true );                                                   \
+   STEP(2, 10, true,  true );                                                   \
+   STEP(3, 11, true,  true );                                                   \
+   STEP(0, 12, true,  true );                                                   \
+   STEP(1, 13, true,  false);                                                   \
+   STEP(2, 14, true,  false);                                                   \
+   STEP(3, 15, false, false);
+
+#define SHANI_LOAD_MSG(R, ptr)                                                  \
+   R##M0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)((ptr)   )), BSWAP); \
+   R##M1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)((ptr)+16)), BSWAP); \
+   R##M2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)((ptr)+32)), BSWAP); \
+   R##M3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)((ptr)+48)), BSWAP);
+
+SHA256_TARGET("sha,sse4.1")
+static void transformShaNi(uint32_t*       state,
+                           uint8_t const * blocks,
+                           size_t          nBlocks)
+{
+   __m128i const BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   __m128i S0, S1, MSG, TMP, M0, M1, M2, M3, ABEF_SAVE, CDGH_SAVE;
+   SHANI_MSG_ALIASES();
+
+   TMP = _mm_loadu_si128((__m128i const *)(state  ));
+   S1  = _mm_loadu_si128((__m128i const *)(state+4));
+   TMP = _mm_shuffle_epi32(TMP, 0xB1);        // CDAB
+   S1  = _mm_shuffle_epi32(S1,  0x1B);        // EFGH
+   S0  = _mm_alignr_epi8(TMP, S1, 8);         // ABEF
+   S1  = _mm_blend_epi16(S1, TMP, 0xF0);      // CDGH
+
+   for(size_t blk=0; blk<nBlocks; blk++, blocks+=64)
+   {
+      ABEF_SAVE = S0;
+      CDGH_SAVE = S1;
+
+      SHANI_LOAD_MSG(, blocks);
+      #define SHANI_STEP_1(n, g, m2, m1)  SHANI_STEP(, n, g, m2, m1)
+      SHANI_ALL_GROUPS(SHANI_STEP_1);
+      #undef SHANI_STEP_1
+
+      S0 = _mm_add_epi32(S0, ABEF_SAVE);
+      S1 = _mm_add_epi32(S1, CDGH_SAVE);
+   }
+
+   TMP = _mm_shuffle_epi32(S0, 0x1B);         // FEBA
+   S1  = _mm_shuffle_epi32(S1, 0xB1);         // DCHG
+   S0  = _mm_blend_epi16(TMP, S1, 0xF0);      // DCBA
+   S1  = _mm_alignr_epi8(S1, TMP, 8);         // HGFE
+
+   _mm_storeu_si128((__m128i*)(state  ), S0);
+   _mm_storeu_si128((__m128i*)(state+4), S1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Two lanes for doubleHashBatch.  The states are word-major like the other
+// multi-buffer versions, so they're shuffled into ABEF/CDGH on the way in.
+SHA256_TARGET("sha,sse4.1")
+static void transformShaNix2(uint32_t* states, uint8_t const * const * blocks)
+{
+   __m128i const BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   __m128i aS0, aS1, aMSG, aM0, aM1, aM2, aM3;
+   __m128i bS0, bS1, bMSG, bM0, bM1, bM2, bM3;
+   SHANI_MSG_ALIASES(a);
+   SHANI_MSG_ALIASES(b);
+
+   #define SHANI_STATE_IN(R, l)                                              \
+      R##S0 = _mm_set_epi32(states[   l], states[ 2+l], states[ 8+l], states[10+l]); \
+      R##S1 = _mm_set_epi32(states[ 4+l], states[ 6+l], states[12+l], states[14+l]);
+   SHANI_STATE_IN(a, 0);
+   SHANI_STATE_IN(b, 1);
+   #undef SHANI_STATE_IN
+   __m128i aABEF = aS0, aCDGH = aS1;
+   __m128i bABEF = bS0, bCDGH = bS1;
+
+   SHANI_LOAD_MSG(a, blocks[0]);
+   SHANI_LOAD_MSG(b, blocks[1]);
+   #define SHANI_STEP_X2(n, g, m2, m1)                                       \
+      SHANI_STEP(a, n, g, m2, m1);                                           \
+      SHANI_STEP(b, n, g, m2, m1);
+   SHANI_ALL_GROUPS(SHANI_STEP_X2);
+   #undef SHANI_STEP_X2
+
+   aS0 = _mm_add_epi32(aS0, aABEF);
+   aS1 = _mm_add_epi32(aS1, aCDGH);
+   bS0 = _mm_add_epi32(bS0, bABEF);
+   bS1 = _mm_add_epi32(bS1, bCDGH);
+
+   // S0 is (A,B,E,F) from the top, S1 is (C,D,G,H)
+   uint32_t abef[4], cdgh[4];
+   #define SHANI_STATE_OUT(R, l)                                             \
+      _mm_storeu_si128((__m128i*)abef, R##S0);                               \
+      _mm_storeu_si128((__m128i*)cdgh, R##S1);                               \
+      states[   l] = abef[3];  states[ 2+l] = abef[2];                       \
+      states[ 4+l] = cdgh[3];  states[ 6+l] = cdgh[2];                       \
+      states[ 8+l] = abef[1];  states[10+l] = abef[0];                       \
+      states[12+l] = cdgh[1];  states[14+l] = cdgh[0];
+   SHANI_STATE_OUT(a, 0);
+   SHANI_STATE_OUT(b, 1);
+   #undef SHANI_STATE_OUT
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Multi-buffer versions, for hashing a lot of separate messages:  each 32-bit
+// lane of the vector registers is a different message, so it's the plain
+// SHA256 algorithm, just done on 4 (SSE4) or 8 (AVX2) messages at once.
+//
+// The states are stored word-major, states[w*NLANES + lane], and each call
+// does one block for every lane.  The blocks come in row-wise (a lane's 64
+// bytes in a row), so they get transposed into one word per register.
+////////////////////////////////////////////////////////////////////////////////
+#define X4_ADD(a,b)       _mm_add_epi32(a,b)
+#define X4_ROTR(x,n)      _mm_or_si128(_mm_srli_epi32(x,n), _mm_slli_epi32(x,32-(n)))
+#define X4_BSIG0(x)       _mm_xor_si128(_mm_xor_si128(X4_ROTR(x, 2), X4_ROTR(x,13)), X4_ROTR(x,22))
+#define X4_BSIG1(x)       _mm_xor_si128(_mm_xor_si128(X4_ROTR(x, 6), X4_ROTR(x,11)), X4_ROTR(x,25))
+#define X4_SSIG0(x)       _mm_xor_si128(_mm_xor_si128(X4_ROTR(x, 7), X4_ROTR(x,18)), _mm_srli_epi32(x, 3))
+#define X4_SSIG1(x)       _mm_xor_si128(_mm_xor_si128(X4_ROTR(x,17), X4_ROTR(x,19)), _mm_srli_epi32(x,10))
+#define X4_CH(x,y,z)      _mm_xor_si128(z, _mm_and_si128(x, _mm_xor_si128(y,z)))
+#define X4_MAJ(x,y,z)     _mm_or_si128(_mm_and_si128(x,y), _mm_and_si128(z, _mm_or_si128(x,y)))
+
+#define X4_ROUND(a,b,c,d,e,f,g,h, t)                                         \
+   {                                                                         \
+      __m128i t1 = X4_ADD(X4_ADD(X4_ADD(h, X4_BSIG1(e)), X4_CH(e,f,g)),      \
+                          X4_ADD(w[(t)&15], _mm_set1_epi32(SHA256_K[t])));   \
+      d = X4_ADD(d, t1);                                                     \
+      h = X4_ADD(t1, X4_ADD(X4_BSIG0(a), X4_MAJ(a,b,c)));                    \
+   }
+
+#define X8_ADD(a,b)       _mm256_add_epi32(a,b)
+#define X8_ROTR(x,n)      _mm256_or_si256(_mm256_srli_epi32(x,n), _mm256_slli_epi32(x,32-(n)))
+#define X8_BSIG0(x)       _mm256_xor_si256(_mm256_xor_si256(X8_ROTR(x, 2), X8_ROTR(x,13)), X8_ROTR(x,22))
+#define X8_BSIG1(x)       _mm256_xor_si256(_mm256_xor_si256(X8_ROTR(x, 6), X8_ROTR(x,11)), X8_ROTR(x,25))
+#define X8_SSIG0(x)       _mm256_xor_si256(_mm256_xor_si256(X8_ROTR(x, 7), X8_ROTR(x,18)), _mm256_srli_epi32(x, 3))
+#define X8_SSIG1(x)       _mm256_xor_si256(_mm256_xor_si256(X8_ROTR(x,17), X8_ROTR(x,19)), _mm256_srli_epi32(x,10))
+#define X8_CH(x,y,z)      _mm256_xor_si256(z, _mm256_and_si256(x, _mm256_xor_si256(y,z)))
+#define X8_MAJ(x,y,z)     _mm256_or_si256(_mm256_and_si256(x,y), _mm256_and_si256(z, _mm256_or_si256(x,y)))
+
+#define X8_ROUND(a,b,c,d,e,f,g,h, t)                                         \
+   {                                                                         \
+      __m256i t1 = X8_ADD(X8_ADD(X8_ADD(h, X8_BSIG1(e)), X8_CH(e,f,g)),      \
+                          X8_ADD(w[(t)&15], _mm256_set1_epi32(SHA256_K[t]))); \
+      d = X8_ADD(d, t1);                                                     \
+      h = X8_ADD(t1, X8_ADD(X8_BSIG0(a), X8_MAJ(a,b,c)));                    \
+   }
+
+// Eight rounds starting at t, extending the schedule first if we're past
+// the 16 words that came straight from the message
+#define XN_ROUNDS8(ROUND, SSIG0, SSIG1, ADD, t)                              \
+   if((t) >= 16)                                                             \
+   {                                                                         \
+      for(uint32_t i=(t); i<(t)+8; i++)                                      \
+         w[i&15] = ADD(ADD(w[i&15], SSIG1(w[(i-2)&15])),                     \
+                       ADD(w[(i-7)&15], SSIG0(w[(i-15)&15])));               \
+   }                                                                         \
+   ROUND(a,b,c,d,e,f,g,h, (t)  );                                            \
+   ROUND(h,a,b,c,d,e,f,g, (t)+1);                                            \
+   ROUND(g,h,a,b,c,d,e,f, (t)+2);                                            \
+   ROUND(f,g,h,a,b,c,d,e, (t)+3);                                            \
+   ROUND(e,f,g,h,a,b,c,d, (t)+4);                                            \
+   ROUND(d,e,f,g,h,a,b,c, (t)+5);                                            \
+   ROUND(c,d,e,f,g,h,a,b, (t)+6);                                            \
+   ROUND(b,c,d,e,f,g,h,a, (t)+7);
+
+
+////////////////////////////////////////////////////////////////////////////////
+SHA256_TARGET("ssse3,sse4.1")
+static void transformSse4x4(uint32_t* states, uint8_t const * const * blocks)
+{
+   __m128i const BSWAP = _mm_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   __m128i w[16];
+
+   // 4x4 transposes, one for each 16 bytes of the blocks
+   for(uint32_t q=0; q<4; q++)
+   {
+      __m128i r0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks[0]+16*q)), BSWAP);
+      __m128i r1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks[1]+16*q)), BSWAP);
+      __m128i r2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks[2]+16*q)), BSWAP);
+      __m128i r3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)(blocks[3]+16*q)), BSWAP);
+      __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+      __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+      __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+      __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+      w[4*q  ] = _mm_unpacklo_epi64(t0, t1);
+      w[4*q+1] = _mm_unpackhi_epi64(t0, t1);
+      w[4*q+2] = _mm_unpacklo_epi64(t2, t3);
+      w[4*q+3] = _mm_unpackhi_epi64(t2, t3);
+   }
+
+   __m128i a = _mm_loadu_si128((__m128i const *)(states     ));
+   __m128i b = _mm_loadu_si128((__m128i const *)(states +  4));
+   __m128i c = _mm_loadu_si128((__m128i const *)(states +  8));
+   __m128i d = _mm_loadu_si128((__m128i const *)(states + 12));
+   __m128i e = _mm_loadu_si128((__m128i const *)(states + 16));
+   __m128i f = _mm_loadu_si128((__m128i const *)(states + 20));
+   __m128i g = _mm_loadu_si128((__m128i const *)(states + 24));
+   __m128i h = _mm_loadu_si128((__m128i const *)(states + 28));
+
+   for(uint32_t t=0; t<64; t+=8)
+   {
+      XN_ROUNDS8(X4_ROUND, X4_SSIG0, X4_SSIG1, X4_ADD, t);
+   }
+
+   #define X4_ADD_STATE(v, idx)                                              \
+      _mm_storeu_si128((__m128i*)(states+(idx)),                             \
+            X4_ADD(v, _mm_loadu_si128((__m128i const *)(states+(idx)))));
+   X4_ADD_STATE(a,  0);
+   X4_ADD_STATE(b,  4);
+   X4_ADD_STATE(c,  8);
+   X4_ADD_STATE(d, 12);
+   X4_ADD_STATE(e, 16);
+   X4_ADD_STATE(f, 20);
+   X4_ADD_STATE(g, 24);
+   X4_ADD_STATE(h, 28);
+   #undef X4_ADD_STATE
+}
+
+////////////////////////////////////////////////////////////////////////////////
+SHA256_TARGET("avx2")
+static void transformAvx2x8(uint32_t* states, uint8_t const * const * blocks)
+{
+   __m256i const BSWAP = _mm256_set_epi64x(0x0c0d0e0f08090a0bLL, 0x0405060700010203LL,
+                                           0x0c0d0e0f08090a0bLL, 0x0405060700010203LL);
+   __m256i w[16];
+
+   // 8x8 transposes, one for each half of the blocks.  The unpacks work
+   // within each 128-bit half, so the last step swaps the halves around.
+   for(uint32_t half=0; half<2; half++)
+   {
+      __m256i r[8];
+      for(uint32_t j=0; j<8; j++)
+         r[j] = _mm256_shuffle_epi8(_mm256_loadu_si256(
+                        (__m256i const *)(blocks[j]+32*half)), BSWAP);
+
+      __m256i t0 = _mm256_unpacklo_epi32(r[0], r[1]);
+      __m256i t1 = _mm256_unpackhi_epi32(r[0], r[1]);
+      __m256i t2 = _mm256_unpacklo_epi32(r[2], r[3]);
+      __m256i t3 = _mm256_unpackhi_epi32(r[2], r[3]);
+      __m256i t4 = _mm256_unpacklo_epi32(r[4], r[5]);
+      __m256i t5 = _mm256_unpackhi_epi32(r[4], r[5]);
+      __m256i t6 = _mm256_unpacklo_epi32(r[6], r[7]);
+      __m256i t7 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+      __m256i u0 = _mm256_unpacklo_epi64(t0, t2);
+      __m256i u1 = _mm256_unpackhi_epi64(t0, t2);
+      __m256i u2 = _mm256_unpacklo_epi64(t1, t3);
+      __m256i u3 = _mm256_unpackhi_epi64(t1, t3);
+      __m256i u4 = _mm256_unpacklo_epi64(t4, t6);
+      __m256i u5 = _mm256_unpackhi_epi64(t4, t6);
+      __m256i u6 = _mm256_unpacklo_epi64(t5, t7);
+      __m256i u7 = _mm256_unpackhi_epi64(t5, t7);
+
+      __m256i* wh = w + 8*half;
+      wh[0] = _mm256_permute2x128_si256(u0, u4, 0x20);
+      wh[1] = _mm256_permute2x128_si256(u1, u5, 0x20);
+      wh[2] = _mm256_permute2x128_si256(u2, u6, 0x20);
+      wh[3] = _mm256_permute2x128_si256(u3, u7, 0x20);
+      wh[4] = _mm256_permute2x128_si256(u0, u4, 0x31);
+      wh[5] = _mm256_permute2x128_si256(u1, u5, 0x31);
+      wh[6] = _mm256_permute2x128_si256(u2, u6, 0x31);
+      wh[7] = _mm256_permute2x128_si256(u3, u7, 0x31);
+   }
+
+   __m256i a = _mm256_loadu_si256((__m256i const *)(states     ));
+   __m256i b = _mm256_loadu_si256((__m256i const *)(states +  8));
+   __m256i c = _mm256_loadu_si256((__m256i const *)(states + 16));
+   __m256i d = _mm256_loadu_si256((__m256i const *)(states + 24));
+   __m256i e = _mm256_loadu_si256((__m256i const *)(states + 32));
+   __m256i f = _mm256_loadu_si256((__m256i const *)(states + 40));
+   __m256i g = _mm256_loadu_si256((__m256i const *)(states + 48));
+   __m256i h = _mm256_loadu_si256((__m256i const *)(states + 56));
+
+   for(uint32_t t=0; t<64; t+=8)
+   {
+      XN_ROUNDS8(X8_ROUND, X8_SSIG0, X8_SSIG1, X8_ADD, t);
+   }
+
+   #define X8_ADD_STATE(v, idx)                                              \
+      _mm256_storeu_si256((__m256i*)(states+(idx)),                          \
+            X8_ADD(v, _mm256_loadu_si256((__m256i const *)(states+(idx)))));
+   X8_ADD_STATE(a,  0);
+   X8_ADD_STATE(b,  8);
+   X8_ADD_STATE(c, 16);
+   X8_ADD_STATE(d, 24);
+   X8_ADD_STATE(e, 32);
+   X8_ADD_STATE(f, 40);
+   X8_ADD_STATE(g, 48);
+   X8_ADD_STATE(h, 56);
+   #undef X8_ADD_STATE
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static void cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4])
+{
+#if defined(_MSC_VER)
+   int r[4];
+   __cpuidex(r, (int)leaf, (int)subleaf);
+   for(int i=0; i<4; i++)
+      regs[i] = (uint32_t)r[i];
+#else
+   __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The CPU having AVX2 isn't enough, the OS has to save the YMM registers on
+// a context switch, too
+static bool osSavesYmm(void)
+{
+#if defined(_MSC_VER)
+   return (_xgetbv(0) & 6) == 6;
+#else
+   uint32_t lo, hi;
+   __asm__ __volatile__ ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+   return (lo & 6) == 6;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+struct CpuFeatures
+{
+   bool sse4_;
+   bool avx2_;
+   bool shani_;
+};
+
+static CpuFeatures detectCpuFeatures(void)
+{
+   CpuFeatures cpu = {false, false, false};
+   uint32_t regs[4];
+
+   cpuid(0, 0, regs);
+   uint32_t maxLeaf = regs[0];
+   if(maxLeaf < 1)
+      return cpu;
+
+   cpuid(1, 0, regs);
+   bool ssse3   = (regs[2] & (1<< 9)) != 0;
+   bool sse41   = (regs[2] & (1<<19)) != 0;
+   bool osxsave = (regs[2] & (1<<27)) != 0;
+   bool avx     = (regs[2] & (1<<28)) != 0;
+   cpu.sse4_ = ssse3 && sse41;
+
+   if(maxLeaf < 7)
+      return cpu;
+
+   cpuid(7, 0, regs);
+   bool avx2 = (regs[1] & (1<< 5)) != 0;
+   bool sha  = (regs[1] & (1<<29)) != 0;
+   cpu.avx2_  = cpu.sse4_ && avx && avx2 && osxsave && osSavesYmm();
+   cpu.shani_ = cpu.sse4_ && sha;
+   return cpu;
+}
+
+#endif  // SHA256_X86_KERNELS
+
+
+
+Sha256::TransformFunc      Sha256::transform_      = Sha256::transformFirstCall;
+Sha256::Engine             Sha256::engine_         = Sha256::ENGINE_GENERIC;
+Sha256::MultiTransformFunc Sha256::multiTransform_ = NULL;
+uint32_t                   Sha256::multiLanes_     = 1;
+
+// Pick the engine during static init, so it's decided before any threads
+// are started.  transformFirstCall covers anything that hashes before this.
+static bool sha256EngineSelected_ = Sha256::setEngine(Sha256::getBestEngine());
+
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::transformFirstCall(uint32_t*       state,
+                                uint8_t const * blocks,
+                                size_t          nBlocks)
+{
+   setEngine(getBestEngine());
+   transform_(state, blocks, nBlocks);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool Sha256::isEngineSupported(Engine e)
+{
+   if(e == ENGINE_GENERIC)
+      return true;
+
+#ifdef SHA256_X86_KERNELS
+   static CpuFeatures cpu = detectCpuFeatures();
+   switch(e)
+   {
+      case ENGINE_SSE4:  return cpu.sse4_;
+      case ENGINE_AVX2:  return cpu.avx2_;
+      case ENGINE_SHANI: return cpu.shani_;
+      default:           return false;
+   }
+#else
+   return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Sha256::Engine Sha256::getBestEngine(void)
+{
+   if(isEngineSupported(ENGINE_SHANI)) return ENGINE_SHANI;
+   if(isEngineSupported(ENGINE_AVX2))  return ENGINE_AVX2;
+   if(isEngineSupported(ENGINE_SSE4))  return ENGINE_SSE4;
+   return ENGINE_GENERIC;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool Sha256::setEngine(Engine e)
+{
+   if(!isEngineSupported(e))
+      return false;
+
+   MultiTransformFunc multi  = NULL;
+   uint32_t           nLanes = 1;
+   switch(e)
+   {
+#ifdef SHA256_X86_KERNELS
+      case ENGINE_SSE4:  
+         transform_ = transformSse4;
+         multi      = transformSse4x4;
+         nLanes     = 4;
+         break;
+      case ENGINE_AVX2:  
+         transform_ = transformAvx2;
+         multi      = transformAvx2x8;
+         nLanes     = 8;
+         break;
+      case ENGINE_SHANI: 
+         transform_ = transformShaNi;
+         multi      = transformShaNix2;
+         nLanes     = 2;
+         break;
+#endif
+      default:           
+         transform_ = transformGeneric; 
+         break;
+   }
+   multiTransform_ = multi;
+   multiLanes_     = nLanes;
+   engine_ = e;
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+char const * Sha256::getEngineName(Engine e)
+{
+   switch(e)
+   {
+      case ENGINE_GENERIC: return "GENERIC";
+      case ENGINE_SSE4:    return "SSE4";
+      case ENGINE_AVX2:    return "AVX2";
+      case ENGINE_SHANI:   return "SHANI";
+      default:             return "UNKNOWN";
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The full blocks are hashed straight from the input, this makes the rest:
+// the leftover bytes, the 0x80 and the length in bits, which takes one more
+// block, or two if there's no room for the length.  Returns the # of blocks
+static uint32_t padMessageTail(uint8_t const * msg, size_t nBytes, uint8_t* tail)
+{
+   size_t nFull = nBytes / 64;
+   size_t nLeft = nBytes - 64*nFull;
+   uint32_t nTail = (nLeft < 56 ? 1 : 2);
+   memcpy(tail, msg + 64*nFull, nLeft);
+   tail[nLeft] = 0x80;
+   memset(tail + nLeft + 1, 0, 64*nTail - nLeft - 1);
+
+   uint64_t nBits = (uint64_t)nBytes * 8;
+   writeUint32BE(tail + 64*nTail - 8, (uint32_t)(nBits >> 32));
+   writeUint32BE(tail + 64*nTail - 4, (uint32_t)(nBits      ));
+   return nTail;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The second hash of a double-SHA256 is always one block:  32 bytes of hash,
+// then padding for a 256-bit message
+static void makeSecondBlock(uint32_t const * state, uint32_t stride, uint8_t* block)
+{
+   for(uint32_t i=0; i<8; i++)
+      writeUint32BE(block + 4*i, state[i*stride]);
+   memset(block+32, 0, 32);
+   block[32] = 0x80;
+   block[62] = 0x01;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::hashToState(uint8_t const * strToHash,
+                         size_t          nBytes,
+                         uint32_t      * state)
+{
+   memcpy(state, SHA256_INIT, 32);
+
+   size_t nFull = nBytes / 64;
+   if(nFull > 0)
+      transform_(state, strToHash, nFull);
+
+   uint8_t tail[128];
+   uint32_t nTail = padMessageTail(strToHash, nBytes, tail);
+   transform_(state, tail, nTail);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::hash(uint8_t const * strToHash,
+                  size_t          nBytes,
+                  uint8_t       * hashOut)
+{
+   uint32_t state[8];
+   hashToState(strToHash, nBytes, state);
+   for(uint32_t i=0; i<8; i++)
+      writeUint32BE(hashOut + 4*i, state[i]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::doubleHash(uint8_t const * strToHash,
+                        size_t          nBytes,
+                        uint8_t       * hashOut)
+{
+   uint32_t state[8];
+   hashToState(strToHash, nBytes, state);
+
+   uint8_t block[64];
+   makeSecondBlock(state, 1, block);
+
+   memcpy(state, SHA256_INIT, 32);
+   transform_(state, block, 1);
+   for(uint32_t i=0; i<8; i++)
+      writeUint32BE(hashOut + 4*i, state[i]);
+}
+
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::doubleHashBatch(uint8_t const * const * msgPtrs,
+                             uint32_t const *        msgSizes,
+                             uint32_t                nMsg,
+                             uint8_t *               hashesOut)
+{
+   // With only a few messages, most of the lanes would be wasted
+   if(multiTransform_ == NULL || nMsg < 2 || nMsg < multiLanes_/2)
+   {
+      for(uint32_t i=0; i<nMsg; i++)
+         doubleHash(msgPtrs[i], msgSizes[i], hashesOut + 32*i);
+      return;
+   }
+
+   hashLanes(msgPtrs, msgSizes, nMsg, hashesOut, true);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::hashBatch(uint8_t const * const * msgPtrs,
+                       uint32_t const *        msgSizes,
+                       uint32_t                nMsg,
+                       uint8_t *               hashesOut)
+{
+   if(multiTransform_ == NULL || nMsg < 2 || nMsg < multiLanes_/2)
+   {
+      for(uint32_t i=0; i<nMsg; i++)
+         hash(msgPtrs[i], msgSizes[i], hashesOut + 32*i);
+      return;
+   }
+
+   hashLanes(msgPtrs, msgSizes, nMsg, hashesOut, false);
+}
+
+
+#define SHA256_MAX_LANES 8
+
+////////////////////////////////////////////////////////////////////////////////
+// Where each lane is in its current message:  first the full blocks straight
+// from the message, then the padded tail, then (for double-SHA256) the one
+// block of the second hash, which also goes in tail_
+struct HashLane
+{
+   uint32_t        msgIdx_;      // UINT32_MAX when there's nothing left
+   uint8_t const * nextBlock_;
+   size_t          nFullLeft_;
+   uint8_t         tail_[128];
+   uint32_t        nTail_;
+   uint32_t        nTailDone_;
+   bool            lastPass_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+void Sha256::hashLanes(uint8_t const * const * msgPtrs,
+                       uint32_t const *        msgSizes,
+                       uint32_t                nMsg,
+                       uint8_t *               hashesOut,
+                       bool                    isDouble)
+{
+   static uint8_t const idleBlock[64] = {0};
+
+   uint32_t           nLanes = multiLanes_;
+   MultiTransformFunc kernel = multiTransform_;
+   uint32_t           states[8*SHA256_MAX_LANES];
+   HashLane           lanes[SHA256_MAX_LANES];
+   uint8_t const *    blockPtrs[SHA256_MAX_LANES];
+
+   uint32_t nextMsg = 0;
+   uint32_t nActive = 0;
+   for(uint32_t l=0; l<nLanes; l++)
+   {
+      lanes[l].msgIdx_ = UINT32_MAX;
+      for(uint32_t i=0; i<8; i++)
+         states[i*nLanes + l] = SHA256_INIT[i];
+   }
+
+   while(true)
+   {
+      // Give any lane that needs it the next message
+      for(uint32_t l=0; l<nLanes; l++)
+      {
+         HashLane & lane = lanes[l];
+         if(lane.msgIdx_ != UINT32_MAX || nextMsg >= nMsg)
+            continue;
+
+         lane.msgIdx_     = nextMsg++;
+         lane.nextBlock_  = msgPtrs[lane.msgIdx_];
+         lane.nFullLeft_  = msgSizes[lane.msgIdx_] / 64;
+         lane.nTail_      = padMessageTail(lane.nextBlock_, 
+                                           msgSizes[lane.msgIdx_], 
+                                           lane.tail_);
+         lane.nTailDone_  = 0;
+         lane.lastPass_   = !isDouble;
+         for(uint32_t i=0; i<8; i++)
+            states[i*nLanes + l] = SHA256_INIT[i];
+         nActive++;
+      }
+
+      if(nActive == 0)
+         break;
+
+      for(uint32_t l=0; l<nLanes; l++)
+      {
+         HashLane & lane = lanes[l];
+         if(lane.msgIdx_ == UINT32_MAX)
+            blockPtrs[l] = idleBlock;
+         else if(lane.nFullLeft_ > 0)
+         {
+            blockPtrs[l] = lane.nextBlock_;
+            lane.nextBlock_ += 64;
+            lane.nFullLeft_--;
+         }
+         else
+            blockPtrs[l] = lane.tail_ + 64*(lane.nTailDone_++);
+      }
+
+      kernel(states, blockPtrs);
+
+      for(uint32_t l=0; l<nLanes; l++)
+      {
+         HashLane & lane = lanes[l];
+         if(lane.msgIdx_ == UINT32_MAX || 
+            lane.nFullLeft_ > 0 || 
+            lane.nTailDone_ < lane.nTail_)
+            continue;
+
+         if(!lane.lastPass_)
+         {
+            makeSecondBlock(states + l, nLanes, lane.tail_);
+            lane.nTail_      = 1;
+            lane.nTailDone_  = 0;
+            lane.lastPass_   = true;
+            for(uint32_t i=0; i<8; i++)
+               states[i*nLanes + l] = SHA256_INIT[i];
+         }
+         else
+         {
+            uint8_t* hashOut = hashesOut + 32*lane.msgIdx_;
+            for(uint32_t i=0; i<8; i++)
+               writeUint32BE(hashOut + 4*i, states[i*nLanes + l]);
+            lane.msgIdx_ = UINT32_MAX;
+            nActive--;
+         }
+      }
+   }
+}
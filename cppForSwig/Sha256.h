@@ -0,0 +1,122 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// Our own SHA256, because hashing every tx and header in the blockchain is
+// the most expensive thing we do when loading it, and the generic Crypto++
+// SHA256 object doesn't take advantage of anything a modern CPU has.
+//
+// There are a few versions of the compression function (the part that eats
+// one 64-byte block), and the fastest one the CPU supports is picked once at
+// startup:
+//
+//    SHANI  -- The Intel SHA extensions do the rounds in hardware.  By far
+//              the fastest, available on recent Intel and all Ryzen CPUs.
+//    AVX2   -- The message schedule for two consecutive blocks is computed
+//              at once in the two halves of a 256-bit register, while the
+//              rounds are done in regular registers.
+//    SSE4   -- Same thing, one block at a time in a 128-bit register.
+//    GENERIC-- Plain C, works everywhere.
+//
+// The SIMD versions are only compiled for x86/x64 with a compiler that knows
+// the intrinsics (gcc 4.9+, clang, MSVC 2015+).  Otherwise it's all GENERIC.
+//
+// Unlike the Crypto++ objects, there's no state kept between calls, so all
+// of these are safe to call from any number of threads.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _SHA256_H_
+#define _SHA256_H_
+
+#include "BinaryData.h"
+
+
+class Sha256
+{
+public:
+   enum Engine
+   {
+      ENGINE_GENERIC=0,
+      ENGINE_SSE4,
+      ENGINE_AVX2,
+      ENGINE_SHANI,
+      NUM_ENGINES
+   };
+
+   // Single SHA256 of nBytes, 32 bytes written to hashOut.  hashOut is
+   // allowed to point into the input.
+   static void hash(uint8_t const * strToHash,
+                    size_t          nBytes,
+                    uint8_t       * hashOut);
+
+   // SHA256(SHA256(x)), what bitcoin uses for tx and header hashes
+   static void doubleHash(uint8_t const * strToHash,
+                          size_t          nBytes,
+                          uint8_t       * hashOut);
+
+   // Double-SHA256 of nMsg separate messages, written one after another to
+   // hashesOut (32*nMsg bytes).  With the SSE4 and AVX2 engines, 4 or 8 of
+   // the messages go through the vector registers side by side, one in each
+   // lane.  SHANI does two at a time with their instructions interleaved.
+   // A lane starts on the next message as soon as it's done with one, so
+   // they don't need to be the same size.  GENERIC does them one by one.
+   static void doubleHashBatch(uint8_t const * const * msgPtrs,
+                               uint32_t const *        msgSizes,
+                               uint32_t                nMsg,
+                               uint8_t *               hashesOut);
+
+   // Same thing, but only a single SHA256 of each message (for HASH160)
+   static void hashBatch(uint8_t const * const * msgPtrs,
+                         uint32_t const *        msgSizes,
+                         uint32_t                nMsg,
+                         uint8_t *               hashesOut);
+
+   // The engine is chosen automatically, these are for testing/benchmarking.
+   // setEngine returns false (and changes nothing) if the CPU can't do it.
+   static Engine       getEngine(void)         { return engine_; }
+   static bool         setEngine(Engine e);
+   static bool         isEngineSupported(Engine e);
+   static Engine       getBestEngine(void);
+   static char const * getEngineName(Engine e);
+
+private:
+   typedef void (*TransformFunc)(uint32_t*       state,
+                                 uint8_t const * blocks,
+                                 size_t          nBlocks);
+
+   // One block for each of the lanes, the states are word-major:
+   // states[word*nLanes + lane]
+   typedef void (*MultiTransformFunc)(uint32_t*               states,
+                                      uint8_t const * const * blocks);
+
+   // Starts out pointing at a function that picks the best engine and then
+   // replaces itself, so this is never used before it's ready
+   static TransformFunc      transform_;
+   static Engine             engine_;
+
+   // NULL if the engine has no multi-buffer version
+   static MultiTransformFunc multiTransform_;
+   static uint32_t           multiLanes_;
+
+   // Pads and hashes the whole message, leaves the result in state[8]
+   static void hashToState(uint8_t const * strToHash,
+                           size_t          nBytes,
+                           uint32_t      * state);
+
+   static void hashLanes(uint8_t const * const * msgPtrs,
+                         uint32_t const *        msgSizes,
+                         uint32_t                nMsg,
+                         uint8_t *               hashesOut,
+                         bool                    isDouble);
+
+   static void transformFirstCall(uint32_t*       state,
+                                  uint8_t const * blocks,
+                                  size_t          nBlocks);
+};
+
+
+#endif
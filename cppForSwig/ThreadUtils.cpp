@@ -0,0 +1,161 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "ThreadUtils.h"
+
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+
+////////////////////////////////////////////////////////////////////////////////
+// Win32 threads have a different signature than pthreads, so we pass the
+// real function and arg through this little struct and unpack it on the
+// other side
+struct Win32ThreadArgs
+{
+   ThreadFunction func_;
+   void*          arg_;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+static DWORD WINAPI Win32ThreadTrampoline(LPVOID argPtr)
+{
+   Win32ThreadArgs* args = (Win32ThreadArgs*)argPtr;
+   ThreadFunction func = args->func_;
+   void*          arg  = args->arg_;
+   delete args;
+   func(arg);
+   return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool ThreadUtils::startThread(ThreadHandle & th, ThreadFunction func, void* arg)
+{
+   Win32ThreadArgs* args = new Win32ThreadArgs;
+   args->func_ = func;
+   args->arg_  = arg;
+   th = CreateThread(NULL, 0, Win32ThreadTrampoline, args, 0, NULL);
+   if(th == NULL)
+   {
+      delete args;
+      return false;
+   }
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ThreadUtils::joinThread(ThreadHandle & th)
+{
+   WaitForSingleObject(th, INFINITE);
+   CloseHandle(th);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t ThreadUtils::getNumCores(void)
+{
+   SYSTEM_INFO sysinfo;
+   GetSystemInfo(&sysinfo);
+   return (sysinfo.dwNumberOfProcessors<1 ? 1 : sysinfo.dwNumberOfProcessors);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double ThreadUtils::getWallClockSec(void)
+{
+   LARGE_INTEGER freq, now;
+   QueryPerformanceFrequency(&freq);
+   QueryPerformanceCounter(&now);
+   return (double)now.QuadPart / (double)freq.QuadPart;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Mutex::Mutex(void)         { InitializeCriticalSection(&cs_); }
+Mutex::~Mutex(void)        { DeleteCriticalSection(&cs_); }
+void Mutex::lock(void)     { EnterCriticalSection(&cs_); }
+void Mutex::unlock(void)   { LeaveCriticalSection(&cs_); }
+
+////////////////////////////////////////////////////////////////////////////////
+Semaphore::Semaphore(uint32_t initCount)
+{
+   sem_ = CreateSemaphore(NULL, initCount, 0x7fffffff, NULL);
+}
+Semaphore::~Semaphore(void)  { CloseHandle(sem_); }
+void Semaphore::post(void)   { ReleaseSemaphore(sem_, 1, NULL); }
+void Semaphore::wait(void)   { WaitForSingleObject(sem_, INFINITE); }
+
+
+
+#else
+
+
+////////////////////////////////////////////////////////////////////////////////
+bool ThreadUtils::startThread(ThreadHandle & th, ThreadFunction func, void* arg)
+{
+   return (pthread_create(&th, NULL, func, arg) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void ThreadUtils::joinThread(ThreadHandle & th)
+{
+   pthread_join(th, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t ThreadUtils::getNumCores(void)
+{
+   long ncores = sysconf(_SC_NPROCESSORS_ONLN);
+   return (ncores<1 ? 1 : (uint32_t)ncores);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+double ThreadUtils::getWallClockSec(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Mutex::Mutex(void)         { pthread_mutex_init(&mutex_, NULL); }
+Mutex::~Mutex(void)        { pthread_mutex_destroy(&mutex_); }
+void Mutex::lock(void)     { pthread_mutex_lock(&mutex_); }
+void Mutex::unlock(void)   { pthread_mutex_unlock(&mutex_); }
+
+////////////////////////////////////////////////////////////////////////////////
+Semaphore::Semaphore(uint32_t initCount) : count_(initCount)
+{
+   pthread_mutex_init(&mutex_, NULL);
+   pthread_cond_init(&cond_, NULL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+Semaphore::~Semaphore(void)
+{
+   pthread_cond_destroy(&cond_);
+   pthread_mutex_destroy(&mutex_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Semaphore::post(void)
+{
+   pthread_mutex_lock(&mutex_);
+   count_++;
+   pthread_cond_signal(&cond_);
+   pthread_mutex_unlock(&mutex_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void Semaphore::wait(void)
+{
+   pthread_mutex_lock(&mutex_);
+   while(count_ == 0)
+      pthread_cond_wait(&cond_, &mutex_);
+   count_--;
+   pthread_mutex_unlock(&mutex_);
+}
+
+
+#endif
@@ -0,0 +1,142 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// Very thin wrapper around the native threading primitives, so that the rest
+// of the code doesn't need to be littered with #ifdefs.  We only need the
+// bare minimum here:  start a thread, wait for it to finish, find out how
+// many cores we have to work with, and a mutex/semaphore pair to build a
+// blocking queue between threads.
+//
+// pthreads on Linux/OSX (we already link -lpthread), Win32 threads on Windows
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _THREADUTILS_H_
+#define _THREADUTILS_H_
+
+#include <deque>
+#include "BinaryData.h"
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   #include <windows.h>
+   typedef HANDLE    ThreadHandle;
+#else
+   #include <pthread.h>
+   #include <unistd.h>
+   #include <sys/time.h>
+   typedef pthread_t ThreadHandle;
+#endif
+
+
+// All thread functions must have this signature, same as pthreads
+typedef void* (*ThreadFunction)(void*);
+
+
+class ThreadUtils
+{
+public:
+   // Returns false if the thread could not be created.  In that case, the
+   // caller should just run the function itself, in the current thread
+   static bool     startThread(ThreadHandle & th, ThreadFunction func, void* arg);
+   static void     joinThread(ThreadHandle & th);
+
+   // Number of logical cores, always at least 1
+   static uint32_t getNumCores(void);
+
+   // Wall-clock seconds with sub-second resolution.  The UniversalTimer uses
+   // clock(), which sums over all threads, so it can't time a thread's stage
+   static double   getWallClockSec(void);
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+class Mutex
+{
+public:
+   Mutex(void);
+   ~Mutex(void);
+   void lock(void);
+   void unlock(void);
+
+private:
+   // Not copyable
+   Mutex(Mutex const &);
+   Mutex & operator=(Mutex const &);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   CRITICAL_SECTION cs_;
+#else
+   pthread_mutex_t  mutex_;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Counting semaphore.  On POSIX this is made from a mutex+condition, because
+// unnamed sem_t doesn't exist on OSX
+class Semaphore
+{
+public:
+   Semaphore(uint32_t initCount=0);
+   ~Semaphore(void);
+   void post(void);
+   void wait(void);
+
+private:
+   // Not copyable
+   Semaphore(Semaphore const &);
+   Semaphore & operator=(Semaphore const &);
+
+#if defined(_MSC_VER) || defined(__MINGW32__)
+   HANDLE           sem_;
+#else
+   pthread_mutex_t  mutex_;
+   pthread_cond_t   cond_;
+   uint32_t         count_;
+#endif
+};
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Fixed-capacity FIFO for passing work between threads:  push() blocks while
+// the queue is full, pop() blocks while it is empty.  This is what keeps a
+// fast stage from running arbitrarily far ahead of a slow one.
+template<typename T>
+class BoundedQueue
+{
+public:
+   BoundedQueue(uint32_t capacity) : slotsFree_(capacity), itemsReady_(0) {}
+
+   void push(T const & item)
+   {
+      slotsFree_.wait();
+      mutex_.lock();
+      queue_.push_back(item);
+      mutex_.unlock();
+      itemsReady_.post();
+   }
+
+   T pop(void)
+   {
+      itemsReady_.wait();
+      mutex_.lock();
+      T out = queue_.front();
+      queue_.pop_front();
+      mutex_.unlock();
+      slotsFree_.post();
+      return out;
+   }
+
+private:
+   Mutex         mutex_;
+   Semaphore     slotsFree_;
+   Semaphore     itemsReady_;
+   deque<T>      queue_;
+};
+
+
+#endif
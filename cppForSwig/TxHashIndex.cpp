@@ -0,0 +1,213 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include <algorithm>
+#include "TxHashIndex.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+TxHashIndex::TxHashIndex(void) :
+   bucketMask_(0),
+   numTx_(0)
+{
+   clear();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TxHashIndex::~TxHashIndex(void)
+{
+   for(uint32_t i=0; i<slabs_.size(); i++)
+      delete[] slabs_[i];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Frees all the slabs, so any TxRef* still floating around is garbage after
+// this.  Same as it was when clearing the multimap.
+void TxHashIndex::clear(void)
+{
+   for(uint32_t i=0; i<slabs_.size(); i++)
+      delete[] slabs_[i];
+   slabs_.clear();
+   slabsByAddr_.clear();
+   numTx_ = 0;
+
+   // Swap trick, to actually give the memory back if the table got big
+   Bucket empty = {0, 0};
+   vector<Bucket>(TXINDEX_INIT_BUCKETS, empty).swap(buckets_);
+   bucketMask_ = TXINDEX_INIT_BUCKETS - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TxRef* TxHashIndex::findTxRef(uint8_t const * txHash) const
+{
+   uint32_t idx = findTxIndex(txHash);
+   return (idx == UINT32_MAX ? NULL : getTxRefByIndex(idx));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t TxHashIndex::findTxIndex(uint8_t const * txHash) const
+{
+   uint32_t key = getKey(txHash);
+   uint32_t b   = getBucketStart(key);
+   while(buckets_[b].txIdxPlus1_ != 0)
+   {
+      if(buckets_[b].key_ == key)
+      {
+         uint32_t idx = buckets_[b].txIdxPlus1_ - 1;
+         if(memcmp(getTxRefByIndex(idx)->getHashPrefixRef().getPtr(),
+                   txHash, TXREF_HASH_PREFIX_BYTES) == 0)
+            return idx;
+      }
+      b = (b+1) & bucketMask_;
+   }
+   return UINT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+TxRef* TxHashIndex::insertTxRef(uint8_t const * txHash,
+                                FileDataPtr const & fdp,
+                                BlockHeader* bhptr)
+{
+   uint32_t key = getKey(txHash);
+   uint32_t b   = getBucketStart(key);
+   while(buckets_[b].txIdxPlus1_ != 0)
+   {
+      if(buckets_[b].key_ == key)
+      {
+         TxRef* txptr = getTxRefByIndex(buckets_[b].txIdxPlus1_ - 1);
+         if(memcmp(txptr->getHashPrefixRef().getPtr(),
+                   txHash, TXREF_HASH_PREFIX_BYTES) == 0)
+            return txptr;
+      }
+      b = (b+1) & bucketMask_;
+   }
+
+   // Not here yet -- b is the empty bucket at the end of the probe sequence
+   uint32_t newIdx = numTx_;
+   if(newIdx % TXINDEX_SLAB_SIZE == 0)
+   {
+      TxRef* newSlab = new TxRef[TXINDEX_SLAB_SIZE];
+      slabs_.push_back(newSlab);
+
+      pair<TxRef const *, uint32_t> slabAddr(newSlab, slabs_.size()-1);
+      slabsByAddr_.insert( upper_bound(slabsByAddr_.begin(),
+                                       slabsByAddr_.end(),
+                                       slabAddr), slabAddr);
+   }
+
+   TxRef* txptr = getTxRefByIndex(newIdx);
+   txptr->setBlkFilePtr(fdp);
+   txptr->setHeaderPtr(bhptr);
+   txptr->setHashPrefix(txHash);
+   numTx_++;
+
+   buckets_[b].key_        = key;
+   buckets_[b].txIdxPlus1_ = newIdx + 1;
+
+   if( (uint64_t)numTx_ * 100 > (uint64_t)buckets_.size() * TXINDEX_MAX_LOAD_PCT)
+      growTable();
+
+   return txptr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Since the keys are stored right in the buckets, we don't need to touch any
+// of the TxRefs to rehash
+void TxHashIndex::growTable(void)
+{
+   vector<Bucket> oldBuckets;
+   oldBuckets.swap(buckets_);
+
+   Bucket empty = {0, 0};
+   buckets_.resize(oldBuckets.size()*2, empty);
+   bucketMask_ = buckets_.size() - 1;
+
+   for(uint32_t i=0; i<oldBuckets.size(); i++)
+   {
+      if(oldBuckets[i].txIdxPlus1_ == 0)
+         continue;
+
+      uint32_t b = getBucketStart(oldBuckets[i].key_);
+      while(buckets_[b].txIdxPlus1_ != 0)
+         b = (b+1) & bucketMask_;
+      buckets_[b] = oldBuckets[i];
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+static bool compareTxRefPrefix(TxRef const * a, TxRef const * b)
+{
+   return memcmp(a->getHashPrefixRef().getPtr(),
+                 b->getHashPrefixRef().getPtr(),
+                 TXREF_HASH_PREFIX_BYTES) < 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+vector<TxRef*> TxHashIndex::findTxRefsByPrefix(uint8_t const * prefix,
+                                               uint32_t len) const
+{
+   vector<TxRef*> result;
+   len = min(len, (uint32_t)TXREF_HASH_PREFIX_BYTES);
+
+   if(len >= 4)
+   {
+      // Every match has the same key, so they're all in one probe sequence
+      uint32_t key = getKey(prefix);
+      uint32_t b   = getBucketStart(key);
+      while(buckets_[b].txIdxPlus1_ != 0)
+      {
+         if(buckets_[b].key_ == key)
+         {
+            TxRef* txptr = getTxRefByIndex(buckets_[b].txIdxPlus1_ - 1);
+            if(memcmp(txptr->getHashPrefixRef().getPtr(), prefix, len) == 0)
+               result.push_back(txptr);
+         }
+         b = (b+1) & bucketMask_;
+      }
+   }
+   else
+   {
+      // Too short to use the table, have to check everything
+      for(uint32_t i=0; i<numTx_; i++)
+      {
+         TxRef* txptr = getTxRefByIndex(i);
+         if(memcmp(txptr->getHashPrefixRef().getPtr(), prefix, len) == 0)
+            result.push_back(txptr);
+      }
+   }
+
+   sort(result.begin(), result.end(), compareTxRefPrefix);
+   return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Find the slab it's in, by address, then the offset in that slab
+uint32_t TxHashIndex::getIndexOfTxRef(TxRef const * txptr) const
+{
+   pair<TxRef const *, uint32_t> searchPair(txptr, UINT32_MAX);
+   vector< pair<TxRef const *, uint32_t> >::const_iterator iter =
+      upper_bound(slabsByAddr_.begin(), slabsByAddr_.end(), searchPair);
+
+   if(iter == slabsByAddr_.begin())
+      return UINT32_MAX;
+   iter--;
+
+   if(txptr >= iter->first + TXINDEX_SLAB_SIZE)
+      return UINT32_MAX;
+
+   uint32_t idx = iter->second*TXINDEX_SLAB_SIZE + (uint32_t)(txptr - iter->first);
+   return (idx < numTx_ ? idx : UINT32_MAX);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t TxHashIndex::getMemoryUsage(void) const
+{
+   return (uint64_t)buckets_.capacity() * sizeof(Bucket) +
+          (uint64_t)slabs_.size() * TXINDEX_SLAB_SIZE * sizeof(TxRef);
+}
+
@@ -0,0 +1,113 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// The BDM needs to find any tx in the blockchain by its hash, and there are
+// millions of them.  This used to be a multimap<HashString, TxRef> keyed by
+// the first 4 bytes of the hash, which costs a tree node, plus a heap-
+// allocated BinaryData for the key, plus the pointer-chasing, for every tx.
+//
+// Instead, the TxRefs themselves are stored in big fixed-size slabs, in the
+// order they were added.  Slabs are never moved or freed (until clear()), so
+// the TxRef* pointers that BlockHeaders and wallets hold on to stay valid.
+// The lookup is a flat open-addressing table (linear probing) where each
+// bucket is just the first 4 bytes of the hash, and the index of the TxRef
+// in the slabs.  Most of the time the 4 bytes are enough to skip a bucket
+// without ever looking at the TxRef, and when they do match, the TxRef has
+// the first TXREF_HASH_PREFIX_BYTES of the hash to confirm it.
+//
+// There's no way to remove a single tx, the BDM never needs to.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _TXHASHINDEX_H_
+#define _TXHASHINDEX_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "BtcUtils.h"
+#include "BlockObj.h"
+
+
+// Number of TxRefs per slab (2 MB of TxRefs, at 32 bytes each)
+#define TXINDEX_SLAB_SIZE      65536
+
+// Starting number of buckets, must be a power of 2.  The table doubles
+// whenever it gets more than TXINDEX_MAX_LOAD_PCT percent full
+#define TXINDEX_INIT_BUCKETS   65536
+#define TXINDEX_MAX_LOAD_PCT   70
+
+
+class TxHashIndex
+{
+public:
+   TxHashIndex(void);
+   ~TxHashIndex(void);
+
+   void     clear(void);
+   uint32_t size(void) const { return numTx_; }
+
+   // The txHash pointers here only need TXREF_HASH_PREFIX_BYTES of hash
+   TxRef*   findTxRef(uint8_t const * txHash) const;
+
+   // Same lookup, but gives the index of the TxRef (UINT32_MAX if not found)
+   uint32_t findTxIndex(uint8_t const * txHash) const;
+
+   // If the tx is already here, returns the existing TxRef (and doesn't
+   // touch it).  Otherwise adds a new one with this file location & header
+   TxRef*   insertTxRef(uint8_t const * txHash,
+                        FileDataPtr const & fdp,
+                        BlockHeader* bhptr=NULL);
+
+   // All TxRefs whose hash starts with these bytes, sorted by hash.  Only
+   // up to TXREF_HASH_PREFIX_BYTES of the prefix are checked, and if it's
+   // shorter than 4 bytes, we have to look at every tx.
+   vector<TxRef*> findTxRefsByPrefix(uint8_t const * prefix, uint32_t len) const;
+
+   // TxRefs are numbered in the order they were added
+   TxRef*   getTxRefByIndex(uint32_t i) const
+                  { return &(slabs_[i / TXINDEX_SLAB_SIZE][i % TXINDEX_SLAB_SIZE]); }
+   uint32_t getIndexOfTxRef(TxRef const * txptr) const;
+
+   // Approximate bytes used by the buckets and slabs
+   uint64_t getMemoryUsage(void) const;
+
+private:
+   // Not copyable, it owns the slabs
+   TxHashIndex(TxHashIndex const &);
+   TxHashIndex & operator=(TxHashIndex const &);
+
+   struct Bucket
+   {
+      uint32_t key_;         // first 4 bytes of the tx hash
+      uint32_t txIdxPlus1_;  // 0 means the bucket is empty
+   };
+
+   static uint32_t getKey(uint8_t const * txHash)
+   {
+      uint32_t key;
+      memcpy(&key, txHash, 4);
+      return key;
+   }
+
+   // Hashes are already random, but not if someone grinds the first bytes
+   uint32_t getBucketStart(uint32_t key) const
+                  { return BtcUtils::hashToBucket(key, bucketMask_+1); }
+
+   void     growTable(void);
+
+   vector<Bucket>  buckets_;
+   uint32_t        bucketMask_;
+   vector<TxRef*>  slabs_;
+   uint32_t        numTx_;
+
+   // Slab start pointers in address order, so we can go from TxRef* back
+   // to its index without a giant map
+   vector< pair<TxRef const *, uint32_t> > slabsByAddr_;
+};
+
+
+#endif
@@ -0,0 +1,158 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "TxOutSpendIndex.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+// Coinbase TxIns point at the all-zero hash, output 0xffffffff
+static bool isCoinbaseTxIn(uint8_t const * txinPtr)
+{
+   static uint8_t const zeros[32] = {0};
+   return (*(uint32_t*)(txinPtr+32) == UINT32_MAX &&
+           memcmp(txinPtr, zeros, 32) == 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TxOutSpendIndex::clear(void)
+{
+   // Swap trick, to actually give the memory back
+   vector<uint32_t>(1, 0).swap(firstOut_);
+   vector<uint32_t>().swap(spenders_);
+   vector<PendingSpend>().swap(pending_);
+   numSpent_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool TxOutSpendIndex::addTx(uint32_t txIdx, uint32_t numTxOut)
+{
+   if(txIdx != getNumTx())
+      return false;
+
+   spenders_.resize(spenders_.size() + numTxOut, 0);
+   firstOut_.push_back(spenders_.size());
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Position in spenders_, or UINT32_MAX if there's no such TxOut
+uint32_t TxOutSpendIndex::getSlot(uint32_t txIdx, uint32_t txOutIdx) const
+{
+   if(txIdx >= getNumTx())
+      return UINT32_MAX;
+
+   uint32_t nOut = firstOut_[txIdx+1] - firstOut_[txIdx];
+   if(txOutIdx >= nOut)
+      return UINT32_MAX;
+
+   return firstOut_[txIdx] + txOutIdx;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t TxOutSpendIndex::getSpender(uint32_t txIdx, uint32_t txOutIdx) const
+{
+   uint32_t slot = getSlot(txIdx, txOutIdx);
+   if(slot == UINT32_MAX || spenders_[slot] == 0)
+      return UINT32_MAX;
+   return spenders_[slot] - 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// spenderIdx == UINT32_MAX un-spends it
+void TxOutSpendIndex::setSpender(uint32_t slot, uint32_t spenderIdx)
+{
+   uint32_t newVal = spenderIdx + 1;  // wraps to 0 for UINT32_MAX
+   if(spenders_[slot] == 0 && newVal != 0)
+      numSpent_++;
+   else if(spenders_[slot] != 0 && newVal == 0)
+      numSpent_--;
+   spenders_[slot] = newVal;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TxOutSpendIndex::addSpends(TxHashIndex const & txIndex,
+                                uint32_t            spenderIdx,
+                                uint8_t const *     txPtr,
+                                vector<uint32_t> const & offsetsIn,
+                                bool                isMainChain)
+{
+   for(uint32_t i=0; i+1<offsetsIn.size(); i++)
+   {
+      uint8_t const * txinPtr = txPtr + offsetsIn[i];
+      if(isCoinbaseTxIn(txinPtr))
+         continue;
+
+      uint32_t txOutIdx = *(uint32_t*)(txinPtr+32);
+      uint32_t prevIdx  = txIndex.findTxIndex(txinPtr);
+      uint32_t slot     = getSlot(prevIdx, txOutIdx);
+
+      if(isMainChain)
+      {
+         if(slot != UINT32_MAX)
+            setSpender(slot, spenderIdx);
+      }
+      else if(slot != UINT32_MAX &&
+              (spenders_[slot]==0 || spenders_[slot]==spenderIdx+1))
+      {
+         setSpender(slot, spenderIdx);
+      }
+      else
+      {
+         // Either the prev tx hasn't shown up yet, or someone else already
+         // spent it.  Wait until we know which one is on the main chain.
+         PendingSpend ps;
+         memcpy(ps.prevTxHash_, txinPtr, 32);
+         ps.txOutIdx_   = txOutIdx;
+         ps.spenderIdx_ = spenderIdx;
+         pending_.push_back(ps);
+      }
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TxOutSpendIndex::removeSpends(TxHashIndex const & txIndex,
+                                   uint32_t            spenderIdx,
+                                   uint8_t const *     txPtr,
+                                   vector<uint32_t> const & offsetsIn)
+{
+   for(uint32_t i=0; i+1<offsetsIn.size(); i++)
+   {
+      uint8_t const * txinPtr = txPtr + offsetsIn[i];
+      if(isCoinbaseTxIn(txinPtr))
+         continue;
+
+      uint32_t txOutIdx = *(uint32_t*)(txinPtr+32);
+      uint32_t slot = getSlot(txIndex.findTxIndex(txinPtr), txOutIdx);
+      if(slot != UINT32_MAX && spenders_[slot] == spenderIdx+1)
+         setSpender(slot, UINT32_MAX);
+   }
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void TxOutSpendIndex::resolvePending(TxHashIndex const & txIndex)
+{
+   for(uint32_t i=0; i<pending_.size(); i++)
+   {
+      PendingSpend const & ps = pending_[i];
+      if(!txIndex.getTxRefByIndex(ps.spenderIdx_)->isMainBranch())
+         continue;
+
+      uint32_t slot = getSlot(txIndex.findTxIndex(ps.prevTxHash_), ps.txOutIdx_);
+      if(slot != UINT32_MAX)
+         setSpender(slot, ps.spenderIdx_);
+   }
+   vector<PendingSpend>().swap(pending_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t TxOutSpendIndex::getMemoryUsage(void) const
+{
+   return (uint64_t)firstOut_.capacity() * sizeof(uint32_t) +
+          (uint64_t)spenders_.capacity() * sizeof(uint32_t) +
+          (uint64_t)pending_.capacity()  * sizeof(PendingSpend);
+}
@@ -0,0 +1,100 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// For every TxOut in the blockchain, which tx (if any) spends it.  Without
+// this, the BDM only knows the answer for outputs of registered wallets, and
+// anything else needs a full scan.
+//
+// A map<OutPoint, TxRef*> would cost a 36-byte key plus a tree node for
+// every spent output.  Instead, everything is by the tx numbers that the
+// TxHashIndex already gives out (in the order the tx were added):
+//
+//    firstOut_[txIdx]    -- where this tx's outputs start in spenders_
+//    spenders_[i]        -- the index of the spending tx, plus one (so 0
+//                           means unspent), for each TxOut of every tx
+//
+// So it's 4 bytes per tx and 4 bytes per TxOut, and a lookup is two array
+// reads once you have the txIdx.
+//
+// Only the main chain is supposed to be in here.  When we're parsing, we
+// don't know yet which blocks that is, so a spend that would replace a
+// different spender (a double-spend on a fork), or one whose prev tx we
+// haven't seen yet, is put aside as "pending".  Once the chain is organized
+// the BDM removes the spends of any tx that didn't end up on the main chain,
+// and resolvePending() puts in the pending ones whose tx did.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _TXOUTSPENDINDEX_H_
+#define _TXOUTSPENDINDEX_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "TxHashIndex.h"
+
+
+class TxOutSpendIndex
+{
+public:
+   TxOutSpendIndex(void) { clear(); }
+
+   void     clear(void);
+   uint32_t getNumTx(void)    const { return firstOut_.size() - 1; }
+   uint32_t getNumTxOut(void) const { return spenders_.size(); }
+   uint32_t getNumSpent(void) const { return numSpent_; }
+
+   // Tx have to be added in the same order the TxHashIndex numbers them, so
+   // this returns false (and does nothing) if txIdx isn't the next one
+   bool     addTx(uint32_t txIdx, uint32_t numTxOut);
+
+   // Index of the tx that spends this TxOut, UINT32_MAX if it's unspent or
+   // there's no such TxOut
+   uint32_t getSpender(uint32_t txIdx, uint32_t txOutIdx) const;
+
+   // Record the spends of all the TxIns of this (serialized) tx.  If
+   // isMainChain is false, we're still parsing and anything questionable
+   // goes on the pending list.  If it's true, it replaces whatever spender
+   // was there before
+   void     addSpends(TxHashIndex const & txIndex,
+                      uint32_t            spenderIdx,
+                      uint8_t const *     txPtr,
+                      vector<uint32_t> const & offsetsIn,
+                      bool                isMainChain);
+
+   // Undo addSpends, for the TxOuts that this tx is still the spender of
+   void     removeSpends(TxHashIndex const & txIndex,
+                         uint32_t            spenderIdx,
+                         uint8_t const *     txPtr,
+                         vector<uint32_t> const & offsetsIn);
+
+   // Call after the chain is organized:  the pending spends by main-chain
+   // tx are put in, the rest are dropped
+   void     resolvePending(TxHashIndex const & txIndex);
+   uint32_t getNumPending(void) const { return pending_.size(); }
+
+   // Approximate bytes used
+   uint64_t getMemoryUsage(void) const;
+
+private:
+   struct PendingSpend
+   {
+      uint8_t  prevTxHash_[32];
+      uint32_t txOutIdx_;
+      uint32_t spenderIdx_;
+   };
+
+   void     setSpender(uint32_t slot, uint32_t spenderIdx);
+   uint32_t getSlot(uint32_t txIdx, uint32_t txOutIdx) const;
+
+   vector<uint32_t>     firstOut_;   // one more than the number of tx
+   vector<uint32_t>     spenders_;   // spender txIdx+1, 0 means unspent
+   uint32_t             numSpent_;
+   vector<PendingSpend> pending_;
+};
+
+
+#endif
@@ -149,6 +149,17 @@ double UniversalTimer::read(string key, string grpstr)
    return call_timers_[most_recent_key_].read();
 }
 
+// Add time that was measured some other way to the given timer.  Worker
+// threads can't touch the timer maps, so they time themselves and the main
+// thread adds the results here when they're done
+void UniversalTimer::add(string key, double sec, string grpstr)
+{
+   most_recent_key_ = grpstr + key;
+   init(key,grpstr);
+   call_timers_[most_recent_key_].add(sec);
+   call_count_[most_recent_key_]++;
+}
+
 // Print complete timing results to a file of this name
 void UniversalTimer::printCSV(string filename, bool excludeZeros)
 {
@@ -82,6 +82,7 @@ public:
    void stop (string key, string grpstr="");
    void reset (string key, string grpstr="");
    double read (string key, string grpstr="");
+   void add (string key, double sec, string grpstr="");
    string getLastKey(void) {return most_recent_key_;}
    double getLastTiming(void) {return call_timers_[most_recent_key_].getPrev();}
    void printCSV(ostream & os=cout, bool excludeZeros=false);
@@ -107,6 +108,7 @@ private:
       double read (void);
       void reset (void);
       double getPrev(void) { return prev_elapsed_; }
+      void add (double sec) { prev_elapsed_ = sec; accum_time_ += sec; }
    private:
       bool isRunning_;
       clock_t start_clock_;
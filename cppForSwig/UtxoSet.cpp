@@ -0,0 +1,252 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+
+#include "UtxoSet.h"
+
+
+////////////////////////////////////////////////////////////////////////////////
+void UtxoSet::clear(void)
+{
+   // Swap trick, to actually give the memory back
+   vector<UtxoEntry>().swap(entries_);
+   vector<uint32_t>().swap(freeSlots_);
+   numUtxo_ = 0;
+   numAddr_ = 0;
+
+   Bucket empty = {0, 0};
+   vector<Bucket>(UTXOSET_INIT_BUCKETS, empty).swap(opTable_);
+   vector<Bucket>(UTXOSET_INIT_BUCKETS, empty).swap(addrTable_);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UtxoSet::insertBucket(vector<Bucket> & table, uint32_t key, uint32_t slot)
+{
+   uint32_t mask = table.size()-1;
+   uint32_t b = getBucketStart(table, key);
+   while(table[b].slotPlus1_ != 0)
+      b = (b+1) & mask;
+   table[b].key_       = key;
+   table[b].slotPlus1_ = slot + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The keys are right in the buckets, so nothing else is needed to rehash
+void UtxoSet::growIfNeeded(vector<Bucket> & table, uint32_t numUsed)
+{
+   if( (uint64_t)numUsed * 100 <= (uint64_t)table.size() * UTXOSET_MAX_LOAD_PCT)
+      return;
+
+   vector<Bucket> oldTable;
+   oldTable.swap(table);
+   Bucket empty = {0, 0};
+   table.resize(oldTable.size()*2, empty);
+   for(uint32_t i=0; i<oldTable.size(); i++)
+      if(oldTable[i].slotPlus1_ != 0)
+         insertBucket(table, oldTable[i].key_, oldTable[i].slotPlus1_-1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Linear probing can't just empty a bucket, or the lookups for anything
+// after it in the same run would stop early.  So shift back whatever in the
+// rest of the run would be happy to sit in the hole.
+void UtxoSet::eraseBucket(vector<Bucket> & table, uint32_t b)
+{
+   uint32_t mask = table.size()-1;
+   uint32_t hole = b;
+   uint32_t next = (b+1) & mask;
+   while(table[next].slotPlus1_ != 0)
+   {
+      // Can it move to the hole?  Only if its home isn't between the hole
+      // and where it is now (cyclically)
+      uint32_t home = getBucketStart(table, table[next].key_);
+      if( ((next - home) & mask) >= ((next - hole) & mask) )
+      {
+         table[hole] = table[next];
+         hole = next;
+      }
+      next = (next+1) & mask;
+   }
+   table[hole].key_       = 0;
+   table[hole].slotPlus1_ = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t UtxoSet::findOutPointBucket(uint32_t txIdx, uint32_t txOutIdx) const
+{
+   uint32_t key  = getOutPointKey(txIdx, txOutIdx);
+   uint32_t mask = opTable_.size()-1;
+   uint32_t b    = getBucketStart(opTable_, key);
+   while(opTable_[b].slotPlus1_ != 0)
+   {
+      if(opTable_[b].key_ == key)
+      {
+         UtxoEntry const & ue = entries_[opTable_[b].slotPlus1_-1];
+         if(ue.txIdx_ == txIdx && ue.txOutIdx_ == txOutIdx)
+            return b;
+      }
+      b = (b+1) & mask;
+   }
+   return UINT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint32_t UtxoSet::findAddrBucket(uint8_t const * addr160) const
+{
+   uint32_t key  = getAddrKey(addr160);
+   uint32_t mask = addrTable_.size()-1;
+   uint32_t b    = getBucketStart(addrTable_, key);
+   while(addrTable_[b].slotPlus1_ != 0)
+   {
+      if(addrTable_[b].key_ == key &&
+         memcmp(entries_[addrTable_[b].slotPlus1_-1].addr160_, addr160, 20) == 0)
+         return b;
+      b = (b+1) & mask;
+   }
+   return UINT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UtxoSet::add(uint32_t          txIdx,
+                  uint32_t          txOutIdx,
+                  uint64_t          value,
+                  TXOUT_SCRIPT_TYPE scriptType,
+                  uint8_t const *   addr160)
+{
+   // Two tx with the same hash are the same TxRef, so the second one's
+   // outputs replace the first one's
+   remove(txIdx, txOutIdx);
+
+   uint32_t slot;
+   if(freeSlots_.size() > 0)
+   {
+      slot = freeSlots_.back();
+      freeSlots_.pop_back();
+   }
+   else
+   {
+      slot = entries_.size();
+      entries_.resize(slot+1);
+   }
+
+   UtxoEntry & ue = entries_[slot];
+   ue.value_      = value;
+   ue.txIdx_      = txIdx;
+   ue.txOutIdx_   = txOutIdx;
+   ue.scriptType_ = (uint8_t)scriptType;
+   ue.prevInAddr_ = UINT32_MAX;
+   ue.nextInAddr_ = UINT32_MAX;
+   memset(ue.addr160_, 0, 20);
+
+   numUtxo_++;
+   growIfNeeded(opTable_, numUtxo_);
+   insertBucket(opTable_, getOutPointKey(txIdx, txOutIdx), slot);
+
+   if(scriptType == TXOUT_SCRIPT_UNKNOWN)
+      return;
+
+   // New entries go at the front of the address's list
+   memcpy(ue.addr160_, addr160, 20);
+   uint32_t b = findAddrBucket(addr160);
+   if(b == UINT32_MAX)
+   {
+      numAddr_++;
+      growIfNeeded(addrTable_, numAddr_);
+      insertBucket(addrTable_, getAddrKey(addr160), slot);
+      return;
+   }
+
+   uint32_t oldHead = addrTable_[b].slotPlus1_ - 1;
+   ue.nextInAddr_ = oldHead;
+   entries_[oldHead].prevInAddr_ = slot;
+   addrTable_[b].slotPlus1_ = slot + 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+bool UtxoSet::remove(uint32_t txIdx, uint32_t txOutIdx)
+{
+   uint32_t b = findOutPointBucket(txIdx, txOutIdx);
+   if(b == UINT32_MAX)
+      return false;
+
+   uint32_t slot = opTable_[b].slotPlus1_ - 1;
+   eraseBucket(opTable_, b);
+   numUtxo_--;
+
+   UtxoEntry & ue = entries_[slot];
+   if(ue.scriptType_ != TXOUT_SCRIPT_UNKNOWN)
+   {
+      if(ue.nextInAddr_ != UINT32_MAX)
+         entries_[ue.nextInAddr_].prevInAddr_ = ue.prevInAddr_;
+
+      if(ue.prevInAddr_ != UINT32_MAX)
+         entries_[ue.prevInAddr_].nextInAddr_ = ue.nextInAddr_;
+      else
+      {
+         // It was the head, so the address bucket points at it
+         uint32_t ab = findAddrBucket(ue.addr160_);
+         if(ue.nextInAddr_ != UINT32_MAX)
+            addrTable_[ab].slotPlus1_ = ue.nextInAddr_ + 1;
+         else
+         {
+            eraseBucket(addrTable_, ab);
+            numAddr_--;
+         }
+      }
+   }
+
+   freeSlots_.push_back(slot);
+   return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+UtxoEntry const * UtxoSet::find(uint32_t txIdx, uint32_t txOutIdx) const
+{
+   uint32_t b = findOutPointBucket(txIdx, txOutIdx);
+   if(b == UINT32_MAX)
+      return NULL;
+   return &(entries_[opTable_[b].slotPlus1_-1]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+void UtxoSet::getUtxosForAddr(uint8_t const * addr160,
+                              vector<UtxoEntry> & utxos) const
+{
+   utxos.clear();
+   uint32_t b = findAddrBucket(addr160);
+   if(b == UINT32_MAX)
+      return;
+
+   for(uint32_t slot = addrTable_[b].slotPlus1_-1;
+       slot != UINT32_MAX;
+       slot = entries_[slot].nextInAddr_)
+      utxos.push_back(entries_[slot]);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t UtxoSet::getBalanceForAddr(uint8_t const * addr160) const
+{
+   uint32_t b = findAddrBucket(addr160);
+   if(b == UINT32_MAX)
+      return 0;
+
+   uint64_t balance = 0;
+   for(uint32_t slot = addrTable_[b].slotPlus1_-1;
+       slot != UINT32_MAX;
+       slot = entries_[slot].nextInAddr_)
+      balance += entries_[slot].value_;
+   return balance;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+uint64_t UtxoSet::getMemoryUsage(void) const
+{
+   return (uint64_t)entries_.capacity()   * sizeof(UtxoEntry) +
+          (uint64_t)freeSlots_.capacity() * sizeof(uint32_t)  +
+          (uint64_t)opTable_.capacity()   * sizeof(Bucket)    +
+          (uint64_t)addrTable_.capacity() * sizeof(Bucket);
+}
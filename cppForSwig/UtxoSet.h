@@ -0,0 +1,135 @@
+////////////////////////////////////////////////////////////////////////////////
+//                                                                            //
+//  Copyright (C) 2011-2012, Alan C. Reiner    <alan.reiner@gmail.com>        //
+//  Distributed under the GNU Affero General Public License (AGPL v3)         //
+//  See LICENSE or http://www.gnu.org/licenses/agpl.html                      //
+//                                                                            //
+////////////////////////////////////////////////////////////////////////////////
+//
+// Every unspent TxOut on the main chain, so the balance and unspent TxOuts of
+// any address can be looked up without scanning the blockchain.
+//
+// Each UTXO is one 48-byte UtxoEntry:  the value, the script type and addr160
+// (the only parts of the script a balance needs), and where it is, as the
+// TxHashIndex number of its tx plus the TxOut index.  Anything else (the tx
+// hash, the whole script, the height) comes from the TxRef.
+//
+// The entries live in one big vector, and the slots of removed ones are
+// reused.  There are two flat open-addressing tables on top of them, the
+// same kind as the TxHashIndex, except that entries can be removed:
+//
+//    by outpoint  -- (txIdx, txOutIdx) to the entry, so a TxIn can remove
+//                    the UTXO it spends
+//    by address   -- addr160 to the first of that address's entries, the
+//                    rest are a doubly-linked list through the entries
+//
+// The BDM decides what goes in and comes out, this is just the container.
+//
+////////////////////////////////////////////////////////////////////////////////
+#ifndef _UTXOSET_H_
+#define _UTXOSET_H_
+
+#include <vector>
+#include "BinaryData.h"
+#include "BtcUtils.h"
+
+
+// Both tables start this big (must be a power of 2), and double whenever
+// they get more than UTXOSET_MAX_LOAD_PCT percent full
+#define UTXOSET_INIT_BUCKETS   65536
+#define UTXOSET_MAX_LOAD_PCT   70
+
+
+class UtxoEntry
+{
+public:
+   uint64_t getValue(void)      const { return value_; }
+   uint32_t getTxIndex(void)    const { return txIdx_; }
+   uint32_t getTxOutIndex(void) const { return txOutIdx_; }
+   BinaryData getAddr160(void)  const { return BinaryData(addr160_, 20); }
+   TXOUT_SCRIPT_TYPE getScriptType(void) const
+                                 { return (TXOUT_SCRIPT_TYPE)scriptType_; }
+
+private:
+   friend class UtxoSet;
+
+   uint64_t value_;
+   uint32_t txIdx_;
+   uint32_t txOutIdx_;
+   uint8_t  addr160_[20];
+   uint8_t  scriptType_;
+   uint32_t prevInAddr_;   // UINT32_MAX at either end of the list
+   uint32_t nextInAddr_;
+};
+
+
+class UtxoSet
+{
+public:
+   UtxoSet(void) { clear(); }
+
+   void     clear(void);
+   uint32_t size(void) const          { return numUtxo_; }
+   uint32_t getNumAddresses(void) const { return numAddr_; }
+
+   // Adds it, replacing any UTXO already at this outpoint.  Non-standard
+   // scripts have no addr160, they're only findable by outpoint.
+   void     add(uint32_t          txIdx,
+                uint32_t          txOutIdx,
+                uint64_t          value,
+                TXOUT_SCRIPT_TYPE scriptType,
+                uint8_t const *   addr160);
+
+   // Returns false if there was no such UTXO
+   bool     remove(uint32_t txIdx, uint32_t txOutIdx);
+
+   UtxoEntry const * find(uint32_t txIdx, uint32_t txOutIdx) const;
+
+   // Newest first (the order they were added, reversed)
+   void     getUtxosForAddr(uint8_t const * addr160,
+                            vector<UtxoEntry> & utxos) const;
+   uint64_t getBalanceForAddr(uint8_t const * addr160) const;
+
+   // Approximate bytes used by the entries and the tables
+   uint64_t getMemoryUsage(void) const;
+
+private:
+   struct Bucket
+   {
+      uint32_t key_;          // a hash of the outpoint, or 4 bytes of addr160
+      uint32_t slotPlus1_;    // 0 means the bucket is empty
+   };
+
+   static uint32_t getOutPointKey(uint32_t txIdx, uint32_t txOutIdx)
+                  { return txIdx ^ (txOutIdx * 0x9e3779b9U); }
+   static uint32_t getAddrKey(uint8_t const * addr160)
+   {
+      uint32_t key;
+      memcpy(&key, addr160, 4);
+      return key;
+   }
+   // The addr160 keys cost nothing to grind (vanity addresses), so these
+   // have to be spread the same way as the TxHashIndex
+   static uint32_t getBucketStart(vector<Bucket> const & table, uint32_t key)
+                  { return BtcUtils::hashToBucket(key, table.size()); }
+
+   static void     insertBucket(vector<Bucket> & table, uint32_t key, 
+                                uint32_t slot);
+   static void     growIfNeeded(vector<Bucket> & table, uint32_t numUsed);
+   static void     eraseBucket(vector<Bucket> & table, uint32_t b);
+
+   // Bucket index, or UINT32_MAX
+   uint32_t findOutPointBucket(uint32_t txIdx, uint32_t txOutIdx) const;
+   uint32_t findAddrBucket(uint8_t const * addr160) const;
+
+   vector<UtxoEntry> entries_;
+   vector<uint32_t>  freeSlots_;
+   uint32_t          numUtxo_;
+   uint32_t          numAddr_;
+
+   vector<Bucket>    opTable_;
+   vector<Bucket>    addrTable_;
+};
+
+
+#endif